@@ -11,17 +11,87 @@
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/sendfile.h>
+#include <linux/filter.h>
+#include <glob.h>
+
+#include "s25common.h"
+#include "s25stats.h"
+#include "s25trace.h"
+#include "s25durable.h"
+#include "s25tar.h"
+#include "s25qos.h"
+#include "s25relay.h"
+#include "s25admit.h"
+#include "s25health.h"
+#include "s25hedge.h"
+#include "s25ring.h"
+#include "s25direct.h"
+#include "s25prefetch.h"
+#include "s25ingest.h"
+#include "s25pool.h"
 
 #define PORT 8080
 #define BUFFER_SIZE 1024
 #define MAX_PATH 256
 #define MAX_COMMAND 512
+#define TAR_SPOOL_LIMIT (1024 * 1024)
+
+// Connections turned away at accept linger this long for the client to read BUSY and close
+#define MAX_LINGERING 64
+#define LINGER_US 1000000
+
+// Upper bound on S25_S1_ACCEPTORS
+#define MAX_ACCEPTORS 64
+
+// Most paths and patterns one purgef may name
+#define PURGE_MAX_ARGUMENTS 4096
 
-// Server ports
+// Server ports (defaults, overridable with S25_S1_PORT ... S25_S4_PORT)
 #define S2_PORT 8081
 #define S3_PORT 8082
 #define S4_PORT 8083
 
+int s2_port = S2_PORT;
+int s3_port = S3_PORT;
+int s4_port = S4_PORT;
+
+// Client commands tracked by the metrics module, in stats index order
+enum { CMD_UPLOADF, CMD_DOWNLF, CMD_REMOVEF, CMD_DOWNLTAR, CMD_DISPFNAMES, CMD_STATS, CMD_TRACE, CMD_LOCATE, CMD_COPYF,
+       CMD_MOVEF, CMD_PURGEF, CMD_COUNT };
+static const char* const command_names[CMD_COUNT] = { "uploadf", "downlf", "removef", "downltar", "dispfnames", "stats", "trace",
+                                                      "locate", "copyf", "movef", "purgef" };
+static const int command_classes[CMD_COUNT] = { QOS_TRANSFER, QOS_TRANSFER, QOS_INTERACTIVE, QOS_BULK, QOS_INTERACTIVE,
+                                                QOS_INTERACTIVE, QOS_INTERACTIVE, QOS_INTERACTIVE, QOS_TRANSFER, QOS_TRANSFER,
+                                                QOS_BULK };
+
+// AF_UNIX listener for co-located clients (S25_SOCKET_DIR); -1 if there is none
+static int local_listener = -1;
+
+// Shared-memory upload ring (S25_RING_SIZE bytes, 0 = off) for uploads of at least S25_RING_MIN_BYTES
+static long ring_size;
+static long ring_min_bytes;
+
+// This child's upload ring, created on its first upload that uses one
+static struct ring* upload_ring;
+
+// Whether locate hands out tokens for direct client-to-storage transfers (S25_DIRECT)
+static int direct_enabled;
+
+// Longest retry hint a storage server gave during the current command; -1 if none was busy
+static long storage_busy_ms = -1;
+
+// Connections the accept loop has turned away and is waiting to close
+static struct {
+    int socket;
+    long long deadline_us;
+} lingering[MAX_LINGERING];
+static int lingering_count;
+
 // Function to create directory if it doesn't exist
 void create_directory_if_not_exists(const char* path) {
     char temp_path[MAX_PATH];
@@ -42,6 +112,17 @@ void create_directory_if_not_exists(const char* path) {
     free(path_copy);
 }
 
+// Function to expand a ~S1 path to the real S1 directory; -1 if it had to be cut to fit MAX_PATH
+int expand_s1_path(char* path) {
+    if (strncmp(path, "~S1", 3) == 0) {
+        char temp_path[MAX_PATH];
+        int length = snprintf(temp_path, MAX_PATH, "%s/S1%s", getenv("HOME"), path + 3);
+        strcpy(path, temp_path);
+        if (length >= MAX_PATH) return -1;
+    }
+    return 0;
+}
+
 // Function to get file extension
 char* get_file_extension(const char* filename) {
     char* dot = strrchr(filename, '.');
@@ -51,124 +132,364 @@ char* get_file_extension(const char* filename) {
     return "";
 }
 
-// Function to connect to a server
+// Function to get the storage server port responsible for an extension
+int get_server_port_for_extension(const char* file_extension) {
+    if (strcmp(file_extension, "pdf") == 0) return s2_port;
+    if (strcmp(file_extension, "txt") == 0) return s3_port;
+    if (strcmp(file_extension, "zip") == 0) return s4_port;
+    return 0;
+}
+
+// Function to get the storage server name for a port
+const char* get_server_name(int port) {
+    if (port == s2_port) return "S2";
+    if (port == s3_port) return "S3";
+    return "S4";
+}
+
+// Function to connect to a server, failing fast if it is marked down or does not answer in time
 int connect_to_server(int port) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        perror("Socket creation failed");
+    if (!health_is_up(port)) {
+        printf("%s is marked down; not calling it\n", get_server_name(port));
         return -1;
     }
     
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    
-    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    // Prefer the node's AF_UNIX socket when it is co-located, falling back to TCP loopback
+    long long connect_start = trace_now_us();
+    char local_path[MAX_PATH];
+    int sock = -1;
+    if (local_socket_path(get_server_name(port), local_path, sizeof(local_path)) != NULL) {
+        sock = connect_local_socket(local_path);
+    }
+    if (sock < 0) sock = connect_local(port, health_connect_timeout_ms());
+    if (sock < 0) {
         perror("Connection failed");
-        close(sock);
+        health_report_failure(port);
         return -1;
     }
     
+    // Every later send and receive on this socket gives up once the node stops making progress
+    set_socket_timeout(sock, health_call_timeout_ms());
+    if (direct_authenticate(sock) < 0) {
+        printf("Error: Cannot authenticate with %s\n", get_server_name(port));
+        close(sock);
+        return -1;
+    }
+    trace_span_args("connect", connect_start, "port", port, NULL, 0);
     return sock;
 }
 
-// Function to send file to another server
-int send_file_to_server(int server_socket, const char* source_filepath, const char* filename) {
-    char buffer[BUFFER_SIZE];
-    FILE* source_file;
-    long file_size;
-    int bytes_read;
+// Function to send a command to a storage server tagged with the current request ID
+int send_command(int server_socket, const char* command) {
+    char frame[MAX_COMMAND];
+    int prefix_length = format_request_prefix(frame, sizeof(frame), trace_current());
     
-    // Open source file
-    source_file = fopen(source_filepath, "rb");
-    if (source_file == NULL) {
-        printf("Error: Cannot open source file %s\n", source_filepath);
-        return -1;
-    }
+    snprintf(frame + prefix_length, sizeof(frame) - prefix_length, "%s", command);
+    return send_message(server_socket, frame);
+}
+
+// Function to start a batch to a storage server with a command tagged with the current request ID
+int batch_command(struct send_batch* batch, int server_socket, const char* command) {
+    char frame[MAX_COMMAND];
+    int prefix_length = format_request_prefix(frame, sizeof(frame), trace_current());
+    
+    snprintf(frame + prefix_length, sizeof(frame) - prefix_length, "%s", command);
+    batch_start(batch, server_socket);
+    return batch_message(batch, frame);
+}
+
+// Function to remember that a storage server turned a request away; returns 1 if the reply was BUSY
+int note_storage_busy(const char* reply) {
+    long retry_after_ms = parse_busy(reply);
     
-    // Get file size
-    fseek(source_file, 0, SEEK_END);
-    file_size = ftell(source_file);
-    fseek(source_file, 0, SEEK_SET);
+    if (retry_after_ms < 0) return 0;
+    if (retry_after_ms > storage_busy_ms) storage_busy_ms = retry_after_ms;
+    return 1;
+}
+
+// Function to end a reply with its completion frame, or with BUSY if a storage server turned part of it away
+int send_completion(int client_socket, const char* completion) {
+    if (storage_busy_ms >= 0) return send_busy(client_socket, storage_busy_ms);
+    return send_message(client_socket, completion);
+}
+
+// Function to get the upload ring for a storage connection; NULL to send the data over the socket
+struct ring* upload_ring_for(int server_socket, long file_size) {
+    if (ring_size <= 0 || file_size < ring_min_bytes || !is_local_socket(server_socket)) return NULL;
     
-    // Send filepath (destination path on target server)
-    send(server_socket, source_filepath, strlen(source_filepath), 0);
+    if (upload_ring == NULL) upload_ring = ring_create(ring_size);
+    if (upload_ring != NULL) ring_bind(upload_ring, server_socket);
+    return upload_ring;
+}
+
+// Function to move an upload from the client into a storage server's ring; 0 if all arrived
+int relay_to_ring(int client_socket, struct ring* ring, long length, struct relay_result* moved) {
+    memset(moved, 0, sizeof(*moved));
     
-    // Send filename
-    send(server_socket, filename, strlen(filename), 0);
+    // The client's bytes go straight into shared memory, with no copy through a socket to the server
+    while (moved->received < length) {
+        size_t space;
+        long long wait_start = stats_now_us();
+        char* area = ring_reserve(ring, &space);
+        moved->sink_stall_us += stats_now_us() - wait_start;
+        if (area == NULL) {
+            moved->sink_failed = 1;
+            break;
+        }
+        
+        long left = length - moved->received;
+        if ((long)space > left) space = left;
+        if (space > QOS_GRANT) space = QOS_GRANT;
+        ssize_t got = recv(client_socket, area, space, 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            moved->source_failed = 1;
+            break;
+        }
+        ring_produce(ring, got);
+        moved->received += got;
+        moved->sent += got;
+        qos_charge(got);
+    }
     
-    // Send file size
-    send(server_socket, &file_size, sizeof(file_size), 0);
+    // Keep the client's stream in step after the server gives up
+    if (moved->sink_failed && drain_bytes(client_socket, length - moved->received) < 0) {
+        moved->source_failed = 1;
+    }
+    stats_count_stall(SIDE_STORAGE, moved->sink_stall_us);
+    return moved->sent == length ? 0 : -1;
+}
+
+// Function to stream an upload from the client to a storage server (-1 discards it).
+// Returns 1 if the server stored it, 0 if not, -1 if the client connection failed.
+int forward_upload(int client_socket, int server_socket, const char* destination_path, const char* filename,
+                   long file_size) {
+    char reply[MAX_COMMAND];
+    struct relay_result moved;
+    struct send_batch batch;
+    struct ring* ring = server_socket >= 0 ? upload_ring_for(server_socket, file_size) : NULL;
     
-    // Send file data
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, source_file)) > 0) {
-        send(server_socket, buffer, bytes_read, 0);
+    if (server_socket >= 0) {
+        // UPLOAD, filepath (destination path on target server), filename and size in one write, held for the
+        // first data; the ring rides with the size
+        batch_command(&batch, server_socket, "UPLOAD");
+        batch_message(&batch, destination_path);
+        batch_message(&batch, filename);
+        if (ring != NULL) {
+            int fds[RING_FDS];
+            ring_fds(ring, fds);
+            batch_flush(&batch, NULL, 0, 0);
+            send_size_fds(server_socket, file_size, fds, RING_FDS);
+        } else {
+            batch_size(&batch, file_size);
+            batch_flush(&batch, NULL, 0, file_size > 0);
+        }
     }
     
-    fclose(source_file);
+    // The client's bytes are drained even if the server fails, to keep the stream in step
+    long long relay_start = trace_now_us();
+    int result = ring != NULL ? relay_to_ring(client_socket, ring, file_size, &moved) :
+                 relay_copy(client_socket, server_socket, file_size, RELAY_FROM_CLIENT | RELAY_DRAIN, &moved);
+    trace_span_args(ring != NULL ? "ring" : "relay", relay_start, "client_us", moved.source_stall_us, "server_us",
+                    moved.sink_stall_us);
+    stats_count_bytes(moved.received, 0);
     
     // Receive response
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(server_socket, buffer, BUFFER_SIZE, 0);
+    long long reply_start = trace_now_us();
+    int replied = !moved.source_failed && result == 0 && recv_message(server_socket, reply, sizeof(reply)) >= 0;
     
-    if (strcmp(buffer, "SUCCESS") == 0) {
-        return 0;
-    } else {
-        return -1;
+    // A ring is reused only if the server took every byte out of it
+    if (ring != NULL && (!replied || !ring_empty(ring))) {
+        ring_free(upload_ring);
+        upload_ring = NULL;
     }
+    if (moved.source_failed) return -1;
+    if (!replied) return 0;
+    trace_span("reply_wait", reply_start);
+    note_storage_busy(reply);
+    return strcmp(reply, "SUCCESS") == 0;
 }
 
-// Function to receive file from another server
-int receive_file_from_server(int server_socket, const char* filepath) {
-    char buffer[BUFFER_SIZE];
-    char filename[MAX_PATH];
-    long file_size;
-    FILE* file;
-    int bytes_received;
+// Function to receive an upload from the client into a file writer's buffer; 0 if all was written
+int relay_to_writer(int client_socket, struct ingest_writer* writer, long length, struct relay_result* moved) {
+    memset(moved, 0, sizeof(*moved));
+    
+    // The client's bytes land in the aligned buffer the file is written from, with no copy in between
+    while (moved->received < length) {
+        size_t space;
+        char* area = ingest_space(writer, &space);
+        long left = length - moved->received;
+        if ((long)space > left) space = left;
+        if (space > QOS_GRANT) space = QOS_GRANT;
+        
+        long long wait_start = stats_now_us();
+        ssize_t got = recv(client_socket, area, space, 0);
+        moved->source_stall_us += stats_now_us() - wait_start;
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            moved->source_failed = 1;
+            break;
+        }
+        moved->received += got;
+        qos_charge(got);
+        
+        // A failed writer still takes the rest, keeping the client's stream in step
+        long long write_start = stats_now_us();
+        if (ingest_fill(writer, got) < 0) moved->sink_failed = 1;
+        moved->sink_stall_us += stats_now_us() - write_start;
+        if (!moved->sink_failed) moved->sent += got;
+    }
     
-    // Send filepath
-    send(server_socket, filepath, strlen(filepath), 0);
+    stats_count_stall(SIDE_CLIENT, moved->source_stall_us);
+    return moved->sent == length ? 0 : -1;
+}
+
+// Function to receive an upload of a .c file straight into a staging file and publish it.
+// Returns 1 if stored, 0 if not, -1 if the client connection failed.
+int store_local_upload(int client_socket, const char* destination_path, long file_size) {
+    char staging_path[MAX_PATH + 64];
+    struct relay_result moved;
+    
+    int fd = durable_temp_path(destination_path, staging_path, sizeof(staging_path)) == 0 ?
+             open(staging_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    struct ingest_writer* writer = fd >= 0 ? ingest_open(fd, file_size) : NULL;
+    if (writer == NULL) {
+        printf("Error: Cannot create staging file for %s\n", destination_path);
+        if (fd >= 0) {
+            close(fd);
+            remove(staging_path);
+        }
+        return drain_bytes(client_socket, file_size) < 0 ? -1 : 0;
+    }
     
-    // Receive filename
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(server_socket, buffer, BUFFER_SIZE, 0);
-    strcpy(filename, buffer);
+    // Written from aligned buffers; large files are preallocated and bypass the page cache
+    long long receive_start = trace_now_us();
+    int stored = relay_to_writer(client_socket, writer, file_size, &moved) == 0;
+    trace_span_args("receive", receive_start, "network_us", moved.source_stall_us, "disk_us", moved.sink_stall_us);
+    stats_count_bytes(moved.received, 0);
+    if (ingest_finish(writer) < 0) stored = 0;
+    if (close(fd) != 0) stored = 0;
     
-    // Receive file size
-    recv(server_socket, &file_size, sizeof(file_size), 0);
+    long long commit_start = trace_now_us();
+    if (!stored) {
+        remove(staging_path);
+    } else if (durable_publish(staging_path, destination_path) < 0) {
+        stored = 0;
+    }
+    trace_span("commit", commit_start);
+    return moved.source_failed ? -1 : stored;
+}
+
+// Function to send a local file to the client as size + data
+int send_local_file(int client_socket, const char* filepath) {
+    struct relay_result moved;
+    struct stat file_info;
     
-    // Open file for writing
-    file = fopen(filepath, "wb");
-    if (file == NULL) {
-        printf("Error: Cannot create file %s\n", filepath);
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0 || fstat(fd, &file_info) < 0) {
+        if (fd >= 0) close(fd);
+        send_size(client_socket, -1);
         return -1;
     }
     
-    // Receive file data
-    long total_received = 0;
-    while (total_received < file_size) {
-        bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) break;
-        fwrite(buffer, 1, bytes_received, file);
-        total_received += bytes_received;
+    // Send file size, then the data, which the kernel reads ahead of the relay
+    prefetch_sequential(fd, 0, file_info.st_size);
+    send_size(client_socket, file_info.st_size);
+    long long transfer_start = trace_now_us();
+    int result = relay_copy(fd, client_socket, file_info.st_size, 0, &moved);
+    close(fd);
+    trace_span_args("transfer", transfer_start, "disk_us", moved.source_stall_us, "network_us", moved.sink_stall_us);
+    stats_count_bytes(0, moved.sent);
+    return result;
+}
+
+// Function to send a file whose descriptor a storage server passed over AF_UNIX, without copying it through S1
+int send_passed_file(int server_socket, int client_socket, int fd, long file_size_bytes) {
+    long offset;
+    long total_sent = 0;
+    
+    int ok = file_size_bytes >= 0 && recv_all(server_socket, &offset, sizeof(offset)) == 0;
+    send_size(client_socket, ok ? file_size_bytes : -1);
+    
+    long long send_start = trace_now_us();
+    while (ok && total_sent < file_size_bytes) {
+        long left = file_size_bytes - total_sent;
+        ssize_t sent = sendfile(client_socket, fd, &offset, left < QOS_GRANT ? left : QOS_GRANT);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) break;
+        total_sent += sent;
+        qos_charge(sent);
+    }
+    close(fd);
+    trace_span_args("sendfile", send_start, "bytes", total_sent, NULL, 0);
+    
+    stats_count_bytes(0, total_sent);
+    return ok && total_sent == file_size_bytes ? 0 : -1;
+}
+
+// Function to forward a size-prefixed payload from a server to the client
+int relay_sized_payload(int server_socket, int client_socket) {
+    long file_size_bytes;
+    int passed_fd = -1;
+    
+    // Receive size from server and pass it on
+    long long reply_start = trace_now_us();
+    if (recv_size_fds(server_socket, &file_size_bytes, &passed_fd, 1) < 0) {
+        send_size(client_socket, -1);
+        return -1;
+    }
+    trace_span("reply_wait", reply_start);
+    if (passed_fd >= 0) {
+        return send_passed_file(server_socket, client_socket, passed_fd, file_size_bytes);
     }
+    if (file_size_bytes == BUSY_SIZE) {
+        char reply[MAX_COMMAND];
+        if (recv_message(server_socket, reply, sizeof(reply)) >= 0) note_storage_busy(reply);
+        file_size_bytes = -1;
+    }
+    send_size(client_socket, file_size_bytes);
     
-    fclose(file);
-    return 0;
+    // Forward data to client
+    long long relay_start = trace_now_us();
+    struct relay_result moved;
+    int result = relay_copy(server_socket, client_socket, file_size_bytes, 0, &moved);
+    trace_span_args("relay", relay_start, "server_us", moved.source_stall_us, "client_us", moved.sink_stall_us);
+    
+    stats_count_bytes(0, moved.sent);
+    return result == 0 && file_size_bytes >= 0 ? 0 : -1;
+}
+
+// A file download from a storage server, as hedge_read() starts it
+struct download_request {
+    int server_port;
+    const char* filepath;
+};
+
+// Function to connect to a storage server and ask it for a file; returns the socket or -1
+int start_download(void* context) {
+    struct download_request* request = context;
+    int server_socket = connect_to_server(request->server_port);
+    if (server_socket < 0) return -1;
+    
+    // Over AF_UNIX the storage server hands over the file's descriptor instead of its bytes
+    const char* command = is_local_socket(server_socket) ? "DOWNLOAD_FD" : "DOWNLOAD";
+    struct send_batch batch;
+    if (batch_command(&batch, server_socket, command) < 0 || batch_message(&batch, request->filepath) < 0 ||
+        batch_flush(&batch, NULL, 0, 0) < 0) {
+        close(server_socket);
+        return -1;
+    }
+    return server_socket;
 }
 
 // Function to handle uploadf command
-void handle_uploadf_command(int client_socket, char* command) {
+int handle_uploadf_command(int client_socket, char* command) {
     char* command_token;
     char source_filenames[3][MAX_PATH];
-    char destination_directory[MAX_PATH];
+    char destination_directory[MAX_PATH] = "";
     int number_of_files = 0;
-    char data_buffer[BUFFER_SIZE];
-    FILE* source_file_handle;
-    FILE* destination_file_handle;
+    int failures = 0;
     long file_size_bytes;
-    int bytes_transferred;
     
     // Parse command
     command_token = strtok(command, " ");
@@ -186,131 +507,79 @@ void handle_uploadf_command(int client_socket, char* command) {
         command_token = strtok(NULL, " ");
     }
     
-    // Get destination path if not found yet
-    if (strlen(destination_directory) == 0) {
-        command_token = strtok(NULL, " ");
-        if (command_token != NULL) {
-            strcpy(destination_directory, command_token);
-        }
+    // Get destination path if not found yet (the loop stops early after 3 files)
+    if (strlen(destination_directory) == 0 && command_token != NULL) {
+        strcpy(destination_directory, command_token);
     }
     
     // Replace ~S1 with actual path
-    if (strstr(destination_directory, "~S1") != NULL) {
-        char* home_directory = getenv("HOME");
-        char temp_path_buffer[MAX_PATH];
-        strcpy(temp_path_buffer, destination_directory);
-        strcpy(destination_directory, home_directory);
-        strcat(destination_directory, "/S1");
-        strcat(destination_directory, strstr(temp_path_buffer, "/S1") + 3);
-    }
+    expand_s1_path(destination_directory);
     
     // Create destination directory if it doesn't exist
-    char* last_slash_position = strrchr(destination_directory, '/');
-    if (last_slash_position) {
-        *last_slash_position = '\0';
-        create_directory_if_not_exists(destination_directory);
-        *last_slash_position = '/';
+    size_t destination_length = strlen(destination_directory);
+    if (destination_length > 1 && destination_directory[destination_length - 1] == '/') {
+        destination_directory[destination_length - 1] = '\0';
     }
+    create_directory_if_not_exists(destination_directory);
     
     // Process each file
     for (int file_index = 0; file_index < number_of_files; file_index++) {
         char* file_extension = get_file_extension(source_filenames[file_index]);
         char complete_destination_path[MAX_PATH];
-        snprintf(complete_destination_path, MAX_PATH, "%s/%s", destination_directory, source_filenames[file_index]);
+        int path_length = snprintf(complete_destination_path, MAX_PATH, "%s/%s", destination_directory,
+                                   source_filenames[file_index]);
         
         // Receive file from client
-        recv(client_socket, &file_size_bytes, sizeof(file_size_bytes), 0);
+        if (recv_size(client_socket, &file_size_bytes) < 0) {
+            return -1;
+        }
         
-        if (file_size_bytes > 0) {
-            // Create temporary file to receive from client
-            char temporary_file_path[MAX_PATH];
-            snprintf(temporary_file_path, MAX_PATH, "/tmp/temp_upload_%d", file_index);
-            
-            FILE* temporary_file_handle = fopen(temporary_file_path, "wb");
-            if (temporary_file_handle == NULL) {
-                printf("Error: Cannot create temporary file\n");
-                send(client_socket, "ERROR", 5, 0);
-                continue;
-            }
-            
-            // Receive file data from client
-            long total_bytes_received = 0;
-            while (total_bytes_received < file_size_bytes) {
-                bytes_transferred = recv(client_socket, data_buffer, BUFFER_SIZE, 0);
-                if (bytes_transferred <= 0) break;
-                fwrite(data_buffer, 1, bytes_transferred, temporary_file_handle);
-                total_bytes_received += bytes_transferred;
-            }
-            fclose(temporary_file_handle);
-            
-            // Send success confirmation to client
-            send(client_socket, "SUCCESS", 7, 0);
-            
-            // Handle file based on extension
-            if (strcmp(file_extension, "c") == 0) {
-                // Store .c files locally
-                source_file_handle = fopen(temporary_file_path, "rb");
-                destination_file_handle = fopen(complete_destination_path, "wb");
-                
-                while ((bytes_transferred = fread(data_buffer, 1, BUFFER_SIZE, source_file_handle)) > 0) {
-                    fwrite(data_buffer, 1, bytes_transferred, destination_file_handle);
-                }
-                
-                fclose(source_file_handle);
-                fclose(destination_file_handle);
-                printf("File %s stored locally in S1\n", source_filenames[file_index]);
-                
-            } else if (strcmp(file_extension, "pdf") == 0) {
-                // Send to S2
-                int s2_server_socket = connect_to_server(S2_PORT);
-                if (s2_server_socket >= 0) {
-                    send(s2_server_socket, "UPLOAD", 6, 0);
-                    if (send_file_to_server(s2_server_socket, temporary_file_path, source_filenames[file_index]) == 0) {
-                        printf("File %s sent to S2\n", source_filenames[file_index]);
-                    }
-                    close(s2_server_socket);
-                }
-                
-            } else if (strcmp(file_extension, "txt") == 0) {
-                // Send to S3
-                int s3_server_socket = connect_to_server(S3_PORT);
-                if (s3_server_socket >= 0) {
-                    send(s3_server_socket, "UPLOAD", 6, 0);
-                    if (send_file_to_server(s3_server_socket, temporary_file_path, source_filenames[file_index]) == 0) {
-                        printf("File %s sent to S3\n", source_filenames[file_index]);
-                    }
-                    close(s3_server_socket);
-                }
-                
-            } else if (strcmp(file_extension, "zip") == 0) {
-                // Send to S4
-                int s4_server_socket = connect_to_server(S4_PORT);
-                if (s4_server_socket >= 0) {
-                    send(s4_server_socket, "UPLOAD", 6, 0);
-                    if (send_file_to_server(s4_server_socket, temporary_file_path, source_filenames[file_index]) == 0) {
-                        printf("File %s sent to S4\n", source_filenames[file_index]);
-                    }
-                    close(s4_server_socket);
-                }
-            }
-            
-            // Clean up temporary file
-            remove(temporary_file_path);
+        // A destination too long to store under is refused; the client's bytes are still read off the socket
+        if (path_length >= MAX_PATH) {
+            printf("Error: Destination path for %s is too long\n", source_filenames[file_index]);
+            if (file_size_bytes > 0 && drain_bytes(client_socket, file_size_bytes) < 0) return -1;
+            file_size_bytes = -1;
+        }
+        if (file_size_bytes < 0) {
+            send_message(client_socket, "ERROR");
+            failures++;
+            continue;
+        }
+        
+        // Stream the file to where it is stored, with no intermediate copy
+        int stored;
+        if (strcmp(file_extension, "c") == 0) {
+            // Store .c files locally via a temporary file published with rename
+            stored = store_local_upload(client_socket, complete_destination_path, file_size_bytes);
+            if (stored > 0) printf("File %s stored locally in S1\n", source_filenames[file_index]);
+        } else {
+            // Send to the server responsible for this extension
+            int server_port = get_server_port_for_extension(file_extension);
+            int storage_server_socket = server_port ? connect_to_server(server_port) : -1;
+            stored = forward_upload(client_socket, storage_server_socket, complete_destination_path,
+                                    source_filenames[file_index], file_size_bytes);
+            if (stored > 0) printf("File %s sent to %s\n", source_filenames[file_index], get_server_name(server_port));
+            if (storage_server_socket >= 0) close(storage_server_socket);
+        }
+        if (stored < 0) {
+            return -1;
         }
+        
+        // Report the result for this file to the client
+        send_message(client_socket, stored ? "SUCCESS" : "ERROR");
+        if (!stored) failures++;
     }
     
-    send(client_socket, "UPLOAD_COMPLETE", 15, 0);
+    send_completion(client_socket, "UPLOAD_COMPLETE");
+    return failures ? -1 : 0;
 }
 
 // Function to handle downlf command
-void handle_downlf_command(int client_socket, char* command) {
+int handle_downlf_command(int client_socket, char* command) {
     char* command_token;
     char file_paths[2][MAX_PATH];
     int number_of_files = 0;
-    char data_buffer[BUFFER_SIZE];
-    FILE* file_handle;
-    long file_size_bytes;
-    int bytes_transferred;
+    int failures = 0;
     
     // Parse command
     command_token = strtok(command, " ");
@@ -319,6 +588,7 @@ void handle_downlf_command(int client_socket, char* command) {
     // Get filepaths (up to 2)
     while (command_token != NULL && number_of_files < 2) {
         strcpy(file_paths[number_of_files], command_token);
+        expand_s1_path(file_paths[number_of_files]);
         number_of_files++;
         command_token = strtok(NULL, " ");
     }
@@ -329,441 +599,1275 @@ void handle_downlf_command(int client_socket, char* command) {
         
         if (strcmp(file_extension, "c") == 0) {
             // Handle .c files locally
-            file_handle = fopen(file_paths[file_index], "rb");
-            if (file_handle == NULL) {
-                send(client_socket, "ERROR: File not found", 20, 0);
-                continue;
-            }
-            
-            // Get file size
-            fseek(file_handle, 0, SEEK_END);
-            file_size_bytes = ftell(file_handle);
-            fseek(file_handle, 0, SEEK_SET);
-            
-            // Send file size
-            send(client_socket, &file_size_bytes, sizeof(file_size_bytes), 0);
-            
-            // Send file data
-            while ((bytes_transferred = fread(data_buffer, 1, BUFFER_SIZE, file_handle)) > 0) {
-                send(client_socket, data_buffer, bytes_transferred, 0);
-            }
-            
-            fclose(file_handle);
-            
-        } else if (strcmp(file_extension, "pdf") == 0) {
-            // Get from S2
-            int s2_server_socket = connect_to_server(S2_PORT);
-            if (s2_server_socket >= 0) {
-                send(s2_server_socket, "DOWNLOAD", 8, 0);
-                if (receive_file_from_server(s2_server_socket, file_paths[file_index]) == 0) {
-                    // Send file to client
-                    file_handle = fopen(file_paths[file_index], "rb");
-                    fseek(file_handle, 0, SEEK_END);
-                    file_size_bytes = ftell(file_handle);
-                    fseek(file_handle, 0, SEEK_SET);
-                    
-                    send(client_socket, &file_size_bytes, sizeof(file_size_bytes), 0);
-                    
-                    while ((bytes_transferred = fread(data_buffer, 1, BUFFER_SIZE, file_handle)) > 0) {
-                        send(client_socket, data_buffer, bytes_transferred, 0);
-                    }
-                    
-                    fclose(file_handle);
-                    remove(file_paths[file_index]); // Clean up temporary file
-                }
-                close(s2_server_socket);
-            }
-            
-        } else if (strcmp(file_extension, "txt") == 0) {
-            // Get from S3
-            int s3_server_socket = connect_to_server(S3_PORT);
-            if (s3_server_socket >= 0) {
-                send(s3_server_socket, "DOWNLOAD", 8, 0);
-                if (receive_file_from_server(s3_server_socket, file_paths[file_index]) == 0) {
-                    // Send file to client
-                    file_handle = fopen(file_paths[file_index], "rb");
-                    fseek(file_handle, 0, SEEK_END);
-                    file_size_bytes = ftell(file_handle);
-                    fseek(file_handle, 0, SEEK_SET);
-                    
-                    send(client_socket, &file_size_bytes, sizeof(file_size_bytes), 0);
-                    
-                    while ((bytes_transferred = fread(data_buffer, 1, BUFFER_SIZE, file_handle)) > 0) {
-                        send(client_socket, data_buffer, bytes_transferred, 0);
-                    }
-                    
-                    fclose(file_handle);
-                    remove(file_paths[file_index]); // Clean up temporary file
-                }
-                close(s3_server_socket);
-            }
-            
-        } else if (strcmp(file_extension, "zip") == 0) {
-            // Get from S4
-            int s4_server_socket = connect_to_server(S4_PORT);
-            if (s4_server_socket >= 0) {
-                send(s4_server_socket, "DOWNLOAD", 8, 0);
-                if (receive_file_from_server(s4_server_socket, file_paths[file_index]) == 0) {
-                    // Send file to client
-                    file_handle = fopen(file_paths[file_index], "rb");
-                    fseek(file_handle, 0, SEEK_END);
-                    file_size_bytes = ftell(file_handle);
-                    fseek(file_handle, 0, SEEK_SET);
-                    
-                    send(client_socket, &file_size_bytes, sizeof(file_size_bytes), 0);
-                    
-                    while ((bytes_transferred = fread(data_buffer, 1, BUFFER_SIZE, file_handle)) > 0) {
-                        send(client_socket, data_buffer, bytes_transferred, 0);
-                    }
-                    
-                    fclose(file_handle);
-                    remove(file_paths[file_index]); // Clean up temporary file
-                }
-                close(s4_server_socket);
-            }
+            if (send_local_file(client_socket, file_paths[file_index]) < 0) failures++;
+            continue;
+        }
+        
+        // Get from the server responsible for this extension, hedging the request if it is slow
+        struct download_request request = { get_server_port_for_extension(file_extension), file_paths[file_index] };
+        int storage_server_socket = request.server_port ? hedge_read(start_download, &request) : -1;
+        if (storage_server_socket < 0) {
+            send_size(client_socket, -1);
+            failures++;
+            continue;
         }
+        
+        if (relay_sized_payload(storage_server_socket, client_socket) < 0) failures++;
+        close(storage_server_socket);
     }
     
-    send(client_socket, "DOWNLOAD_COMPLETE", 17, 0);
+    send_completion(client_socket, "DOWNLOAD_COMPLETE");
+    return failures ? -1 : 0;
 }
 
-// Function to handle removef command
-void handle_removef_command(int client_socket, char* command) {
-    char* command_token;
-    char file_paths[2][MAX_PATH];
-    int number_of_files = 0;
-    
-    // Parse command
-    command_token = strtok(command, " ");
-    command_token = strtok(NULL, " "); // Skip "removef"
+// Function to handle locate: authorize one direct transfer with the storage server and send the client to it
+int handle_locate_command(int client_socket, char* command) {
+    char filepath[MAX_PATH];
+    char grant[MAX_COMMAND];
+    char reply[MAX_COMMAND];
+    char token[DIRECT_TOKEN_SIZE];
+    char setting[32];
+    char local_path[MAX_PATH];
+    long file_size = -1;
     
-    // Get filepaths (up to 2)
-    while (command_token != NULL && number_of_files < 2) {
-        strcpy(file_paths[number_of_files], command_token);
-        number_of_files++;
-        command_token = strtok(NULL, " ");
+    // "locate put <destination> <name> <size>" or "locate get <path>"
+    strtok(command, " ");
+    char* kind = strtok(NULL, " ");
+    char* path = strtok(NULL, " ");
+    char* name = strtok(NULL, " ");
+    char* size_text = strtok(NULL, " ");
+    int put = kind != NULL && strcmp(kind, "put") == 0;
+    if (path == NULL || (!put && strcmp(kind, "get") != 0) || (put && (size_text == NULL || atol(size_text) < 0))) {
+        send_message(client_socket, "ERROR");
+        return -1;
     }
     
-    // Process each file
-    for (int file_index = 0; file_index < number_of_files; file_index++) {
-        char* file_extension = get_file_extension(file_paths[file_index]);
+    // Uploads land where uploadf would put them, in a directory S1 creates
+    int fits = snprintf(filepath, MAX_PATH, "%s", path) < MAX_PATH && expand_s1_path(filepath) == 0;
+    if (fits && put) {
+        size_t length = strlen(filepath);
+        if (length > 1 && filepath[length - 1] == '/') filepath[--length] = '\0';
+        fits = snprintf(filepath + length, MAX_PATH - length, "/%s", name) < (int)(MAX_PATH - length);
         
-        if (strcmp(file_extension, "c") == 0) {
-            // Delete .c files locally
-            if (remove(file_paths[file_index]) == 0) {
-                printf("File %s deleted from S1\n", file_paths[file_index]);
-            } else {
-                printf("Error deleting file %s\n", file_paths[file_index]);
-            }
-            
-        } else if (strcmp(file_extension, "pdf") == 0) {
-            // Request S2 to delete
-            int s2_server_socket = connect_to_server(S2_PORT);
-            if (s2_server_socket >= 0) {
-                send(s2_server_socket, "DELETE", 6, 0);
-                send(s2_server_socket, file_paths[file_index], strlen(file_paths[file_index]), 0);
-                close(s2_server_socket);
-            }
-            
-        } else if (strcmp(file_extension, "txt") == 0) {
-            // Request S3 to delete
-            int s3_server_socket = connect_to_server(S3_PORT);
-            if (s3_server_socket >= 0) {
-                send(s3_server_socket, "DELETE", 6, 0);
-                send(s3_server_socket, file_paths[file_index], strlen(file_paths[file_index]), 0);
-                close(s3_server_socket);
-            }
-            
-        } else if (strcmp(file_extension, "zip") == 0) {
-            // Request S4 to delete
-            int s4_server_socket = connect_to_server(S4_PORT);
-            if (s4_server_socket >= 0) {
-                send(s4_server_socket, "DELETE", 6, 0);
-                send(s4_server_socket, file_paths[file_index], strlen(file_paths[file_index]), 0);
-                close(s4_server_socket);
-            }
+        // Only a path that fits is created, so the token and the extension check see the real name
+        if (fits) {
+            filepath[length] = '\0';
+            create_directory_if_not_exists(filepath);
+            filepath[length] = '/';
         }
+        file_size = atol(size_text);
+    }
+    if (!fits) {
+        printf("Error: Path for locate %s is too long\n", kind);
+        send_message(client_socket, "ERROR");
+        return -1;
     }
     
-    send(client_socket, "DELETE_COMPLETE", 15, 0);
+    // Files S1 keeps itself, and everything while direct transfers are off, go through uploadf/downlf
+    int server_port = get_server_port_for_extension(get_file_extension(filepath));
+    if (!direct_enabled || server_port == 0) {
+        return send_message(client_socket, "PROXY");
+    }
+    
+    // The storage server learns the token from S1 before the client can present it
+    int granted = 0;
+    int server_socket = direct_new_token(token) == 0 ? connect_to_server(server_port) : -1;
+    if (server_socket >= 0) {
+        int length = snprintf(grant, sizeof(grant), "%s %s %s %ld %s", direct_secret(), token, kind, file_size, filepath);
+        struct send_batch batch;
+        granted = length < (int)sizeof(grant) && batch_command(&batch, server_socket, "GRANT") == 0 &&
+                  batch_message(&batch, grant) == 0 && batch_flush(&batch, NULL, 0, 0) == 0 &&
+                  recv_message(server_socket, reply, sizeof(reply)) >= 0 && strcmp(reply, "SUCCESS") == 0;
+        close(server_socket);
+    }
+    if (!granted) {
+        send_message(client_socket, "ERROR");
+        return -1;
+    }
+    
+    // A client on S1's AF_UNIX socket is co-located, so it gets the storage server's socket too
+    const char* server_name = get_server_name(server_port);
+    const char* host = is_local_socket(client_socket) ? local_socket_path(server_name, local_path, sizeof(local_path)) : NULL;
+    snprintf(setting, sizeof(setting), "S25_%s_HOST", server_name);
+    if (host == NULL) host = get_config_string(setting, "127.0.0.1");
+    
+    snprintf(reply, sizeof(reply), "REDIRECT %s %d %s", host, server_port, token);
+    printf("Direct %s of %s granted on %s\n", kind, filepath, server_name);
+    return send_message(client_socket, reply);
 }
 
-// Function to handle downltar command
-void handle_downltar_command(int client_socket, char* command) {
-    char* command_token;
-    char file_type[10];
-    char data_buffer[BUFFER_SIZE];
-    FILE* file_handle;
-    long file_size_bytes;
-    int bytes_transferred;
+// One storage server's share of a bulk delete
+struct purge_job {
+    int server_port;
+    int server_socket;
+    int count;                 // arguments sent to this server
+    int* indexes;              // their positions in the request
+    char* results;             // "STATUS position name" lines the server sent back
+    size_t results_length;
+    size_t results_capacity;
+    char reply[MAX_COMMAND];   // the server's final frame; empty if it never came
+};
+
+// Function to check whether a path has glob wildcards in it
+int has_wildcards(const char* path) {
+    return strpbrk(path, "*?[") != NULL;
+}
+
+// Function to queue the result for one file of a bulk delete, logging it and, if reporting, sending it on;
+// a relative name is under the S1 directory, any other is shown as it is
+void report_purge_result(struct send_batch* report, int deleted, const char* name, int relative, const char* server_name) {
+    char result[MAX_PATH + 32];
     
-    // Parse command
-    command_token = strtok(command, " ");
-    command_token = strtok(NULL, " "); // Skip "downltar"
-    strcpy(file_type, command_token);
+    snprintf(result, sizeof(result), "%s %s%s", deleted ? "DELETED" : "FAILED", relative ? "~S1/" : "", name);
+    if (deleted) {
+        printf("File %s deleted from %s\n", result + 8, server_name);
+    } else {
+        printf("Error deleting file %s\n", result + 7);
+    }
+    if (report != NULL) batch_message(report, result);
+}
+
+// Function to read one storage server's bulk delete results until its final frame
+void* collect_purge_results(void* argument) {
+    struct purge_job* job = argument;
+    char frame[MAX_PATH + 64];
     
-    if (strcmp(file_type, ".c") == 0) {
-        // Create tar of .c files locally
-        system("cd ~/S1 && tar -cf cfiles.tar $(find . -name '*.c')");
-        
-        // Send tar file to client
-        file_handle = fopen("~/S1/cfiles.tar", "rb");
-        if (file_handle == NULL) {
-            return;
+    while (recv_message(job->server_socket, frame, sizeof(frame)) >= 0) {
+        if (strncmp(frame, "DELETED ", 8) != 0 && strncmp(frame, "FAILED ", 7) != 0) {
+            snprintf(job->reply, sizeof(job->reply), "%s", frame);
+            break;
         }
         
-        fseek(file_handle, 0, SEEK_END);
-        file_size_bytes = ftell(file_handle);
-        fseek(file_handle, 0, SEEK_SET);
+        size_t length = strlen(frame) + 1;
+        if (job->results_length + length > job->results_capacity) {
+            size_t capacity = job->results_capacity ? job->results_capacity * 2 : 4096;
+            while (capacity < job->results_length + length) capacity *= 2;
+            char* grown = realloc(job->results, capacity);
+            if (grown == NULL) break;
+            job->results = grown;
+            job->results_capacity = capacity;
+        }
+        memcpy(job->results + job->results_length, frame, length);
+        job->results[job->results_length + length - 1] = '\n';
+        job->results_length += length;
+    }
+    return NULL;
+}
+
+// Function to check that a path or pattern, up to its first wildcard, stays inside the S1 directory
+int purge_inside_root(const char* path) {
+    char root[MAX_PATH];
+    char directory[MAX_PATH];
+    
+    snprintf(root, MAX_PATH, "%s/S1", getenv("HOME"));
+    snprintf(directory, MAX_PATH, "%.*s", (int)strcspn(path, "*?["), path);
+    char* slash = strrchr(directory, '/');
+    if (slash == NULL) return 0;
+    *slash = '\0';
+    return path_within(root, directory);
+}
+
+// Function to delete S1's own .c files named by a path, or matched by it unless exact; returns the failures
+int purge_local_files(const char* path, int exact, struct send_batch* report, int* matched) {
+    char root[MAX_PATH];
+    glob_t found;
+    int failures = 0;
+    
+    snprintf(root, MAX_PATH, "%s/S1/", getenv("HOME"));
+    size_t root_length = strlen(root);
+    
+    if (exact || !has_wildcards(path)) {
+        int deleted = strcmp(get_file_extension(path), "c") == 0 && path_within(root, path) && remove(path) == 0;
+        int relative = strncmp(path, root, root_length) == 0;
+        *matched = 1;
+        report_purge_result(report, deleted, relative ? path + root_length : path, relative, "S1");
+        return deleted ? 0 : 1;
+    }
+    
+    // Only regular .c files under S1 are S1's to delete, even if a wildcard or ".." leads elsewhere;
+    // glob() already skips hidden entries such as in-progress uploads
+    if (glob(path, 0, NULL, &found) != 0) return 0;
+    for (size_t i = 0; i < found.gl_pathc; i++) {
+        const char* file = found.gl_pathv[i];
+        struct stat info;
+        if (lstat(file, &info) < 0 || !S_ISREG(info.st_mode) || strcmp(get_file_extension(file), "c") != 0) continue;
+        if (!path_within(root, file)) continue;
         
-        send(client_socket, &file_size_bytes, sizeof(file_size_bytes), 0);
+        int deleted = remove(file) == 0;
+        int relative = strncmp(file, root, root_length) == 0;
+        *matched = 1;
+        report_purge_result(report, deleted, relative ? file + root_length : file, relative, "S1");
+        if (!deleted) failures++;
+    }
+    globfree(&found);
+    return failures;
+}
+
+// Function to delete the files named by ~S1 paths, or matched by them as glob patterns unless exact, with one
+// batched PURGE per storage server, all running at once; reports each file if report is set, returns the failures
+int purge_files(char (*paths)[MAX_PATH], int count, int exact, struct send_batch* report) {
+    const int ports[3] = { s2_port, s3_port, s4_port };
+    struct purge_job jobs[3];
+    pthread_t threads[3];
+    int started[3] = { 0, 0, 0 };
+    char expanded[MAX_PATH];
+    char header[64];
+    int failures = 0;
+    int* matched = calloc(count > 0 ? count : 1, sizeof(int));
+    int allocated = matched != NULL;
+    
+    memset(jobs, 0, sizeof(jobs));
+    for (int j = 0; j < 3; j++) {
+        jobs[j].server_port = ports[j];
+        jobs[j].server_socket = -1;
+        jobs[j].indexes = malloc((count > 0 ? count : 1) * sizeof(int));
+        if (jobs[j].indexes == NULL) allocated = 0;
+    }
+    if (!allocated) {
+        for (int j = 0; j < 3; j++) free(jobs[j].indexes);
+        free(matched);
+        return count;
+    }
+    
+    // A pattern whose extension is itself a pattern (or missing) may match files of every type
+    int local[count > 0 ? count : 1];
+    for (int i = 0; i < count; i++) {
+        snprintf(expanded, MAX_PATH, "%s", paths[i]);
+        expand_s1_path(expanded);
+        const char* slash = strrchr(expanded, '/');
+        const char* extension = get_file_extension(slash ? slash + 1 : expanded);
+        int any_type = !exact && has_wildcards(expanded) && (extension[0] == '\0' || has_wildcards(extension));
         
-        while ((bytes_transferred = fread(data_buffer, 1, BUFFER_SIZE, file_handle)) > 0) {
-            send(client_socket, data_buffer, bytes_transferred, 0);
+        // Nothing is sent anywhere for a path or pattern that starts outside ~S1
+        if (!purge_inside_root(expanded)) {
+            local[i] = 0;
+            matched[i] = 1;
+            report_purge_result(report, 0, paths[i], 0, "S1");
+            failures++;
+            continue;
+        }
+        local[i] = any_type || strcmp(extension, "c") == 0;
+        int routed = local[i];
+        for (int j = 0; j < 3; j++) {
+            if (any_type || get_server_port_for_extension(extension) == jobs[j].server_port) {
+                jobs[j].indexes[jobs[j].count++] = i;
+                routed = 1;
+            }
         }
+        if (!routed) {
+            matched[i] = 1;
+            report_purge_result(report, 0, paths[i], 0, "S1");
+            failures++;
+        }
+    }
+    
+    // Every server gets its whole list in one request before any reply is read, so they all work at once
+    for (int j = 0; j < 3; j++) {
+        if (jobs[j].count == 0 || (jobs[j].server_socket = connect_to_server(jobs[j].server_port)) < 0) continue;
         
-        fclose(file_handle);
+        struct send_batch batch;
+        snprintf(header, sizeof(header), "%d %s", jobs[j].count, exact ? "exact" : "glob");
+        int sent = batch_command(&batch, jobs[j].server_socket, "PURGE") == 0 && batch_message(&batch, header) == 0;
+        for (int k = 0; k < jobs[j].count && sent; k++) {
+            snprintf(expanded, MAX_PATH, "%s", paths[jobs[j].indexes[k]]);
+            expand_s1_path(expanded);
+            sent = batch_message(&batch, expanded) == 0;
+        }
+        if (sent && batch_flush(&batch, NULL, 0, 0) == 0) {
+            started[j] = pthread_create(&threads[j], NULL, collect_purge_results, &jobs[j]) == 0;
+        }
+    }
+    
+    // S1's own files are deleted while the servers work
+    long long disk_start = trace_now_us();
+    for (int i = 0; i < count; i++) {
+        if (!local[i]) continue;
+        snprintf(expanded, MAX_PATH, "%s", paths[i]);
+        expand_s1_path(expanded);
+        failures += purge_local_files(expanded, exact, report, &matched[i]);
+    }
+    trace_span("disk", disk_start);
+    
+    for (int j = 0; j < 3; j++) {
+        if (started[j]) pthread_join(threads[j], NULL);
+        if (jobs[j].server_socket >= 0) close(jobs[j].server_socket);
+        const char* server_name = get_server_name(jobs[j].server_port);
         
-    } else if (strcmp(file_type, ".pdf") == 0) {
-        // Get tar from S2
-        int s2_server_socket = connect_to_server(S2_PORT);
-        if (s2_server_socket >= 0) {
-            send(s2_server_socket, "TAR", 3, 0);
-            
-            // Receive tar file size
-            recv(s2_server_socket, &file_size_bytes, sizeof(file_size_bytes), 0);
-            
-            // Send file size to client
-            send(client_socket, &file_size_bytes, sizeof(file_size_bytes), 0);
-            
-            // Forward tar file to client
-            long total_bytes_received = 0;
-            while (total_bytes_received < file_size_bytes) {
-                bytes_transferred = recv(s2_server_socket, data_buffer, BUFFER_SIZE, 0);
-                if (bytes_transferred <= 0) break;
-                send(client_socket, data_buffer, bytes_transferred, 0);
-                total_bytes_received += bytes_transferred;
+        // Lines are "STATUS position name", position counting the arguments this server was sent
+        char* line = jobs[j].results;
+        char* results_end = jobs[j].results + jobs[j].results_length;
+        while (line != NULL && line < results_end) {
+            char* newline = memchr(line, '\n', results_end - line);
+            *newline = '\0';
+            int deleted = strncmp(line, "DELETED ", 8) == 0;
+            char* position_text = line + (deleted ? 8 : 7);
+            char* name = strchr(position_text, ' ');
+            int position = atoi(position_text);
+            if (name != NULL && position >= 0 && position < jobs[j].count) {
+                matched[jobs[j].indexes[position]] = 1;
+                report_purge_result(report, deleted, name + 1, name[1] != '/', server_name);
+                if (!deleted) failures++;
             }
-            
-            close(s2_server_socket);
+            line = newline + 1;
         }
         
-    } else if (strcmp(file_type, ".txt") == 0) {
-        // Get tar from S3
-        int s3_server_socket = connect_to_server(S3_PORT);
-        if (s3_server_socket >= 0) {
-            send(s3_server_socket, "TAR", 3, 0);
-            
-            // Receive tar file size
-            recv(s3_server_socket, &file_size_bytes, sizeof(file_size_bytes), 0);
-            
-            // Send file size to client
-            send(client_socket, &file_size_bytes, sizeof(file_size_bytes), 0);
-            
-            // Forward tar file to client
-            long total_bytes_received = 0;
-            while (total_bytes_received < file_size_bytes) {
-                bytes_transferred = recv(s3_server_socket, data_buffer, BUFFER_SIZE, 0);
-                if (bytes_transferred <= 0) break;
-                send(client_socket, data_buffer, bytes_transferred, 0);
-                total_bytes_received += bytes_transferred;
+        // Arguments a server never answered for failed as a whole
+        if (jobs[j].count > 0 && strcmp(jobs[j].reply, "SUCCESS") != 0 && strcmp(jobs[j].reply, "ERROR") != 0) {
+            note_storage_busy(jobs[j].reply);
+            for (int k = 0; k < jobs[j].count; k++) {
+                if (matched[jobs[j].indexes[k]]) continue;
+                matched[jobs[j].indexes[k]] = 1;
+                report_purge_result(report, 0, paths[jobs[j].indexes[k]], 0, server_name);
+                failures++;
             }
-            
-            close(s3_server_socket);
         }
+        free(jobs[j].indexes);
+        free(jobs[j].results);
+    }
+    
+    // A pattern nothing matched is reported once, as the client wrote it
+    for (int i = 0; i < count; i++) {
+        if (matched[i]) continue;
+        char result[MAX_PATH + 16];
+        snprintf(result, sizeof(result), "NO_MATCH %s", paths[i]);
+        printf("No files match %s\n", paths[i]);
+        if (report != NULL) batch_message(report, result);
     }
     
-    send(client_socket, "TAR_COMPLETE", 12, 0);
+    free(matched);
+    return failures;
 }
 
+// Function to handle removef command
+int handle_removef_command(int client_socket, char* command) {
+    char file_paths[MAX_COMMAND / 2][MAX_PATH];
+    int number_of_files = 0;
+    
+    // Every path in the command, taken literally; one request per storage server covers them all
+    strtok(command, " "); // Skip "removef"
+    for (char* token = strtok(NULL, " "); token != NULL && number_of_files < MAX_COMMAND / 2; token = strtok(NULL, " ")) {
+        snprintf(file_paths[number_of_files++], MAX_PATH, "%s", token);
+    }
+    
+    int failures = purge_files(file_paths, number_of_files, 1, NULL);
+    send_completion(client_socket, "DELETE_COMPLETE");
+    return failures ? -1 : 0;
+}
 
+// Function to handle purgef: delete the files the paths and glob patterns that follow name, reporting each one
+int handle_purgef_command(int client_socket, char* command) {
+    struct send_batch report;
+    int failures = 0;
+    
+    // "purgef <count>", then one frame per path or pattern
+    strtok(command, " ");
+    char* count_text = strtok(NULL, " ");
+    int count = count_text ? atoi(count_text) : 0;
+    char (*paths)[MAX_PATH] = count > 0 && count <= PURGE_MAX_ARGUMENTS ? malloc(count * sizeof(*paths)) : NULL;
+    
+    // The frames are read even when the request is refused, so the next command is found
+    for (int i = 0; i < count; i++) {
+        if (recv_message(client_socket, paths ? paths[i] : command, MAX_PATH) < 0) {
+            free(paths);
+            return -1;
+        }
+    }
+    if (paths == NULL) {
+        send_message(client_socket, "ERROR");
+        return -1;
+    }
+    
+    // Per-file results are batched into full frames; the client reads them until DELETE_COMPLETE
+    batch_start(&report, client_socket);
+    failures = purge_files(paths, count, 0, &report);
+    batch_flush(&report, NULL, 0, 0);
+    free(paths);
+    
+    send_completion(client_socket, "DELETE_COMPLETE");
+    return failures ? -1 : 0;
+}
+
+// Function to send a storage server a command with its argument frames; 1 if it answered SUCCESS
+int call_storage(int server_port, const char* command, const char* const* arguments, int count) {
+    char reply[MAX_COMMAND];
+    int server_socket = connect_to_server(server_port);
+    if (server_socket < 0) return 0;
+    
+    struct send_batch batch;
+    int sent = batch_command(&batch, server_socket, command) == 0;
+    for (int i = 0; i < count && sent; i++) sent = batch_message(&batch, arguments[i]) == 0;
+    if (sent) sent = batch_flush(&batch, NULL, 0, 0) == 0;
+    
+    long long reply_start = trace_now_us();
+    int replied = sent && recv_message(server_socket, reply, sizeof(reply)) >= 0;
+    close(server_socket);
+    if (!replied) return 0;
+    trace_span("reply_wait", reply_start);
+    note_storage_busy(reply);
+    return strcmp(reply, "SUCCESS") == 0;
+}
+
+// Function to copy or move a .c file within S1: a rename, or a clone published like an upload
+int copy_local_file(const char* source, const char* destination, int move) {
+    char staging_path[MAX_PATH + 64];
+    struct stat file_info;
+    
+    if (move) return durable_rename(source, destination) == 0;
+    
+    int source_fd = open(source, O_RDONLY);
+    if (source_fd < 0 || fstat(source_fd, &file_info) < 0) {
+        if (source_fd >= 0) close(source_fd);
+        return 0;
+    }
+    int fd = durable_temp_path(destination, staging_path, sizeof(staging_path)) == 0 ?
+             open(staging_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    int copied = fd >= 0 && durable_clone(source_fd, fd, file_info.st_size) == 0;
+    close(source_fd);
+    if (fd < 0) return 0;
+    if (close(fd) != 0 || !copied) {
+        remove(staging_path);
+        return 0;
+    }
+    return durable_publish(staging_path, destination) == 0;
+}
+
+// Function to upload a .c file S1 keeps to a storage server, under a name of another type
+int upload_local_file(int server_port, const char* source, const char* destination) {
+    char reply[MAX_COMMAND];
+    struct relay_result moved = { 0 };
+    struct stat file_info;
+    
+    int fd = open(source, O_RDONLY);
+    if (fd < 0 || fstat(fd, &file_info) < 0) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    int server_socket = connect_to_server(server_port);
+    if (server_socket < 0) {
+        close(fd);
+        return 0;
+    }
+    
+    // An ordinary UPLOAD, with the file as the client
+    struct send_batch batch;
+    int sent = batch_command(&batch, server_socket, "UPLOAD") == 0 && batch_message(&batch, destination) == 0 &&
+               batch_message(&batch, strrchr(destination, '/') + 1) == 0 && batch_size(&batch, file_info.st_size) == 0 &&
+               batch_flush(&batch, NULL, 0, file_info.st_size > 0) == 0;
+    long long relay_start = trace_now_us();
+    if (sent) sent = relay_copy(fd, server_socket, file_info.st_size, 0, &moved) == 0;
+    close(fd);
+    trace_span_args("relay", relay_start, "disk_us", moved.source_stall_us, "server_us", moved.sink_stall_us);
+    
+    int replied = sent && recv_message(server_socket, reply, sizeof(reply)) >= 0;
+    close(server_socket);
+    if (!replied) return 0;
+    note_storage_busy(reply);
+    return strcmp(reply, "SUCCESS") == 0;
+}
+
+// Function to download a file from a storage server into S1's own tree as a .c file
+int download_to_local(int server_port, const char* source, const char* destination) {
+    long file_size;
+    int server_socket = connect_to_server(server_port);
+    if (server_socket < 0) return 0;
+    
+    int stored = 0;
+    struct send_batch batch;
+    if (batch_command(&batch, server_socket, "DOWNLOAD") == 0 && batch_message(&batch, source) == 0 &&
+        batch_flush(&batch, NULL, 0, 0) == 0 && recv_size(server_socket, &file_size) == 0) {
+        if (file_size == BUSY_SIZE) {
+            char reply[MAX_COMMAND];
+            if (recv_message(server_socket, reply, sizeof(reply)) >= 0) note_storage_busy(reply);
+        } else if (file_size >= 0) {
+            // The storage server is the sender, as a client is for uploadf
+            stored = store_local_upload(server_socket, destination, file_size) > 0;
+        }
+    }
+    close(server_socket);
+    return stored;
+}
+
+// Function to handle copyf and movef: the servers copy the file among themselves, and the client gets a status
+int handle_copyf_command(int client_socket, char* command, int move) {
+    char source[MAX_PATH];
+    char destination[MAX_PATH];
+    
+    // "copyf <source> <destination>"; a destination ending in '/' or without an extension is a directory
+    strtok(command, " ");
+    char* source_token = strtok(NULL, " ");
+    char* destination_token = strtok(NULL, " ");
+    if (destination_token == NULL) {
+        send_message(client_socket, "ERROR");
+        return -1;
+    }
+    int fits = snprintf(source, MAX_PATH, "%s", source_token) < MAX_PATH &&
+               snprintf(destination, MAX_PATH, "%s", destination_token) < MAX_PATH &&
+               expand_s1_path(source) == 0 && expand_s1_path(destination) == 0;
+    if (fits && (source[0] != '/' || destination[0] != '/')) {
+        send_message(client_socket, "ERROR");
+        return -1;
+    }
+    
+    const char* source_name = strrchr(source, '/') ? strrchr(source, '/') + 1 : source;
+    const char* destination_name = strrchr(destination, '/') ? strrchr(destination, '/') + 1 : destination;
+    if (fits && *get_file_extension(destination_name) == '\0') {
+        size_t length = strlen(destination);
+        if (length > 1 && destination[length - 1] == '/') destination[--length] = '\0';
+        fits = snprintf(destination + length, MAX_PATH - length, "/%s", source_name) < (int)(MAX_PATH - length);
+    }
+    
+    // A shortened name would copy or move the wrong file, or land under the wrong name
+    if (!fits) {
+        printf("Error: Path for %s is too long\n", command_names[move ? CMD_MOVEF : CMD_COPYF]);
+        send_message(client_socket, "ERROR");
+        return -1;
+    }
+    
+    // S1's tree mirrors every directory, as for uploadf
+    char directory[MAX_PATH];
+    snprintf(directory, MAX_PATH, "%s", destination);
+    *strrchr(directory, '/') = '\0';
+    create_directory_if_not_exists(directory);
+    
+    // .c files are S1's own (port 0); any other type needs a storage server
+    char* source_extension = get_file_extension(source);
+    char* destination_extension = get_file_extension(destination);
+    int source_local = strcmp(source_extension, "c") == 0;
+    int destination_local = strcmp(destination_extension, "c") == 0;
+    int source_port = source_local ? 0 : get_server_port_for_extension(source_extension);
+    int destination_port = destination_local ? 0 : get_server_port_for_extension(destination_extension);
+    const char* paths[2] = { source, destination };
+    int done = 0;
+    
+    if ((!source_local && source_port == 0) || (!destination_local && destination_port == 0)) {
+        printf("Error: Cannot %s %s, unsupported file type\n", command_names[move ? CMD_MOVEF : CMD_COPYF], source);
+    } else if (source_local && destination_local) {
+        done = copy_local_file(source, destination, move);
+    } else if (source_port == destination_port) {
+        // One server: a rename or a clone that never leaves its disk
+        done = call_storage(source_port, move ? "MOVE" : "COPY", paths, 2);
+    } else if (!source_local && !destination_local) {
+        // Two servers: the source pushes the file straight to the destination, then drops it if moving
+        char target[64];
+        const char* push[3] = { source, destination, target };
+        snprintf(target, sizeof(target), "%s %d", get_server_name(destination_port), destination_port);
+        done = call_storage(source_port, "PUSH", push, 3) && (!move || call_storage(source_port, "DELETE", paths, 1));
+    } else if (source_local) {
+        done = upload_local_file(destination_port, source, destination) && (!move || remove(source) == 0);
+    } else {
+        done = download_to_local(source_port, source, destination) && (!move || call_storage(source_port, "DELETE", paths, 1));
+    }
+    
+    printf("%s %s to %s: %s\n", move ? "Move" : "Copy", source, destination, done ? "done" : "failed");
+    send_completion(client_socket, done ? "SUCCESS" : "ERROR");
+    return done ? 0 : -1;
+}
+
+// Client socket shared by the threads merging archives into one
+struct tar_merge {
+    int client_socket;
+    pthread_mutex_t lock;
+    long written;
+    int failed;
+};
+
+// Archive being read from one storage server
+struct tar_feed {
+    struct tar_merge* merge;
+    int server_socket;
+    long budget;  // entry bytes the server announced and has not sent yet
+    int entries;
+};
+
+// Function to append bytes to the merged archive; caller holds the lock
+int merge_send(struct tar_merge* merge, const void* data, long length) {
+    if (merge->failed || send_all(merge->client_socket, data, length) < 0) {
+        merge->failed = 1;
+        return -1;
+    }
+    merge->written += length;
+    qos_charge(length);
+    return 0;
+}
+
+// Function to copy complete entries from one storage server into the merged archive
+void* merge_server_archive(void* argument) {
+    struct tar_feed* feed = argument;
+    struct tar_merge* merge = feed->merge;
+    char header[TAR_BLOCK];
+    
+    while (!merge->failed && feed->budget >= TAR_BLOCK && recv_all(feed->server_socket, header, TAR_BLOCK) == 0) {
+        // The end-of-archive marker is not a valid header
+        long entry_size = tar_header_entry_size(header);
+        if (entry_size < 0 || entry_size > feed->budget) break;
+        long data_size = entry_size - TAR_BLOCK;
+        feed->budget -= entry_size;
+        
+        // Small entries are received first, so other servers' entries go out meanwhile
+        if (entry_size <= TAR_SPOOL_LIMIT) {
+            char* entry = malloc(entry_size);
+            int received = entry != NULL && recv_all(feed->server_socket, entry + TAR_BLOCK, data_size) == 0;
+            if (received) {
+                memcpy(entry, header, TAR_BLOCK);
+                pthread_mutex_lock(&merge->lock);
+                merge_send(merge, entry, entry_size);
+                pthread_mutex_unlock(&merge->lock);
+                feed->entries++;
+            }
+            free(entry);
+            if (!received) break;
+            continue;
+        }
+        
+        // Large entries are relayed while holding the client; data a failed server owes is zero-filled
+        int server_alive = 1;
+        pthread_mutex_lock(&merge->lock);
+        if (merge_send(merge, header, TAR_BLOCK) == 0) {
+            struct relay_result moved;
+            relay_copy(feed->server_socket, merge->client_socket, data_size, 0, &moved);
+            merge->written += moved.sent;
+            if (moved.sink_failed) {
+                merge->failed = 1;
+            } else if (moved.source_failed) {
+                server_alive = 0;
+                if (tar_send_zeros(merge->client_socket, data_size - moved.sent) < 0) merge->failed = 1;
+                merge->written += data_size - moved.sent;
+            }
+            feed->entries++;
+        }
+        pthread_mutex_unlock(&merge->lock);
+        if (!server_alive) break;
+    }
+    return NULL;
+}
+
+// Function to stream one archive of the local .c files and every storage server's files
+int send_merged_archive(int client_socket) {
+    const int ports[3] = { s2_port, s3_port, s4_port };
+    struct tar_feed feeds[3];
+    pthread_t threads[3];
+    int started[3] = { 0, 0, 0 };
+    struct tar_merge merge = { client_socket, PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+    char root[MAX_PATH];
+    struct tar_list list;
+    long size;
+    
+    // Ask every storage server first, so they all build their archives at the same time
+    long long tar_start = trace_now_us();
+    for (int i = 0; i < 3; i++) {
+        feeds[i].merge = &merge;
+        feeds[i].entries = 0;
+        feeds[i].server_socket = connect_to_server(ports[i]);
+        if (feeds[i].server_socket >= 0) send_command(feeds[i].server_socket, "TAR");
+    }
+    snprintf(root, MAX_PATH, "%s/S1", getenv("HOME"));
+    tar_list_init(&list);
+    tar_collect_files(&list, root, "c");
+    tar_list_sort(&list);
+    
+    // The merged size is known once every server has announced its archive
+    long total = tar_archive_size(&list);
+    for (int i = 0; i < 3; i++) {
+        if (feeds[i].server_socket >= 0 && recv_size(feeds[i].server_socket, &size) == 0 && size >= 2 * TAR_BLOCK) {
+            feeds[i].budget = size - 2 * TAR_BLOCK;
+            total += feeds[i].budget;
+            continue;
+        }
+        char reply[MAX_COMMAND];
+        if (feeds[i].server_socket >= 0 && size == BUSY_SIZE && recv_message(feeds[i].server_socket, reply, sizeof(reply)) >= 0) {
+            note_storage_busy(reply);
+        }
+        printf("Warning: %s archive unavailable, leaving it out\n", get_server_name(ports[i]));
+        if (feeds[i].server_socket >= 0) close(feeds[i].server_socket);
+        feeds[i].server_socket = -1;
+    }
+    trace_span("tar", tar_start);
+    
+    send_size(client_socket, total);
+    long long transfer_start = trace_now_us();
+    for (int i = 0; i < 3; i++) {
+        if (feeds[i].server_socket < 0) continue;
+        started[i] = pthread_create(&threads[i], NULL, merge_server_archive, &feeds[i]) == 0;
+        if (!started[i]) merge_server_archive(&feeds[i]);
+    }
+    
+    // Local entries are interleaved with the servers' as they are read, the next few read ahead
+    struct prefetch_batch* prefetch = prefetch_start(&list, NULL, NULL);
+    for (int i = 0; i < list.count && !merge.failed; i++) {
+        prefetch_reached(prefetch, i);
+        pthread_mutex_lock(&merge.lock);
+        if (tar_send_entry(client_socket, &list.entries[i], NULL) < 0) {
+            merge.failed = 1;
+        } else {
+            merge.written += tar_entry_size(&list.entries[i]);
+            qos_charge(tar_entry_size(&list.entries[i]));
+        }
+        pthread_mutex_unlock(&merge.lock);
+    }
+    prefetch_finish(prefetch);
+    
+    int files = list.count;
+    for (int i = 0; i < 3; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        if (feeds[i].server_socket >= 0) close(feeds[i].server_socket);
+        files += feeds[i].entries;
+    }
+    tar_list_free(&list);
+    
+    // The end marker is padded with zeros for any bytes a failed server did not send
+    if (!merge.failed && tar_send_zeros(client_socket, total - merge.written) < 0) merge.failed = 1;
+    trace_span_args("transfer", transfer_start, "files", files, "bytes", total);
+    if (merge.failed) return -1;
+    stats_count_bytes(0, total);
+    return 0;
+}
+
+// Function to handle downltar command
+int handle_downltar_command(int client_socket, char* command) {
+    char* command_token;
+    char file_type[10] = "";
+    int result = -1;
+    
+    // Parse command
+    command_token = strtok(command, " ");
+    command_token = strtok(NULL, " "); // Skip "downltar"
+    if (command_token != NULL) {
+        snprintf(file_type, sizeof(file_type), "%s", command_token);
+    }
+    
+    if (strcmp(file_type, ".c") == 0) {
+        // Stream a tar of the .c files in ~/S1 straight to the client
+        char root[MAX_PATH];
+        struct tar_list list;
+        
+        snprintf(root, MAX_PATH, "%s/S1", getenv("HOME"));
+        long long tar_start = trace_now_us();
+        tar_list_init(&list);
+        tar_collect_files(&list, root, "c");
+        tar_list_sort(&list);
+        trace_span("tar", tar_start);
+        
+        // Entry by entry, so the scheduler can pace the archive; the next few files are read ahead
+        send_size(client_socket, tar_archive_size(&list));
+        long long transfer_start = trace_now_us();
+        long total_sent = 0;
+        struct prefetch_batch* prefetch = prefetch_start(&list, NULL, NULL);
+        for (int i = 0; i < list.count && total_sent >= 0; i++) {
+            prefetch_reached(prefetch, i);
+            if (tar_send_entry(client_socket, &list.entries[i], NULL) < 0) {
+                total_sent = -1;
+            } else {
+                total_sent += tar_entry_size(&list.entries[i]);
+                qos_charge(tar_entry_size(&list.entries[i]));
+            }
+        }
+        prefetch_finish(prefetch);
+        if (total_sent >= 0) total_sent = tar_send_zeros(client_socket, 2 * TAR_BLOCK) < 0 ? -1 : total_sent + 2 * TAR_BLOCK;
+        trace_span_args("transfer", transfer_start, "files", list.count, "bytes", total_sent);
+        tar_list_free(&list);
+        if (total_sent >= 0) {
+            stats_count_bytes(0, total_sent);
+            result = 0;
+        }
+        
+    } else if (strcmp(file_type, "all") == 0) {
+        // One archive with the files of every server
+        result = send_merged_archive(client_socket);
+        
+    } else if (strcmp(file_type, ".pdf") == 0 || strcmp(file_type, ".txt") == 0 || strcmp(file_type, ".zip") == 0) {
+        // Get tar from S2, S3 or S4
+        int server_port = get_server_port_for_extension(file_type + 1);
+        int storage_server_socket = connect_to_server(server_port);
+        if (storage_server_socket >= 0) {
+            send_command(storage_server_socket, "TAR");
+            
+            // Forward tar file to client
+            result = relay_sized_payload(storage_server_socket, client_socket);
+            
+            close(storage_server_socket);
+        } else {
+            send_size(client_socket, -1);
+        }
+        
+    } else {
+        send_size(client_socket, -1);
+    }
+    
+    send_completion(client_socket, "TAR_COMPLETE");
+    return result;
+}
+
+// Function to append the listing of one storage server
+void append_server_listing(int server_port, const char* directory_path, char* files_list, size_t list_size) {
+    char data_buffer[BUFFER_SIZE * 10];
+    
+    int storage_server_socket = connect_to_server(server_port);
+    if (storage_server_socket < 0) {
+        return;
+    }
+    
+    struct send_batch batch;
+    batch_command(&batch, storage_server_socket, "LIST");
+    batch_message(&batch, directory_path);
+    batch_flush(&batch, NULL, 0, 0);
+    
+    if (recv_message(storage_server_socket, data_buffer, sizeof(data_buffer)) >= 0 && !note_storage_busy(data_buffer) &&
+        strlen(files_list) + strlen(data_buffer) < list_size) {
+        strcat(files_list, data_buffer);
+    }
+    
+    close(storage_server_socket);
+}
 
 // Function to handle dispfnames command
-void handle_dispfnames_command(int client_socket, char* command) {
+int handle_dispfnames_command(int client_socket, char* command) {
     char* command_token;
-    char directory_path[MAX_PATH];
-    char data_buffer[BUFFER_SIZE];
+    char directory_path[MAX_PATH] = "";
     DIR* directory_handle;
     struct dirent* directory_entry;
     char c_files_list[BUFFER_SIZE * 10] = "";
     char pdf_files_list[BUFFER_SIZE * 10] = "";
     char txt_files_list[BUFFER_SIZE * 10] = "";
     char zip_files_list[BUFFER_SIZE * 10] = "";
-    char final_file_list[BUFFER_SIZE * 10] = "";
+    char final_file_list[BUFFER_SIZE * 40] = "";
     char temp_list[BUFFER_SIZE];
     
     // Parse command
     command_token = strtok(command, " ");
     command_token = strtok(NULL, " "); // Skip "dispfnames"
-    strcpy(directory_path, command_token);
+    if (command_token != NULL) {
+        strcpy(directory_path, command_token);
+    }
     
     // Replace ~S1 with actual path
-    if (strstr(directory_path, "~S1") != NULL) {
-        char* home = getenv("HOME");
-        char temp_path[MAX_PATH];
-        strcpy(temp_path, directory_path);
-        strcpy(directory_path, home);
-        strcat(directory_path, "/S1");
-        strcat(directory_path, strstr(temp_path, "/S1") + 3);
-    }
+    expand_s1_path(directory_path);
     
     // Get .c files from local directory
+    long long disk_start = trace_now_us();
     directory_handle = opendir(directory_path);
     if (directory_handle != NULL) {
         while ((directory_entry = readdir(directory_handle)) != NULL) {
             if (directory_entry->d_type == DT_REG) {
-                if (strstr(directory_entry->d_name, ".c") != NULL) {
+                if (strcmp(get_file_extension(directory_entry->d_name), "c") == 0) {
                     snprintf(temp_list, BUFFER_SIZE, "%s\n", directory_entry->d_name);
-                    strcat(c_files_list, temp_list);
+                    if (strlen(c_files_list) + strlen(temp_list) < sizeof(c_files_list)) {
+                        strcat(c_files_list, temp_list);
+                    }
                 }
             }
         }
         closedir(directory_handle);
     }
+    trace_span("disk", disk_start);
     
-    // Get .pdf files from S2
-    int s2_server_socket = connect_to_server(S2_PORT);
-    if (s2_server_socket >= 0) {
-        send(s2_server_socket, "LIST", 4, 0);
-        send(s2_server_socket, directory_path, strlen(directory_path), 0);
-        
-        memset(data_buffer, 0, BUFFER_SIZE);
-        recv(s2_server_socket, data_buffer, BUFFER_SIZE, 0);
-        strcat(pdf_files_list, data_buffer);
-        
-        close(s2_server_socket);
+    // Get .pdf, .txt and .zip files from S2, S3 and S4
+    append_server_listing(s2_port, directory_path, pdf_files_list, sizeof(pdf_files_list));
+    append_server_listing(s3_port, directory_path, txt_files_list, sizeof(txt_files_list));
+    append_server_listing(s4_port, directory_path, zip_files_list, sizeof(zip_files_list));
+    
+    // Combine in correct order: .c, .pdf, .txt, .zip
+    strcat(final_file_list, c_files_list);
+    strcat(final_file_list, pdf_files_list);
+    strcat(final_file_list, txt_files_list);
+    strcat(final_file_list, zip_files_list);
+    
+    // A listing missing a busy server's files is not sent as if it were complete
+    if (storage_busy_ms >= 0) {
+        send_busy(client_socket, storage_busy_ms);
+        return -1;
     }
     
-    // Get .txt files from S3
-    int s3_server_socket = connect_to_server(S3_PORT);
-    if (s3_server_socket >= 0) {
-        send(s3_server_socket, "LIST", 4, 0);
-        send(s3_server_socket, directory_path, strlen(directory_path), 0);
-        
-        memset(data_buffer, 0, BUFFER_SIZE);
-        recv(s3_server_socket, data_buffer, BUFFER_SIZE, 0);
-        strcat(txt_files_list, data_buffer);
-        
-        close(s3_server_socket);
+    // Send combined file list to client
+    stats_count_bytes(0, strlen(final_file_list));
+    return send_message(client_socket, final_file_list) < 0 ? -1 : 0;
+}
+
+// Function to append the metrics of one storage server
+int append_server_stats(int server_port, FILE* output) {
+    int storage_server_socket = connect_to_server(server_port);
+    if (storage_server_socket < 0) {
+        fprintf(output, "# %s unreachable\n", get_server_name(server_port));
+        return -1;
     }
     
-    // Get .zip files from S4
-    int s4_server_socket = connect_to_server(S4_PORT);
-    if (s4_server_socket >= 0) {
-        send(s4_server_socket, "LIST", 4, 0);
-        send(s4_server_socket, directory_path, strlen(directory_path), 0);
-        
-        memset(data_buffer, 0, BUFFER_SIZE);
-        recv(s4_server_socket, data_buffer, BUFFER_SIZE, 0);
-        strcat(zip_files_list, data_buffer);
-        
-        close(s4_server_socket);
+    char* data_buffer = malloc(S25_MAX_FRAME);
+    int result = -1;
+    
+    send_command(storage_server_socket, "STATS");
+    if (data_buffer != NULL && recv_message(storage_server_socket, data_buffer, S25_MAX_FRAME) >= 0) {
+        if (parse_busy(data_buffer) >= 0) {
+            fprintf(output, "# %s busy\n", get_server_name(server_port));
+        } else {
+            fputs(data_buffer, output);
+            result = 0;
+        }
     }
     
+    free(data_buffer);
+    close(storage_server_socket);
+    return result;
+}
 
+// Function to handle stats command: S1 metrics followed by S2, S3 and S4
+int handle_stats_command(int client_socket) {
+    char* stats_text = NULL;
+    size_t stats_length = 0;
+    int failures = 0;
     
-    // Combine in correct order: .c, .pdf, .txt, .zip
-    strcat(final_file_list, c_files_list);
-    strcat(final_file_list, pdf_files_list);
-    strcat(final_file_list, txt_files_list);
-    strcat(final_file_list, zip_files_list);
+    FILE* output = open_memstream(&stats_text, &stats_length);
+    if (output == NULL) {
+        send_message(client_socket, "");
+        return -1;
+    }
     
-    // Send combined file list to client
-    send(client_socket, final_file_list, strlen(final_file_list), 0);
+    char* local_stats = stats_format();
+    if (local_stats != NULL) fputs(local_stats, output);
+    free(local_stats);
+    
+    if (append_server_stats(s2_port, output) < 0) failures++;
+    if (append_server_stats(s3_port, output) < 0) failures++;
+    if (append_server_stats(s4_port, output) < 0) failures++;
+    fclose(output);
+    
+    stats_count_bytes(0, stats_length);
+    int result = send_message(client_socket, stats_text);
+    free(stats_text);
+    return result < 0 || failures ? -1 : 0;
+}
+
+// Function to append the trace events of one storage server
+int append_server_trace(int server_port, FILE* output) {
+    int storage_server_socket = connect_to_server(server_port);
+    if (storage_server_socket < 0) {
+        return -1;
+    }
+    
+    char* data_buffer = malloc(S25_MAX_FRAME);
+    int result = -1;
+    
+    send_command(storage_server_socket, "TRACE");
+    if (data_buffer != NULL && recv_message(storage_server_socket, data_buffer, S25_MAX_FRAME) >= 0 &&
+        parse_busy(data_buffer) < 0) {
+        if (data_buffer[0] != '\0') fprintf(output, ",\n%s", data_buffer);
+        result = 0;
+    }
+    
+    free(data_buffer);
+    close(storage_server_socket);
+    return result;
+}
+
+// Function to handle trace command: Chrome trace JSON for all four servers
+int handle_trace_command(int client_socket) {
+    char* trace_text = NULL;
+    size_t trace_length = 0;
+    int failures = 0;
+    
+    FILE* output = open_memstream(&trace_text, &trace_length);
+    if (output == NULL) {
+        send_message(client_socket, "");
+        return -1;
+    }
+    
+    char* local_events = trace_format_events();
+    fprintf(output, "{\"traceEvents\":[\n%s", local_events ? local_events : "");
+    free(local_events);
+    
+    if (append_server_trace(s2_port, output) < 0) failures++;
+    if (append_server_trace(s3_port, output) < 0) failures++;
+    if (append_server_trace(s4_port, output) < 0) failures++;
+    fprintf(output, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(output);
+    
+    stats_count_bytes(0, trace_length);
+    int result = send_message(client_socket, trace_text);
+    free(trace_text);
+    return result < 0 || failures ? -1 : 0;
+}
+
+// Function to turn a command away while S1 is overloaded, keeping the reply in the shape the client expects
+void reject_command(int client_socket, int command_index, char* command) {
+    long retry_after_ms = admit_retry_after_ms();
+    int arguments = 0;
+    long file_size;
+    char path[MAX_PATH];
+    
+    // Count the files the command names: up to 3 uploads before the ~S1 destination, up to 2 otherwise
+    strtok(command, " ");
+    for (char* token = strtok(NULL, " "); token != NULL; token = strtok(NULL, " ")) {
+        if (command_index == CMD_PURGEF) {
+            arguments = atoi(token);
+            break;
+        }
+        if (command_index == CMD_UPLOADF && (strstr(token, "~S1") != NULL || arguments == 3)) break;
+        if (command_index == CMD_DOWNLF && arguments == 2) break;
+        arguments++;
+    }
+    
+    switch (command_index) {
+        case CMD_UPLOADF:
+            // The client sends its files without waiting, so they are read and dropped
+            for (int i = 0; i < arguments; i++) {
+                if (recv_size(client_socket, &file_size) < 0) return;
+                if (file_size > 0 && drain_bytes(client_socket, file_size) < 0) return;
+                send_message(client_socket, "ERROR");
+            }
+            break;
+        case CMD_DOWNLF:
+            for (int i = 0; i < arguments; i++) send_size(client_socket, -1);
+            break;
+        case CMD_DOWNLTAR:
+            send_size(client_socket, -1);
+            break;
+        case CMD_PURGEF:
+            // The paths and patterns follow in frames of their own
+            for (int i = 0; i < arguments; i++) {
+                if (recv_message(client_socket, path, MAX_PATH) < 0) return;
+            }
+            break;
+    }
+    send_busy(client_socket, retry_after_ms);
+    printf("Server busy: rejected %s\n", command_names[command_index]);
+}
+
+// Function to find a client command's stats index from its first word; -1 if unknown
+int lookup_command(const char* command) {
+    size_t word_length = strcspn(command, " ");
+    
+    for (int index = 0; index < CMD_COUNT; index++) {
+        if (strlen(command_names[index]) == word_length && strncmp(command, command_names[index], word_length) == 0) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+// Function to check whether the client has already sent another request
+int request_waiting(int client_socket) {
+    char byte;
+    return recv(client_socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
 }
 
 // Function to process client requests (prcclient function)
 void prcclient(int client_socket) {
-    char command[MAX_COMMAND];
+    char frame[MAX_COMMAND];
+    struct request_context context;
     int bytes_received;
     
     printf("Client connected, starting prcclient() function\n");
     
+    // A reply's frames are corked into full segments and flushed before waiting for the next request;
+    // requests already waiting (pipelined) get their replies flushed together
+    int tcp_client = !is_local_socket(client_socket);
+    int corked = 0;
+    if (tcp_client) set_nodelay(client_socket);
+    
     // Infinite loop waiting for client commands
     while (1) {
+        if (corked && !request_waiting(client_socket)) {
+            set_cork(client_socket, 0);
+            corked = 0;
+        }
+        
         // Receive command from client
-        memset(command, 0, MAX_COMMAND);
-        bytes_received = recv(client_socket, command, MAX_COMMAND, 0);
+        bytes_received = recv_message(client_socket, frame, MAX_COMMAND);
+        if (bytes_received >= 0 && tcp_client && !corked) corked = set_cork(client_socket, 1) == 0;
         
-        if (bytes_received <= 0) {
+        if (bytes_received < 0) {
             printf("Client disconnected\n");
             break;
         }
         
-        printf("Received command: %s\n", command);
+        // Split off the request ID; S1 forwards it to S2/S3/S4
+        char* command = parse_request_prefix(frame, &context);
+        printf("Received command: %s (rid %016llx)\n", command, (unsigned long long)context.id);
         
-        // Process command based on first word
-        if (strncmp(command, "uploadf", 7) == 0) {
-            handle_uploadf_command(client_socket, command);
-        } else if (strncmp(command, "downlf", 6) == 0) {
-            handle_downlf_command(client_socket, command);
-        } else if (strncmp(command, "removef", 7) == 0) {
-            handle_removef_command(client_socket, command);
-        } else if (strncmp(command, "downltar", 8) == 0) {
-            handle_downltar_command(client_socket, command);
-        } else if (strncmp(command, "dispfnames", 10) == 0) {
-            handle_dispfnames_command(client_socket, command);
-        } else if (strncmp(command, "quit", 4) == 0) {
+        if (strncmp(command, "quit", 4) == 0) {
             printf("Client requested quit\n");
             break;
-        } else {
+        }
+        
+        // Liveness probe; answered without touching the storage servers
+        if (strcmp(command, "ping") == 0) {
+            send_message(client_socket, "PONG");
+            continue;
+        }
+        
+        int command_index = lookup_command(command);
+        if (command_index < 0) {
             printf("Unknown command: %s\n", command);
-            send(client_socket, "UNKNOWN_COMMAND", 14, 0);
+            send_message(client_socket, "UNKNOWN_COMMAND");
+            continue;
+        }
+        
+        if (!admit_command_begin(command_index, 1)) {
+            reject_command(client_socket, command_index, command);
+            continue;
+        }
+        
+        // Process command based on first word
+        int result = -1;
+        storage_busy_ms = -1;
+        stats_begin(command_index);
+        trace_begin_request(&context, command_names[command_index]);
+        qos_begin(command_classes[command_index]);
+        switch (command_index) {
+            case CMD_UPLOADF: result = handle_uploadf_command(client_socket, command); break;
+            case CMD_DOWNLF: result = handle_downlf_command(client_socket, command); break;
+            case CMD_REMOVEF: result = handle_removef_command(client_socket, command); break;
+            case CMD_DOWNLTAR: result = handle_downltar_command(client_socket, command); break;
+            case CMD_DISPFNAMES: result = handle_dispfnames_command(client_socket, command); break;
+            case CMD_STATS: result = handle_stats_command(client_socket); break;
+            case CMD_TRACE: result = handle_trace_command(client_socket); break;
+            case CMD_LOCATE: result = handle_locate_command(client_socket, command); break;
+            case CMD_COPYF: result = handle_copyf_command(client_socket, command, 0); break;
+            case CMD_MOVEF: result = handle_copyf_command(client_socket, command, 1); break;
+            case CMD_PURGEF: result = handle_purgef_command(client_socket, command); break;
         }
+        qos_end();
+        trace_end_request();
+        stats_end(result == 0);
+        admit_command_end(command_index);
     }
     
     close(client_socket);
     exit(0);
 }
 
+// Function to turn a connection away with BUSY, keeping it open until the client has read the reply
+void reject_session(int client_socket) {
+    send_busy(client_socket, admit_retry_after_ms());
+    stats_count_rejected(-1);
+    printf("Server busy: rejected client connection\n");
+    
+    // Closing with the client's first request unread would reset the connection and lose the reply
+    shutdown(client_socket, SHUT_WR);
+    if (lingering_count == MAX_LINGERING) {
+        close(client_socket);
+        return;
+    }
+    fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL, 0) | O_NONBLOCK);
+    lingering[lingering_count].socket = client_socket;
+    lingering[lingering_count].deadline_us = stats_now_us() + LINGER_US;
+    lingering_count++;
+}
+
+// Function to drop what turned-away clients send and close them once they hang up or time out
+void service_lingering(const struct pollfd* fds) {
+    char discard[BUFFER_SIZE];
+    long long now = stats_now_us();
+    int kept = 0;
+    
+    for (int i = 0; i < lingering_count; i++) {
+        int done = now >= lingering[i].deadline_us;
+        if (!done && fds[i].revents) {
+            ssize_t got;
+            while ((got = recv(lingering[i].socket, discard, sizeof(discard), 0)) > 0);
+            done = got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        }
+        if (done) {
+            close(lingering[i].socket);
+        } else {
+            lingering[kept++] = lingering[i];
+        }
+    }
+    lingering_count = kept;
+}
+
 // Signal handler for zombie processes
 void sigchld_handler(int sig) {
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    (void)sig;
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        admit_session_end();
+    }
 }
 
-int main() {
-    int server_socket, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    pid_t child_pid;
-    
-    // Set up signal handler for zombie processes
-    signal(SIGCHLD, sigchld_handler);
+// Function to create a listening socket; acceptors share the port through SO_REUSEPORT
+int open_listener(int port, int shared) {
+    struct sockaddr_in server_addr;
+    int opt = 1;
     
-    // Create socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket == -1) {
         perror("Socket creation failed");
-        exit(EXIT_FAILURE);
+        return -1;
     }
     
     // Set socket options
-    int opt = 1;
     setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (shared && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("SO_REUSEPORT failed");
+        close(server_socket);
+        return -1;
+    }
     
     // Configure server address
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons(port);
     
     // Bind socket
     if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         perror("Bind failed");
-        exit(EXIT_FAILURE);
+        close(server_socket);
+        return -1;
     }
     
     // Listen for connections
-    if (listen(server_socket, 5) < 0) {
+    if (listen(server_socket, admit_backlog()) < 0) {
         perror("Listen failed");
-        exit(EXIT_FAILURE);
+        close(server_socket);
+        return -1;
     }
+    return server_socket;
+}
+
+// Function to steer each connection to the listener of the CPU that received it
+void steer_by_cpu(int server_socket) {
+    // Listener i belongs to the acceptor pinned to CPU i, so the CPU number is the group index
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog program = { sizeof(code) / sizeof(code[0]), code };
     
-    printf("S1 Server started on port %d\n", PORT);
-    printf("Waiting for client connections...\n");
+    if (setsockopt(server_socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0) {
+        perror("SO_ATTACH_REUSEPORT_CBPF failed; the kernel will hash connections instead");
+    }
+}
+
+// Function to accept connections and fork a child process for each
+void accept_connections(int server_socket) {
+    struct sockaddr_in client_addr;
+    socklen_t client_len;
+    pid_t child_pid;
+    
+    // Set up signal handler for zombie processes
+    signal(SIGCHLD, sigchld_handler);
     
-    // Accept connections and fork child processes
     while (1) {
-        client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
+        // Wait for a connection while finishing off the ones turned away
+        // (poll skips the AF_UNIX slot when there is no local listener)
+        struct pollfd fds[2 + MAX_LINGERING];
+        fds[0] = (struct pollfd){ server_socket, POLLIN, 0 };
+        fds[1] = (struct pollfd){ local_listener, POLLIN, 0 };
+        for (int i = 0; i < lingering_count; i++) {
+            fds[2 + i] = (struct pollfd){ lingering[i].socket, POLLIN, 0 };
+        }
+        int ready = poll(fds, 2 + lingering_count, lingering_count > 0 ? 100 : -1);
+        if (ready >= 0) service_lingering(fds + 2);
+        if (ready <= 0 || !((fds[0].revents | fds[1].revents) & POLLIN)) continue;
+        
+        client_len = sizeof(client_addr);
+        int client_socket;
+        if (fds[0].revents & POLLIN) {
+            client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
+        } else {
+            // Local clients share one listener; another acceptor may have taken the connection
+            client_socket = accept(local_listener, NULL, NULL);
+            if (client_socket < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            client_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        }
         if (client_socket < 0) {
             perror("Accept failed");
             continue;
@@ -771,12 +1875,21 @@ int main() {
         
         printf("New client connection accepted\n");
         
+        // Fail fast instead of forking past the session limit
+        if (!admit_session_begin()) {
+            reject_session(client_socket);
+            admit_session_end();
+            continue;
+        }
+        
         // Fork child process
         child_pid = fork();
         
         if (child_pid == 0) {
             // Child process
             close(server_socket); // Close server socket in child
+            if (local_listener >= 0) close(local_listener);
+            qos_session(client_addr.sin_addr.s_addr);
             prcclient(client_socket); // Call prcclient function
         } else if (child_pid > 0) {
             // Parent process
@@ -786,8 +1899,132 @@ int main() {
             // Fork failed
             perror("Fork failed");
             close(client_socket);
+            admit_session_end();
         }
     }
+}
+
+// Function to fork the acceptor that owns listener index, pinned to its CPU when asked
+pid_t start_acceptor(const int* listeners, int count, int index, int pin) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    
+    for (int i = 0; i < count; i++) {
+        if (i != index) close(listeners[i]);
+    }
+    if (pin) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) perror("sched_setaffinity failed");
+    }
+    printf("Acceptor %d (pid %d) listening\n", index, getpid());
+    accept_connections(listeners[index]);
+    exit(0);
+}
+
+// Function to run one acceptor per listener and restart any that dies
+void run_acceptors(int port, int count) {
+    int listeners[MAX_ACCEPTORS];
+    pid_t pids[MAX_ACCEPTORS];
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int pin = get_config_long("S25_S1_PIN_ACCEPTORS", 1);
+    
+    // The listeners are opened here, in order, so bind errors stop S1 and the group index is stable
+    for (int i = 0; i < count; i++) {
+        listeners[i] = open_listener(port, 1);
+        if (listeners[i] < 0) exit(EXIT_FAILURE);
+    }
+    if (pin && count == cpus) steer_by_cpu(listeners[0]);
+    
+    printf("S1 Server started on port %d with %d SO_REUSEPORT listeners\n", port, count);
+    printf("Waiting for client connections...\n");
+    
+    for (int i = 0; i < count; i++) {
+        pids[i] = start_acceptor(listeners, count, i, pin);
+    }
+    
+    // Sessions are ended by the acceptors that forked them; here only acceptors are reaped
+    while (1) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            perror("wait failed");
+            sleep(1);
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            if (pids[i] != pid) continue;
+            printf("Acceptor %d (pid %d) exited; restarting it\n", i, pid);
+            pids[i] = start_acceptor(listeners, count, i, pin);
+        }
+    }
+}
+
+int main() {
+    int port = get_config_long("S25_S1_PORT", PORT);
+    int acceptors = get_config_long("S25_S1_ACCEPTORS", 1);
+    
+    s2_port = get_config_long("S25_S2_PORT", S2_PORT);
+    s3_port = get_config_long("S25_S3_PORT", S3_PORT);
+    s4_port = get_config_long("S25_S4_PORT", S4_PORT);
+    int metrics_port = get_config_long("S25_S1_METRICS_PORT", 0);
+    int storage_ports[3] = { s2_port, s3_port, s4_port };
+    static const char* const storage_names[3] = { "S2", "S3", "S4" };
+    if (acceptors <= 0) acceptors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (acceptors > MAX_ACCEPTORS) acceptors = MAX_ACCEPTORS;
+    
+    // Metrics and spans live in shared memory so every forked child reports into them
+    stats_init("S1", command_names, CMD_COUNT);
+    admit_init(command_names, CMD_COUNT);
+    trace_init("S1");
+    durable_init();
+    pool_init();
+    prefetch_init();
+    ingest_init();
+    qos_init();
+    relay_init();
+    health_init(storage_ports, storage_names, 3);
+    health_start();
+    hedge_init();
+    ring_size = get_config_long("S25_RING_SIZE", 0);
+    ring_min_bytes = get_config_long("S25_RING_MIN_BYTES", 65536);
+    if (ring_size > 0) {
+        printf("Upload rings: %ld bytes, for uploads of at least %ld bytes\n", ring_size, ring_min_bytes);
+    }
+    direct_enabled = get_config_long("S25_DIRECT", 0) != 0;
+    if (direct_enabled && direct_secret() == NULL) {
+        fprintf(stderr, "S25_DIRECT needs S25_DIRECT_SECRET; direct transfers are off\n");
+        direct_enabled = 0;
+    }
+    if (direct_enabled) printf("Direct transfers: clients are sent to the storage servers\n");
+    if (metrics_port > 0) {
+        stats_start_http(metrics_port);
+    }
+    
+    // Co-located clients can also reach S1 over AF_UNIX
+    char local_path[MAX_PATH];
+    if (local_socket_path("S1", local_path, sizeof(local_path)) != NULL) {
+        local_listener = listen_local_socket(local_path, admit_backlog());
+        if (local_listener < 0) {
+            perror("Local socket failed");
+            exit(EXIT_FAILURE);
+        }
+        fcntl(local_listener, F_SETFL, fcntl(local_listener, F_GETFL, 0) | O_NONBLOCK);
+        printf("S1 Server also listening on %s\n", local_path);
+    }
+    
+    if (acceptors > 1) {
+        run_acceptors(port, acceptors);
+    }
+    
+    int server_socket = open_listener(port, 0);
+    if (server_socket < 0) exit(EXIT_FAILURE);
+    
+    printf("S1 Server started on port %d\n", port);
+    printf("Waiting for client connections...\n");
+    accept_connections(server_socket);
     
     close(server_socket);
     return 0;
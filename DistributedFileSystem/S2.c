@@ -9,30 +9,43 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <fnmatch.h>
+
+#include "s25common.h"
+#include "s25stats.h"
+#include "s25trace.h"
+#include "s25durable.h"
+#include "s25engine.h"
+#include "s25tar.h"
+#include "s25tarcache.h"
+#include "s25admit.h"
+#include "s25ring.h"
+#include "s25direct.h"
+#include "s25prefetch.h"
+#include "s25ingest.h"
+#include "s25pool.h"
 
 #define PORT 8081
 #define BUFFER_SIZE 1024
 #define MAX_PATH 256
 
-// Function to create directory if it doesn't exist
-void create_directory_if_not_exists(const char* path) {
-    char temp_path[MAX_PATH];
-    char* token;
-    char* path_copy = strdup(path);
-    
-    // Create directories one by one
-    token = strtok(path_copy, "/");
-    strcpy(temp_path, "");
-    
-    while (token != NULL) {
-        strcat(temp_path, "/");
-        strcat(temp_path, token);
-        mkdir(temp_path, 0755);
-        token = strtok(NULL, "/");
-    }
-    
-    free(path_copy);
-}
+// Most paths and patterns one PURGE may name
+#define PURGE_MAX_ARGUMENTS 4096
+
+// Commands tracked by the metrics module, in stats index order
+enum { CMD_UPLOAD, CMD_DOWNLOAD, CMD_DELETE, CMD_TAR, CMD_LIST, CMD_STATS, CMD_TRACE, CMD_PUT, CMD_GET, CMD_COPY,
+       CMD_MOVE, CMD_PUSH, CMD_PURGE, CMD_COUNT };
+static const char* const command_names[CMD_COUNT] = { "UPLOAD", "DOWNLOAD", "DELETE", "TAR", "LIST", "STATS", "TRACE", "PUT",
+                                                      "GET", "COPY", "MOVE", "PUSH", "PURGE" };
+
+// Storage engine selected at startup (S25_STORAGE_ENGINE)
+static const struct storage_engine* engine;
 
 // Function to get file extension
 char* get_file_extension(const char* filename) {
@@ -43,274 +56,887 @@ char* get_file_extension(const char* filename) {
     return "";
 }
 
-// Function to handle file upload from S1
-void handle_file_upload(int client_socket) {
-    char buffer[BUFFER_SIZE];
-    char filepath[MAX_PATH];
-    char filename[MAX_PATH];
-    long file_size;
-    FILE* file;
-    int bytes_received;
-    
-    // Receive filepath
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0);
-    strcpy(filepath, buffer);
-    
-    // Replace S1 path with S2 path
-    if (strstr(filepath, "/S1/") != NULL) {
-        char* home = getenv("HOME");
-        char temp_path[MAX_PATH];
-        strcpy(temp_path, filepath);
-        strcpy(filepath, home);
-        strcat(filepath, "/S2");
-        strcat(filepath, strstr(temp_path, "/S1/") + 4);
+// Function to replace the S1 part of a path with this server's directory
+void map_to_local_path(char* path) {
+    char* s1_part = strstr(path, "/S1/");
+    if (s1_part == NULL) {
+        size_t length = strlen(path);
+        if (length >= 3 && strcmp(path + length - 3, "/S1") == 0) {
+            s1_part = path + length - 3;
+        } else {
+            return;
+        }
     }
     
-    // Create directory if it doesn't exist
-    char* last_slash = strrchr(filepath, '/');
-    if (last_slash) {
-        *last_slash = '\0';
-        create_directory_if_not_exists(filepath);
-        *last_slash = '/';
+    char temp_path[MAX_PATH];
+    snprintf(temp_path, MAX_PATH, "%s/S2%s", getenv("HOME"), s1_part + 3);
+    strcpy(path, temp_path);
+}
+
+// Function to check whether a file belongs in the TAR archive (.pdf files)
+static int archived_file(const char* path) {
+    const char* dot = strrchr(path, '.');
+    return dot != NULL && strcmp(dot, ".pdf") == 0;
+}
+
+// Function to tell the tar cache that an archived file changed
+static void invalidate_tar_entry(const char* path) {
+    char root[MAX_PATH];
+    snprintf(root, MAX_PATH, "%s/S2", getenv("HOME"));
+    size_t root_length = strlen(root);
+
+    if (archived_file(path) && strncmp(path, root, root_length) == 0 && path[root_length] == '/') {
+        tar_cache_invalidate(path + root_length + 1);
     }
-    
-    // Receive filename
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0);
-    strcpy(filename, buffer);
-    
-    // Receive file size
-    recv(client_socket, &file_size, sizeof(file_size), 0);
-    
-    // Open file for writing
-    file = fopen(filepath, "wb");
-    if (file == NULL) {
+}
+
+// Function to discard an upload's bytes, from the ring if S1 sent one
+int drain_upload(int client_socket, struct ring* ring, long length) {
+    if (ring == NULL) return drain_bytes(client_socket, length);
+    
+    while (length > 0) {
+        size_t available;
+        if (ring_peek(ring, &available) == NULL) return -1;
+        if ((long)available > length) available = length;
+        ring_consume(ring, available);
+        length -= available;
+    }
+    return 0;
+}
+
+// Function to store an upload of file_size bytes at filepath, from the ring if there is one, and reply
+int store_upload(int client_socket, const char* filepath, long file_size, struct ring* ring) {
+    size_t buffer_size = pool_io_size();
+    long bytes_received;
+    
+    // Socket data is received into a pooled buffer; ring data is written from the ring
+    char* buffer = ring == NULL ? pool_get(buffer_size) : NULL;
+    
+    // Stream into the storage engine; the file only becomes visible on commit
+    long long open_start = trace_now_us();
+    struct engine_stream* stream = ring != NULL || buffer != NULL ? engine->create(filepath, file_size) : NULL;
+    trace_span("open", open_start);
+    if (stream == NULL) {
         printf("Error: Cannot create file %s\n", filepath);
-        send(client_socket, "ERROR", 5, 0);
-        return;
+        pool_put(buffer, buffer_size);
+        drain_upload(client_socket, ring, file_size);
+        ring_free(ring);
+        send_message(client_socket, "ERROR");
+        return -1;
     }
     
     // Receive file data
+    long long transfer_start = trace_now_us();
+    long long disk_us = 0;
     long total_received = 0;
+    int write_failed = 0;
     while (total_received < file_size) {
-        bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
+        long remaining = file_size - total_received;
+        const char* data = buffer;
+        if (ring != NULL) {
+            // Write straight out of the ring, then hand the space back to S1
+            size_t available;
+            data = ring_peek(ring, &available);
+            bytes_received = data == NULL ? -1 : ((long)available < remaining ? (long)available : remaining);
+        } else {
+            bytes_received = recv(client_socket, buffer, remaining < (long)buffer_size ? remaining : (long)buffer_size, 0);
+        }
         if (bytes_received <= 0) break;
-        fwrite(buffer, 1, bytes_received, file);
+        long long write_start = trace_now_us();
+        if (!write_failed && engine->write(stream, data, bytes_received) < 0) {
+            write_failed = 1;
+        }
+        disk_us += trace_now_us() - write_start;
+        if (ring != NULL) ring_consume(ring, bytes_received);
         total_received += bytes_received;
     }
     
-    fclose(file);
-    send(client_socket, "SUCCESS", 7, 0);
+    trace_span_args("transfer", transfer_start, "disk_us", disk_us, "network_us", trace_now_us() - transfer_start - disk_us);
+    stats_count_bytes(total_received, 0);
+    ring_free(ring);
+    pool_put(buffer, buffer_size);
+    if (total_received < file_size) {
+        printf("Error: Upload of %s truncated\n", filepath);
+        engine->abort(stream);
+        return -1;
+    }
+    
+    // Publish (and, depending on S25_DURABILITY, sync) before acknowledging
+    long long commit_start = trace_now_us();
+    if (write_failed) {
+        engine->abort(stream);
+    }
+    if (write_failed || engine->commit(stream) < 0) {
+        printf("Error: Cannot store file %s\n", filepath);
+        send_message(client_socket, "ERROR");
+        return -1;
+    }
+    trace_span("commit", commit_start);
+    invalidate_tar_entry(filepath);
+    
+    send_message(client_socket, "SUCCESS");
     printf("File uploaded successfully: %s\n", filepath);
+    return 0;
 }
 
-// Function to handle file download for S1
-void handle_file_download(int client_socket) {
-    char buffer[BUFFER_SIZE];
+// Function to handle file upload from S1
+int handle_file_upload(int client_socket) {
     char filepath[MAX_PATH];
-    FILE* file;
+    char filename[MAX_PATH];
     long file_size;
-    int bytes_read;
+    int ring_fds[RING_FDS];
+    struct ring* ring = NULL;
     
     // Receive filepath
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0);
-    strcpy(filepath, buffer);
+    if (recv_message(client_socket, filepath, MAX_PATH) < 0) return -1;
     
     // Replace S1 path with S2 path
-    if (strstr(filepath, "/S1/") != NULL) {
-        char* home = getenv("HOME");
-        char temp_path[MAX_PATH];
-        strcpy(temp_path, filepath);
-        strcpy(filepath, home);
-        strcat(filepath, "/S2");
-        strcat(filepath, strstr(temp_path, "/S1/") + 4);
+    map_to_local_path(filepath);
+    
+    // Receive filename
+    if (recv_message(client_socket, filename, MAX_PATH) < 0) return -1;
+    
+    // Receive file size; S1 attaches a shared-memory ring when the data comes through one
+    int passed = recv_size_fds(client_socket, &file_size, ring_fds, RING_FDS);
+    if (passed < 0) return -1;
+    if (passed == RING_FDS) {
+        ring = ring_attach(ring_fds);
+        if (ring == NULL) return -1;
+        ring_bind(ring, client_socket);
+        printf("Receiving upload through a shared-memory ring\n");
+    } else if (passed > 0) {
+        for (int i = 0; i < passed; i++) close(ring_fds[i]);
+        return -1;
     }
     
+    return store_upload(client_socket, filepath, file_size, ring);
+}
+
+// Function to send the file at filepath as a sized payload, or its descriptor if pass_fd is set
+int send_stored_file(int client_socket, const char* filepath, int pass_fd) {
+    long file_size;
+    long bytes_read;
+    
     // Check if file exists
-    file = fopen(filepath, "rb");
-    if (file == NULL) {
+    long long open_start = trace_now_us();
+    struct engine_stream* stream = engine->open(filepath, &file_size);
+    trace_span("open", open_start);
+    if (stream == NULL) {
         printf("Error: File not found %s\n", filepath);
-        send(client_socket, "ERROR", 5, 0);
-        return;
+        send_size(client_socket, -1);
+        return -1;
     }
     
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    // The file is read front to back, so the kernel can read ahead at the disk's sequential speed
+    int fd = -1;
+    long offset = 0;
+    int has_extent = engine->extent(stream, &fd, &offset) == 0;
+    if (has_extent) prefetch_sequential(fd, offset, file_size);
+    
+    // Over AF_UNIX S1 can take the descriptor and send the bytes itself
+    if (pass_fd && has_extent) {
+        long long pass_start = trace_now_us();
+        int passed = send_size_fds(client_socket, file_size, &fd, 1) == 0 && send_all(client_socket, &offset, sizeof(offset)) == 0;
+        engine->close(stream);
+        trace_span("pass_fd", pass_start);
+        printf("File descriptor passed for %s\n", filepath);
+        return passed ? 0 : -1;
+    }
     
-    // Send file size
-    send(client_socket, &file_size, sizeof(file_size), 0);
+    char* buffer = pool_get(prefetch_read_size());
+    if (buffer == NULL) {
+        engine->close(stream);
+        send_size(client_socket, -1);
+        return -1;
+    }
     
-    // Send file data
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-        send(client_socket, buffer, bytes_read, 0);
+    // Send file data in large reads that, after the first, start on chunk boundaries of the file;
+    // the size goes out with the first read, and every read but the last is marked as followed by more
+    long long transfer_start = trace_now_us();
+    long long network_us = 0;
+    long total_sent = 0;
+    long hinted = offset;
+    long wanted = prefetch_first_read(offset, file_size);
+    int size_sent = 0;
+    while (total_sent < file_size && (bytes_read = engine->read(stream, buffer, wanted)) > 0) {
+        struct iovec parts[2] = { { &file_size, sizeof(file_size) }, { buffer, bytes_read } };
+        long long send_start = trace_now_us();
+        if (send_parts(client_socket, parts + size_sent, 2 - size_sent, total_sent + bytes_read < file_size) < 0) break;
+        size_sent = 1;
+        network_us += trace_now_us() - send_start;
+        total_sent += bytes_read;
+        if (has_extent) hinted = prefetch_ahead(fd, offset + total_sent, hinted, offset + file_size);
+        wanted = prefetch_read_size();
     }
     
-    fclose(file);
+    if (!size_sent) send_size(client_socket, file_size);
+    engine->close(stream);
+    pool_put(buffer, prefetch_read_size());
+    trace_span_args("transfer", transfer_start, "disk_us", trace_now_us() - transfer_start - network_us, "network_us", network_us);
+    stats_count_bytes(0, total_sent);
     printf("File downloaded successfully: %s\n", filepath);
+    return total_sent == file_size ? 0 : -1;
 }
 
-// Function to handle file deletion
-void handle_file_deletion(int client_socket) {
-    char buffer[BUFFER_SIZE];
+// Function to handle file download for S1
+int handle_file_download(int client_socket, int pass_fd) {
     char filepath[MAX_PATH];
     
     // Receive filepath
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0);
-    strcpy(filepath, buffer);
+    if (recv_message(client_socket, filepath, MAX_PATH) < 0) return -1;
     
     // Replace S1 path with S2 path
-    if (strstr(filepath, "/S1/") != NULL) {
-        char* home = getenv("HOME");
-        char temp_path[MAX_PATH];
-        strcpy(temp_path, filepath);
-        strcpy(filepath, home);
-        strcat(filepath, "/S2");
-        strcat(filepath, strstr(temp_path, "/S1/") + 4);
+    map_to_local_path(filepath);
+    return send_stored_file(client_socket, filepath, pass_fd);
+}
+
+// Function to register a token S1 granted a client for one direct transfer
+int handle_grant(int client_socket) {
+    char grant[BUFFER_SIZE];
+    char secret[128];
+    char token[DIRECT_TOKEN_SIZE];
+    char kind[8];
+    char filepath[MAX_PATH];
+    long file_size;
+    
+    // "<secret> <token> <put|get> <size> <S1 path>"
+    if (recv_message(client_socket, grant, sizeof(grant)) < 0) return -1;
+    int granted = sscanf(grant, "%127s %32s %7s %ld %255s", secret, token, kind, &file_size, filepath) == 5 &&
+                  direct_grant(secret, token, strcmp(kind, "put") == 0 ? DIRECT_PUT : DIRECT_GET, filepath,
+                               file_size) == 0;
+    if (!granted) printf("Error: Grant refused\n");
+    return send_message(client_socket, granted ? "SUCCESS" : "ERROR");
+}
+
+// Function to handle an upload sent straight from a client with a token
+int handle_direct_put(int client_socket) {
+    char token[MAX_PATH];
+    char filepath[MAX_PATH];
+    long granted_size;
+    long file_size;
+    
+    if (recv_message(client_socket, token, MAX_PATH) < 0 || recv_size(client_socket, &file_size) < 0) return -1;
+    
+    // Without a valid token the data is not read; the connection is closed after the reply
+    if (direct_redeem(token, DIRECT_PUT, filepath, MAX_PATH, &granted_size) < 0 || file_size != granted_size) {
+        printf("Error: Upload refused, invalid token\n");
+        send_message(client_socket, "ERROR");
+        shutdown(client_socket, SHUT_RD);
+        return -1;
+    }
+    
+    map_to_local_path(filepath);
+    return store_upload(client_socket, filepath, file_size, NULL);
+}
+
+// Function to handle a download asked for straight from a client with a token
+int handle_direct_get(int client_socket) {
+    char token[MAX_PATH];
+    char filepath[MAX_PATH];
+    long granted_size;
+    
+    if (recv_message(client_socket, token, MAX_PATH) < 0) return -1;
+    if (direct_redeem(token, DIRECT_GET, filepath, MAX_PATH, &granted_size) < 0) {
+        printf("Error: Download refused, invalid token\n");
+        send_size(client_socket, -1);
+        return -1;
     }
     
+    map_to_local_path(filepath);
+    return send_stored_file(client_socket, filepath, 0);
+}
+
+// Function to handle file deletion
+int handle_file_deletion(int client_socket) {
+    char filepath[MAX_PATH];
+    
+    // Receive filepath
+    if (recv_message(client_socket, filepath, MAX_PATH) < 0) return -1;
+    
+    // Replace S1 path with S2 path
+    map_to_local_path(filepath);
+    
     // Delete file
-    if (remove(filepath) == 0) {
+    long long disk_start = trace_now_us();
+    int removed = engine->remove(filepath) == 0;
+    trace_span("disk", disk_start);
+    if (removed) {
+        invalidate_tar_entry(filepath);
         printf("File deleted successfully: %s\n", filepath);
-        send(client_socket, "SUCCESS", 7, 0);
+        send_message(client_socket, "SUCCESS");
+        return 0;
+    }
+    
+    printf("Error: Cannot delete file %s\n", filepath);
+    send_message(client_socket, "ERROR");
+    return -1;
+}
+
+// Files a bulk delete pattern matched, collected before any is removed
+struct purge_matches {
+    const char* pattern;
+    char** paths;
+    int count;
+    int capacity;
+};
+
+// Function to collect a listed file if it matches a bulk delete pattern
+void add_purge_match(const char* path, long size, long mtime, void* user_data) {
+    struct purge_matches* matches = user_data;
+    (void)size;
+    (void)mtime;
+    
+    // Wildcards stop at '/' and never match a leading '.', so in-progress uploads are left alone
+    if (fnmatch(matches->pattern, path, FNM_PATHNAME | FNM_PERIOD) != 0 || !archived_file(path)) return;
+    if (matches->count == matches->capacity) {
+        int capacity = matches->capacity ? matches->capacity * 2 : 64;
+        char** grown = realloc(matches->paths, capacity * sizeof(char*));
+        if (grown == NULL) return;
+        matches->paths = grown;
+        matches->capacity = capacity;
+    }
+    if ((matches->paths[matches->count] = strdup(path)) != NULL) matches->count++;
+}
+
+// Function to compare matched paths, so results come back in order
+int compare_paths(const void* first, const void* second) {
+    return strcmp(*(char* const*)first, *(char* const*)second);
+}
+
+// Function to queue one bulk delete result, naming the file relative to this server's directory
+void queue_purge_result(struct send_batch* batch, int position, const char* path, int removed) {
+    char root[MAX_PATH];
+    char result[MAX_PATH + 32];
+    
+    // Results name files relative to this server's directory, which mirrors S1's
+    snprintf(root, MAX_PATH, "%s/S2", getenv("HOME"));
+    size_t root_length = strlen(root);
+    const char* name = strncmp(path, root, root_length) == 0 && path[root_length] == '/' ? path + root_length + 1 : path;
+    snprintf(result, sizeof(result), "%s %d %s", removed ? "DELETED" : "FAILED", position, name);
+    batch_message(batch, result);
+}
+
+// Function to delete one file of a bulk delete and queue its result frame; -1 if it could not be deleted
+int purge_file(struct send_batch* batch, int position, const char* path) {
+    char root[MAX_PATH];
+    int removed = 0;
+    
+    // Only this server's own file type, and only under its directory, however the path was spelled
+    snprintf(root, MAX_PATH, "%s/S2", getenv("HOME"));
+    if (!archived_file(path) || !path_within(root, path)) {
+        printf("Error: Refusing to delete %s, which is not a .pdf file under %s\n", path, root);
     } else {
-        printf("Error: Cannot delete file %s\n", filepath);
-        send(client_socket, "ERROR", 5, 0);
+        removed = engine->remove(path) == 0;
+        if (removed) invalidate_tar_entry(path);
     }
+    queue_purge_result(batch, position, path, removed);
+    return removed ? 0 : -1;
 }
 
-// Function to create tar file of all .pdf files
-void handle_tar_creation(int client_socket) {
-    char buffer[BUFFER_SIZE];
-    char command[MAX_PATH];
-    char tar_filename[] = "pdf.tar";
+// Function to delete the files matching one pattern; returns how many could not be deleted
+int purge_pattern(struct send_batch* batch, int position, const char* pattern) {
+    char root[MAX_PATH];
+    char directory[MAX_PATH];
+    struct purge_matches matches = { pattern, NULL, 0, 0 };
+    int failures = 0;
+    
+    // List from the deepest directory the pattern names literally, into subdirectories only if it reaches them
+    size_t literal = strcspn(pattern, "*?[");
+    snprintf(directory, MAX_PATH, "%.*s", (int)literal, pattern);
+    char* slash = strrchr(directory, '/');
+    if (slash == NULL) return 0;
+    *slash = '\0';
+    
+    // The listing fallback walks any directory it is given, so the pattern must start inside this server's
+    snprintf(root, MAX_PATH, "%s/S2", getenv("HOME"));
+    if (!path_within(root, directory)) {
+        printf("Error: Pattern %s reaches outside %s\n", pattern, root);
+        queue_purge_result(batch, position, pattern, 0);
+        return 1;
+    }
+    engine->list(directory, strchr(pattern + literal, '/') != NULL, add_purge_match, &matches);
     
-    // Create tar file of all .pdf files in ~/S2
-    snprintf(command, MAX_PATH, "cd ~/S2 && tar -cf %s $(find . -name '*.pdf')", tar_filename);
-    system(command);
+    if (matches.count > 1) qsort(matches.paths, matches.count, sizeof(char*), compare_paths);
+    for (int i = 0; i < matches.count; i++) {
+        if (purge_file(batch, position, matches.paths[i]) < 0) failures++;
+        free(matches.paths[i]);
+    }
+    free(matches.paths);
+    return failures;
+}
+
+// Function to handle a bulk delete (PURGE): a "<count> exact|glob" frame, then the S1 paths or patterns
+int handle_bulk_deletion(int client_socket) {
+    char header[MAX_PATH];
+    char mode[16];
+    int count = 0;
+    int failures = 0;
+    
+    if (recv_message(client_socket, header, sizeof(header)) < 0 || sscanf(header, "%d %15s", &count, mode) != 2) return -1;
+    
+    // Everything is read before anything is sent, so S1 can send its whole list before reading results
+    char (*paths)[MAX_PATH] = count > 0 && count <= PURGE_MAX_ARGUMENTS ? malloc(count * sizeof(*paths)) : NULL;
+    for (int i = 0; i < count; i++) {
+        if (recv_message(client_socket, paths ? paths[i] : header, MAX_PATH) < 0) {
+            free(paths);
+            return -1;
+        }
+    }
+    if (paths == NULL) {
+        send_message(client_socket, "ERROR");
+        return -1;
+    }
     
-    // Send tar file
-    FILE* tar_file = fopen("~/S2/pdf.tar", "rb");
-    if (tar_file == NULL) {
-        printf("Error: Cannot create tar file\n");
-        return;
+    // One result frame per file, tagged with the position of the path or pattern that named it
+    struct send_batch batch;
+    int exact = strcmp(mode, "exact") == 0;
+    batch_start(&batch, client_socket);
+    long long disk_start = trace_now_us();
+    for (int i = 0; i < count; i++) {
+        map_to_local_path(paths[i]);
+        if (exact || strpbrk(paths[i], "*?[") == NULL) {
+            if (purge_file(&batch, i, paths[i]) < 0) failures++;
+        } else {
+            failures += purge_pattern(&batch, i, paths[i]);
+        }
     }
+    trace_span("disk", disk_start);
+    free(paths);
     
-    // Get file size
-    fseek(tar_file, 0, SEEK_END);
-    long file_size = ftell(tar_file);
-    fseek(tar_file, 0, SEEK_SET);
+    printf("Bulk delete of %d paths finished with %d failures\n", count, failures);
+    batch_message(&batch, failures ? "ERROR" : "SUCCESS");
+    batch_flush(&batch, NULL, 0, 0);
+    return failures ? -1 : 0;
+}
+
+// Function to copy or move a file within this server (COPY/MOVE), without its bytes leaving it
+int handle_file_copy(int client_socket, int move) {
+    char source[MAX_PATH];
+    char destination[MAX_PATH];
+    
+    // Receive source and destination, both S1 paths
+    if (recv_message(client_socket, source, MAX_PATH) < 0 || recv_message(client_socket, destination, MAX_PATH) < 0) {
+        return -1;
+    }
+    map_to_local_path(source);
+    map_to_local_path(destination);
+    
+    long long disk_start = trace_now_us();
+    int done = (move ? engine->move(source, destination) : engine->copy(source, destination)) == 0;
+    trace_span("disk", disk_start);
+    if (!done) {
+        printf("Error: Cannot %s %s to %s\n", move ? "move" : "copy", source, destination);
+        send_message(client_socket, "ERROR");
+        return -1;
+    }
+    
+    invalidate_tar_entry(destination);
+    if (move) invalidate_tar_entry(source);
+    printf("File %s successfully: %s -> %s\n", move ? "moved" : "copied", source, destination);
+    return send_message(client_socket, "SUCCESS");
+}
+
+// Function to send a stored file's data to another server, by descriptor if the engine exposes one
+int push_file_data(int server_socket, struct engine_stream* stream, long file_size) {
+    long total_sent = 0;
+    long bytes_read;
+    int fd;
+    long offset;
+    
+    if (engine->extent(stream, &fd, &offset) == 0) {
+        // The page cache goes straight to the socket, read ahead of sendfile()
+        prefetch_sequential(fd, offset, file_size);
+        while (total_sent < file_size) {
+            ssize_t sent = sendfile(server_socket, fd, &offset, file_size - total_sent);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) break;
+            total_sent += sent;
+        }
+    } else {
+        size_t buffer_size = pool_io_size();
+        char* buffer = pool_get(buffer_size);
+        while (buffer != NULL && total_sent < file_size && (bytes_read = engine->read(stream, buffer, buffer_size)) > 0) {
+            if (send_all(server_socket, buffer, bytes_read) < 0) break;
+            total_sent += bytes_read;
+        }
+        pool_put(buffer, buffer_size);
+    }
+    stats_count_bytes(0, total_sent);
+    return total_sent == file_size ? 0 : -1;
+}
+
+// Function to upload a stored file straight to another storage server (PUSH), for copies between servers
+int handle_file_push(int client_socket) {
+    char filepath[MAX_PATH];
+    char destination[MAX_PATH];
+    char target[MAX_PATH];
+    char server[16];
+    char local_path[MAX_PATH];
+    char frame[BUFFER_SIZE];
+    char reply[BUFFER_SIZE];
+    int port;
+    long file_size;
     
-    // Send file size
-    send(client_socket, &file_size, sizeof(file_size), 0);
+    // Receive the file, where it goes (an S1 path) and the server that stores it ("<name> <port>")
+    if (recv_message(client_socket, filepath, MAX_PATH) < 0 || recv_message(client_socket, destination, MAX_PATH) < 0 ||
+        recv_message(client_socket, target, MAX_PATH) < 0) {
+        return -1;
+    }
+    map_to_local_path(filepath);
     
-    // Send file data
-    int bytes_read;
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, tar_file)) > 0) {
-        send(client_socket, buffer, bytes_read, 0);
+    struct engine_stream* stream = sscanf(target, "%15s %d", server, &port) == 2 ? engine->open(filepath, &file_size) : NULL;
+    if (stream == NULL) {
+        printf("Error: Cannot push %s\n", filepath);
+        send_message(client_socket, "ERROR");
+        return -1;
     }
     
-    fclose(tar_file);
+    // Reach the other server the way S1 does: its AF_UNIX socket if co-located, else TCP loopback
+    long long connect_start = trace_now_us();
+    int server_socket = -1;
+    if (local_socket_path(server, local_path, sizeof(local_path)) != NULL) {
+        server_socket = connect_local_socket(local_path);
+    }
+    if (server_socket < 0) server_socket = connect_local(port, get_config_long("S25_CONNECT_TIMEOUT_MS", 1000));
+    trace_span("connect", connect_start);
+    if (server_socket < 0) {
+        engine->close(stream);
+        printf("Error: Cannot reach %s to push %s\n", server, filepath);
+        send_message(client_socket, "ERROR");
+        return -1;
+    }
+    set_socket_timeout(server_socket, get_config_long("S25_STORAGE_TIMEOUT_MS", 10000));
+    direct_authenticate(server_socket);
+    
+    // An ordinary UPLOAD, under the same request ID, written in one go and held for the first data
+    const char* filename = strrchr(destination, '/') ? strrchr(destination, '/') + 1 : destination;
+    int prefix_length = format_request_prefix(frame, sizeof(frame), trace_current());
+    snprintf(frame + prefix_length, sizeof(frame) - prefix_length, "UPLOAD");
+    struct send_batch batch;
+    batch_start(&batch, server_socket);
+    long long transfer_start = trace_now_us();
+    int sent = batch_message(&batch, frame) == 0 && batch_message(&batch, destination) == 0 &&
+               batch_message(&batch, filename) == 0 && batch_size(&batch, file_size) == 0 &&
+               batch_flush(&batch, NULL, 0, file_size > 0) == 0 && push_file_data(server_socket, stream, file_size) == 0;
+    engine->close(stream);
+    int replied = sent && recv_message(server_socket, reply, sizeof(reply)) >= 0;
+    trace_span_args("push", transfer_start, "bytes", file_size, NULL, 0);
+    close(server_socket);
+    
+    // The other server's answer (SUCCESS, ERROR or BUSY) is the answer
+    if (!replied) snprintf(reply, sizeof(reply), "ERROR");
+    printf("File %s pushed to %s: %s\n", filepath, server, reply);
+    send_message(client_socket, reply);
+    return strcmp(reply, "SUCCESS") == 0 ? 0 : -1;
+}
+
+// Context for collecting archive entries
+struct tar_context {
+    struct tar_list* list;
+    size_t root_length;
+};
+
+// Function to add a .pdf file to the archive listing
+void add_tar_entry(const char* path, long size, long mtime, void* user_data) {
+    struct tar_context* context = user_data;
+    
+    if (archived_file(path)) {
+        tar_list_add(context->list, path + context->root_length, path, size, mtime);
+    }
+}
+
+// Function to open an archive entry through the storage engine
+void* open_tar_entry(const char* source, long* size) {
+    return engine->open(source, size);
+}
+
+// Function to read an archive entry through the storage engine
+long read_tar_entry(void* handle, void* buffer, size_t length) {
+    return engine->read(handle, buffer, length);
+}
+
+// Function to close an archive entry
+void close_tar_entry(void* handle) {
+    engine->close(handle);
+}
+
+// Function to get where an archive entry's data sits, for read-ahead
+int extent_tar_entry(void* handle, int* fd, long* offset) {
+    return engine->extent(handle, fd, offset);
+}
+
+static const struct tar_source engine_tar_source = { open_tar_entry, read_tar_entry, close_tar_entry, extent_tar_entry };
+
+// Function to collect every .pdf file under ~/S2 for the archive
+void collect_tar_entries(struct tar_list* list, void* user_data) {
+    const char* root = user_data;
+    struct tar_context context = {list, strlen(root) + 1};
+    
+    engine->list(root, 1, add_tar_entry, &context);
+}
+
+// Function to send the tar file of all .pdf files
+int handle_tar_creation(int client_socket) {
+    char root[MAX_PATH];
+    
+    // The cached archive is rebuilt only if a .pdf file changed since it was made
+    snprintf(root, MAX_PATH, "%s/S2", getenv("HOME"));
+    long long tar_start = trace_now_us();
+    long total_sent = tar_cache_send(client_socket, collect_tar_entries, root, &engine_tar_source);
+    trace_span_args("tar", tar_start, "bytes", total_sent, NULL, 0);
+    
+    if (total_sent < 0) {
+        printf("Error: Tar transfer failed\n");
+        return -1;
+    }
+    stats_count_bytes(0, total_sent);
     printf("Tar file created and sent successfully\n");
+    return 0;
+}
+
+// Context for building a listing
+struct listing_context {
+    char* file_list;
+    size_t list_size;
+};
+
+// Function to add a .pdf file name to a newline-separated listing
+void add_listing_entry(const char* path, long size, long mtime, void* user_data) {
+    struct listing_context* context = user_data;
+    char temp_list[BUFFER_SIZE];
+    const char* name = strrchr(path, '/') + 1;
+    (void)size;
+    (void)mtime;
+    
+    if (strstr(name, ".pdf") != NULL) {
+        snprintf(temp_list, BUFFER_SIZE, "%s\n", name);
+        if (strlen(context->file_list) + strlen(temp_list) < context->list_size) {
+            strcat(context->file_list, temp_list);
+        }
+    }
 }
 
 // Function to list all .pdf files in a directory
-void handle_file_listing(int client_socket) {
-    char buffer[BUFFER_SIZE];
+int handle_file_listing(int client_socket) {
     char dirpath[MAX_PATH];
-    DIR* dir;
-    struct dirent* entry;
     char file_list[BUFFER_SIZE * 10] = "";
-    char temp_list[BUFFER_SIZE];
     
     // Receive directory path
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0);
-    strcpy(dirpath, buffer);
+    if (recv_message(client_socket, dirpath, MAX_PATH) < 0) return -1;
     
     // Replace S1 path with S2 path
-    if (strstr(dirpath, "/S1/") != NULL) {
-        char* home = getenv("HOME");
-        char temp_path[MAX_PATH];
-        strcpy(temp_path, dirpath);
-        strcpy(dirpath, home);
-        strcat(dirpath, "/S2");
-        strcat(dirpath, strstr(temp_path, "/S1/") + 4);
-    }
-    
-    // Open directory
-    dir = opendir(dirpath);
-    if (dir == NULL) {
-        printf("Error: Cannot open directory %s\n", dirpath);
-        send(client_socket, "ERROR", 5, 0);
-        return;
-    }
+    map_to_local_path(dirpath);
     
     // Read directory entries
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG) { // Regular file
-            if (strstr(entry->d_name, ".pdf") != NULL) {
-                snprintf(temp_list, BUFFER_SIZE, "%s\n", entry->d_name);
-                strcat(file_list, temp_list);
-            }
-        }
-    }
-    
-    closedir(dir);
+    long long disk_start = trace_now_us();
+    struct listing_context context = {file_list, sizeof(file_list)};
+    engine->list(dirpath, 0, add_listing_entry, &context);
+    trace_span("disk", disk_start);
     
     // Send file list
-    send(client_socket, file_list, strlen(file_list), 0);
+    send_message(client_socket, file_list);
+    stats_count_bytes(0, strlen(file_list));
     printf("File list sent for directory: %s\n", dirpath);
+    return 0;
+}
+
+// Function to send this server's metrics to S1
+int handle_stats_request(int client_socket) {
+    char* text = stats_format();
+    int result = send_message(client_socket, text ? text : "");
+    
+    free(text);
+    return result < 0 ? -1 : 0;
+}
+
+// Function to send this server's trace spans to S1
+int handle_trace_request(int client_socket) {
+    char* events = trace_format_events();
+    int result = send_message(client_socket, events ? events : "");
+    
+    free(events);
+    return result < 0 ? -1 : 0;
+}
+
+// Function to turn a request away while the server is overloaded, in the reply shape S1 expects
+void reject_request(int client_socket, int command_index) {
+    char argument[MAX_PATH];
+    long size;
+    
+    // Take the request's own frames off the connection first; upload data is not read
+    if (command_index == CMD_UPLOAD) {
+        if (recv_message(client_socket, argument, MAX_PATH) < 0 || recv_message(client_socket, argument, MAX_PATH) < 0 ||
+            recv_size(client_socket, &size) < 0) return;
+    } else if (command_index == CMD_PUT) {
+        if (recv_message(client_socket, argument, MAX_PATH) < 0 || recv_size(client_socket, &size) < 0) return;
+    } else if (command_index == CMD_COPY || command_index == CMD_MOVE || command_index == CMD_PUSH) {
+        if (recv_message(client_socket, argument, MAX_PATH) < 0 || recv_message(client_socket, argument, MAX_PATH) < 0) return;
+        if (command_index == CMD_PUSH && recv_message(client_socket, argument, MAX_PATH) < 0) return;
+    } else if (command_index == CMD_PURGE) {
+        int count = 0;
+        if (recv_message(client_socket, argument, MAX_PATH) < 0) return;
+        sscanf(argument, "%d", &count);
+        for (int i = 0; i < count; i++) {
+            if (recv_message(client_socket, argument, MAX_PATH) < 0) return;
+        }
+    } else if (command_index == CMD_DOWNLOAD || command_index == CMD_DELETE || command_index == CMD_LIST ||
+               command_index == CMD_GET) {
+        if (recv_message(client_socket, argument, MAX_PATH) < 0) return;
+    }
+    
+    if (command_index == CMD_DOWNLOAD || command_index == CMD_TAR || command_index == CMD_GET) {
+        send_size(client_socket, BUSY_SIZE);
+    }
+    send_busy(client_socket, admit_retry_after_ms());
+    printf("Server busy: rejected %s\n", command_names[command_index]);
+}
+
+// Function to find a command's stats index; -1 if unknown
+int lookup_command(const char* command) {
+    for (int index = 0; index < CMD_COUNT; index++) {
+        if (strcmp(command, command_names[index]) == 0) return index;
+    }
+    return -1;
 }
 
 // Function to handle client requests
 void handle_client(int client_socket) {
-    char command[BUFFER_SIZE];
+    char frame[BUFFER_SIZE];
+    struct request_context context;
     int bytes_received;
+    int session_admitted = admit_session_begin();
+    int trusted = direct_secret() == NULL;
     
     while (1) {
         // Receive command from S1
-        memset(command, 0, BUFFER_SIZE);
-        bytes_received = recv(client_socket, command, BUFFER_SIZE, 0);
+        bytes_received = recv_message(client_socket, frame, BUFFER_SIZE);
         
-        if (bytes_received <= 0) {
+        if (bytes_received < 0) {
             printf("Client disconnected\n");
             break;
         }
         
-        printf("Received command: %s\n", command);
+        // Split off the request ID S1 forwarded with the command
+        char* command = parse_request_prefix(frame, &context);
         
-        // Process command
-        if (strcmp(command, "UPLOAD") == 0) {
-            handle_file_upload(client_socket);
-        } else if (strcmp(command, "DOWNLOAD") == 0) {
-            handle_file_download(client_socket);
-        } else if (strcmp(command, "DELETE") == 0) {
-            handle_file_deletion(client_socket);
-        } else if (strcmp(command, "TAR") == 0) {
-            handle_tar_creation(client_socket);
-        } else if (strcmp(command, "LIST") == 0) {
-            handle_file_listing(client_socket);
-        } else if (strcmp(command, "QUIT") == 0) {
+        // S1 and the other storage servers open with the secret; checked before logging so it is never printed
+        if (strncmp(command, "AUTH ", 5) == 0) {
+            trusted = direct_authorized(command + 5);
+            if (!trusted) {
+                printf("Error: Wrong secret\n");
+                send_message(client_socket, "ERROR");
+                break;
+            }
+            continue;
+        }
+        printf("Received command: %s (rid %016llx)\n", command, (unsigned long long)context.id);
+        
+        // Clients talking to the server directly say "quit", as they do to S1
+        if (strcmp(command, "QUIT") == 0 || strcmp(command, "quit") == 0) {
             printf("Client requested quit\n");
             break;
-        } else {
+        }
+        
+        // S1's heartbeat; answered even when the server is turning work away
+        if (strcmp(command, "PING") == 0) {
+            send_message(client_socket, "PONG");
+            continue;
+        }
+        
+        // S1 registering a direct transfer; cheap, so never turned away
+        if (strcmp(command, "GRANT") == 0) {
+            handle_grant(client_socket);
+            continue;
+        }
+        
+        // DOWNLOAD_FD is DOWNLOAD asking for the file's descriptor instead of its bytes
+        int pass_fd = strcmp(command, "DOWNLOAD_FD") == 0 && is_local_socket(client_socket);
+        int command_index = pass_fd ? CMD_DOWNLOAD : lookup_command(command);
+        if (command_index < 0) {
             printf("Unknown command: %s\n", command);
-            send(client_socket, "UNKNOWN_COMMAND", 14, 0);
+            send_message(client_socket, "UNKNOWN_COMMAND");
+            continue;
+        }
+        
+        // Direct clients share this listener, so without the secret a connection may only redeem tokens
+        if (!trusted && command_index != CMD_PUT && command_index != CMD_GET) {
+            printf("Error: %s needs the secret\n", command);
+            send_message(client_socket, "ERROR");
+            break;
+        }
+        
+        // Metrics requests get through an over-full server, but not past their own limit
+        int exempt = command_index == CMD_STATS || command_index == CMD_TRACE;
+        if (!admit_command_begin(command_index, session_admitted || exempt)) {
+            reject_request(client_socket, command_index);
+            break;
+        }
+        
+        // Process command
+        int result = -1;
+        stats_begin(command_index);
+        trace_begin_request(&context, command_names[command_index]);
+        switch (command_index) {
+            case CMD_UPLOAD: result = handle_file_upload(client_socket); break;
+            case CMD_DOWNLOAD: result = handle_file_download(client_socket, pass_fd); break;
+            case CMD_DELETE: result = handle_file_deletion(client_socket); break;
+            case CMD_TAR: result = handle_tar_creation(client_socket); break;
+            case CMD_LIST: result = handle_file_listing(client_socket); break;
+            case CMD_STATS: result = handle_stats_request(client_socket); break;
+            case CMD_TRACE: result = handle_trace_request(client_socket); break;
+            case CMD_PUT: result = handle_direct_put(client_socket); break;
+            case CMD_GET: result = handle_direct_get(client_socket); break;
+            case CMD_COPY: result = handle_file_copy(client_socket, 0); break;
+            case CMD_MOVE: result = handle_file_copy(client_socket, 1); break;
+            case CMD_PUSH: result = handle_file_push(client_socket); break;
+            case CMD_PURGE: result = handle_bulk_deletion(client_socket); break;
         }
+        trace_end_request();
+        stats_end(result == 0);
+        admit_command_end(command_index);
     }
     
+    admit_session_end();
     close(client_socket);
 }
 
+// Function to run one S1 connection on its own thread
+void* client_thread(void* argument) {
+    handle_client((int)(intptr_t)argument);
+    return NULL;
+}
+
 int main() {
     int server_socket, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
+    struct sockaddr_in server_addr;
+    char local_path[MAX_PATH];
+    int port = get_config_long("S25_S2_PORT", PORT);
+    int metrics_port = get_config_long("S25_S2_METRICS_PORT", 0);
+    
+    // Set up metrics and tracing before serving; the HTTP endpoint is optional
+    stats_init("S2", command_names, CMD_COUNT);
+    admit_init(command_names, CMD_COUNT);
+    trace_init("S2");
+    durable_init();
+    pool_init();
+    prefetch_init();
+    ingest_init();
+    
+    // The storage engine recovers its data before the first connection
+    char root[MAX_PATH];
+    snprintf(root, MAX_PATH, "%s/S2", getenv("HOME"));
+    engine = engine_init(root);
+    char tar_cache[MAX_PATH + 16];
+    snprintf(tar_cache, sizeof(tar_cache), "%s/.tarcache", root);
+    if (engine == NULL || tar_cache_init(tar_cache) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    
+    // A client that disconnects during sendfile() must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    if (metrics_port > 0) {
+        stats_start_http(metrics_port);
+    }
     
     // Create socket
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -326,7 +952,7 @@ int main() {
     // Configure server address
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons(port);
     
     // Bind socket
     if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
@@ -335,17 +961,32 @@ int main() {
     }
     
     // Listen for connections
-    if (listen(server_socket, 5) < 0) {
+    if (listen(server_socket, admit_backlog()) < 0) {
         perror("Listen failed");
         exit(EXIT_FAILURE);
     }
     
-    printf("S2 Server started on port %d\n", PORT);
+    // A co-located S1 can also reach us over AF_UNIX
+    int local_socket = -1;
+    if (local_socket_path("S2", local_path, sizeof(local_path)) != NULL) {
+        local_socket = listen_local_socket(local_path, admit_backlog());
+        if (local_socket < 0) {
+            perror("Local socket failed");
+            exit(EXIT_FAILURE);
+        }
+        printf("S2 Server also listening on %s\n", local_path);
+    }
+    
+    printf("S2 Server started on port %d\n", port);
     printf("Waiting for connections from S1...\n");
     
-    // Accept connections
+    // Accept connections on whichever listener has one (poll skips a -1 descriptor)
     while (1) {
-        client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
+        struct pollfd listeners[2] = { { server_socket, POLLIN, 0 }, { local_socket, POLLIN, 0 } };
+        if (poll(listeners, 2, -1) < 0) continue;
+        
+        int listener = listeners[0].revents & POLLIN ? server_socket : local_socket;
+        client_socket = accept(listener, NULL, NULL);
         if (client_socket < 0) {
             perror("Accept failed");
             continue;
@@ -353,8 +994,17 @@ int main() {
         
         printf("Connection accepted from S1\n");
         
-        // Handle client in same process (simple approach)
-        handle_client(client_socket);
+        // Replies are written whole, so nothing is gained by Nagle's delay
+        if (listener == server_socket) set_nodelay(client_socket);
+        
+        // Handle each connection on its own thread so uploads can share a group commit
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, client_thread, (void*)(intptr_t)client_socket) != 0) {
+            perror("Thread creation failed");
+            close(client_socket);
+            continue;
+        }
+        pthread_detach(thread);
     }
     
     close(server_socket);
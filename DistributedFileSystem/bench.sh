@@ -0,0 +1,55 @@
+#!/bin/bash
+# Start S1-S4 on loopback with temporary HOME roots, run s25bench against
+# them and print its JSON report.  Arguments are passed to s25bench.
+#
+#   BENCH_PORT_BASE  first of four consecutive ports to use (default 18080)
+#   BENCH_KEEP=1     keep the temporary directory (server logs, data)
+#   BENCH_LOCAL=1    also serve over AF_UNIX sockets in the temporary
+#                    directory, and connect s25bench to S1 through one
+#   BENCH_ROOT       directory to create the temporary directory in
+#                    (default /tmp); durability runs need a real disk there
+
+dir=$(cd "$(dirname "$0")" && pwd)
+base=${BENCH_PORT_BASE:-18080}
+root=$(mktemp -d "${BENCH_ROOT:-/tmp}/s25bench.XXXXXX") || exit 1
+pids=()
+
+cleanup() {
+    for pid in "${pids[@]}"; do kill "$pid" 2>/dev/null; done
+    wait 2>/dev/null
+    if [ "${BENCH_KEEP:-0}" = 1 ]; then
+        echo "bench: kept $root" >&2
+    else
+        rm -rf "$root"
+    fi
+}
+trap cleanup EXIT
+
+export S25_S1_PORT=$base
+export S25_S2_PORT=$((base + 1))
+export S25_S3_PORT=$((base + 2))
+export S25_S4_PORT=$((base + 3))
+connect=()
+if [ "${BENCH_LOCAL:-0}" = 1 ]; then
+    export S25_SOCKET_DIR=$root
+    connect=(-H "$root/S1.sock")
+fi
+
+# Each server gets its own HOME so the data sets stay separate
+for n in 1 2 3 4; do
+    mkdir -p "$root/h$n/S$n"
+    HOME="$root/h$n" "$dir/S$n" > "$root/S$n.log" 2>&1 &
+    pids+=($!)
+done
+
+# Wait until every server accepts connections
+for port in $S25_S1_PORT $S25_S2_PORT $S25_S3_PORT $S25_S4_PORT; do
+    for attempt in $(seq 50); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$port") 2>/dev/null; then break; fi
+        if [ "$attempt" = 50 ]; then echo "bench: port $port did not open" >&2; exit 1; fi
+        sleep 0.1
+    done
+done
+
+pid_list=$(IFS=,; echo "${pids[*]}")
+"$dir/s25bench" -w "$root/work" -P "$pid_list" "${connect[@]}" "$@"
@@ -0,0 +1,1225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libs25.h"
+#include "s25common.h"
+#include "s25pool.h"
+
+#define IO_CHUNK (64 * 1024)
+#define OUT_CAPACITY (IO_CHUNK + 8192)
+#define MAX_MESSAGE (S25_MAX_FRAME)
+
+enum op_kind { OP_UPLOAD, OP_DOWNLOAD, OP_REMOVE, OP_TAR, OP_LIST, OP_PUT, OP_GET, OP_COPY, OP_PURGE };
+enum expect_kind { EXPECT_FRAME, EXPECT_SIZE, EXPECT_DATA, EXPECT_NOTHING };
+enum conn_state { CONN_CONNECTING, CONN_READY, CONN_CLOSED };
+
+struct s25_op {
+    s25_op* next;
+    s25_conn* conn;
+    int kind;
+    s25_op_cb callback;
+    void* user_data;
+
+    // Request side: command frame, then (uploads only) size + data per file
+    char* request;
+    size_t request_length;
+    int request_done;
+    int send_file;
+    int send_header_done;
+    long send_remaining;
+
+    // Per-file bookkeeping
+    int file_count;
+    char** files;
+    int* file_fds;
+    long* file_sizes;
+    int* file_status;
+    char* local_directory;
+
+    // Response side
+    int expect;
+    int step;
+    unsigned char header[8];
+    size_t header_got;
+    char* frame;
+    size_t frame_length;
+    size_t frame_got;
+    long data_remaining;
+    int data_fd;
+    char* message;
+    long long bytes;
+    long retry_after_ms;
+
+    // Request ID sent ahead of the command (see s25common.h)
+    struct request_context context;
+};
+
+struct s25_conn {
+    s25_conn* next;
+    s25_loop* loop;
+    int fd;
+    int state;
+    int close_requested;
+    s25_connect_cb callback;
+    void* user_data;
+    s25_op* head;
+    s25_op* tail;
+    s25_op* writer;
+    char* out;
+    size_t out_length;
+    size_t out_sent;
+    char* in;
+};
+
+struct s25_loop {
+    s25_conn* conns;
+    int dispatching;
+    double trace_sample_rate;
+};
+
+// Function to set a descriptor non-blocking
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Function to get the last path component
+static const char* base_name(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Function to duplicate a string (strdup is not C99)
+static char* copy_string(const char* text) {
+    size_t length = strlen(text) + 1;
+    char* copy = malloc(length);
+    if (copy) memcpy(copy, text, length);
+    return copy;
+}
+
+// Function to build a framed command in a freshly allocated buffer
+static char* build_frame(const char* text, size_t* frame_length) {
+    size_t length = strlen(text);
+    char* frame = malloc(length + 4);
+    if (frame == NULL) return NULL;
+
+    uint32_t header = htonl((uint32_t)length);
+    memcpy(frame, &header, 4);
+    memcpy(frame + 4, text, length);
+    *frame_length = length + 4;
+    return frame;
+}
+
+// Function to build an operation's command frame, tagged with a new request ID
+static char* build_command_frame(s25_op* op, const char* command) {
+    char text[4096 + 64];
+    int prefix_length;
+
+    op->context.id = new_request_id();
+    op->context.sampled = request_sampled(op->context.id, op->conn->loop->trace_sample_rate);
+    prefix_length = format_request_prefix(text, sizeof(text), &op->context);
+    snprintf(text + prefix_length, sizeof(text) - prefix_length, "%s", command);
+    return build_frame(text, &op->request_length);
+}
+
+// Function to build a storage server request: the command frame, then a frame with the token S1 handed out
+static char* build_token_request(s25_op* op, const char* command, const char* token) {
+    size_t token_length;
+    char* command_frame = build_command_frame(op, command);
+    char* token_frame = build_frame(token, &token_length);
+    char* request = NULL;
+
+    if (command_frame && token_frame && (request = malloc(op->request_length + token_length)) != NULL) {
+        memcpy(request, command_frame, op->request_length);
+        memcpy(request + op->request_length, token_frame, token_length);
+        op->request_length += token_length;
+    }
+    free(command_frame);
+    free(token_frame);
+    return request;
+}
+
+// Function to release an operation and everything it owns
+static void op_free(s25_op* op) {
+    for (int i = 0; i < op->file_count; i++) {
+        free(op->files[i]);
+        if (op->file_fds && op->file_fds[i] >= 0) close(op->file_fds[i]);
+    }
+    if (op->data_fd >= 0) close(op->data_fd);
+    free(op->files);
+    free(op->file_fds);
+    free(op->file_sizes);
+    free(op->file_status);
+    free(op->local_directory);
+    free(op->request);
+    free(op->frame);
+    free(op->message);
+    free(op);
+}
+
+// Function to allocate an operation with room for count files
+static s25_op* op_new(s25_conn* conn, int kind, int count, s25_op_cb callback, void* user_data) {
+    s25_op* op = calloc(1, sizeof(*op));
+    if (op == NULL) return NULL;
+
+    op->conn = conn;
+    op->kind = kind;
+    op->callback = callback;
+    op->user_data = user_data;
+    op->data_fd = -1;
+    op->retry_after_ms = -1;
+    op->file_count = count;
+    op->files = calloc(count > 0 ? count : 1, sizeof(char*));
+    op->file_status = calloc(count > 0 ? count : 1, sizeof(int));
+    if (op->files == NULL || op->file_status == NULL) {
+        op->file_count = 0;
+        op_free(op);
+        return NULL;
+    }
+    return op;
+}
+
+// Function to open the local files an upload sends and note their sizes; -1 on failure
+static int op_open_sources(s25_op* op, const char* const* local_files) {
+    op->file_fds = malloc(op->file_count * sizeof(int));
+    op->file_sizes = malloc(op->file_count * sizeof(long));
+    if (op->file_fds == NULL || op->file_sizes == NULL) return -1;
+    for (int i = 0; i < op->file_count; i++) op->file_fds[i] = -1;
+
+    for (int i = 0; i < op->file_count; i++) {
+        struct stat file_info;
+
+        op->files[i] = copy_string(local_files[i]);
+        op->file_fds[i] = open(local_files[i], O_RDONLY);
+        if (op->files[i] == NULL || op->file_fds[i] < 0 || fstat(op->file_fds[i], &file_info) < 0) return -1;
+        op->file_sizes[i] = file_info.st_size;
+    }
+    return 0;
+}
+
+// Function to append an operation to its connection's queue
+static s25_op* op_submit(s25_op* op) {
+    s25_conn* conn = op->conn;
+
+    if (op->request == NULL) {
+        op_free(op);
+        return NULL;
+    }
+
+    if (conn->tail) {
+        conn->tail->next = op;
+    } else {
+        conn->head = op;
+    }
+    conn->tail = op;
+    if (conn->writer == NULL) conn->writer = op;
+
+    // The first response of every command is either a frame or a size
+    op->expect = (op->kind == OP_DOWNLOAD || op->kind == OP_TAR || op->kind == OP_GET) ? EXPECT_SIZE : EXPECT_FRAME;
+    if (op->kind == OP_DOWNLOAD && op->file_count == 0) op->expect = EXPECT_FRAME;
+    return op;
+}
+
+// Function to finish an operation: unlink it, run the callback, free it
+static void op_complete(s25_op* op, int status) {
+    s25_conn* conn = op->conn;
+
+    if (conn->head == op) {
+        conn->head = op->next;
+        if (conn->tail == op) conn->tail = NULL;
+    }
+    if (conn->writer == op) conn->writer = op->next;
+
+    if (op->callback) op->callback(op, status, op->user_data);
+    op_free(op);
+}
+
+// Function to fail every queued operation on a connection
+static void conn_fail(s25_conn* conn, int status) {
+    if (conn->state != CONN_CLOSED) {
+        if (conn->fd >= 0) close(conn->fd);
+        conn->fd = -1;
+        if (conn->state == CONN_CONNECTING && conn->callback) {
+            conn->state = CONN_CLOSED;
+            conn->callback(conn, S25_ERR_CONNECT, conn->user_data);
+        }
+        conn->state = CONN_CLOSED;
+    }
+
+    while (conn->head) {
+        s25_op* op = conn->head;
+        conn->writer = NULL;
+        op_complete(op, status);
+    }
+}
+
+// Function to queue bytes on the connection's output buffer; 0 if they do not fit
+static int conn_queue_output(s25_conn* conn, const void* data, size_t length) {
+    if (conn->out_length + length > OUT_CAPACITY) return 0;
+    memcpy(conn->out + conn->out_length, data, length);
+    conn->out_length += length;
+    return 1;
+}
+
+// Function to let the current writer produce more output; 0 when nothing left
+static int conn_produce_output(s25_conn* conn) {
+    while (conn->writer) {
+        s25_op* op = conn->writer;
+
+        if (!op->request_done) {
+            if (!conn_queue_output(conn, op->request, op->request_length)) return 1;
+            op->request_done = 1;
+            continue;
+        }
+
+        if ((op->kind == OP_UPLOAD || op->kind == OP_PUT) && op->send_file < op->file_count) {
+            int index = op->send_file;
+
+            if (!op->send_header_done) {
+                if (!conn_queue_output(conn, &op->file_sizes[index], sizeof(long))) return 1;
+                op->send_header_done = 1;
+                op->send_remaining = op->file_sizes[index];
+            }
+
+            if (op->send_remaining > 0) {
+                size_t space = OUT_CAPACITY - conn->out_length;
+                size_t want = op->send_remaining < IO_CHUNK ? (size_t)op->send_remaining : IO_CHUNK;
+                if (want > space) want = space;
+                if (want == 0) return 1;
+                ssize_t got = read(op->file_fds[index], conn->out + conn->out_length, want);
+                if (got <= 0) {
+                    // The file shrank under us; the stream cannot be resynchronised
+                    return -1;
+                }
+                conn->out_length += got;
+                op->send_remaining -= got;
+                op->bytes += got;
+                return 1;
+            }
+
+            close(op->file_fds[index]);
+            op->file_fds[index] = -1;
+            op->send_file++;
+            op->send_header_done = 0;
+            continue;
+        }
+
+        conn->writer = op->next;
+    }
+
+    return conn->out_length > 0;
+}
+
+// Function to check whether more output is already known to follow what is buffered
+static int conn_more_output(const s25_conn* conn) {
+    const s25_op* op = conn->writer;
+
+    if (op == NULL) return 0;
+    if (!op->request_done) return 1;
+    if (op->kind == OP_UPLOAD || op->kind == OP_PUT) {
+        // The rest of the current file, or another file of the same upload
+        if (op->send_header_done && op->send_remaining > 0) return 1;
+        if (op->send_file + (op->send_header_done ? 1 : 0) < op->file_count) return 1;
+    }
+    return op->next != NULL;
+}
+
+// Function to write as much pending output as the socket accepts
+static int conn_flush(s25_conn* conn) {
+    while (1) {
+        if (conn->out_sent == conn->out_length) {
+            conn->out_sent = conn->out_length = 0;
+            int produced = conn_produce_output(conn);
+            if (produced < 0) return -1;
+            if (produced == 0) return 0;
+        }
+
+        // A partial segment is held back only while more bytes are known to follow; an op's last chunk goes out now
+        int more = conn_more_output(conn) ? MSG_MORE : 0;
+        ssize_t sent = send(conn->fd, conn->out + conn->out_sent, conn->out_length - conn->out_sent, MSG_NOSIGNAL | more);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        conn->out_sent += sent;
+    }
+}
+
+// Function to open the local file that receives the next download
+static int op_open_local_file(s25_op* op, const char* name) {
+    char path[1024];
+
+    if (op->local_directory) {
+        snprintf(path, sizeof(path), "%s/%s", op->local_directory, name);
+    } else {
+        snprintf(path, sizeof(path), "%s", name);
+    }
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+// Function to pick the tar file name for a file type
+static const char* tar_name_for_type(const char* filetype) {
+    if (strcmp(filetype, ".c") == 0) return "cfiles.tar";
+    if (strcmp(filetype, ".pdf") == 0) return "pdf.tar";
+    if (strcmp(filetype, ".txt") == 0) return "text.tar";
+    if (strcmp(filetype, ".zip") == 0) return "zip.tar";
+    if (strcmp(filetype, "all") == 0) return "all.tar";
+    return "archive.tar";
+}
+
+static int op_on_data_done(s25_op* op);
+
+// Function to handle a complete size header; returns 1 if the op finished
+static int op_on_size(s25_op* op, long size) {
+    if (size < 0) {
+        op->file_status[op->step] = S25_ERR_SERVER;
+        op->step++;
+        
+        // A storage server ends GET with the payload; only BUSY_SIZE has a frame after it
+        if (op->kind == OP_GET && size != BUSY_SIZE) {
+            op->expect = EXPECT_NOTHING;
+            op_complete(op, S25_ERR_SERVER);
+            return 1;
+        }
+        op->expect = (op->kind == OP_DOWNLOAD && op->step < op->file_count) ? EXPECT_SIZE : EXPECT_FRAME;
+        return 0;
+    }
+
+    const char* name = op->kind == OP_TAR ? op->files[0] : base_name(op->files[op->step]);
+    op->data_fd = op_open_local_file(op, name);
+    if (op->data_fd < 0) {
+        op->file_status[op->step] = S25_ERR_IO;
+    }
+
+    op->data_remaining = size;
+    op->expect = EXPECT_DATA;
+    if (size == 0) return op_on_data_done(op);
+    return 0;
+}
+
+// Function to handle the end of a file payload; returns 1 if the op finished
+static int op_on_data_done(s25_op* op) {
+    if (op->data_fd >= 0) {
+        close(op->data_fd);
+        op->data_fd = -1;
+    }
+    op->step++;
+    if (op->kind == OP_GET) {
+        op->expect = EXPECT_NOTHING;
+        op_complete(op, op->file_status[0]);
+        return 1;
+    }
+    op->expect = (op->kind == OP_DOWNLOAD && op->step < op->file_count) ? EXPECT_SIZE : EXPECT_FRAME;
+    return 0;
+}
+
+// Function to record one per-file result of purgef ("DELETED path", "FAILED path" or "NO_MATCH pattern");
+// 0 if the frame is not one
+static int op_add_result(s25_op* op, const char* text) {
+    const char* name = strchr(text, ' ');
+    int status;
+
+    if (strncmp(text, "DELETED ", 8) == 0) {
+        status = S25_OK;
+    } else if (strncmp(text, "FAILED ", 7) == 0) {
+        status = S25_ERR_SERVER;
+    } else if (strncmp(text, "NO_MATCH ", 9) == 0) {
+        status = S25_ERR_NO_MATCH;
+    } else {
+        return 0;
+    }
+
+    // The files are only known as the results arrive
+    char** files = realloc(op->files, (op->file_count + 1) * sizeof(char*));
+    if (files != NULL) op->files = files;
+    int* file_status = realloc(op->file_status, (op->file_count + 1) * sizeof(int));
+    if (file_status != NULL) op->file_status = file_status;
+    if (files == NULL || file_status == NULL) return 1;
+
+    op->files[op->file_count] = copy_string(name + 1);
+    op->file_status[op->file_count] = status;
+    if (op->files[op->file_count] != NULL) op->file_count++;
+    return 1;
+}
+
+// Function to handle a complete frame; returns 1 if the op finished
+static int op_on_frame(s25_op* op) {
+    char* text = op->frame;
+    op->frame = NULL;
+    
+    // An overloaded server may answer in place of any frame
+    long retry_after_ms = parse_busy(text);
+    if (retry_after_ms >= 0) {
+        free(op->message);
+        op->message = text;
+        op->retry_after_ms = retry_after_ms;
+        op->expect = EXPECT_NOTHING;
+        op_complete(op, S25_ERR_BUSY);
+        return 1;
+    }
+
+    // Per-file upload acknowledgements precede the final status
+    if (op->kind == OP_UPLOAD && op->step < op->file_count) {
+        if (strcmp(text, "SUCCESS") != 0) op->file_status[op->step] = S25_ERR_SERVER;
+        op->step++;
+        free(text);
+        return 0;
+    }
+
+    // Per-file bulk delete results precede the final status
+    if (op->kind == OP_PURGE && op_add_result(op, text)) {
+        free(text);
+        return 0;
+    }
+
+    free(op->message);
+    op->message = text;
+
+    const char* expected = NULL;
+    if (op->kind == OP_PUT || op->kind == OP_COPY) {
+        expected = "SUCCESS";
+        if (strcmp(text, expected) != 0) op->file_status[0] = S25_ERR_SERVER;
+    }
+    if (op->kind == OP_UPLOAD) expected = "UPLOAD_COMPLETE";
+    if (op->kind == OP_DOWNLOAD) expected = "DOWNLOAD_COMPLETE";
+    if (op->kind == OP_REMOVE || op->kind == OP_PURGE) expected = "DELETE_COMPLETE";
+    if (op->kind == OP_TAR) expected = "TAR_COMPLETE";
+
+    int status = S25_OK;
+    if (expected && strcmp(text, expected) != 0) status = S25_ERR_SERVER;
+    for (int i = 0; i < op->file_count && status == S25_OK; i++) {
+        if (op->file_status[i] != S25_OK) status = op->file_status[i];
+    }
+
+    op->expect = EXPECT_NOTHING;
+    op_complete(op, status);
+    return 1;
+}
+
+// Function to feed received bytes to the head operation; returns bytes used or -1
+static long op_consume(s25_op* op, const char* data, size_t length, int* finished) {
+    size_t used = 0;
+    *finished = 0;
+
+    while (used < length && !*finished) {
+        if (op->expect == EXPECT_FRAME || op->expect == EXPECT_SIZE) {
+            size_t header_size = op->expect == EXPECT_FRAME ? 4 : sizeof(long);
+
+            if (op->frame == NULL || op->expect == EXPECT_SIZE) {
+                size_t take = header_size - op->header_got;
+                if (take > length - used) take = length - used;
+                memcpy(op->header + op->header_got, data + used, take);
+                op->header_got += take;
+                used += take;
+                if (op->header_got < header_size) break;
+                op->header_got = 0;
+
+                // A connection turned away at accept gets a BUSY frame even where a size is due;
+                // no real size has "BUSY" in its top bytes
+                if (op->expect == EXPECT_SIZE && memcmp(op->header + 4, "BUSY", 4) == 0) {
+                    uint32_t frame_length;
+                    memcpy(&frame_length, op->header, 4);
+                    op->frame_length = ntohl(frame_length);
+                    if (op->frame_length <= 4 || op->frame_length > MAX_MESSAGE) return -1;
+                    op->frame = malloc(op->frame_length + 1);
+                    if (op->frame == NULL) return -1;
+                    memcpy(op->frame, "BUSY", 4);
+                    op->frame_got = 4;
+                    op->expect = EXPECT_FRAME;
+                    continue;
+                }
+                
+                if (op->expect == EXPECT_SIZE) {
+                    long size;
+                    memcpy(&size, op->header, sizeof(size));
+                    *finished = op_on_size(op, size);
+                    continue;
+                }
+
+                uint32_t frame_length;
+                memcpy(&frame_length, op->header, 4);
+                op->frame_length = ntohl(frame_length);
+                if (op->frame_length > MAX_MESSAGE) return -1;
+                op->frame = malloc(op->frame_length + 1);
+                if (op->frame == NULL) return -1;
+                op->frame_got = 0;
+            }
+
+            size_t take = op->frame_length - op->frame_got;
+            if (take > length - used) take = length - used;
+            memcpy(op->frame + op->frame_got, data + used, take);
+            op->frame_got += take;
+            used += take;
+            if (op->frame_got == op->frame_length) {
+                op->frame[op->frame_length] = '\0';
+                *finished = op_on_frame(op);
+            }
+
+        } else if (op->expect == EXPECT_DATA) {
+            size_t take = op->data_remaining < (long)(length - used) ? (size_t)op->data_remaining : length - used;
+            if (op->data_fd >= 0 && write(op->data_fd, data + used, take) != (ssize_t)take) {
+                close(op->data_fd);
+                op->data_fd = -1;
+                op->file_status[op->step] = S25_ERR_IO;
+            }
+            op->data_remaining -= take;
+            op->bytes += take;
+            used += take;
+            if (op->data_remaining == 0) *finished = op_on_data_done(op);
+
+        } else {
+            return -1;
+        }
+    }
+
+    return (long)used;
+}
+
+// Function to read and parse everything the socket has for us
+static int conn_read(s25_conn* conn) {
+    while (1) {
+        ssize_t received = recv(conn->fd, conn->in, IO_CHUNK, 0);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (received == 0) return -1;
+
+        size_t offset = 0;
+        while (offset < (size_t)received) {
+            if (conn->head == NULL) return -1; // unsolicited data
+            int finished;
+            long used = op_consume(conn->head, conn->in + offset, received - offset, &finished);
+            if (used < 0) return -1;
+            offset += used;
+        }
+    }
+}
+
+// Function to finish a non-blocking connect
+static void conn_finish_connect(s25_conn* conn) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+        conn_fail(conn, S25_ERR_CONNECT);
+        return;
+    }
+
+    conn->state = CONN_READY;
+    if (conn->callback) conn->callback(conn, S25_OK, conn->user_data);
+}
+
+// Function to fail connections whose connect or socket already died
+static void loop_fail_dead(s25_loop* loop) {
+    for (s25_conn* conn = loop->conns; conn; conn = conn->next) {
+        if (conn->close_requested) continue;
+        if (conn->fd < 0 || conn->state == CONN_CLOSED) conn_fail(conn, S25_ERR_CLOSED);
+    }
+}
+
+// Function to release connections the caller has closed
+static void loop_reap(s25_loop* loop) {
+    s25_conn** link = &loop->conns;
+
+    while (*link) {
+        s25_conn* conn = *link;
+        if (conn->close_requested) {
+            if (conn->head) conn_fail(conn, S25_ERR_CLOSED);
+            if (conn->fd >= 0) close(conn->fd);
+            *link = conn->next;
+            pool_put(conn->out, OUT_CAPACITY);
+            pool_put(conn->in, IO_CHUNK);
+            free(conn);
+        } else {
+            link = &conn->next;
+        }
+    }
+}
+
+s25_loop* s25_loop_new(void) {
+    s25_loop* loop = calloc(1, sizeof(s25_loop));
+    if (loop == NULL) return NULL;
+
+    // Fraction of requests the servers record trace spans for
+    loop->trace_sample_rate = get_config_double("S25_TRACE_SAMPLE", 0.0);
+    return loop;
+}
+
+void s25_loop_free(s25_loop* loop) {
+    if (loop == NULL) return;
+    for (s25_conn* conn = loop->conns; conn; conn = conn->next) {
+        conn->close_requested = 1;
+    }
+    loop_reap(loop);
+    free(loop);
+}
+
+// Function to count connects and operations still in flight
+int s25_loop_pending(s25_loop* loop) {
+    int pending = 0;
+
+    for (s25_conn* conn = loop->conns; conn; conn = conn->next) {
+        if (conn->close_requested) continue;
+        if (conn->state == CONN_CONNECTING) pending++;
+        for (s25_op* op = conn->head; op; op = op->next) pending++;
+    }
+    return pending;
+}
+
+int s25_loop_fill_pollfds(s25_loop* loop, struct pollfd* fds, int max_fds) {
+    int count = 0;
+
+    for (s25_conn* conn = loop->conns; conn && count < max_fds; conn = conn->next) {
+        if (conn->state == CONN_CLOSED || conn->close_requested || conn->fd < 0) continue;
+
+        fds[count].fd = conn->fd;
+        fds[count].revents = 0;
+        if (conn->state == CONN_CONNECTING) {
+            fds[count].events = POLLOUT;
+        } else {
+            fds[count].events = POLLIN;
+            if (conn->out_sent < conn->out_length || conn->writer) fds[count].events |= POLLOUT;
+        }
+        count++;
+    }
+    return count;
+}
+
+void s25_loop_dispatch(s25_loop* loop, const struct pollfd* fds, int nfds) {
+    loop->dispatching = 1;
+    loop_fail_dead(loop);
+
+    for (int i = 0; i < nfds; i++) {
+        if (fds[i].revents == 0) continue;
+
+        s25_conn* conn = loop->conns;
+        while (conn && conn->fd != fds[i].fd) conn = conn->next;
+        if (conn == NULL || conn->close_requested || conn->state == CONN_CLOSED) continue;
+
+        if (conn->state == CONN_CONNECTING) {
+            conn_finish_connect(conn);
+            if (conn->state != CONN_READY) continue;
+        }
+
+        if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (conn_read(conn) < 0) {
+                conn_fail(conn, S25_ERR_PROTOCOL);
+                continue;
+            }
+        }
+
+        if (conn->state == CONN_READY && !conn->close_requested && conn_flush(conn) < 0) {
+            conn_fail(conn, S25_ERR_PROTOCOL);
+        }
+    }
+
+    loop->dispatching = 0;
+    loop_reap(loop);
+}
+
+int s25_loop_run_once(s25_loop* loop, int timeout_ms) {
+    struct pollfd fds[256];
+
+    loop->dispatching = 1;
+    loop_fail_dead(loop);
+    loop->dispatching = 0;
+    loop_reap(loop);
+
+    int nfds = s25_loop_fill_pollfds(loop, fds, 256);
+    if (nfds == 0) return 0;
+
+    int ready = poll(fds, nfds, timeout_ms);
+    if (ready < 0) return errno == EINTR ? 0 : -1;
+
+    s25_loop_dispatch(loop, fds, nfds);
+    return ready;
+}
+
+int s25_loop_run(s25_loop* loop) {
+    while (s25_loop_pending(loop) > 0) {
+        if (s25_loop_run_once(loop, -1) < 0) return -1;
+    }
+    return 0;
+}
+
+s25_conn* s25_connect(s25_loop* loop, const char* host, int port, s25_connect_cb callback, void* user_data) {
+    struct addrinfo hints;
+    struct addrinfo* result;
+    struct addrinfo local;
+    struct sockaddr_un local_address;
+    char port_text[16];
+
+    memset(&hints, 0, sizeof(hints));
+    if (host[0] == '/') {
+        // An absolute path names S1's AF_UNIX socket
+        memset(&local_address, 0, sizeof(local_address));
+        local_address.sun_family = AF_UNIX;
+        snprintf(local_address.sun_path, sizeof(local_address.sun_path), "%s", host);
+        memset(&local, 0, sizeof(local));
+        local.ai_family = AF_UNIX;
+        local.ai_addr = (struct sockaddr*)&local_address;
+        local.ai_addrlen = sizeof(local_address);
+        result = &local;
+    } else {
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(port_text, sizeof(port_text), "%d", port);
+        if (getaddrinfo(host, port_text, &hints, &result) != 0) return NULL;
+    }
+
+    s25_conn* conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) {
+        if (result != &local) freeaddrinfo(result);
+        return NULL;
+    }
+    conn->out = pool_get(OUT_CAPACITY);
+    conn->in = pool_get(IO_CHUNK);
+    conn->fd = socket(result->ai_family, SOCK_STREAM, 0);
+    if (conn->out == NULL || conn->in == NULL || conn->fd < 0 || set_nonblocking(conn->fd) < 0) {
+        if (conn->fd >= 0) close(conn->fd);
+        pool_put(conn->out, OUT_CAPACITY);
+        pool_put(conn->in, IO_CHUNK);
+        free(conn);
+        if (result != &local) freeaddrinfo(result);
+        return NULL;
+    }
+
+    conn->loop = loop;
+    conn->callback = callback;
+    conn->user_data = user_data;
+    conn->state = CONN_CONNECTING;
+    if (result->ai_family == AF_INET) set_nodelay(conn->fd);
+
+    int rc = connect(conn->fd, result->ai_addr, result->ai_addrlen);
+    if (result != &local) freeaddrinfo(result);
+    if (rc < 0 && errno != EINPROGRESS) {
+        // Reported through the callback on the next loop iteration
+        close(conn->fd);
+        conn->fd = -1;
+    }
+
+    conn->next = loop->conns;
+    loop->conns = conn;
+    return conn;
+}
+
+void s25_conn_close(s25_conn* conn) {
+    // Best effort: tell S1 we are leaving if nothing else is in flight
+    if (conn->state == CONN_READY && conn->head == NULL && conn->out_sent == conn->out_length) {
+        size_t length;
+        char* frame = build_frame("quit", &length);
+        if (frame) {
+            send(conn->fd, frame, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+            free(frame);
+        }
+    }
+
+    conn->close_requested = 1;
+    if (!conn->loop->dispatching) loop_reap(conn->loop);
+}
+
+// Function to append " word" to a command being built; -1 if it does not fit (the command is then unusable)
+static int append_argument(char* command, size_t size, size_t* used, const char* word) {
+    int length = snprintf(command + *used, size - *used, " %s", word);
+    if (length < 0 || (size_t)length >= size - *used) return -1;
+    *used += length;
+    return 0;
+}
+
+s25_op* s25_uploadf(s25_conn* conn, const char* const* local_files, int count, const char* destination,
+                    s25_op_cb callback, void* user_data) {
+    char command[4096];
+    size_t used;
+
+    if (count < 1 || destination == NULL) return NULL;
+
+    s25_op* op = op_new(conn, OP_UPLOAD, count, callback, user_data);
+    if (op == NULL) return NULL;
+    if (op_open_sources(op, local_files) < 0) {
+        op_free(op);
+        return NULL;
+    }
+
+    // A command too long for S1 is refused here rather than sent cut short
+    int fits = 1;
+    used = snprintf(command, sizeof(command), "uploadf");
+    for (int i = 0; i < count && fits; i++) {
+        fits = append_argument(command, sizeof(command), &used, base_name(local_files[i])) == 0;
+    }
+    if (!fits || append_argument(command, sizeof(command), &used, destination) < 0) {
+        op_free(op);
+        return NULL;
+    }
+
+    op->request = build_command_frame(op, command);
+    return op_submit(op);
+}
+
+s25_op* s25_downlf(s25_conn* conn, const char* const* remote_paths, int count, const char* local_directory,
+                   s25_op_cb callback, void* user_data) {
+    char command[4096];
+    size_t used;
+
+    if (count < 1) return NULL;
+
+    s25_op* op = op_new(conn, OP_DOWNLOAD, count, callback, user_data);
+    if (op == NULL) return NULL;
+
+    used = snprintf(command, sizeof(command), "downlf");
+    for (int i = 0; i < count; i++) {
+        op->files[i] = copy_string(remote_paths[i]);
+        if (append_argument(command, sizeof(command), &used, remote_paths[i]) < 0) {
+            op_free(op);
+            return NULL;
+        }
+    }
+    if (local_directory) op->local_directory = copy_string(local_directory);
+
+    op->request = build_command_frame(op, command);
+    return op_submit(op);
+}
+
+s25_op* s25_removef(s25_conn* conn, const char* const* remote_paths, int count,
+                    s25_op_cb callback, void* user_data) {
+    char command[4096];
+    size_t used;
+
+    if (count < 1) return NULL;
+
+    // removef has no per-file replies; files are kept for the caller's benefit
+    s25_op* op = op_new(conn, OP_REMOVE, count, callback, user_data);
+    if (op == NULL) return NULL;
+
+    used = snprintf(command, sizeof(command), "removef");
+    for (int i = 0; i < count; i++) {
+        op->files[i] = copy_string(remote_paths[i]);
+        if (append_argument(command, sizeof(command), &used, remote_paths[i]) < 0) {
+            op_free(op);
+            return NULL;
+        }
+    }
+
+    op->request = build_command_frame(op, command);
+    return op_submit(op);
+}
+
+s25_op* s25_purgef(s25_conn* conn, const char* const* remote_paths, int count,
+                   s25_op_cb callback, void* user_data) {
+    char command[64];
+    size_t total;
+
+    if (count < 1) return NULL;
+
+    // Files become known as the server reports them
+    s25_op* op = op_new(conn, OP_PURGE, 0, callback, user_data);
+    if (op == NULL) return NULL;
+
+    // "purgef <count>", then one frame per path or pattern, sent together
+    snprintf(command, sizeof(command), "purgef %d", count);
+    char* command_frame = build_command_frame(op, command);
+    total = op->request_length;
+    for (int i = 0; i < count; i++) total += 4 + strlen(remote_paths[i]);
+    if (command_frame != NULL && (op->request = malloc(total)) != NULL) {
+        memcpy(op->request, command_frame, op->request_length);
+        for (int i = 0; i < count; i++) {
+            size_t length = strlen(remote_paths[i]);
+            uint32_t header = htonl((uint32_t)length);
+            memcpy(op->request + op->request_length, &header, 4);
+            memcpy(op->request + op->request_length + 4, remote_paths[i], length);
+            op->request_length += 4 + length;
+        }
+    }
+    free(command_frame);
+    return op_submit(op);
+}
+
+// Function to queue copyf or movef of one remote file
+static s25_op* op_copy(s25_conn* conn, const char* command_name, const char* source, const char* destination,
+                       s25_op_cb callback, void* user_data) {
+    char command[4096];
+
+    if (source == NULL || destination == NULL) return NULL;
+
+    // The servers move the bytes; the only reply is a status
+    s25_op* op = op_new(conn, OP_COPY, 1, callback, user_data);
+    if (op == NULL) return NULL;
+
+    op->files[0] = copy_string(source);
+    if (snprintf(command, sizeof(command), "%s %s %s", command_name, source, destination) >= (int)sizeof(command)) {
+        op_free(op);
+        return NULL;
+    }
+    op->request = build_command_frame(op, command);
+    return op_submit(op);
+}
+
+s25_op* s25_copyf(s25_conn* conn, const char* source, const char* destination,
+                  s25_op_cb callback, void* user_data) {
+    return op_copy(conn, "copyf", source, destination, callback, user_data);
+}
+
+s25_op* s25_movef(s25_conn* conn, const char* source, const char* destination,
+                  s25_op_cb callback, void* user_data) {
+    return op_copy(conn, "movef", source, destination, callback, user_data);
+}
+
+s25_op* s25_downltar(s25_conn* conn, const char* filetype, const char* local_directory,
+                     s25_op_cb callback, void* user_data) {
+    char command[256];
+
+    s25_op* op = op_new(conn, OP_TAR, 1, callback, user_data);
+    if (op == NULL) return NULL;
+
+    op->files[0] = copy_string(tar_name_for_type(filetype));
+    if (local_directory) op->local_directory = copy_string(local_directory);
+
+    snprintf(command, sizeof(command), "downltar %s", filetype);
+    op->request = build_command_frame(op, command);
+    return op_submit(op);
+}
+
+s25_op* s25_dispfnames(s25_conn* conn, const char* remote_directory,
+                       s25_op_cb callback, void* user_data) {
+    char command[4096];
+
+    s25_op* op = op_new(conn, OP_LIST, 0, callback, user_data);
+    if (op == NULL) return NULL;
+
+    if (snprintf(command, sizeof(command), "dispfnames %s", remote_directory) >= (int)sizeof(command)) {
+        op_free(op);
+        return NULL;
+    }
+    op->request = build_command_frame(op, command);
+    return op_submit(op);
+}
+
+s25_op* s25_stats(s25_conn* conn, s25_op_cb callback, void* user_data) {
+    s25_op* op = op_new(conn, OP_LIST, 0, callback, user_data);
+    if (op == NULL) return NULL;
+
+    op->request = build_command_frame(op, "stats");
+    return op_submit(op);
+}
+
+s25_op* s25_trace(s25_conn* conn, s25_op_cb callback, void* user_data) {
+    s25_op* op = op_new(conn, OP_LIST, 0, callback, user_data);
+    if (op == NULL) return NULL;
+
+    op->request = build_command_frame(op, "trace");
+    return op_submit(op);
+}
+
+s25_op* s25_ping(s25_conn* conn, s25_op_cb callback, void* user_data) {
+    s25_op* op = op_new(conn, OP_LIST, 0, callback, user_data);
+    if (op == NULL) return NULL;
+
+    op->request = build_command_frame(op, "ping");
+    return op_submit(op);
+}
+
+// A direct transfer in progress: first the locate on S1, then the PUT or GET on the storage server
+struct direct_transfer {
+    s25_conn* conn;
+    s25_conn* storage;
+    int upload;
+    char* file;              // local file to upload, or remote path to download
+    char* destination;       // where an upload goes on S1
+    char* local_directory;   // where a download goes locally
+    s25_op_cb callback;
+    void* user_data;
+};
+
+// Function to release a direct transfer
+static void direct_free(struct direct_transfer* transfer) {
+    free(transfer->file);
+    free(transfer->destination);
+    free(transfer->local_directory);
+    free(transfer);
+}
+
+// Function to hand the finished PUT or GET to the caller and drop the storage connection
+static void direct_done(s25_op* op, int status, void* user_data) {
+    struct direct_transfer* transfer = user_data;
+
+    transfer->callback(op, status, transfer->user_data);
+    if (!transfer->storage->close_requested) s25_conn_close(transfer->storage);
+    direct_free(transfer);
+}
+
+// Function to start the PUT or GET S1 authorized, on a new connection to the storage server
+static s25_op* direct_start(struct direct_transfer* transfer, const char* host, int port, const char* token) {
+    const char* files[1] = { transfer->file };
+
+    transfer->storage = s25_connect(transfer->conn->loop, host, port, NULL, NULL);
+    if (transfer->storage == NULL) return NULL;
+
+    s25_op* op = op_new(transfer->storage, transfer->upload ? OP_PUT : OP_GET, 1, direct_done, transfer);
+    if (op != NULL && transfer->upload && op_open_sources(op, files) < 0) {
+        op_free(op);
+        op = NULL;
+    }
+    if (op != NULL && !transfer->upload) {
+        op->files[0] = copy_string(transfer->file);
+        if (transfer->local_directory) op->local_directory = copy_string(transfer->local_directory);
+    }
+    if (op != NULL) {
+        op->request = build_token_request(op, transfer->upload ? "PUT" : "GET", token);
+        op = op_submit(op);
+    }
+    if (op == NULL) s25_conn_close(transfer->storage);
+    return op;
+}
+
+// Function to follow S1's answer to locate: to the storage server, or back to S1 for files it keeps
+static void locate_done(s25_op* op, int status, void* user_data) {
+    struct direct_transfer* transfer = user_data;
+    const char* files[1] = { transfer->file };
+    char host[1024];
+    char token[64];
+    int port;
+
+    if (status != S25_OK) {
+        transfer->callback(op, status, transfer->user_data);
+        direct_free(transfer);
+        return;
+    }
+
+    if (strcmp(s25_op_message(op), "PROXY") == 0) {
+        s25_op* next = transfer->upload ?
+            s25_uploadf(transfer->conn, files, 1, transfer->destination, transfer->callback, transfer->user_data) :
+            s25_downlf(transfer->conn, files, 1, transfer->local_directory, transfer->callback, transfer->user_data);
+        if (next == NULL) transfer->callback(op, S25_ERR_IO, transfer->user_data);
+        direct_free(transfer);
+        return;
+    }
+
+    // Once the PUT or GET is queued, direct_done finishes the transfer
+    status = S25_ERR_SERVER;
+    if (sscanf(s25_op_message(op), "REDIRECT %1023s %d %63s", host, &port, token) == 3) {
+        if (direct_start(transfer, host, port, token) != NULL) return;
+        status = S25_ERR_CONNECT;
+    }
+    transfer->callback(op, status, transfer->user_data);
+    direct_free(transfer);
+}
+
+// Function to ask S1 where a direct transfer goes
+static s25_op* direct_locate(struct direct_transfer* transfer, const char* command) {
+    s25_op* op = transfer ? op_new(transfer->conn, OP_LIST, 0, locate_done, transfer) : NULL;
+
+    if (op != NULL) {
+        op->request = build_command_frame(op, command);
+        op = op_submit(op);
+    }
+    if (op == NULL && transfer != NULL) direct_free(transfer);
+    return op;
+}
+
+s25_op* s25_uploadf_direct(s25_conn* conn, const char* local_file, const char* destination,
+                           s25_op_cb callback, void* user_data) {
+    char command[4096];
+    struct stat file_info;
+
+    if (destination == NULL || stat(local_file, &file_info) < 0) return NULL;
+
+    struct direct_transfer* transfer = calloc(1, sizeof(*transfer));
+    if (transfer == NULL) return NULL;
+    transfer->conn = conn;
+    transfer->upload = 1;
+    transfer->file = copy_string(local_file);
+    transfer->destination = copy_string(destination);
+    transfer->callback = callback;
+    transfer->user_data = user_data;
+    if (transfer->file == NULL || transfer->destination == NULL) {
+        direct_free(transfer);
+        return NULL;
+    }
+
+    if (snprintf(command, sizeof(command), "locate put %s %s %ld", destination, base_name(local_file),
+                 (long)file_info.st_size) >= (int)sizeof(command)) {
+        direct_free(transfer);
+        return NULL;
+    }
+    return direct_locate(transfer, command);
+}
+
+s25_op* s25_downlf_direct(s25_conn* conn, const char* remote_path, const char* local_directory,
+                          s25_op_cb callback, void* user_data) {
+    char command[4096];
+
+    struct direct_transfer* transfer = calloc(1, sizeof(*transfer));
+    if (transfer == NULL) return NULL;
+    transfer->conn = conn;
+    transfer->file = copy_string(remote_path);
+    if (local_directory) transfer->local_directory = copy_string(local_directory);
+    transfer->callback = callback;
+    transfer->user_data = user_data;
+    if (transfer->file == NULL || (local_directory && transfer->local_directory == NULL)) {
+        direct_free(transfer);
+        return NULL;
+    }
+
+    if (snprintf(command, sizeof(command), "locate get %s", remote_path) >= (int)sizeof(command)) {
+        direct_free(transfer);
+        return NULL;
+    }
+    return direct_locate(transfer, command);
+}
+
+const char* s25_op_message(const s25_op* op) {
+    return op->message ? op->message : "";
+}
+
+int s25_op_file_count(const s25_op* op) {
+    return op->file_count;
+}
+
+const char* s25_op_file_name(const s25_op* op, int index) {
+    if (index < 0 || index >= op->file_count) return NULL;
+    return op->files[index];
+}
+
+int s25_op_file_status(const s25_op* op, int index) {
+    if (index < 0 || index >= op->file_count) return S25_ERR_PROTOCOL;
+    return op->file_status[index];
+}
+
+long long s25_op_bytes(const s25_op* op) {
+    return op->bytes;
+}
+
+unsigned long long s25_op_request_id(const s25_op* op) {
+    return op->context.id;
+}
+
+long s25_op_retry_after_ms(const s25_op* op) {
+    return op->retry_after_ms;
+}
+
+const char* s25_strerror(int status) {
+    switch (status) {
+    case S25_OK: return "success";
+    case S25_ERR_CONNECT: return "connection failed";
+    case S25_ERR_IO: return "local file error";
+    case S25_ERR_PROTOCOL: return "protocol or connection error";
+    case S25_ERR_SERVER: return "server reported failure";
+    case S25_ERR_CLOSED: return "connection closed";
+    case S25_ERR_BUSY: return "server busy";
+    case S25_ERR_NO_MATCH: return "no file matched";
+    default: return "unknown error";
+    }
+}
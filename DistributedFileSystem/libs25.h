@@ -0,0 +1,98 @@
+#ifndef LIBS25_H
+#define LIBS25_H
+
+#include <poll.h>
+
+// libs25 - asynchronous client library for the distributed file system.
+//
+// A loop owns any number of connections to S1.  Each connection runs its
+// operations in submission order (requests are pipelined on the socket),
+// while operations on different connections progress concurrently.  All
+// sockets are non-blocking; only local file reads and writes block.
+//
+// Drive the loop with s25_loop_run() / s25_loop_run_once(), or embed it in
+// an existing event loop with s25_loop_fill_pollfds() + s25_loop_dispatch().
+// Callbacks are only ever invoked from inside those calls.
+//
+// Every request carries a fresh request ID; S25_TRACE_SAMPLE (0..1) sets the
+// fraction of requests the servers record trace spans for.
+
+// Status codes passed to callbacks
+#define S25_OK 0
+#define S25_ERR_CONNECT -1
+#define S25_ERR_IO -2
+#define S25_ERR_PROTOCOL -3
+#define S25_ERR_SERVER -4
+#define S25_ERR_CLOSED -5
+#define S25_ERR_BUSY -6      // server overloaded; see s25_op_retry_after_ms()
+#define S25_ERR_NO_MATCH -7  // a purgef pattern matched no file
+
+typedef struct s25_loop s25_loop;
+typedef struct s25_conn s25_conn;
+typedef struct s25_op s25_op;
+
+typedef void (*s25_connect_cb)(s25_conn* conn, int status, void* user_data);
+typedef void (*s25_op_cb)(s25_op* op, int status, void* user_data);
+
+// Loop management
+s25_loop* s25_loop_new(void);
+void s25_loop_free(s25_loop* loop);
+int s25_loop_pending(s25_loop* loop);
+int s25_loop_run_once(s25_loop* loop, int timeout_ms);
+int s25_loop_run(s25_loop* loop);
+
+// Embedding: fill at most max_fds entries, then pass the polled array back
+int s25_loop_fill_pollfds(s25_loop* loop, struct pollfd* fds, int max_fds);
+void s25_loop_dispatch(s25_loop* loop, const struct pollfd* fds, int nfds);
+
+// Connections; operations may be queued before the connect completes.
+// A host starting with '/' is the path of S1's AF_UNIX socket (port is ignored).
+s25_conn* s25_connect(s25_loop* loop, const char* host, int port, s25_connect_cb callback, void* user_data);
+void s25_conn_close(s25_conn* conn);
+
+// Operations; each returns NULL if the request could not be queued
+s25_op* s25_uploadf(s25_conn* conn, const char* const* local_files, int count, const char* destination,
+                    s25_op_cb callback, void* user_data);
+s25_op* s25_downlf(s25_conn* conn, const char* const* remote_paths, int count, const char* local_directory,
+                   s25_op_cb callback, void* user_data);
+s25_op* s25_removef(s25_conn* conn, const char* const* remote_paths, int count,
+                    s25_op_cb callback, void* user_data);
+// Bulk delete: each path may be a glob pattern (*, ?, [...]; wildcards stop at '/').  The
+// operation's files are the results: every file deleted or not (status S25_OK or S25_ERR_SERVER),
+// and every pattern that matched nothing (S25_ERR_NO_MATCH).
+s25_op* s25_purgef(s25_conn* conn, const char* const* remote_paths, int count,
+                   s25_op_cb callback, void* user_data);
+// Server-side copy and move of one file.  A destination ending in '/' or without an extension
+// is a directory and keeps the source's name; a different extension may put it on another server.
+s25_op* s25_copyf(s25_conn* conn, const char* source, const char* destination,
+                  s25_op_cb callback, void* user_data);
+s25_op* s25_movef(s25_conn* conn, const char* source, const char* destination,
+                  s25_op_cb callback, void* user_data);
+s25_op* s25_downltar(s25_conn* conn, const char* filetype, const char* local_directory,
+                     s25_op_cb callback, void* user_data);
+s25_op* s25_dispfnames(s25_conn* conn, const char* remote_directory,
+                       s25_op_cb callback, void* user_data);
+s25_op* s25_stats(s25_conn* conn, s25_op_cb callback, void* user_data);
+s25_op* s25_trace(s25_conn* conn, s25_op_cb callback, void* user_data);
+s25_op* s25_ping(s25_conn* conn, s25_op_cb callback, void* user_data);   // round trip to S1 only
+
+// Direct transfers of one file (S25_DIRECT on S1): S1 only authorizes them, and the bytes go
+// straight to or from the storage server on a connection of their own.  Files S1 keeps
+// itself go through uploadf/downlf.  The callback gets the operation that ended the transfer.
+s25_op* s25_uploadf_direct(s25_conn* conn, const char* local_file, const char* destination,
+                           s25_op_cb callback, void* user_data);
+s25_op* s25_downlf_direct(s25_conn* conn, const char* remote_path, const char* local_directory,
+                          s25_op_cb callback, void* user_data);
+
+// Result accessors, valid only inside the operation callback
+const char* s25_op_message(const s25_op* op);
+int s25_op_file_count(const s25_op* op);
+const char* s25_op_file_name(const s25_op* op, int index);
+int s25_op_file_status(const s25_op* op, int index);
+long long s25_op_bytes(const s25_op* op);
+unsigned long long s25_op_request_id(const s25_op* op);
+long s25_op_retry_after_ms(const s25_op* op);
+
+const char* s25_strerror(int status);
+
+#endif
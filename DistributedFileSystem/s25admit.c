@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/mman.h>
+
+#include "s25admit.h"
+#include "s25common.h"
+#include "s25stats.h"
+
+struct admit_region {
+    int sessions;
+    int active[STATS_MAX_COMMANDS];
+};
+
+static struct admit_region* region;
+static int backlog;
+static int max_sessions;
+static int limits[STATS_MAX_COMMANDS];
+static int limit_count;
+static long retry_after_ms;
+
+// Function to read the limits for the server's commands; call before forking/threads
+int admit_init(const char* const* command_names, int command_count) {
+    region = mmap(NULL, sizeof(*region), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        region = NULL;
+        perror("Admission region");
+        return -1;
+    }
+
+    backlog = get_config_long("S25_LISTEN_BACKLOG", 128);
+    max_sessions = get_config_long("S25_MAX_SESSIONS", 0);
+    retry_after_ms = get_config_long("S25_RETRY_AFTER_MS", 100);
+    if (retry_after_ms < 1) retry_after_ms = 1;
+
+    limit_count = command_count < STATS_MAX_COMMANDS ? command_count : STATS_MAX_COMMANDS;
+    for (int command = 0; command < limit_count; command++) {
+        char setting[64];
+        int length = snprintf(setting, sizeof(setting), "S25_MAX_%s", command_names[command]);
+        for (int i = 8; i < length && i < (int)sizeof(setting); i++) {
+            setting[i] = toupper((unsigned char)setting[i]);
+        }
+        limits[command] = get_config_long(setting, 0);
+        if (limits[command] > 0) printf("Admission: at most %d concurrent %s\n", limits[command], command_names[command]);
+    }
+    if (max_sessions > 0) printf("Admission: at most %d sessions\n", max_sessions);
+    return 0;
+}
+
+// Function to get the listen() backlog
+int admit_backlog(void) {
+    return backlog > 0 ? backlog : 1;
+}
+
+// Function to start a session; returns 0 if it is over the limit (it is counted either way)
+int admit_session_begin(void) {
+    if (region == NULL) return 1;
+
+    int sessions = __atomic_add_fetch(&region->sessions, 1, __ATOMIC_RELAXED);
+    return max_sessions <= 0 || sessions <= max_sessions;
+}
+
+// Function to end a session started with admit_session_begin (async-signal-safe)
+void admit_session_end(void) {
+    if (region != NULL) __atomic_sub_fetch(&region->sessions, 1, __ATOMIC_RELAXED);
+}
+
+// Function to start a request; returns 0 (and counts a rejection) if it must be turned away
+int admit_command_begin(int command, int session_admitted) {
+    if (region == NULL || command < 0 || command >= limit_count) return 1;
+
+    if (!session_admitted) {
+        stats_count_rejected(-1);
+        return 0;
+    }
+
+    int active = __atomic_add_fetch(&region->active[command], 1, __ATOMIC_RELAXED);
+    if (limits[command] > 0 && active > limits[command]) {
+        __atomic_sub_fetch(&region->active[command], 1, __ATOMIC_RELAXED);
+        stats_count_rejected(command);
+        return 0;
+    }
+    return 1;
+}
+
+// Function to end a request started with admit_command_begin
+void admit_command_end(int command) {
+    if (region == NULL || command < 0 || command >= limit_count) return;
+    __atomic_sub_fetch(&region->active[command], 1, __ATOMIC_RELAXED);
+}
+
+// Function to get the retry hint for a BUSY reply
+long admit_retry_after_ms(void) {
+    double load = 1;
+
+    // The more sessions past the limit, the longer clients should stay away
+    if (region != NULL && max_sessions > 0) {
+        double sessions = (double)__atomic_load_n(&region->sessions, __ATOMIC_RELAXED) / max_sessions;
+        if (sessions > load) load = sessions;
+    }
+
+    long hint = (long)(retry_after_ms * load);
+    return hint + random() % (hint / 2 + 1);
+}
@@ -0,0 +1,45 @@
+#ifndef S25ADMIT_H
+#define S25ADMIT_H
+
+// Admission control shared by every server.
+//
+// A server turns work away with a BUSY reply (see s25common.h) instead of
+// queueing it once its limits are reached:
+//
+//   S25_LISTEN_BACKLOG   listen() backlog (default 128)
+//   S25_MAX_SESSIONS     concurrent sessions: client connections for S1,
+//                        connections from S1 for S2-S4 (default 0 = no limit)
+//   S25_MAX_<COMMAND>    concurrent requests of one command, named as the
+//                        server knows it (S25_MAX_DOWNLTAR for S1,
+//                        S25_MAX_TAR for S2-S4; default 0 = no limit)
+//   S25_RETRY_AFTER_MS   retry hint sent with BUSY (default 100); it grows
+//                        with how far the limit is exceeded and is jittered
+//                        so rejected clients do not come back together
+//
+// Counters live in shared memory created before forking, so S1's children
+// and its accept loop see the same numbers.  Rejections are counted in the
+// server's metrics.
+
+// Function to read the limits for the server's commands; call before forking/threads
+int admit_init(const char* const* command_names, int command_count);
+
+// Function to get the listen() backlog
+int admit_backlog(void);
+
+// Function to start a session; returns 0 if it is over the limit (it is counted either way)
+int admit_session_begin(void);
+
+// Function to end a session started with admit_session_begin (async-signal-safe)
+void admit_session_end(void);
+
+// Function to start a request; returns 0 (and counts a rejection) if it must be turned away.
+// Requests on a session over the limit count as rejected sessions.
+int admit_command_begin(int command, int session_admitted);
+
+// Function to end a request started with admit_command_begin
+void admit_command_end(int command);
+
+// Function to get the retry hint for a BUSY reply
+long admit_retry_after_ms(void);
+
+#endif
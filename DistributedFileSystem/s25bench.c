@@ -0,0 +1,604 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "libs25.h"
+#include "s25common.h"
+
+// s25bench - closed-loop load generator for the distributed file system.
+//
+// Each client owns one connection to S1 and a private remote directory
+// (~S1/bench/c<N>).  A client issues one operation at a time, picked from
+// the configured mix, and issues the next one from the completion
+// callback.  Results are printed as JSON: ops/s, MB/s and latency
+// percentiles per command.  The "connect" command reconnects and pings S1,
+// so its ops/s is the connection rate S1 sustains.  With S25_DIRECT=1,
+// uploads and downloads go straight to the storage servers (see
+// s25direct.h).  Given the server pids
+// (-P), the report also has the CPU time they used and that time per GB
+// moved.
+
+#define MAX_CLIENTS 256
+#define MAX_CLASSES 16
+#define MAX_TYPES 4
+#define VARIANTS 8
+#define MAX_PATH 1024
+#define MAX_PIDS 8
+
+enum command_kind { CMD_UPLOAD, CMD_DOWNLOAD, CMD_LIST, CMD_REMOVE, CMD_TAR, CMD_CONNECT, CMD_COUNT };
+
+static const char* command_names[CMD_COUNT] = { "upload", "download", "list", "remove", "tar", "connect" };
+
+struct size_class {
+    long bytes;
+    int weight;
+    char label[32];
+};
+
+struct command_stats {
+    long long ops;
+    long long errors;
+    long long busy;
+    long long bytes;
+    double* latencies_us;
+    long count;
+    long capacity;
+};
+
+struct bench_client {
+    int index;
+    s25_conn* conn;
+    int busy;
+    int dead;
+    unsigned int seed;
+    int kind;
+    struct timespec started;
+    // Which catalog entries this client currently has on the server
+    unsigned char present[MAX_CLASSES][MAX_TYPES][VARIANTS];
+    int present_count;
+    char download_directory[MAX_PATH];
+};
+
+static struct size_class size_classes[MAX_CLASSES];
+static int size_class_count;
+static int size_weight_total;
+static int mix_weights[CMD_COUNT];
+static int mix_total;
+static char file_types[MAX_TYPES][8];
+static int file_type_count;
+static char work_directory[MAX_PATH / 2];
+static struct command_stats stats[CMD_COUNT];
+static struct bench_client clients[MAX_CLIENTS];
+static int client_count = 4;
+static double duration_s = 10;
+static long max_ops;
+static long issued_ops;
+static struct timespec deadline;
+static int stopping;
+static s25_loop* loop;
+static const char* host = "127.0.0.1";
+static int port;
+static int direct_transfers;
+static long server_pids[MAX_PIDS];
+static int server_pid_count;
+
+// Function to get the time between two timestamps in microseconds
+static double elapsed_us(const struct timespec* from, const struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+// Function to parse sizes like 512, 4k, 64K, 1m, 2G
+static long parse_size(const char* text) {
+    char* end;
+    double value = strtod(text, &end);
+
+    switch (*end) {
+    case 'k': case 'K': value *= 1024; break;
+    case 'm': case 'M': value *= 1024 * 1024; break;
+    case 'g': case 'G': value *= 1024.0 * 1024 * 1024; break;
+    default: break;
+    }
+    return (long)value;
+}
+
+// Function to parse "4k=50,64k=30,1m=20" into size classes
+static int parse_size_distribution(const char* spec) {
+    char copy[512];
+    char* saveptr;
+
+    snprintf(copy, sizeof(copy), "%s", spec);
+    size_class_count = 0;
+    size_weight_total = 0;
+
+    for (char* item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        if (size_class_count == MAX_CLASSES) return -1;
+
+        char* equals = strchr(item, '=');
+        int weight = 1;
+        if (equals) {
+            *equals = '\0';
+            weight = atoi(equals + 1);
+        }
+
+        struct size_class* class = &size_classes[size_class_count++];
+        class->bytes = parse_size(item);
+        class->weight = weight;
+        snprintf(class->label, sizeof(class->label), "%s", item);
+        size_weight_total += weight;
+    }
+    return size_class_count > 0 && size_weight_total > 0 ? 0 : -1;
+}
+
+// Function to parse "upload=40,download=40,list=10,remove=10,tar=0"
+static int parse_mix(const char* spec) {
+    char copy[512];
+    char* saveptr;
+
+    snprintf(copy, sizeof(copy), "%s", spec);
+    memset(mix_weights, 0, sizeof(mix_weights));
+    mix_total = 0;
+
+    for (char* item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        char* equals = strchr(item, '=');
+        if (equals == NULL) return -1;
+        *equals = '\0';
+
+        int kind;
+        for (kind = 0; kind < CMD_COUNT; kind++) {
+            if (strcmp(item, command_names[kind]) == 0) break;
+        }
+        if (kind == CMD_COUNT) return -1;
+
+        mix_weights[kind] = atoi(equals + 1);
+        mix_total += mix_weights[kind];
+    }
+    return mix_total > 0 ? 0 : -1;
+}
+
+// Function to parse "pdf,txt,zip,c"
+static int parse_types(const char* spec) {
+    char copy[128];
+    char* saveptr;
+
+    snprintf(copy, sizeof(copy), "%s", spec);
+    file_type_count = 0;
+    for (char* item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        if (file_type_count == MAX_TYPES) return -1;
+        if (*item == '.') item++;
+        if (strcmp(item, "c") && strcmp(item, "pdf") && strcmp(item, "txt") && strcmp(item, "zip")) return -1;
+        snprintf(file_types[file_type_count++], sizeof(file_types[0]), "%s", item);
+    }
+    return file_type_count > 0 ? 0 : -1;
+}
+
+// Function to build the local name of a catalog entry
+static void source_name(int class, int type, int variant, char* name, size_t size) {
+    snprintf(name, size, "b%s_%d.%s", size_classes[class].label, variant, file_types[type]);
+}
+
+// Function to create the local source files uploads are made from
+static int create_source_files(void) {
+    char path[MAX_PATH];
+    char name[128];
+    char* block = malloc(64 * 1024);
+
+    if (block == NULL) return -1;
+    for (int i = 0; i < 64 * 1024; i++) block[i] = (char)rand();
+
+    snprintf(path, sizeof(path), "%s/src", work_directory);
+    mkdir(path, 0755);
+
+    for (int class = 0; class < size_class_count; class++) {
+        for (int type = 0; type < file_type_count; type++) {
+            for (int variant = 0; variant < VARIANTS; variant++) {
+                source_name(class, type, variant, name, sizeof(name));
+                snprintf(path, sizeof(path), "%s/src/%s", work_directory, name);
+
+                int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0) {
+                    free(block);
+                    return -1;
+                }
+                block[0] = (char)variant;
+                for (long left = size_classes[class].bytes; left > 0; ) {
+                    long chunk = left < 64 * 1024 ? left : 64 * 1024;
+                    if (write(fd, block, chunk) != chunk) break;
+                    left -= chunk;
+                }
+                close(fd);
+            }
+        }
+    }
+
+    free(block);
+    return 0;
+}
+
+// Function to pick a weighted size class
+static int pick_size_class(struct bench_client* client) {
+    int roll = rand_r(&client->seed) % size_weight_total;
+    for (int class = 0; class < size_class_count; class++) {
+        roll -= size_classes[class].weight;
+        if (roll < 0) return class;
+    }
+    return size_class_count - 1;
+}
+
+// Function to pick a random file this client has uploaded; -1 if none
+static int pick_present(struct bench_client* client, int* class, int* type, int* variant) {
+    if (client->present_count == 0) return -1;
+
+    int target = rand_r(&client->seed) % client->present_count;
+    for (int c = 0; c < size_class_count; c++) {
+        for (int t = 0; t < file_type_count; t++) {
+            for (int v = 0; v < VARIANTS; v++) {
+                if (client->present[c][t][v] && target-- == 0) {
+                    *class = c;
+                    *type = t;
+                    *variant = v;
+                    return 0;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+// Function to record one completed operation
+static void record(int kind, int status, long long bytes, double latency_us) {
+    struct command_stats* entry = &stats[kind];
+
+    entry->ops++;
+    if (status != S25_OK) entry->errors++;
+    if (status == S25_ERR_BUSY) entry->busy++;
+    entry->bytes += bytes;
+
+    if (entry->count == entry->capacity) {
+        long capacity = entry->capacity ? entry->capacity * 2 : 1024;
+        double* grown = realloc(entry->latencies_us, capacity * sizeof(double));
+        if (grown == NULL) return;
+        entry->latencies_us = grown;
+        entry->capacity = capacity;
+    }
+    entry->latencies_us[entry->count++] = latency_us;
+}
+
+static void issue_next(struct bench_client* client);
+
+// Function to handle the completion of any benchmark operation
+static void operation_done(s25_op* op, int status, void* user_data) {
+    struct bench_client* client = user_data;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    record(client->kind, status, s25_op_bytes(op), elapsed_us(&client->started, &now));
+    client->busy = 0;
+
+    if (status == S25_ERR_CLOSED || status == S25_ERR_PROTOCOL || status == S25_ERR_CONNECT) {
+        client->dead = 1;
+        return;
+    }
+    issue_next(client);
+}
+
+// Function to start the next operation for a client
+static void issue_next(struct bench_client* client) {
+    char remote[MAX_PATH];
+    char local[MAX_PATH];
+    char name[128];
+    struct timespec now;
+    s25_op* op = NULL;
+    int class, type, variant;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (stopping || client->dead || (max_ops > 0 && issued_ops >= max_ops) ||
+        (max_ops == 0 && elapsed_us(&deadline, &now) >= 0)) {
+        stopping = stopping || max_ops == 0;
+        return;
+    }
+
+    int roll = rand_r(&client->seed) % mix_total;
+    int kind = 0;
+    while (roll >= mix_weights[kind]) roll -= mix_weights[kind++];
+
+    // Reads and removes need something to act on; upload first
+    if ((kind == CMD_DOWNLOAD || kind == CMD_REMOVE) && client->present_count == 0) kind = CMD_UPLOAD;
+
+    client->kind = kind;
+    client->started = now;
+    client->busy = 1;
+    issued_ops++;
+
+    switch (kind) {
+    case CMD_UPLOAD: {
+        class = pick_size_class(client);
+        type = rand_r(&client->seed) % file_type_count;
+        variant = rand_r(&client->seed) % VARIANTS;
+        source_name(class, type, variant, name, sizeof(name));
+        snprintf(local, sizeof(local), "%s/src/%s", work_directory, name);
+        snprintf(remote, sizeof(remote), "~S1/bench/c%d", client->index);
+
+        const char* files[1] = { local };
+        op = direct_transfers ? s25_uploadf_direct(client->conn, local, remote, operation_done, client) :
+                                s25_uploadf(client->conn, files, 1, remote, operation_done, client);
+        if (op && !client->present[class][type][variant]) {
+            client->present[class][type][variant] = 1;
+            client->present_count++;
+        }
+        break;
+    }
+    case CMD_DOWNLOAD:
+    case CMD_REMOVE: {
+        pick_present(client, &class, &type, &variant);
+        source_name(class, type, variant, name, sizeof(name));
+        snprintf(remote, sizeof(remote), "~S1/bench/c%d/%s", client->index, name);
+
+        const char* paths[1] = { remote };
+        if (kind == CMD_DOWNLOAD) {
+            op = direct_transfers ?
+                s25_downlf_direct(client->conn, remote, client->download_directory, operation_done, client) :
+                s25_downlf(client->conn, paths, 1, client->download_directory, operation_done, client);
+        } else {
+            op = s25_removef(client->conn, paths, 1, operation_done, client);
+            client->present[class][type][variant] = 0;
+            client->present_count--;
+        }
+        break;
+    }
+    case CMD_LIST:
+        snprintf(remote, sizeof(remote), "~S1/bench/c%d", client->index);
+        op = s25_dispfnames(client->conn, remote, operation_done, client);
+        break;
+    case CMD_TAR:
+        snprintf(name, sizeof(name), ".%s", file_types[rand_r(&client->seed) % file_type_count]);
+        op = s25_downltar(client->conn, name, client->download_directory, operation_done, client);
+        break;
+    case CMD_CONNECT:
+        // A fresh connection each time; the ping completes once S1 has accepted and served it
+        s25_conn_close(client->conn);
+        client->conn = s25_connect(loop, host, port, NULL, NULL);
+        if (client->conn) op = s25_ping(client->conn, operation_done, client);
+        break;
+    }
+
+    if (op == NULL) {
+        record(kind, S25_ERR_IO, 0, 0);
+        client->busy = 0;
+        client->dead = 1;
+    }
+}
+
+// Function to start issuing once a client is connected
+static void client_connected(s25_conn* conn, int status, void* user_data) {
+    struct bench_client* client = user_data;
+    (void)conn;
+
+    if (status != S25_OK) {
+        fprintf(stderr, "client %d: %s\n", client->index, s25_strerror(status));
+        client->dead = 1;
+        return;
+    }
+    issue_next(client);
+}
+
+// Function to compare two latencies for qsort
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Function to get a percentile from a sorted array
+static double percentile(const double* sorted, long count, double fraction) {
+    if (count == 0) return 0;
+    long index = (long)(fraction * count);
+    if (index >= count) index = count - 1;
+    return sorted[index];
+}
+
+// Function to parse a comma-separated list of server pids
+static int parse_pids(const char* text) {
+    char copy[256];
+    char* save = NULL;
+
+    snprintf(copy, sizeof(copy), "%s", text);
+    server_pid_count = 0;
+    for (char* item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        if (server_pid_count == MAX_PIDS || atol(item) <= 0) return -1;
+        server_pids[server_pid_count++] = atol(item);
+    }
+    return server_pid_count > 0 ? 0 : -1;
+}
+
+// Function to get the CPU seconds the server processes and their reaped children have used
+static double server_cpu_s(void) {
+    double ticks = 0;
+
+    for (int i = 0; i < server_pid_count; i++) {
+        char path[64], line[1024];
+        unsigned long user, system;
+        long child_user, child_system;
+
+        snprintf(path, sizeof(path), "/proc/%ld/stat", server_pids[i]);
+        FILE* file = fopen(path, "r");
+        if (file == NULL) continue;
+        char* fields = fgets(line, sizeof(line), file) ? strrchr(line, ')') : NULL;
+        fclose(file);
+
+        // Fields 14-17 of stat(5): utime, stime, cutime, cstime
+        if (fields && sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld", &user,
+                             &system, &child_user, &child_system) == 4) {
+            ticks += user + system + child_user + child_system;
+        }
+    }
+    return ticks / sysconf(_SC_CLK_TCK);
+}
+
+// Function to print the results as JSON (cpu_s < 0 if the servers were not measured)
+static void print_report(FILE* out, const char* label, double wall_s, double cpu_s) {
+    long long total_ops = 0, total_errors = 0, total_busy = 0, total_bytes = 0;
+
+    fprintf(out, "{\n  \"label\": \"%s\",\n  \"clients\": %d,\n  \"wall_s\": %.3f,\n", label, client_count, wall_s);
+    fprintf(out, "  \"commands\": {");
+
+    int first = 1;
+    for (int kind = 0; kind < CMD_COUNT; kind++) {
+        struct command_stats* entry = &stats[kind];
+        if (entry->ops == 0) continue;
+
+        qsort(entry->latencies_us, entry->count, sizeof(double), compare_double);
+        fprintf(out, "%s\n    \"%s\": {\"ops\": %lld, \"errors\": %lld, \"busy\": %lld, \"ops_per_s\": %.1f, \"mb_per_s\": %.3f, "
+                "\"latency_us\": {\"p50\": %.0f, \"p99\": %.0f, \"p999\": %.0f, \"max\": %.0f}}",
+                first ? "" : ",", command_names[kind], entry->ops, entry->errors, entry->busy,
+                entry->ops / wall_s, entry->bytes / wall_s / (1024 * 1024),
+                percentile(entry->latencies_us, entry->count, 0.50),
+                percentile(entry->latencies_us, entry->count, 0.99),
+                percentile(entry->latencies_us, entry->count, 0.999),
+                entry->count ? entry->latencies_us[entry->count - 1] : 0);
+        first = 0;
+
+        total_ops += entry->ops;
+        total_errors += entry->errors;
+        total_busy += entry->busy;
+        total_bytes += entry->bytes;
+    }
+
+    fprintf(out, "\n  },\n  \"total\": {\"ops\": %lld, \"errors\": %lld, \"busy\": %lld, \"ops_per_s\": %.1f, \"mb_per_s\": %.3f",
+            total_ops, total_errors, total_busy, total_ops / wall_s, total_bytes / wall_s / (1024 * 1024));
+    if (cpu_s >= 0) {
+        fprintf(out, ", \"server_cpu_s\": %.3f, \"cpu_s_per_gb\": %.3f", cpu_s,
+                total_bytes > 0 ? cpu_s / (total_bytes / (1024.0 * 1024 * 1024)) : 0);
+    }
+    fprintf(out, "}\n}\n");
+}
+
+// Function to print usage
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -c clients     concurrent clients, one connection each (default 4, max %d)\n"
+            "  -d seconds     run time (default 10)\n"
+            "  -n ops         stop after this many operations instead of a time limit\n"
+            "  -m mix         operation mix (default upload=40,download=40,list=10,remove=10)\n"
+            "                 commands: upload, download, list, remove, tar, connect\n"
+            "  -s sizes       file size distribution (default 4k=60,64k=30,1m=10)\n"
+            "  -t types       file types to use (default pdf,txt,zip,c)\n"
+            "  -H host        S1 address or AF_UNIX socket path (default 127.0.0.1)\n"
+            "  -p port        S1 port (default $S25_S1_PORT or 8080)\n"
+            "  -w directory   scratch directory (default: a new directory in /tmp)\n"
+            "  -P pids        comma-separated server pids whose CPU time to report\n"
+            "  -l label       label copied into the report\n"
+            "  -o file        write the JSON report here instead of stdout\n",
+            program, MAX_CLIENTS);
+}
+
+int main(int argc, char** argv) {
+    const char* label = "s25bench";
+    const char* output_path = NULL;
+    int option;
+
+    port = get_config_long("S25_S1_PORT", 8080);
+    direct_transfers = get_config_long("S25_DIRECT", 0) != 0;
+
+    parse_mix("upload=40,download=40,list=10,remove=10");
+    parse_size_distribution("4k=60,64k=30,1m=10");
+    parse_types("pdf,txt,zip,c");
+
+    while ((option = getopt(argc, argv, "c:d:n:m:s:t:H:p:w:P:l:o:h")) != -1) {
+        switch (option) {
+        case 'c': client_count = atoi(optarg); break;
+        case 'd': duration_s = atof(optarg); break;
+        case 'n': max_ops = atol(optarg); break;
+        case 'm':
+            if (parse_mix(optarg) < 0) { fprintf(stderr, "Invalid mix: %s\n", optarg); return 1; }
+            break;
+        case 's':
+            if (parse_size_distribution(optarg) < 0) { fprintf(stderr, "Invalid sizes: %s\n", optarg); return 1; }
+            break;
+        case 't':
+            if (parse_types(optarg) < 0) { fprintf(stderr, "Invalid types: %s\n", optarg); return 1; }
+            break;
+        case 'H': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'w': snprintf(work_directory, sizeof(work_directory), "%s", optarg); break;
+        case 'P':
+            if (parse_pids(optarg) < 0) { fprintf(stderr, "Invalid pids: %s\n", optarg); return 1; }
+            break;
+        case 'l': label = optarg; break;
+        case 'o': output_path = optarg; break;
+        default: usage(argv[0]); return option == 'h' ? 0 : 1;
+        }
+    }
+    if (client_count < 1 || client_count > MAX_CLIENTS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (work_directory[0] == '\0') {
+        snprintf(work_directory, sizeof(work_directory), "/tmp/s25bench.XXXXXX");
+        if (mkdtemp(work_directory) == NULL) {
+            perror("mkdtemp");
+            return 1;
+        }
+    } else {
+        mkdir(work_directory, 0755);
+    }
+    if (create_source_files() < 0) {
+        perror("Creating source files");
+        return 1;
+    }
+
+    loop = s25_loop_new();
+    for (int i = 0; i < client_count; i++) {
+        struct bench_client* client = &clients[i];
+        client->index = i;
+        client->seed = 12345u + i * 7919u;
+        snprintf(client->download_directory, MAX_PATH, "%s/dl%d", work_directory, i);
+        mkdir(client->download_directory, 0755);
+        client->conn = s25_connect(loop, host, port, client_connected, client);
+        if (client->conn == NULL) client->dead = 1;
+    }
+
+    struct timespec start, end;
+    double cpu_start = server_cpu_s();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+    deadline.tv_sec += (time_t)duration_s;
+    deadline.tv_nsec += (long)((duration_s - (time_t)duration_s) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (s25_loop_pending(loop) > 0) {
+        if (s25_loop_run_once(loop, 100) < 0) break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // S1 serves each connection in a child, whose CPU time counts once it has exited and been reaped
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].conn) s25_conn_close(clients[i].conn);
+    }
+    double cpu_used = -1;
+    if (server_pid_count > 0) {
+        usleep(200000);
+        cpu_used = server_cpu_s() - cpu_start;
+    }
+
+    FILE* out = output_path ? fopen(output_path, "w") : stdout;
+    if (out == NULL) {
+        perror(output_path);
+        return 1;
+    }
+    print_report(out, label, elapsed_us(&start, &end) / 1e6, cpu_used);
+    if (out != stdout) fclose(out);
+
+    s25_loop_free(loop);
+    return 0;
+}
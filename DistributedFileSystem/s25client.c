@@ -10,32 +10,16 @@
 #include <dirent.h>
 #include <fcntl.h>
 
+#include "libs25.h"
+#include "s25common.h"
+
 #define SERVER_PORT 8080
 #define BUFFER_SIZE 1024
 #define MAX_COMMAND 512
 #define MAX_PATH 256
 
-// Function to connect to S1 server
-int connect_to_server() {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        perror("Socket creation failed");
-        return -1;
-    }
-    
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    
-    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection to S1 failed");
-        close(sock);
-        return -1;
-    }
-    
-    return sock;
-}
+// Whether uploads and downloads go straight to the storage servers (S25_DIRECT)
+static int direct_transfers;
 
 // Function to validate command syntax
 int validate_command_syntax(const char* command) {
@@ -50,8 +34,7 @@ int validate_command_syntax(const char* command) {
     if (strcmp(token, "uploadf") == 0) {
         // uploadf filename1 filename2 filename3 destination_path
         int arg_count = 0;
-        while (token != NULL) {
-            token = strtok(NULL, " ");
+        while ((token = strtok(NULL, " ")) != NULL) {
             arg_count++;
         }
         if (arg_count < 2 || arg_count > 4) {
@@ -62,8 +45,7 @@ int validate_command_syntax(const char* command) {
     } else if (strcmp(token, "downlf") == 0) {
         // downlf filename1 filename2
         int arg_count = 0;
-        while (token != NULL) {
-            token = strtok(NULL, " ");
+        while ((token = strtok(NULL, " ")) != NULL) {
             arg_count++;
         }
         if (arg_count < 1 || arg_count > 2) {
@@ -74,8 +56,7 @@ int validate_command_syntax(const char* command) {
     } else if (strcmp(token, "removef") == 0) {
         // removef filename1 filename2
         int arg_count = 0;
-        while (token != NULL) {
-            token = strtok(NULL, " ");
+        while ((token = strtok(NULL, " ")) != NULL) {
             arg_count++;
         }
         if (arg_count < 1 || arg_count > 2) {
@@ -83,6 +64,35 @@ int validate_command_syntax(const char* command) {
             return 0;
         }
         
+    } else if (strcmp(token, "purgef") == 0) {
+        // purgef path_or_pattern... (or @listfile)
+        int arg_count = 0;
+        while ((token = strtok(NULL, " ")) != NULL) {
+            if (token[0] != '@' && strncmp(token, "~S1", 3) != 0) {
+                printf("Error: purgef paths must start with ~S1\n");
+                return 0;
+            }
+            arg_count++;
+        }
+        if (arg_count < 1) {
+            printf("Error: purgef requires at least 1 argument (paths, patterns or @listfile)\n");
+            return 0;
+        }
+        
+    } else if (strcmp(token, "copyf") == 0 || strcmp(token, "movef") == 0) {
+        // copyf source destination, movef source destination
+        const char* name = token;
+        char* source = strtok(NULL, " ");
+        char* destination = strtok(NULL, " ");
+        if (destination == NULL || strtok(NULL, " ") != NULL) {
+            printf("Error: %s requires 2 arguments (source and destination)\n", name);
+            return 0;
+        }
+        if (strncmp(source, "~S1", 3) != 0 || strncmp(destination, "~S1", 3) != 0) {
+            printf("Error: %s paths must start with ~S1\n", name);
+            return 0;
+        }
+        
     } else if (strcmp(token, "downltar") == 0) {
         // downltar filetype
         token = strtok(NULL, " ");
@@ -90,8 +100,9 @@ int validate_command_syntax(const char* command) {
             printf("Error: downltar requires 1 argument (filetype)\n");
             return 0;
         }
-        if (strcmp(token, ".c") != 0 && strcmp(token, ".pdf") != 0 && strcmp(token, ".txt") != 0) {
-            printf("Error: downltar only supports .c, .pdf, and .txt filetypes\n");
+        if (strcmp(token, ".c") != 0 && strcmp(token, ".pdf") != 0 && strcmp(token, ".txt") != 0 &&
+            strcmp(token, ".zip") != 0 && strcmp(token, "all") != 0) {
+            printf("Error: downltar only supports .c, .pdf, .txt, .zip and all\n");
             return 0;
         }
         
@@ -107,6 +118,21 @@ int validate_command_syntax(const char* command) {
             return 0;
         }
         
+    } else if (strcmp(token, "stats") == 0) {
+        // stats takes no arguments
+        if (strtok(NULL, " ") != NULL) {
+            printf("Error: stats takes no arguments\n");
+            return 0;
+        }
+        
+    } else if (strcmp(token, "trace") == 0) {
+        // trace [output_file]
+        strtok(NULL, " ");
+        if (strtok(NULL, " ") != NULL) {
+            printf("Error: trace takes at most 1 argument (output file)\n");
+            return 0;
+        }
+        
     } else if (strcmp(token, "quit") == 0) {
         // quit command is valid
         return 1;
@@ -148,15 +174,39 @@ int validate_file_type(const char* filename) {
     return 0;
 }
 
+// Function to print why an operation failed, with the server's retry hint when it was busy
+void print_failure(const char* what, s25_op* op, int status) {
+    if (status == S25_ERR_BUSY) {
+        printf("%s: %s, retry after %ld ms\n", what, s25_strerror(status), s25_op_retry_after_ms(op));
+    } else {
+        printf("%s: %s\n", what, s25_strerror(status));
+    }
+}
+
+// Function to report the result of an uploadf operation
+void uploadf_done(s25_op* op, int status, void* user_data) {
+    (void)user_data;
+    
+    for (int i = 0; i < s25_op_file_count(op); i++) {
+        if (s25_op_file_status(op, i) != S25_OK) {
+            printf("Error: Upload of '%s' failed\n", s25_op_file_name(op, i));
+        }
+    }
+    
+    if (status == S25_OK) {
+        printf("Upload completed successfully\n");
+    } else {
+        print_failure("Upload failed", op, status);
+    }
+}
+
 // Function to handle uploadf command
-void handle_uploadf_command(int server_socket, char* command) {
+void handle_uploadf_command(s25_loop* loop, s25_conn* conn, char* command) {
     char* token;
     char filenames[3][MAX_PATH];
+    const char* file_pointers[3];
+    char destination[MAX_PATH] = "";
     int file_count = 0;
-    char buffer[BUFFER_SIZE];
-    FILE* file;
-    long file_size;
-    int bytes_read;
     
     // Parse command
     token = strtok(command, " ");
@@ -166,12 +216,16 @@ void handle_uploadf_command(int server_socket, char* command) {
     while (token != NULL && file_count < 3) {
         if (strstr(token, "~S1") == NULL) {
             strcpy(filenames[file_count], token);
+            file_pointers[file_count] = filenames[file_count];
             file_count++;
         } else {
             break;
         }
         token = strtok(NULL, " ");
     }
+    if (token != NULL) {
+        strcpy(destination, token);
+    }
     
     // Validate files
     for (int i = 0; i < file_count; i++) {
@@ -184,51 +238,53 @@ void handle_uploadf_command(int server_socket, char* command) {
             return;
         }
     }
+    if (strlen(destination) == 0) {
+        printf("Error: uploadf requires a ~S1 destination path\n");
+        return;
+    }
     
-    // Send command to server first
-    send(server_socket, command, strlen(command), 0);
+    // Direct transfers run one per file, each to the storage server S1 names
+    for (int i = 0; direct_transfers && i < file_count; i++) {
+        if (s25_uploadf_direct(conn, file_pointers[i], destination, uploadf_done, NULL) == NULL) {
+            printf("Error: Upload of '%s' could not be queued\n", filenames[i]);
+        }
+    }
+    if (!direct_transfers && s25_uploadf(conn, file_pointers, file_count, destination, uploadf_done, NULL) == NULL) {
+        printf("Upload failed: could not queue request\n");
+        return;
+    }
+    s25_loop_run(loop);
+}
+
+// Function to report the result of a downlf operation
+void downlf_done(s25_op* op, int status, void* user_data) {
+    (void)user_data;
     
-    // Process each file
-    for (int i = 0; i < file_count; i++) {
-        // Receive file size from server
-        recv(server_socket, &file_size, sizeof(file_size), 0);
+    for (int i = 0; i < s25_op_file_count(op); i++) {
+        const char* filename = strrchr(s25_op_file_name(op, i), '/');
+        filename = filename ? filename + 1 : s25_op_file_name(op, i);
         
-        // Send file data to server
-        file = fopen(filenames[i], "rb");
-        if (file != NULL) {
-            long total_sent = 0;
-            while (total_sent < file_size) {
-                bytes_read = fread(buffer, 1, BUFFER_SIZE, file);
-                if (bytes_read <= 0) break;
-                send(server_socket, buffer, bytes_read, 0);
-                total_sent += bytes_read;
-            }
-            fclose(file);
-            
-            // Send success confirmation
-            send(server_socket, "SUCCESS", 7, 0);
+        if (s25_op_file_status(op, i) == S25_OK) {
+            printf("File '%s' downloaded successfully\n", filename);
+        } else if (s25_op_file_status(op, i) == S25_ERR_IO) {
+            printf("Error: Cannot create file '%s'\n", filename);
+        } else if (status != S25_ERR_BUSY) {
+            printf("Error: File '%s' not found on server\n", filename);
         }
     }
     
-    // Receive final response
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(server_socket, buffer, BUFFER_SIZE, 0);
-    
-    if (strcmp(buffer, "UPLOAD_COMPLETE") == 0) {
-        printf("Upload completed successfully\n");
+    if (status == S25_OK) {
+        printf("Download completed successfully\n");
     } else {
-        printf("Upload failed: %s\n", buffer);
+        print_failure("Download failed", op, status);
     }
 }
 
 // Function to handle downlf command
-void handle_downlf_command(int server_socket, char* command) {
-    char buffer[BUFFER_SIZE];
-    long file_size;
-    FILE* file;
-    int bytes_received;
+void handle_downlf_command(s25_loop* loop, s25_conn* conn, char* command) {
     char* token;
     char filenames[2][MAX_PATH];
+    const char* file_pointers[2];
     int file_count = 0;
     
     // Parse command
@@ -238,154 +294,291 @@ void handle_downlf_command(int server_socket, char* command) {
     // Get filenames (up to 2)
     while (token != NULL && file_count < 2) {
         strcpy(filenames[file_count], token);
+        file_pointers[file_count] = filenames[file_count];
         file_count++;
         token = strtok(NULL, " ");
     }
     
-    // Send command to server
-    send(server_socket, command, strlen(command), 0);
-    
-    // Process each file
-    for (int i = 0; i < file_count; i++) {
-        // Extract filename from path
-        char* filename = strrchr(filenames[i], '/');
-        if (filename == NULL) {
-            filename = filenames[i];
-        } else {
-            filename++; // Skip the '/'
+    for (int i = 0; direct_transfers && i < file_count; i++) {
+        if (s25_downlf_direct(conn, file_pointers[i], NULL, downlf_done, NULL) == NULL) {
+            printf("Error: Download of '%s' could not be queued\n", filenames[i]);
         }
-        
-        // Receive file size from server
-        recv(server_socket, &file_size, sizeof(file_size), 0);
-        
-        if (file_size > 0) {
-            // Create file in current directory
-            file = fopen(filename, "wb");
-            if (file != NULL) {
-                long total_received = 0;
-                while (total_received < file_size) {
-                    bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
-                    if (bytes_received <= 0) break;
-                    fwrite(buffer, 1, bytes_received, file);
-                    total_received += bytes_received;
-                }
-                fclose(file);
-                printf("File '%s' downloaded successfully\n", filename);
-            } else {
-                printf("Error: Cannot create file '%s'\n", filename);
-            }
+    }
+    if (!direct_transfers && s25_downlf(conn, file_pointers, file_count, NULL, downlf_done, NULL) == NULL) {
+        printf("Download failed: could not queue request\n");
+        return;
+    }
+    s25_loop_run(loop);
+}
+
+// Function to report the result of a removef operation
+void removef_done(s25_op* op, int status, void* user_data) {
+    (void)op;
+    (void)user_data;
+    
+    if (status == S25_OK) {
+        printf("File deletion completed successfully\n");
+    } else {
+        print_failure("File deletion failed", op, status);
+    }
+}
+
+// Function to handle removef command
+void handle_removef_command(s25_loop* loop, s25_conn* conn, char* command) {
+    char* token;
+    char filenames[2][MAX_PATH];
+    const char* file_pointers[2];
+    int file_count = 0;
+    
+    // Parse command
+    token = strtok(command, " ");
+    token = strtok(NULL, " "); // Skip "removef"
+    
+    while (token != NULL && file_count < 2) {
+        strcpy(filenames[file_count], token);
+        file_pointers[file_count] = filenames[file_count];
+        file_count++;
+        token = strtok(NULL, " ");
+    }
+    
+    if (s25_removef(conn, file_pointers, file_count, removef_done, NULL) == NULL) {
+        printf("File deletion failed: could not queue request\n");
+        return;
+    }
+    s25_loop_run(loop);
+}
+
+// Function to report every file of a purgef operation, then its result
+void purgef_done(s25_op* op, int status, void* user_data) {
+    int deleted = 0;
+    (void)user_data;
+    
+    for (int i = 0; i < s25_op_file_count(op); i++) {
+        int file_status = s25_op_file_status(op, i);
+        if (file_status == S25_OK) {
+            deleted++;
+            printf("  deleted %s\n", s25_op_file_name(op, i));
         } else {
-            printf("Error: File '%s' not found on server\n", filename);
+            printf("  %s: %s\n", s25_op_file_name(op, i), s25_strerror(file_status));
         }
     }
     
-    // Receive final response
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(server_socket, buffer, BUFFER_SIZE, 0);
-    
-    if (strcmp(buffer, "DOWNLOAD_COMPLETE") == 0) {
-        printf("Download completed successfully\n");
+    if (status == S25_OK) {
+        printf("Bulk deletion completed successfully: %d files deleted\n", deleted);
     } else {
-        printf("Download failed: %s\n", buffer);
+        printf("%d files deleted\n", deleted);
+        print_failure("Bulk deletion failed", op, status);
     }
 }
 
-// Function to handle removef command
-void handle_removef_command(int server_socket, char* command) {
-    char buffer[BUFFER_SIZE];
+// Function to add the paths listed in a local file, one per line, to a purgef request
+int read_path_list(const char* list_path, char*** paths, int* count, int* capacity) {
+    char line[MAX_PATH];
+    FILE* list = fopen(list_path, "r");
+    if (list == NULL) {
+        perror(list_path);
+        return -1;
+    }
+    
+    while (fgets(line, sizeof(line), list) != NULL) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == '\0') continue;
+        if (*count == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 64;
+            char** grown = realloc(*paths, *capacity * sizeof(char*));
+            if (grown == NULL) break;
+            *paths = grown;
+        }
+        if (((*paths)[*count] = strdup(line)) != NULL) (*count)++;
+    }
+    fclose(list);
+    return 0;
+}
+
+// Function to handle purgef command
+void handle_purgef_command(s25_loop* loop, s25_conn* conn, char* command) {
+    char** paths = NULL;
+    int count = 0;
+    int capacity = 0;
+    
+    // Paths and patterns are sent as written; "@file" adds the paths listed in a local file
+    strtok(command, " "); // Skip "purgef"
+    for (char* token = strtok(NULL, " "); token != NULL; token = strtok(NULL, " ")) {
+        if (token[0] == '@') {
+            if (read_path_list(token + 1, &paths, &count, &capacity) < 0) break;
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char** grown = realloc(paths, capacity * sizeof(char*));
+            if (grown == NULL) break;
+            paths = grown;
+        }
+        if ((paths[count] = strdup(token)) != NULL) count++;
+    }
     
-    // Send command to server
-    send(server_socket, command, strlen(command), 0);
+    if (count == 0 || s25_purgef(conn, (const char* const*)paths, count, purgef_done, NULL) == NULL) {
+        printf("Bulk deletion failed: could not queue request\n");
+    } else {
+        s25_loop_run(loop);
+    }
+    for (int i = 0; i < count; i++) free(paths[i]);
+    free(paths);
+}
+
+// Function to report the result of a copyf or movef operation
+void copyf_done(s25_op* op, int status, void* user_data) {
+    const char* verb = user_data;
     
-    // Receive response
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(server_socket, buffer, BUFFER_SIZE, 0);
+    if (status == S25_OK) {
+        printf("File %s successfully: %s\n", verb, s25_op_file_name(op, 0));
+    } else {
+        print_failure(strcmp(verb, "moved") == 0 ? "File move failed" : "File copy failed", op, status);
+    }
+}
+
+// Function to handle copyf and movef commands
+void handle_copyf_command(s25_loop* loop, s25_conn* conn, char* command) {
+    // Parse command
+    char* name = strtok(command, " ");
+    char* source = strtok(NULL, " ");
+    char* destination = strtok(NULL, " ");
+    int move = strcmp(name, "movef") == 0;
+    
+    s25_op* op = move ? s25_movef(conn, source, destination, copyf_done, (void*)"moved") :
+                        s25_copyf(conn, source, destination, copyf_done, (void*)"copied");
+    if (op == NULL) {
+        printf("File %s failed: could not queue request\n", move ? "move" : "copy");
+        return;
+    }
+    s25_loop_run(loop);
+}
+
+// Function to report the result of a downltar operation
+void downltar_done(s25_op* op, int status, void* user_data) {
+    (void)user_data;
+    
+    if (s25_op_file_status(op, 0) == S25_OK) {
+        printf("Tar file '%s' downloaded successfully\n", s25_op_file_name(op, 0));
+    } else if (s25_op_file_status(op, 0) == S25_ERR_IO) {
+        printf("Error: Cannot create tar file '%s'\n", s25_op_file_name(op, 0));
+    } else if (status != S25_ERR_BUSY) {
+        printf("Error: Tar file creation failed on server\n");
+    }
     
-    if (strcmp(buffer, "DELETE_COMPLETE") == 0) {
-        printf("File deletion completed successfully\n");
+    if (status == S25_OK) {
+        printf("Tar download completed successfully\n");
     } else {
-        printf("File deletion failed: %s\n", buffer);
+        print_failure("Tar download failed", op, status);
     }
 }
 
 // Function to handle downltar command
-void handle_downltar_command(int server_socket, char* command) {
-    char buffer[BUFFER_SIZE];
-    long file_size;
-    FILE* file;
-    int bytes_received;
+void handle_downltar_command(s25_loop* loop, s25_conn* conn, char* command) {
     char* token;
-    char filetype[10];
-    char tar_filename[20];
     
     // Parse command
     token = strtok(command, " ");
     token = strtok(NULL, " "); // Skip "downltar"
-    strcpy(filetype, token);
-    
-    // Determine tar filename
-    if (strcmp(filetype, ".c") == 0) {
-        strcpy(tar_filename, "cfiles.tar");
-    } else if (strcmp(filetype, ".pdf") == 0) {
-        strcpy(tar_filename, "pdf.tar");
-    } else if (strcmp(filetype, ".txt") == 0) {
-        strcpy(tar_filename, "text.tar");
-    }
-    
-    // Send command to server
-    send(server_socket, command, strlen(command), 0);
-    
-    // Receive file size from server
-    recv(server_socket, &file_size, sizeof(file_size), 0);
-    
-    if (file_size > 0) {
-        // Create tar file in current directory
-        file = fopen(tar_filename, "wb");
-        if (file != NULL) {
-            long total_received = 0;
-            while (total_received < file_size) {
-                bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
-                if (bytes_received <= 0) break;
-                fwrite(buffer, 1, bytes_received, file);
-                total_received += bytes_received;
-            }
-            fclose(file);
-            printf("Tar file '%s' downloaded successfully\n", tar_filename);
-        } else {
-            printf("Error: Cannot create tar file '%s'\n", tar_filename);
-        }
-    } else {
-        printf("Error: Tar file creation failed on server\n");
-    }
     
-    // Receive final response
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(server_socket, buffer, BUFFER_SIZE, 0);
+    if (s25_downltar(conn, token, NULL, downltar_done, NULL) == NULL) {
+        printf("Tar download failed: could not queue request\n");
+        return;
+    }
+    s25_loop_run(loop);
+}
+
+// Function to print the result of a dispfnames operation
+void dispfnames_done(s25_op* op, int status, void* user_data) {
+    (void)user_data;
     
-    if (strcmp(buffer, "TAR_COMPLETE") == 0) {
-        printf("Tar download completed successfully\n");
-    } else {
-        printf("Tar download failed: %s\n", buffer);
+    if (status != S25_OK) {
+        print_failure("Listing failed", op, status);
+        return;
     }
+    printf("Files in the specified directory:\n");
+    printf("%s", s25_op_message(op));
 }
 
 // Function to handle dispfnames command
-void handle_dispfnames_command(int server_socket, char* command) {
-    char buffer[BUFFER_SIZE];
+void handle_dispfnames_command(s25_loop* loop, s25_conn* conn, char* command) {
+    char* token;
     
-    // Send command to server
-    send(server_socket, command, strlen(command), 0);
+    // Parse command
+    token = strtok(command, " ");
+    token = strtok(NULL, " "); // Skip "dispfnames"
     
-    // Receive file list from server
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(server_socket, buffer, BUFFER_SIZE, 0);
+    if (s25_dispfnames(conn, token, dispfnames_done, NULL) == NULL) {
+        printf("Listing failed: could not queue request\n");
+        return;
+    }
+    s25_loop_run(loop);
+}
+
+// Function to print the result of a stats operation
+void stats_done(s25_op* op, int status, void* user_data) {
+    (void)user_data;
     
-    printf("Files in the specified directory:\n");
-    printf("%s", buffer);
+    if (status != S25_OK) {
+        print_failure("Stats failed", op, status);
+        return;
+    }
+    printf("%s", s25_op_message(op));
+}
+
+// Function to handle stats command
+void handle_stats_command(s25_loop* loop, s25_conn* conn) {
+    if (s25_stats(conn, stats_done, NULL) == NULL) {
+        printf("Stats failed: could not queue request\n");
+        return;
+    }
+    s25_loop_run(loop);
+}
+
+// Function to save the Chrome trace returned by a trace operation
+void trace_done(s25_op* op, int status, void* user_data) {
+    const char* output_path = user_data;
+    
+    if (status != S25_OK) {
+        print_failure("Trace failed", op, status);
+        return;
+    }
+    
+    FILE* output = fopen(output_path, "w");
+    if (output == NULL) {
+        printf("Trace failed: cannot create %s\n", output_path);
+        return;
+    }
+    fputs(s25_op_message(op), output);
+    fclose(output);
+    printf("Trace written to %s (open it in chrome://tracing or Perfetto)\n", output_path);
+}
+
+// Function to handle trace command
+void handle_trace_command(s25_loop* loop, s25_conn* conn, char* command) {
+    char* token;
+    
+    // Parse command
+    token = strtok(command, " ");
+    token = strtok(NULL, " "); // Skip "trace"
+    
+    if (s25_trace(conn, trace_done, token ? token : "s25trace.json") == NULL) {
+        printf("Trace failed: could not queue request\n");
+        return;
+    }
+    s25_loop_run(loop);
+}
+
+// Function to record the outcome of the connection attempt
+void connect_done(s25_conn* conn, int status, void* user_data) {
+    (void)conn;
+    *(int*)user_data = status;
 }
 
 int main() {
-    int server_socket;
+    s25_loop* loop;
+    s25_conn* conn;
+    int connect_status = S25_ERR_CONNECT;
     char command[MAX_COMMAND];
     
     printf("s25client - Distributed File System Client\n");
@@ -393,15 +586,30 @@ int main() {
     printf("  uploadf filename1 filename2 filename3 destination_path\n");
     printf("  downlf filename1 filename2\n");
     printf("  removef filename1 filename2\n");
-    printf("  downltar filetype (.c/.pdf/.txt)\n");
+    printf("  copyf source destination\n");
+    printf("  movef source destination\n");
+    printf("  purgef path_or_pattern... (or @listfile)\n");
+    printf("  downltar filetype (.c/.pdf/.txt/.zip, or all)\n");
     printf("  dispfnames pathname\n");
+    printf("  stats\n");
+    printf("  trace [output_file]\n");
     printf("  quit\n");
     printf("Enter 'quit' to exit\n\n");
     
-    // Connect to S1 server
-    server_socket = connect_to_server();
-    if (server_socket < 0) {
+    direct_transfers = get_config_long("S25_DIRECT", 0) != 0;
+    
+    // Connect to S1 server, over its AF_UNIX socket when S25_SOCKET_DIR names one
+    char local_path[256];
+    const char* host = local_socket_path("S1", local_path, sizeof(local_path));
+    loop = s25_loop_new();
+    conn = loop ? s25_connect(loop, host ? host : "127.0.0.1", get_config_long("S25_S1_PORT", SERVER_PORT), connect_done, &connect_status) : NULL;
+    if (conn != NULL) {
+        s25_loop_run(loop);
+    }
+    if (connect_status != S25_OK) {
+        perror("Connection to S1 failed");
         printf("Failed to connect to S1 server. Make sure S1 is running.\n");
+        s25_loop_free(loop);
         return 1;
     }
     
@@ -420,7 +628,6 @@ int main() {
         
         // Check for quit command
         if (strcmp(command, "quit") == 0) {
-            send(server_socket, command, strlen(command), 0);
             printf("Disconnecting from server...\n");
             break;
         }
@@ -433,15 +640,23 @@ int main() {
         
         // Process command based on first word
         if (strncmp(command, "uploadf", 7) == 0) {
-            handle_uploadf_command(server_socket, command);
+            handle_uploadf_command(loop, conn, command);
         } else if (strncmp(command, "downlf", 6) == 0) {
-            handle_downlf_command(server_socket, command);
+            handle_downlf_command(loop, conn, command);
         } else if (strncmp(command, "removef", 7) == 0) {
-            handle_removef_command(server_socket, command);
+            handle_removef_command(loop, conn, command);
+        } else if (strncmp(command, "copyf", 5) == 0 || strncmp(command, "movef", 5) == 0) {
+            handle_copyf_command(loop, conn, command);
+        } else if (strncmp(command, "purgef", 6) == 0) {
+            handle_purgef_command(loop, conn, command);
         } else if (strncmp(command, "downltar", 8) == 0) {
-            handle_downltar_command(server_socket, command);
+            handle_downltar_command(loop, conn, command);
         } else if (strncmp(command, "dispfnames", 10) == 0) {
-            handle_dispfnames_command(server_socket, command);
+            handle_dispfnames_command(loop, conn, command);
+        } else if (strcmp(command, "stats") == 0) {
+            handle_stats_command(loop, conn);
+        } else if (strncmp(command, "trace", 5) == 0) {
+            handle_trace_command(loop, conn, command);
         } else {
             printf("Unknown command. Type 'quit' to exit.\n");
         }
@@ -449,6 +664,7 @@ int main() {
         printf("s25client$ ");
     }
     
-    close(server_socket);
+    s25_conn_close(conn);
+    s25_loop_free(loop);
     return 0;
 }
@@ -0,0 +1,540 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "s25common.h"
+#include "s25pool.h"
+
+// Function to send a whole buffer, retrying on short writes
+int send_all(int sock, const void* data, size_t length) {
+    const char* cursor = data;
+
+    while (length > 0) {
+        ssize_t sent = send(sock, cursor, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        cursor += sent;
+        length -= sent;
+    }
+
+    return 0;
+}
+
+// Function to receive exactly length bytes
+int recv_all(int sock, void* data, size_t length) {
+    char* cursor = data;
+
+    while (length > 0) {
+        ssize_t received = recv(sock, cursor, length, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return -1;
+        cursor += received;
+        length -= received;
+    }
+
+    return 0;
+}
+
+// Function to send a framed text message
+int send_message(int sock, const char* message) {
+    size_t length = strlen(message);
+    uint32_t header = htonl((uint32_t)length);
+    struct iovec parts[2] = { { &header, sizeof(header) }, { (char*)message, length } };
+
+    return send_parts(sock, parts, 2, 0);
+}
+
+// Function to receive a framed text message into a NUL-terminated buffer
+int recv_message(int sock, char* buffer, size_t buffer_size) {
+    uint32_t header;
+
+    if (recv_all(sock, &header, sizeof(header)) < 0) return -1;
+
+    size_t length = ntohl(header);
+    if (length > S25_MAX_FRAME) return -1;
+
+    // Keep what fits, discard the rest so the stream stays in sync
+    size_t kept = length < buffer_size - 1 ? length : buffer_size - 1;
+    if (recv_all(sock, buffer, kept) < 0) return -1;
+    buffer[kept] = '\0';
+
+    if (drain_bytes(sock, (long)(length - kept)) < 0) return -1;
+    return (int)kept;
+}
+
+// Function to send a file size header
+int send_size(int sock, long size) {
+    return send_all(sock, &size, sizeof(size));
+}
+
+// Function to send every byte of several buffers, in one sendmsg() unless the socket takes less; more sets MSG_MORE
+int send_parts(int sock, struct iovec* parts, int count, int more) {
+    struct msghdr message = { 0 };
+
+    message.msg_iov = parts;
+    message.msg_iovlen = count;
+    while (message.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(sock, &message, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0) return -1;
+
+        // Skip what went out, including a partly sent buffer (the caller's array is updated)
+        while (message.msg_iovlen > 0 && (size_t)sent >= message.msg_iov->iov_len) {
+            sent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0) {
+            message.msg_iov->iov_base = (char*)message.msg_iov->iov_base + sent;
+            message.msg_iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+// Function to start collecting frames for a socket
+void batch_start(struct send_batch* batch, int sock) {
+    batch->sock = sock;
+    batch->length = 0;
+}
+
+// Function to add bytes to a batch, sending what is queued first if they do not fit
+static int batch_add(struct send_batch* batch, const void* data, size_t length) {
+    if (batch->length + length > sizeof(batch->data)) {
+        if (batch_flush(batch, NULL, 0, 1) < 0) return -1;
+        if (length > sizeof(batch->data)) return send_all(batch->sock, data, length);
+    }
+    memcpy(batch->data + batch->length, data, length);
+    batch->length += length;
+    return 0;
+}
+
+// Function to add a framed text message to a batch, sending what is queued first if it does not fit
+int batch_message(struct send_batch* batch, const char* message) {
+    size_t length = strlen(message);
+    uint32_t header = htonl((uint32_t)length);
+
+    if (batch->length + sizeof(header) + length > sizeof(batch->data) && batch_flush(batch, NULL, 0, 1) < 0) return -1;
+    if (batch_add(batch, &header, sizeof(header)) < 0) return -1;
+    return batch_add(batch, message, length);
+}
+
+// Function to add a file size header to a batch
+int batch_size(struct send_batch* batch, long size) {
+    return batch_add(batch, &size, sizeof(size));
+}
+
+// Function to send the batch followed by length bytes of payload (NULL for none); more sets MSG_MORE
+int batch_flush(struct send_batch* batch, const void* payload, size_t length, int more) {
+    struct iovec parts[2] = { { batch->data, batch->length }, { (void*)payload, payload ? length : 0 } };
+    size_t queued = batch->length;
+
+    batch->length = 0;
+    if (queued == 0 && parts[1].iov_len == 0) return 0;
+    return send_parts(batch->sock, queued ? parts : parts + 1, queued ? 2 : 1, more);
+}
+
+// Function to send small writes at once instead of waiting to coalesce them (TCP only; fails harmlessly otherwise)
+int set_nodelay(int sock) {
+    int on = 1;
+    return setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+// Function to hold back partial segments while on; turning it off sends them (TCP only; fails harmlessly otherwise)
+int set_cork(int sock, int on) {
+    return setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+// Function to receive a file size header
+int recv_size(int sock, long* size) {
+    return recv_all(sock, size, sizeof(*size));
+}
+
+// Function to send a file size header with open descriptors attached (AF_UNIX only)
+int send_size_fds(int sock, long size, const int* fds, int count) {
+    char control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+    struct iovec data = { &size, sizeof(size) };
+    struct msghdr message = { 0 };
+
+    if (count < 1 || count > MAX_PASSED_FDS) return -1;
+    memset(control, 0, sizeof(control));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(header), fds, count * sizeof(int));
+
+    ssize_t sent;
+    while ((sent = sendmsg(sock, &message, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    if (sent < 0) return -1;
+    return send_all(sock, (char*)&size + sent, sizeof(size) - sent);
+}
+
+// Function to receive a file size header and up to max descriptors sent with it; how many came, or -1
+int recv_size_fds(int sock, long* size, int* fds, int max) {
+    char control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+    struct iovec data = { size, sizeof(*size) };
+    struct msghdr message = { 0 };
+    int count = 0;
+
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t received;
+    while ((received = recvmsg(sock, &message, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (received <= 0) return -1;
+
+    for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) continue;
+        int passed = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < passed; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            if (count < max) {
+                fds[count++] = fd;
+            } else {
+                close(fd);
+            }
+        }
+    }
+    if (recv_all(sock, (char*)size + received, sizeof(*size) - received) < 0) {
+        for (int i = 0; i < count; i++) close(fds[i]);
+        return -1;
+    }
+    return count;
+}
+
+// Function to discard length bytes from a socket
+int drain_bytes(int sock, long length) {
+    size_t buffer_size = pool_io_size();
+    char* buffer = pool_get(buffer_size);
+    int result = buffer != NULL ? 0 : -1;
+
+    while (result == 0 && length > 0) {
+        size_t chunk = length < (long)buffer_size ? (size_t)length : buffer_size;
+        if (recv_all(sock, buffer, chunk) < 0) result = -1;
+        length -= chunk;
+    }
+
+    pool_put(buffer, buffer_size);
+    return result;
+}
+
+// Function to send a BUSY frame with a retry hint in milliseconds
+int send_busy(int sock, long retry_after_ms) {
+    char message[64];
+
+    snprintf(message, sizeof(message), "BUSY retry-after=%ld", retry_after_ms);
+    return send_message(sock, message);
+}
+
+// Function to get the retry hint of a BUSY frame; -1 if the message is not one
+long parse_busy(const char* message) {
+    long retry_after_ms;
+
+    if (sscanf(message, "BUSY retry-after=%ld", &retry_after_ms) != 1 || retry_after_ms < 0) return -1;
+    return retry_after_ms;
+}
+
+// Function to connect to a local server, giving up after timeout_ms (<= 0 waits as long as connect() does)
+int connect_local(int port, int timeout_ms) {
+    struct sockaddr_in address;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (timeout_ms > 0) fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+    if (connect(sock, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        if (timeout_ms <= 0 || errno != EINPROGRESS) {
+            close(sock);
+            return -1;
+        }
+
+        // Wait for the handshake; a full backlog on a hung server shows up here
+        struct pollfd pending = { sock, POLLOUT, 0 };
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        int ready;
+        while ((ready = poll(&pending, 1, timeout_ms)) < 0 && errno == EINTR);
+        if (ready <= 0 || getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0 || error != 0) {
+            errno = ready == 0 ? ETIMEDOUT : error;
+            close(sock);
+            return -1;
+        }
+    }
+
+    fcntl(sock, F_SETFL, flags);
+    set_nodelay(sock);
+    return sock;
+}
+
+// Function to get the AF_UNIX path of a server ("<S25_SOCKET_DIR>/S2.sock"); NULL if not configured
+const char* local_socket_path(const char* server, char* buffer, size_t buffer_size) {
+    const char* directory = get_config_string("S25_SOCKET_DIR", "");
+
+    if (directory[0] == '\0') return NULL;
+    snprintf(buffer, buffer_size, "%s/%s.sock", directory, server);
+    return buffer;
+}
+
+// Function to listen on an AF_UNIX stream socket, replacing a stale one; -1 on failure
+int listen_local_socket(const char* path, int backlog) {
+    struct sockaddr_un address;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    unlink(path);
+    if (bind(sock, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(sock, backlog) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Function to connect to an AF_UNIX stream socket without waiting on a full backlog; -1 on failure
+int connect_local_socket(const char* path) {
+    struct sockaddr_un address;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+    if (connect(sock, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFL, flags);
+    return sock;
+}
+
+// Function to check whether a socket is an AF_UNIX one
+int is_local_socket(int sock) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+
+    return getsockname(sock, (struct sockaddr*)&address, &length) == 0 && address.ss_family == AF_UNIX;
+}
+
+// Function to make blocking sends and receives on a socket fail after timeout_ms without progress
+int set_socket_timeout(int sock, int timeout_ms) {
+    struct timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+
+    if (timeout_ms <= 0) return 0;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) return -1;
+    return setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Function to get a socket's SO_RCVTIMEO or SO_SNDTIMEO in milliseconds; -1 if there is none
+int get_socket_timeout(int sock, int option) {
+    struct timeval timeout;
+    socklen_t length = sizeof(timeout);
+
+    if (getsockopt(sock, SOL_SOCKET, option, &timeout, &length) < 0) return -1;
+    if (timeout.tv_sec == 0 && timeout.tv_usec == 0) return -1;
+    return timeout.tv_sec * 1000 + (timeout.tv_usec + 999) / 1000;
+}
+
+// Function to read an integer setting, falling back to default_value
+long get_config_long(const char* name, long default_value) {
+    const char* value = getenv(name);
+    char* end;
+
+    if (value == NULL || *value == '\0') return default_value;
+
+    long parsed = strtol(value, &end, 10);
+    if (*end != '\0') {
+        fprintf(stderr, "Ignoring invalid %s=%s\n", name, value);
+        return default_value;
+    }
+    return parsed;
+}
+
+// Function to read a string setting, falling back to default_value
+const char* get_config_string(const char* name, const char* default_value) {
+    const char* value = getenv(name);
+    return value != NULL && *value != '\0' ? value : default_value;
+}
+
+// Function to read a fractional setting such as a sampling rate
+double get_config_double(const char* name, double default_value) {
+    const char* value = getenv(name);
+    char* end;
+
+    if (value == NULL || *value == '\0') return default_value;
+
+    double parsed = strtod(value, &end);
+    if (*end != '\0') {
+        fprintf(stderr, "Ignoring invalid %s=%s\n", name, value);
+        return default_value;
+    }
+    return parsed;
+}
+
+// Function to get the wall clock in microseconds
+long long wall_clock_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Function to scramble a 64-bit value (splitmix64 finaliser)
+static uint64_t mix64(uint64_t value) {
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+// Function to create a new random request ID
+uint64_t new_request_id(void) {
+    static uint64_t counter;
+    uint64_t id;
+
+    do {
+        uint64_t sequence = __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+        id = mix64((uint64_t)wall_clock_us() ^ ((uint64_t)getpid() << 40) ^ (sequence * 0x9e3779b97f4a7c15ULL));
+    } while (id == 0);
+    return id;
+}
+
+// Function to decide whether a request is traced at the given rate (0..1)
+int request_sampled(uint64_t id, double rate) {
+    if (rate <= 0) return 0;
+    if (rate >= 1) return 1;
+    return (mix64(id) % 1000000) < (uint64_t)(rate * 1000000);
+}
+
+// Function to write "rid=...:... " for context, stamped with the current time
+int format_request_prefix(char* buffer, size_t buffer_size, const struct request_context* context) {
+    return snprintf(buffer, buffer_size, "rid=%016llx:%d:%lld ",
+                    (unsigned long long)context->id, context->sampled ? 1 : 0, wall_clock_us());
+}
+
+// Function to strip a request prefix; context->id is 0 if there was none
+char* parse_request_prefix(char* frame, struct request_context* context) {
+    unsigned long long id;
+    int sampled;
+    long long sent_us;
+    int consumed = 0;
+
+    memset(context, 0, sizeof(*context));
+    if (strncmp(frame, "rid=", 4) != 0) return frame;
+    if (sscanf(frame, "rid=%16llx:%d:%lld %n", &id, &sampled, &sent_us, &consumed) < 3 || consumed == 0) {
+        return frame;
+    }
+
+    context->id = id;
+    context->sampled = sampled;
+    context->sent_us = sent_us;
+    return frame + consumed;
+}
+
+// Function to extend a CRC-32 (IEEE) with more data; start with crc = 0
+uint32_t crc32_update(uint32_t crc, const void* data, size_t length) {
+    static uint32_t table[256];
+    static int table_ready;
+    const unsigned char* bytes = data;
+
+    if (!__atomic_load_n(&table_ready, __ATOMIC_ACQUIRE)) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; bit++) value = (value >> 1) ^ (value & 1 ? 0xedb88320u : 0);
+            table[i] = value;
+        }
+        __atomic_store_n(&table_ready, 1, __ATOMIC_RELEASE);
+    }
+
+    crc = ~crc;
+    while (length--) crc = table[(crc ^ *bytes++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Function to check that an absolute path stays under root once ".", ".." and
+// symlinks are resolved; the part that does not exist yet is resolved lexically
+int path_within(const char* root, const char* path) {
+    char resolved_root[PATH_MAX];
+    char normal[PATH_MAX];
+    char resolved[PATH_MAX];
+    size_t length = 0;
+
+    if (path[0] != '/' || strlen(path) >= sizeof(normal) || realpath(root, resolved_root) == NULL) return 0;
+
+    // A path that exists is resolved the way the kernel will when it is opened or unlinked
+    if (realpath(path, resolved) == NULL) {
+        if (errno != ENOENT && errno != ENOTDIR) return 0;
+
+        // Otherwise drop "." and "//" and fold ".." first, so a missing directory cannot hide a climb out
+        const char* cursor = path;
+        while (*cursor != '\0') {
+            while (*cursor == '/') cursor++;
+            size_t part = strcspn(cursor, "/");
+            if (part == 0 || (part == 1 && cursor[0] == '.')) {
+                cursor += part;
+                continue;
+            }
+            if (part == 2 && cursor[0] == '.' && cursor[1] == '.') {
+                while (length > 0 && normal[length - 1] != '/') length--;
+                if (length > 0) length--;
+                cursor += part;
+                continue;
+            }
+            normal[length++] = '/';
+            memcpy(normal + length, cursor, part);
+            length += part;
+            cursor += part;
+        }
+        normal[length] = '\0';
+
+        // and resolve the longest prefix that exists; what is left cannot be a symlink
+        size_t existing = length;
+        while (existing == length || realpath(normal, resolved) == NULL) {
+            if (existing < length && errno != ENOENT && errno != ENOTDIR) return 0;
+            if (existing < length) normal[existing] = '/';
+            while (existing > 0 && normal[existing - 1] != '/') existing--;
+            if (existing <= 1) return 0;
+            normal[--existing] = '\0';
+        }
+        normal[existing] = '/';
+        if (strlen(resolved) + strlen(normal + existing) >= sizeof(resolved)) return 0;
+        if (strcmp(resolved, "/") == 0) resolved[0] = '\0';
+        strcat(resolved, normal + existing);
+    }
+
+    size_t root_length = strlen(resolved_root);
+    if (strcmp(resolved_root, "/") == 0) return 1;
+    return strncmp(resolved, resolved_root, root_length) == 0 &&
+           (resolved[root_length] == '/' || resolved[root_length] == '\0');
+}
@@ -0,0 +1,169 @@
+#ifndef S25COMMON_H
+#define S25COMMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Wire protocol shared by s25client, libs25, S1 and the storage servers.
+//
+// Every text message (commands, paths, status replies, file lists) is sent
+// as a frame: a 4-byte big-endian length followed by that many bytes.
+// File sizes are sent as a raw host-order long, followed by exactly that
+// many bytes of file data.  A negative size means "no data follows".
+#define S25_MAX_FRAME (1024 * 1024)
+
+// Function to send a whole buffer, retrying on short writes
+int send_all(int sock, const void* data, size_t length);
+
+// Function to receive exactly length bytes
+int recv_all(int sock, void* data, size_t length);
+
+// Function to send a framed text message
+int send_message(int sock, const char* message);
+
+// Function to receive a framed text message into a NUL-terminated buffer
+int recv_message(int sock, char* buffer, size_t buffer_size);
+
+// Function to send a file size header
+int send_size(int sock, long size);
+
+// Function to receive a file size header
+int recv_size(int sock, long* size);
+
+// Function to discard length bytes from a socket
+int drain_bytes(int sock, long length);
+
+// A logical message (a command and its arguments, a size and the data that
+// follows it) goes out in one sendmsg() rather than a send() per piece.
+// Sockets run with TCP_NODELAY, so each sendmsg() leaves at once; bulk
+// senders cork the socket (or pass MSG_MORE) so what they send in pieces
+// still fills whole segments.  A send_batch collects small frames and sizes
+// and sends them, with an optional payload, when flushed.
+#define SEND_BATCH_BYTES 4096
+
+struct send_batch {
+    int sock;
+    size_t length;
+    char data[SEND_BATCH_BYTES];
+};
+
+// Function to send every byte of several buffers, in one sendmsg() unless the socket takes less; more sets MSG_MORE
+int send_parts(int sock, struct iovec* parts, int count, int more);
+
+// Function to start collecting frames for a socket
+void batch_start(struct send_batch* batch, int sock);
+
+// Function to add a framed text message to a batch, sending what is queued first if it does not fit
+int batch_message(struct send_batch* batch, const char* message);
+
+// Function to add a file size header to a batch
+int batch_size(struct send_batch* batch, long size);
+
+// Function to send the batch followed by length bytes of payload (NULL for none); more sets MSG_MORE
+int batch_flush(struct send_batch* batch, const void* payload, size_t length, int more);
+
+// Function to send small writes at once instead of waiting to coalesce them (TCP only; fails harmlessly otherwise)
+int set_nodelay(int sock);
+
+// Function to hold back partial segments while on; turning it off sends them (TCP only; fails harmlessly otherwise)
+int set_cork(int sock, int on);
+
+// Over AF_UNIX, a size header may carry open descriptors (SCM_RIGHTS).
+// A storage server answers DOWNLOAD_FD that way: the size, with the file's
+// descriptor attached, then a raw long offset of the data in that file and
+// no data; the receiver sends the bytes itself.  Without a descriptor the
+// reply is an ordinary sized payload.  S1 sends an UPLOAD's size with a
+// shared-memory ring attached (see s25ring.h), and the data follows through
+// the ring instead of the socket.
+
+#define MAX_PASSED_FDS 4
+
+// Function to send a file size header with open descriptors attached (AF_UNIX only)
+int send_size_fds(int sock, long size, const int* fds, int count);
+
+// Function to receive a file size header and up to max descriptors sent with it; how many came, or -1
+int recv_size_fds(int sock, long* size, int* fds, int max);
+
+// An overloaded server answers with a BUSY frame, "BUSY retry-after=<ms>",
+// in place of the reply it would have sent.  Where the reply starts with a
+// size, the size is BUSY_SIZE and the BUSY frame follows it.
+#define BUSY_SIZE -2
+
+// Function to send a BUSY frame with a retry hint in milliseconds
+int send_busy(int sock, long retry_after_ms);
+
+// Function to get the retry hint of a BUSY frame; -1 if the message is not one
+long parse_busy(const char* message);
+
+// Function to connect to a local server, giving up after timeout_ms (<= 0 waits as long as connect() does)
+int connect_local(int port, int timeout_ms);
+
+// With S25_SOCKET_DIR set, every server also listens on <dir>/<server>.sock
+// and local peers prefer that over TCP loopback.
+
+// Function to get the AF_UNIX path of a server ("<S25_SOCKET_DIR>/S2.sock"); NULL if not configured
+const char* local_socket_path(const char* server, char* buffer, size_t buffer_size);
+
+// Function to listen on an AF_UNIX stream socket, replacing a stale one; -1 on failure
+int listen_local_socket(const char* path, int backlog);
+
+// Function to connect to an AF_UNIX stream socket without waiting on a full backlog; -1 on failure
+int connect_local_socket(const char* path);
+
+// Function to check whether a socket is an AF_UNIX one
+int is_local_socket(int sock);
+
+// Function to make blocking sends and receives on a socket fail after timeout_ms without progress
+int set_socket_timeout(int sock, int timeout_ms);
+
+// Function to get a socket's SO_RCVTIMEO or SO_SNDTIMEO in milliseconds; -1 if there is none
+int get_socket_timeout(int sock, int option);
+
+// Every command frame may start with a request context prefix
+//
+//   rid=<16 hex digits>:<sampled 0/1>:<sender wall clock in us> <command>
+//
+// s25client/libs25 pick the ID and the sampling decision; S1 forwards the
+// same ID to S2/S3/S4 so one request can be followed across servers.
+struct request_context {
+    uint64_t id;
+    int sampled;
+    long long sent_us;
+};
+
+// Function to get the wall clock in microseconds
+long long wall_clock_us(void);
+
+// Function to create a new random request ID
+uint64_t new_request_id(void);
+
+// Function to decide whether a request is traced at the given rate (0..1)
+int request_sampled(uint64_t id, double rate);
+
+// Function to write "rid=...:... " for context, stamped with the current time
+int format_request_prefix(char* buffer, size_t buffer_size, const struct request_context* context);
+
+// Function to strip a request prefix; context->id is 0 if there was none
+char* parse_request_prefix(char* frame, struct request_context* context);
+
+// Function to extend a CRC-32 (IEEE) with more data; start with crc = 0
+uint32_t crc32_update(uint32_t crc, const void* data, size_t length);
+
+// Function to check that an absolute path stays under root once ".", ".." and
+// symlinks are resolved; the part that does not exist yet is resolved lexically
+int path_within(const char* root, const char* path);
+
+// Settings are read from S25_* environment variables so that tests and
+// benchmarks can run several clusters side by side.
+
+// Function to read an integer setting, falling back to default_value
+long get_config_long(const char* name, long default_value);
+
+// Function to read a string setting, falling back to default_value
+const char* get_config_string(const char* name, const char* default_value);
+
+// Function to read a fractional setting such as a sampling rate
+double get_config_double(const char* name, double default_value);
+
+#endif
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+#include "s25direct.h"
+#include "s25common.h"
+
+// Outstanding grants a storage server keeps; expired ones are reused first
+#define MAX_GRANTS 256
+#define MAX_GRANT_PATH 256
+
+struct grant {
+    char token[DIRECT_TOKEN_SIZE];
+    int kind;
+    long size;
+    long long expires_us;
+    char path[MAX_GRANT_PATH];
+};
+
+static struct grant grants[MAX_GRANTS];
+static pthread_mutex_t grants_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to get a monotonic time in microseconds
+static long long now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Function to compare two strings in time that does not depend on where they differ
+static int same_secret(const char* a, const char* b) {
+    size_t a_length = strlen(a);
+    size_t b_length = strlen(b);
+    unsigned char difference = a_length != b_length;
+
+    for (size_t i = 0; i < a_length && i < b_length; i++) difference |= a[i] ^ b[i];
+    return difference == 0;
+}
+
+// Function to make a new random token (DIRECT_TOKEN_SIZE bytes with the NUL); -1 on failure
+int direct_new_token(char* token) {
+    unsigned char random_bytes[(DIRECT_TOKEN_SIZE - 1) / 2];
+
+    if (getrandom(random_bytes, sizeof(random_bytes), 0) != (ssize_t)sizeof(random_bytes)) return -1;
+    for (size_t i = 0; i < sizeof(random_bytes); i++) sprintf(token + 2 * i, "%02x", random_bytes[i]);
+    return 0;
+}
+
+// Function to get the secret S1 sends with GRANT; NULL if there is none
+const char* direct_secret(void) {
+    const char* secret = get_config_string("S25_DIRECT_SECRET", "");
+    return secret[0] != '\0' ? secret : NULL;
+}
+
+// Function to prove a connection to a storage server comes from S1 or another storage server; 0 if there is no secret
+int direct_authenticate(int sock) {
+    char frame[160];
+    const char* secret = direct_secret();
+
+    if (secret == NULL) return 0;
+    if (snprintf(frame, sizeof(frame), "AUTH %s", secret) >= (int)sizeof(frame)) return -1;
+    return send_message(sock, frame);
+}
+
+// Function to check the secret of an AUTH frame; any secret is fine when none is set
+int direct_authorized(const char* secret) {
+    const char* expected = direct_secret();
+    return expected == NULL || same_secret(secret, expected);
+}
+
+// Function to register a transfer a token allows; -1 if the secret is wrong or the table is full
+int direct_grant(const char* secret, const char* token, int kind, const char* path, long size) {
+    const char* expected = direct_secret();
+    long long now = now_us();
+    int slot = -1;
+
+    if (expected == NULL || !same_secret(secret, expected) || strlen(token) != DIRECT_TOKEN_SIZE - 1) return -1;
+
+    pthread_mutex_lock(&grants_lock);
+    for (int i = 0; i < MAX_GRANTS && slot < 0; i++) {
+        if (grants[i].expires_us <= now) slot = i;
+    }
+    if (slot >= 0) {
+        struct grant* grant = &grants[slot];
+        snprintf(grant->token, sizeof(grant->token), "%s", token);
+        snprintf(grant->path, sizeof(grant->path), "%s", path);
+        grant->kind = kind;
+        grant->size = size;
+        grant->expires_us = now + get_config_long("S25_DIRECT_TOKEN_MS", 10000) * 1000;
+    }
+    pthread_mutex_unlock(&grants_lock);
+    return slot >= 0 ? 0 : -1;
+}
+
+// Function to use up a token, getting the path and size it allows; -1 if unknown, expired or of another kind
+int direct_redeem(const char* token, int kind, char* path, size_t path_size, long* size) {
+    long long now = now_us();
+    int found = -1;
+
+    pthread_mutex_lock(&grants_lock);
+    for (int i = 0; i < MAX_GRANTS; i++) {
+        struct grant* grant = &grants[i];
+        if (grant->expires_us <= now || strcmp(grant->token, token) != 0) continue;
+
+        // A token is spent by its first use, even a wrong one
+        if (grant->kind == kind) {
+            snprintf(path, path_size, "%s", grant->path);
+            *size = grant->size;
+            found = 0;
+        }
+        grant->expires_us = 0;
+        break;
+    }
+    pthread_mutex_unlock(&grants_lock);
+    return found;
+}
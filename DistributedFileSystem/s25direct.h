@@ -0,0 +1,53 @@
+#ifndef S25DIRECT_H
+#define S25DIRECT_H
+
+#include <stddef.h>
+
+// Direct client-to-storage transfers.
+//
+// With S25_DIRECT=1, S1 only authorizes uploads and downloads.  A client
+// asks it "locate put <destination> <name> <size>" or "locate get <path>".
+// S1 picks the storage server and registers a single-use token for that one
+// transfer with it (GRANT).  Then it answers "REDIRECT <host> <port> <token>".
+// The client connects to that server itself and sends PUT or GET with the
+// token.  The bytes never pass through S1.  S1 answers "PROXY" for files it
+// serves itself (.c files, or everything while direct transfers are off),
+// and the client then uses uploadf/downlf as usual.
+//
+//   S25_DIRECT                   let S1 hand out tokens (default 0); clients
+//                                use the same setting to ask for them
+//   S25_DIRECT_SECRET            shared by S1 and S2-S4; a storage server only
+//                                takes GRANTs that carry it, and S1 will not
+//                                hand out tokens without one (no spaces)
+//
+// Clients reach the same listener S1 uses, so while a storage server has a
+// secret, a connection only gets PUT and GET until it sends "AUTH <secret>".
+// S1 and the storage servers send it first on every connection they open.
+//   S25_DIRECT_TOKEN_MS          how long a token stays valid (default 10000)
+//   S25_S2_HOST ... S25_S4_HOST  address S1 hands out for each storage server
+//                                (default 127.0.0.1); over S1's AF_UNIX
+//                                socket it hands out the server's socket path
+
+#define DIRECT_TOKEN_SIZE 33
+#define DIRECT_PUT 0
+#define DIRECT_GET 1
+
+// Function to make a new random token (DIRECT_TOKEN_SIZE bytes with the NUL); -1 on failure
+int direct_new_token(char* token);
+
+// Function to get the secret S1 sends with GRANT; NULL if there is none
+const char* direct_secret(void);
+
+// Function to prove a connection to a storage server comes from S1 or another storage server; 0 if there is no secret
+int direct_authenticate(int sock);
+
+// Function to check the secret of an AUTH frame; any secret is fine when none is set
+int direct_authorized(const char* secret);
+
+// Function to register a transfer a token allows; -1 if the secret is wrong or the table is full
+int direct_grant(const char* secret, const char* token, int kind, const char* path, long size);
+
+// Function to use up a token, getting the path and size it allows; -1 if unknown, expired or of another kind
+int direct_redeem(const char* token, int kind, char* path, size_t path_size, long* size);
+
+#endif
@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "s25durable.h"
+#include "s25common.h"
+#include "s25pool.h"
+
+#define COMMIT_SLOTS 64
+#define COMMIT_PATH 512
+
+enum { SLOT_FREE, SLOT_PENDING, SLOT_FLUSHING, SLOT_DONE };
+
+struct commit_slot {
+    int state;
+    int result;
+    char temp_path[COMMIT_PATH];
+    char final_path[COMMIT_PATH];
+};
+
+struct commit_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t work; // signalled when a slot becomes PENDING
+    pthread_cond_t done; // broadcast when slots become DONE or FREE
+    int pending;
+    struct commit_slot slots[COMMIT_SLOTS];
+};
+
+static int mode = DURABILITY_NONE;
+static long group_delay_us;
+static struct commit_queue* queue;
+
+// Function to fdatasync a file by path
+static int sync_file(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    int result = fdatasync(fd);
+    close(fd);
+    return result;
+}
+
+// Function to fsync the directory holding path so a rename survives a crash
+static int sync_parent_directory(const char* path) {
+    char directory[COMMIT_PATH];
+    snprintf(directory, sizeof(directory), "%s", path);
+
+    char* last_slash = strrchr(directory, '/');
+    if (last_slash == NULL) {
+        strcpy(directory, ".");
+    } else if (last_slash == directory) {
+        directory[1] = '\0';
+    } else {
+        *last_slash = '\0';
+    }
+
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return -1;
+
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+// Function to check whether two paths share a parent directory
+static int same_parent(const char* first, const char* second) {
+    const char* first_slash = strrchr(first, '/');
+    const char* second_slash = strrchr(second, '/');
+    size_t first_length = first_slash ? (size_t)(first_slash - first) : 0;
+    size_t second_length = second_slash ? (size_t)(second_slash - second) : 0;
+
+    return first_length == second_length && strncmp(first, second, first_length) == 0;
+}
+
+// Function to make everything written to the file systems of a batch durable with one syncfs() per file
+// system; files whose file system failed to sync get result -1
+static void sync_batch(struct commit_slot** entries, const int* fds, int count) {
+    dev_t devices[COMMIT_SLOTS];
+    int results[COMMIT_SLOTS];
+    int synced = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct stat info;
+        int known = -1;
+
+        if (entries[i]->result < 0) continue;
+        if (fstat(fds[i], &info) < 0) {
+            entries[i]->result = -1;
+            continue;
+        }
+        for (int j = 0; j < synced && known < 0; j++) {
+            if (devices[j] == info.st_dev) known = j;
+        }
+        if (known < 0) {
+            devices[synced] = info.st_dev;
+            results[synced] = syncfs(fds[i]);
+            known = synced++;
+        }
+        if (results[known] < 0) entries[i]->result = -1;
+    }
+}
+
+// Function to sync and publish every upload queued since the last batch
+static void* flusher_thread(void* argument) {
+    int batch[COMMIT_SLOTS];
+    (void)argument;
+
+    pthread_mutex_lock(&queue->lock);
+    while (1) {
+        while (queue->pending == 0) {
+            pthread_cond_wait(&queue->work, &queue->lock);
+        }
+
+        // Optionally linger so more concurrent uploads join this batch
+        if (group_delay_us > 0) {
+            pthread_mutex_unlock(&queue->lock);
+            usleep(group_delay_us);
+            pthread_mutex_lock(&queue->lock);
+        }
+
+        int count = 0;
+        for (int slot = 0; slot < COMMIT_SLOTS; slot++) {
+            if (queue->slots[slot].state == SLOT_PENDING) {
+                queue->slots[slot].state = SLOT_FLUSHING;
+                batch[count++] = slot;
+            }
+        }
+        queue->pending -= count;
+        pthread_mutex_unlock(&queue->lock);
+
+        // Writeback of every file starts at once; then one barrier makes all the data durable
+        struct commit_slot* entries[COMMIT_SLOTS];
+        int fds[COMMIT_SLOTS];
+        for (int i = 0; i < count; i++) {
+            entries[i] = &queue->slots[batch[i]];
+            fds[i] = open(entries[i]->temp_path, O_RDONLY);
+            entries[i]->result = fds[i] < 0 ? -1 : 0;
+            if (fds[i] >= 0) sync_file_range(fds[i], 0, 0, SYNC_FILE_RANGE_WRITE);
+        }
+        sync_batch(entries, fds, count);
+
+        // Renamed only once their data is durable, and a second barrier covers every directory they touched
+        for (int i = 0; i < count; i++) {
+            if (entries[i]->result == 0 && rename(entries[i]->temp_path, entries[i]->final_path) < 0) entries[i]->result = -1;
+            if (entries[i]->result < 0) remove(entries[i]->temp_path);
+        }
+        sync_batch(entries, fds, count);
+        for (int i = 0; i < count; i++) {
+            if (fds[i] >= 0) close(fds[i]);
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        for (int i = 0; i < count; i++) {
+            queue->slots[batch[i]].state = SLOT_DONE;
+        }
+        pthread_cond_broadcast(&queue->done);
+    }
+    return NULL;
+}
+
+// Function to set up the shared commit queue and its flusher thread
+static int start_group_commit(void) {
+    pthread_mutexattr_t mutex_attributes;
+    pthread_condattr_t cond_attributes;
+    pthread_t thread;
+
+    queue = mmap(NULL, sizeof(*queue), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (queue == MAP_FAILED) {
+        queue = NULL;
+        perror("Commit queue");
+        return -1;
+    }
+
+    pthread_mutexattr_init(&mutex_attributes);
+    pthread_mutexattr_setpshared(&mutex_attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&queue->lock, &mutex_attributes);
+    pthread_mutexattr_destroy(&mutex_attributes);
+
+    pthread_condattr_init(&cond_attributes);
+    pthread_condattr_setpshared(&cond_attributes, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&queue->work, &cond_attributes);
+    pthread_cond_init(&queue->done, &cond_attributes);
+    pthread_condattr_destroy(&cond_attributes);
+
+    if (pthread_create(&thread, NULL, flusher_thread, NULL) != 0) {
+        perror("Flusher thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Function to read S25_DURABILITY and start the flusher if needed; call before forking/threads
+int durable_init(void) {
+    const char* setting = get_config_string("S25_DURABILITY", "none");
+
+    group_delay_us = get_config_long("S25_GROUP_COMMIT_DELAY_US", 0);
+    if (strcmp(setting, "fsync") == 0) {
+        mode = DURABILITY_FSYNC;
+    } else if (strcmp(setting, "group") == 0) {
+        mode = DURABILITY_GROUP;
+        if (start_group_commit() < 0) {
+            printf("Group commit unavailable, falling back to per-file fsync\n");
+            mode = DURABILITY_FSYNC;
+        }
+    } else {
+        if (strcmp(setting, "none") != 0) {
+            fprintf(stderr, "Ignoring invalid S25_DURABILITY=%s\n", setting);
+        }
+        mode = DURABILITY_NONE;
+    }
+
+    printf("Upload durability: %s\n", mode == DURABILITY_GROUP ? "group commit" : mode == DURABILITY_FSYNC ? "fsync" : "none");
+    return 0;
+}
+
+// Function to get the configured durability mode
+int durable_mode(void) {
+    return mode;
+}
+
+// Function to build a hidden temporary path next to final_path
+int durable_temp_path(const char* final_path, char* temp_path, size_t temp_size) {
+    static unsigned long counter;
+    const char* last_slash = strrchr(final_path, '/');
+    int directory_length = last_slash ? (int)(last_slash - final_path) : 1;
+    const char* directory = last_slash ? final_path : ".";
+
+    // No file extension, so listings and tar patterns never pick it up
+    int length = snprintf(temp_path, temp_size, "%.*s/.s25tmp.%d.%d.%lu", directory_length, directory,
+                          (int)getpid(), (int)gettid(), __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED));
+    return length < 0 || (size_t)length >= temp_size ? -1 : 0;
+}
+
+// Function to queue a file for the flusher and wait for its batch
+static int group_publish(const char* temp_path, const char* final_path) {
+    struct commit_slot* entry = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    while (entry == NULL) {
+        for (int slot = 0; slot < COMMIT_SLOTS && entry == NULL; slot++) {
+            if (queue->slots[slot].state == SLOT_FREE) entry = &queue->slots[slot];
+        }
+        if (entry == NULL) pthread_cond_wait(&queue->done, &queue->lock);
+    }
+
+    snprintf(entry->temp_path, COMMIT_PATH, "%s", temp_path);
+    snprintf(entry->final_path, COMMIT_PATH, "%s", final_path);
+    entry->state = SLOT_PENDING;
+    queue->pending++;
+    pthread_cond_signal(&queue->work);
+
+    while (entry->state != SLOT_DONE) {
+        pthread_cond_wait(&queue->done, &queue->lock);
+    }
+    int result = entry->result;
+    entry->state = SLOT_FREE;
+    pthread_cond_broadcast(&queue->done);
+    pthread_mutex_unlock(&queue->lock);
+    return result;
+}
+
+// Function to publish a closed temporary file under final_path; removes it on failure
+int durable_publish(const char* temp_path, const char* final_path) {
+    if (strlen(temp_path) >= COMMIT_PATH || strlen(final_path) >= COMMIT_PATH) {
+        remove(temp_path);
+        return -1;
+    }
+
+    if (mode == DURABILITY_GROUP) {
+        return group_publish(temp_path, final_path);
+    }
+
+    if (mode == DURABILITY_FSYNC && sync_file(temp_path) < 0) {
+        remove(temp_path);
+        return -1;
+    }
+    if (rename(temp_path, final_path) < 0) {
+        remove(temp_path);
+        return -1;
+    }
+    if (mode == DURABILITY_FSYNC && sync_parent_directory(final_path) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to copy length bytes between files: a reflink if the file system shares
+// extents, else copy_file_range(), else read and write
+int durable_clone(int source_fd, int destination_fd, long length) {
+    size_t buffer_size = pool_io_size();
+    long copied = 0;
+
+    // A reflink shares the source's blocks, so the copy costs no data I/O at all
+    if (ioctl(destination_fd, FICLONE, source_fd) == 0) return 0;
+
+    // The kernel copies in place (server-side on network file systems), never through user space
+    while (copied < length) {
+        ssize_t moved = copy_file_range(source_fd, NULL, destination_fd, NULL, length - copied, 0);
+        if (moved < 0 && errno == EINTR) continue;
+        if (moved <= 0) break;
+        copied += moved;
+    }
+
+    // Older kernels and cross-file-system copies refuse copy_file_range
+    char* buffer = copied < length ? pool_get(buffer_size) : NULL;
+    if (copied < length && buffer == NULL) return -1;
+    while (copied < length) {
+        ssize_t got = pread(source_fd, buffer, length - copied < (long)buffer_size ? length - copied : (long)buffer_size,
+                            copied);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0 || pwrite(destination_fd, buffer, got, copied) != got) break;
+        copied += got;
+    }
+    pool_put(buffer, buffer_size);
+    return copied == length ? 0 : -1;
+}
+
+// Function to rename a file in place, syncing the directories unless S25_DURABILITY is none
+int durable_rename(const char* source_path, const char* final_path) {
+    if (rename(source_path, final_path) < 0) return -1;
+    if (mode == DURABILITY_NONE) return 0;
+
+    // The data is already durable; only the directory entries changed
+    if (sync_parent_directory(final_path) < 0) return -1;
+    if (!same_parent(source_path, final_path) && sync_parent_directory(source_path) < 0) return -1;
+    return 0;
+}
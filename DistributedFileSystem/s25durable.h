@@ -0,0 +1,51 @@
+#ifndef S25DURABLE_H
+#define S25DURABLE_H
+
+#include <stddef.h>
+
+// Atomic, optionally durable publishing of uploaded files.
+//
+// Uploads are written to a temporary file in the destination directory and
+// published with rename(), so readers see either the old file or the whole
+// new one.  S25_DURABILITY selects what happens before the upload is
+// acknowledged:
+//
+//   none   rename only; data reaches disk whenever the kernel writes it
+//   fsync  fdatasync the file, rename, fsync the directory (per upload)
+//   group  hand the file to a flusher thread that publishes every upload
+//          that arrived while the previous batch was flushing, then wakes
+//          all of their senders together: writeback of the whole batch,
+//          one syncfs() for its data, the renames, one syncfs() for the
+//          directories (two flushes per batch instead of two per file)
+//
+// The group queue lives in a MAP_SHARED mapping with process-shared locks,
+// so S1's forked children are served by the flusher in the parent.
+#define DURABILITY_NONE 0
+#define DURABILITY_FSYNC 1
+#define DURABILITY_GROUP 2
+
+// Function to read S25_DURABILITY and start the flusher if needed; call before forking/threads
+int durable_init(void);
+
+// Function to get the configured durability mode
+int durable_mode(void);
+
+// Function to build a hidden temporary path next to final_path
+int durable_temp_path(const char* final_path, char* temp_path, size_t temp_size);
+
+// Function to publish a closed temporary file under final_path; removes it on failure
+int durable_publish(const char* temp_path, const char* final_path);
+
+// Server-side copies and moves (copyf/movef) reuse the same publishing:
+// a copy is cloned into a temporary file and published with
+// durable_publish(), a move is a rename that leaves the source in place if
+// it fails.
+
+// Function to copy length bytes between files: a reflink if the file system shares
+// extents, else copy_file_range(), else read and write
+int durable_clone(int source_fd, int destination_fd, long length);
+
+// Function to rename a file in place, syncing the directories unless S25_DURABILITY is none
+int durable_rename(const char* source_path, const char* final_path);
+
+#endif
@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "s25engine.h"
+#include "s25common.h"
+#include "s25durable.h"
+#include "s25pack.h"
+#include "s25meta.h"
+#include "s25ingest.h"
+#include "s25pool.h"
+
+#define ENGINE_PATH 1024
+
+static int metadata;
+
+static const struct storage_engine file_engine;
+static const struct storage_engine log_engine;
+
+struct engine_stream {
+    FILE* file;
+    int fd;
+    struct ingest_writer* writer;
+    struct pack_writer* pack_writer;
+    struct pack_reader* pack_reader;
+    uint32_t checksum;
+    char temp_path[ENGINE_PATH];
+    char final_path[ENGINE_PATH];
+};
+
+// Function to create every missing directory above path
+static void make_parent_directories(const char* path) {
+    char directory[ENGINE_PATH];
+    snprintf(directory, sizeof(directory), "%s", path);
+
+    for (char* slash = strchr(directory + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(directory, 0755);
+        *slash = '/';
+    }
+}
+
+// Function to allocate an empty stream
+static struct engine_stream* new_stream(void) {
+    return calloc(1, sizeof(struct engine_stream));
+}
+
+// Function to start the file engine (small files optionally go to the pack store)
+static int file_init(const char* root) {
+    mkdir(root, 0755);
+    if (pack_init(root, get_config_long("S25_PACK_MAX_SIZE", 0)) < 0) {
+        printf("Pack store unavailable, storing every file separately\n");
+    }
+    metadata = meta_init(root) == 0;
+    if (!metadata) printf("Metadata unavailable, listing by walking the directories\n");
+    return 0;
+}
+
+// Function to start writing a file: packed if small enough, else a temporary file
+static struct engine_stream* file_create(const char* path, long size) {
+    struct engine_stream* stream = new_stream();
+    if (stream == NULL) return NULL;
+
+    snprintf(stream->final_path, sizeof(stream->final_path), "%s", path);
+    if (pack_max_file_size() > 0 && size <= pack_max_file_size() &&
+        (stream->pack_writer = pack_create(path, size, time(NULL))) != NULL) {
+        return stream;
+    }
+
+    // Write to a temporary file; it replaces path only once complete
+    make_parent_directories(path);
+    if (durable_temp_path(path, stream->temp_path, sizeof(stream->temp_path)) < 0 ||
+        (stream->fd = open(stream->temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        free(stream);
+        return NULL;
+    }
+    if ((stream->writer = ingest_open(stream->fd, size)) == NULL) {
+        close(stream->fd);
+        remove(stream->temp_path);
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+// Function to write the next part of a file
+static int file_write(struct engine_stream* stream, const void* data, size_t length) {
+    if (stream->pack_writer) return pack_write(stream->pack_writer, data, length);
+    stream->checksum = crc32_update(stream->checksum, data, length);
+    return ingest_write(stream->writer, data, length);
+}
+
+// Function to publish a written file
+static int file_commit(struct engine_stream* stream) {
+    int sync = durable_mode() != DURABILITY_NONE;
+    struct stat info;
+    int result;
+
+    if (stream->pack_writer) {
+        // Drop a file-per-object copy left from an earlier, larger version
+        result = pack_commit(stream->pack_writer, sync);
+        if (result == 0) {
+            meta_remove(stream->final_path, sync);
+            remove(stream->final_path);
+        }
+    } else {
+        int written = ingest_finish(stream->writer) == 0;
+        if (close(stream->fd) != 0 || !written || stat(stream->temp_path, &info) < 0) {
+            remove(stream->temp_path);
+            result = -1;
+        } else {
+            // Journaled first: recovery checks the path, so a crash before the rename is harmless
+            meta_update(stream->final_path, info.st_size, info.st_mtime, stream->checksum, sync);
+            result = durable_publish(stream->temp_path, stream->final_path);
+            if (result < 0) meta_refresh(stream->final_path);
+        }
+
+        // A packed older version would otherwise shadow the new file
+        if (result == 0) pack_delete(stream->final_path);
+    }
+    free(stream);
+    return result;
+}
+
+// Function to drop an unfinished file
+static void file_abort(struct engine_stream* stream) {
+    if (stream->pack_writer) {
+        pack_abort(stream->pack_writer);
+    } else {
+        ingest_abort(stream->writer);
+        close(stream->fd);
+        remove(stream->temp_path);
+    }
+    free(stream);
+}
+
+// Function to open a file for reading, packed or not
+static struct engine_stream* file_open(const char* path, long* size) {
+    struct engine_stream* stream = new_stream();
+    struct stat info;
+    if (stream == NULL) return NULL;
+
+    if ((stream->pack_reader = pack_open(path, size)) != NULL) return stream;
+
+    stream->file = fopen(path, "rb");
+    if (stream->file == NULL || fstat(fileno(stream->file), &info) < 0 || !S_ISREG(info.st_mode)) {
+        if (stream->file) fclose(stream->file);
+        free(stream);
+        return NULL;
+    }
+    *size = info.st_size;
+    return stream;
+}
+
+// Function to read the next part of a file
+static long file_read(struct engine_stream* stream, void* buffer, size_t length) {
+    if (stream->pack_reader) return pack_read(stream->pack_reader, buffer, length);
+
+    size_t got = fread(buffer, 1, length, stream->file);
+    return got == 0 && ferror(stream->file) ? -1 : (long)got;
+}
+
+// Function to close a reader
+static void file_close(struct engine_stream* stream) {
+    if (stream->pack_reader) {
+        pack_close(stream->pack_reader);
+    } else {
+        fclose(stream->file);
+    }
+    free(stream);
+}
+
+// Function to get the descriptor and offset a reader's remaining data starts at
+static int file_extent(struct engine_stream* stream, int* fd, long* offset) {
+    if (stream->pack_reader) return pack_extent(stream->pack_reader, fd, offset);
+
+    *fd = fileno(stream->file);
+    *offset = ftell(stream->file);
+    return *offset < 0 ? -1 : 0;
+}
+
+// Function to delete a file, packed or not
+static int file_remove(const char* path) {
+    if (pack_delete(path) == 0) return 0;
+
+    meta_remove(path, durable_mode() != DURABILITY_NONE);
+    if (remove(path) == 0) return 0;
+    meta_refresh(path);
+    return -1;
+}
+
+// Function to copy an object by reading it and writing it back, for objects in the pack store
+static int copy_through_engine(const struct storage_engine* engine, const char* source, const char* destination) {
+    size_t buffer_size = pool_io_size();
+    long size;
+    long copied = 0;
+    long got = 0;
+
+    struct engine_stream* reader = engine->open(source, &size);
+    if (reader == NULL) return -1;
+    struct engine_stream* writer = engine->create(destination, size);
+    char* buffer = writer != NULL ? pool_get(buffer_size) : NULL;
+    if (buffer == NULL) {
+        if (writer != NULL) engine->abort(writer);
+        engine->close(reader);
+        return -1;
+    }
+
+    while (copied < size && (got = engine->read(reader, buffer, buffer_size)) > 0) {
+        if (engine->write(writer, buffer, got) < 0) break;
+        copied += got;
+    }
+    engine->close(reader);
+    pool_put(buffer, buffer_size);
+    if (copied < size) {
+        engine->abort(writer);
+        return -1;
+    }
+    return engine->commit(writer);
+}
+
+// Function to copy a file: cloned into a temporary file on disk, or through the pack store if packed
+static int file_copy(const char* source, const char* destination) {
+    char temp_path[ENGINE_PATH];
+    struct stat info;
+
+    if (strcmp(source, destination) == 0) return 0;
+    if (pack_stat(source, NULL) >= 0) return copy_through_engine(&file_engine, source, destination);
+
+    int source_fd = open(source, O_RDONLY);
+    if (source_fd < 0 || fstat(source_fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+        if (source_fd >= 0) close(source_fd);
+        return -1;
+    }
+
+    make_parent_directories(destination);
+    int fd = durable_temp_path(destination, temp_path, sizeof(temp_path)) == 0 ?
+             open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    int copied = fd >= 0 && durable_clone(source_fd, fd, info.st_size) == 0;
+    close(source_fd);
+    if (fd < 0) return -1;
+    if (fstat(fd, &info) < 0) copied = 0;
+    if (close(fd) != 0 || !copied) {
+        remove(temp_path);
+        return -1;
+    }
+
+    // Journaled first, as on commit; the copy's checksum is the source's
+    meta_copy(source, destination, info.st_size, info.st_mtime, durable_mode() != DURABILITY_NONE);
+    if (durable_publish(temp_path, destination) < 0) {
+        meta_refresh(destination);
+        return -1;
+    }
+    pack_delete(destination);
+    return 0;
+}
+
+// Function to move a file: renamed on disk, or copied and deleted if packed
+static int file_move(const char* source, const char* destination) {
+    int sync = durable_mode() != DURABILITY_NONE;
+    struct stat info;
+
+    if (strcmp(source, destination) == 0) return 0;
+    if (pack_stat(source, NULL) >= 0) {
+        return copy_through_engine(&file_engine, source, destination) == 0 ? pack_delete(source) : -1;
+    }
+    if (lstat(source, &info) < 0 || !S_ISREG(info.st_mode)) return -1;
+
+    make_parent_directories(destination);
+    meta_copy(source, destination, info.st_size, info.st_mtime, sync);
+    meta_remove(source, sync);
+    if (durable_rename(source, destination) < 0) {
+        meta_refresh(source);
+        meta_refresh(destination);
+        return -1;
+    }
+    pack_delete(destination);
+    return 0;
+}
+
+// Function to visit the regular files in a directory (hidden names skipped)
+static void walk_directory(const char* directory, int recursive, engine_visit visit, void* user_data) {
+    char child[ENGINE_PATH];
+    struct dirent* entry;
+    struct stat info;
+
+    DIR* handle = opendir(directory);
+    if (handle == NULL) return;
+
+    while ((entry = readdir(handle)) != NULL) {
+        // Skips ".", "..", the pack store and in-progress uploads
+        if (entry->d_name[0] == '.') continue;
+
+        snprintf(child, sizeof(child), "%s/%s", directory, entry->d_name);
+        if (lstat(child, &info) < 0) continue;
+        if (S_ISREG(info.st_mode)) {
+            visit(child, info.st_size, info.st_mtime, user_data);
+        } else if (recursive && S_ISDIR(info.st_mode)) {
+            walk_directory(child, recursive, visit, user_data);
+        }
+    }
+    closedir(handle);
+}
+
+// Function to list files on disk (from the metadata snapshot if available) and in the pack store
+static void file_list(const char* directory, int recursive, engine_visit visit, void* user_data) {
+    if (!metadata || meta_list(directory, recursive, visit, user_data) < 0) {
+        walk_directory(directory, recursive, visit, user_data);
+    }
+    pack_list(directory, recursive, visit, user_data);
+}
+
+// Function to start the log engine: every file lives in the pack store
+static int log_init(const char* root) {
+    mkdir(root, 0755);
+    return pack_init(root, 0xffffffffL);
+}
+
+// Function to start writing a file into the log
+static struct engine_stream* log_create(const char* path, long size) {
+    struct engine_stream* stream = new_stream();
+    if (stream != NULL && (stream->pack_writer = pack_create(path, size, time(NULL))) == NULL) {
+        free(stream);
+        stream = NULL;
+    }
+    return stream;
+}
+
+// Function to publish a file written to the log
+static int log_commit(struct engine_stream* stream) {
+    int result = pack_commit(stream->pack_writer, durable_mode() != DURABILITY_NONE);
+    free(stream);
+    return result;
+}
+
+// Function to open a file in the log
+static struct engine_stream* log_open(const char* path, long* size) {
+    struct engine_stream* stream = new_stream();
+    if (stream != NULL && (stream->pack_reader = pack_open(path, size)) == NULL) {
+        free(stream);
+        stream = NULL;
+    }
+    return stream;
+}
+
+// Function to delete a file from the log
+static int log_remove(const char* path) {
+    return pack_delete(path);
+}
+
+// Function to copy a file within the log
+static int log_copy(const char* source, const char* destination) {
+    if (strcmp(source, destination) == 0) return 0;
+    return copy_through_engine(&log_engine, source, destination);
+}
+
+// Function to move a file within the log: a copy, then a tombstone for the source
+static int log_move(const char* source, const char* destination) {
+    if (strcmp(source, destination) == 0) return 0;
+    return copy_through_engine(&log_engine, source, destination) == 0 ? pack_delete(source) : -1;
+}
+
+static const struct storage_engine file_engine = {
+    "file", file_init, file_create, file_write, file_commit, file_abort,
+    file_open, file_read, file_close, file_remove, file_list, file_extent, file_copy, file_move,
+};
+
+// Streams of the log engine only ever hold pack handles, which the file functions handle
+static const struct storage_engine log_engine = {
+    "log", log_init, log_create, file_write, log_commit, file_abort,
+    log_open, file_read, file_close, log_remove, pack_list, file_extent, log_copy, log_move,
+};
+
+// Function to pick the engine named by S25_STORAGE_ENGINE and initialise it under root
+const struct storage_engine* engine_init(const char* root) {
+    const char* setting = get_config_string("S25_STORAGE_ENGINE", "file");
+    const struct storage_engine* engine = &file_engine;
+
+    if (strcmp(setting, "log") == 0) {
+        engine = &log_engine;
+    } else if (strcmp(setting, "file") != 0) {
+        fprintf(stderr, "Ignoring invalid S25_STORAGE_ENGINE=%s\n", setting);
+    }
+
+    if (engine->init(root) < 0) {
+        printf("Storage engine %s unavailable\n", engine->name);
+        return NULL;
+    }
+    printf("Storage engine: %s\n", engine->name);
+    return engine;
+}
@@ -0,0 +1,48 @@
+#ifndef S25ENGINE_H
+#define S25ENGINE_H
+
+#include <stddef.h>
+
+// Storage engines behind the storage servers' UPLOAD, DOWNLOAD, DELETE,
+// LIST and TAR handlers.  S25_STORAGE_ENGINE selects one at startup:
+//
+//   file  one file per object under ~/SN (the original layout); with
+//         S25_PACK_MAX_SIZE set, files up to that size go to the pack store
+//   log   every object is a record in the pack store's append-only log
+//         (hash index, checkpoints, crash recovery, compaction)
+//
+// Writes are streamed: create() is told the final size, write() is called
+// with the data as it arrives, and commit() publishes the object (synced
+// according to S25_DURABILITY) or abort() drops it.  The file engine writes
+// through s25ingest.h, so large files are preallocated and written with
+// O_DIRECT.  Readers and writers
+// are engine_stream handles.  extent() exposes the descriptor and offset a
+// reader's data sits at, so it can be handed to S1 and sent without copying.
+// copy() and move() duplicate or rename an object without it leaving the
+// server (COPY and MOVE); a file on disk is cloned or renamed in place.
+
+struct engine_stream;
+
+typedef void (*engine_visit)(const char* path, long size, long mtime, void* user_data);
+
+struct storage_engine {
+    const char* name;
+    int (*init)(const char* root);
+    struct engine_stream* (*create)(const char* path, long size);
+    int (*write)(struct engine_stream* stream, const void* data, size_t length);
+    int (*commit)(struct engine_stream* stream);
+    void (*abort)(struct engine_stream* stream);
+    struct engine_stream* (*open)(const char* path, long* size);
+    long (*read)(struct engine_stream* stream, void* buffer, size_t length);
+    void (*close)(struct engine_stream* stream);
+    int (*remove)(const char* path);
+    void (*list)(const char* directory, int recursive, engine_visit visit, void* user_data);
+    int (*extent)(struct engine_stream* stream, int* fd, long* offset);
+    int (*copy)(const char* source, const char* destination);
+    int (*move)(const char* source, const char* destination);
+};
+
+// Function to pick the engine named by S25_STORAGE_ENGINE and initialise it under root
+const struct storage_engine* engine_init(const char* root);
+
+#endif
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "s25health.h"
+#include "s25common.h"
+#include "s25stats.h"
+
+struct node_health {
+    int up;
+    int failures;     // consecutive failed heartbeats or calls
+    int successes;    // consecutive good heartbeats
+};
+
+static struct node_health* nodes;   // shared with S1's children
+static const int* node_ports;
+static const char* const* node_names;
+static int node_count;
+static long interval_ms;
+static long heartbeat_timeout_ms;
+static long down_after;
+static long up_after;
+static long connect_timeout_ms;
+static long call_timeout_ms;
+
+// Function to set up health tracking for the storage nodes; call before forking
+int health_init(const int* ports, const char* const* names, int count) {
+    nodes = mmap(NULL, count * sizeof(*nodes), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (nodes == MAP_FAILED) {
+        nodes = NULL;
+        perror("Health region");
+        return -1;
+    }
+
+    node_ports = ports;
+    node_names = names;
+    node_count = count;
+    for (int node = 0; node < count; node++) nodes[node].up = 1;
+
+    interval_ms = get_config_long("S25_HEARTBEAT_MS", 500);
+    if (interval_ms < 10) interval_ms = 10;
+    heartbeat_timeout_ms = get_config_long("S25_HEARTBEAT_TIMEOUT_MS", 500);
+    if (heartbeat_timeout_ms < 1) heartbeat_timeout_ms = 1;
+    down_after = get_config_long("S25_HEALTH_DOWN_AFTER", 3);
+    if (down_after < 1) down_after = 1;
+    up_after = get_config_long("S25_HEALTH_UP_AFTER", 3);
+    if (up_after < 1) up_after = 1;
+    connect_timeout_ms = get_config_long("S25_CONNECT_TIMEOUT_MS", 1000);
+    call_timeout_ms = get_config_long("S25_STORAGE_TIMEOUT_MS", 10000);
+
+    stats_init_nodes(names, count);
+    printf("Storage health: heartbeat every %ld ms, down after %ld misses, up after %ld, call timeout %ld ms\n",
+           interval_ms, down_after, up_after, call_timeout_ms);
+    return 0;
+}
+
+// Function to find a node by port; -1 if it is not tracked
+static int find_node(int port) {
+    for (int node = 0; node < node_count; node++) {
+        if (node_ports[node] == port) return node;
+    }
+    return -1;
+}
+
+// Function to record one observation of a node and move it up or down past the thresholds
+static void observe(int node, int ok) {
+    struct node_health* health = &nodes[node];
+
+    if (ok) {
+        __atomic_store_n(&health->failures, 0, __ATOMIC_RELAXED);
+        int successes = __atomic_add_fetch(&health->successes, 1, __ATOMIC_RELAXED);
+        if (!__atomic_load_n(&health->up, __ATOMIC_RELAXED) && successes >= up_after) {
+            __atomic_store_n(&health->up, 1, __ATOMIC_RELAXED);
+            stats_set_node_up(node, 1);
+            printf("Storage node %s is back up\n", node_names[node]);
+        }
+    } else {
+        __atomic_store_n(&health->successes, 0, __ATOMIC_RELAXED);
+        int failures = __atomic_add_fetch(&health->failures, 1, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&health->up, __ATOMIC_RELAXED) && failures >= down_after) {
+            __atomic_store_n(&health->up, 0, __ATOMIC_RELAXED);
+            stats_set_node_up(node, 0);
+            printf("Storage node %s marked down after %d failures\n", node_names[node], failures);
+        }
+    }
+}
+
+// Function to ping one node within the heartbeat deadline
+static int probe(int port) {
+    char reply[64];
+
+    int sock = connect_local(port, heartbeat_timeout_ms);
+    if (sock < 0) return 0;
+
+    set_socket_timeout(sock, heartbeat_timeout_ms);
+    int ok = send_message(sock, "PING") == 0 && recv_message(sock, reply, sizeof(reply)) >= 0 &&
+             strcmp(reply, "PONG") == 0;
+    close(sock);
+    return ok;
+}
+
+// Function to ping every node until the process exits
+static void* heartbeat_thread(void* argument) {
+    (void)argument;
+
+    while (1) {
+        for (int node = 0; node < node_count; node++) {
+            observe(node, probe(node_ports[node]));
+        }
+        usleep(interval_ms * 1000);
+    }
+    return NULL;
+}
+
+// Function to start the heartbeat thread in the long-lived S1 process
+int health_start(void) {
+    pthread_t thread;
+
+    if (nodes == NULL) return -1;
+    if (pthread_create(&thread, NULL, heartbeat_thread, NULL) != 0) {
+        perror("Heartbeat thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Function to check whether the node on a port is up; unknown ports count as up
+int health_is_up(int port) {
+    int node = find_node(port);
+    if (nodes == NULL || node < 0) return 1;
+    return __atomic_load_n(&nodes[node].up, __ATOMIC_RELAXED);
+}
+
+// Function to count a failed call to a node towards marking it down
+void health_report_failure(int port) {
+    int node = find_node(port);
+    if (nodes != NULL && node >= 0) observe(node, 0);
+}
+
+// Function to get the connect deadline in milliseconds
+int health_connect_timeout_ms(void) {
+    return connect_timeout_ms;
+}
+
+// Function to get the per-call deadline in milliseconds (0 = none)
+int health_call_timeout_ms(void) {
+    return call_timeout_ms;
+}
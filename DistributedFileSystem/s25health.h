@@ -0,0 +1,41 @@
+#ifndef S25HEALTH_H
+#define S25HEALTH_H
+
+// Storage node health for S1.
+//
+// A heartbeat thread in S1's first process pings every storage server
+// (PING, answered with PONG) and tracks consecutive results with
+// hysteresis: a node is marked down after S25_HEALTH_DOWN_AFTER failures
+// in a row and readmitted after S25_HEALTH_UP_AFTER successes in a row.
+// Calls to a node that is down fail at once instead of waiting on it.
+//
+//   S25_HEARTBEAT_MS           time between heartbeats (default 500)
+//   S25_HEARTBEAT_TIMEOUT_MS   deadline for one heartbeat (default 500)
+//   S25_HEALTH_DOWN_AFTER      failures before a node is marked down (default 3)
+//   S25_HEALTH_UP_AFTER        successes before it is readmitted (default 3)
+//   S25_CONNECT_TIMEOUT_MS     deadline for connecting to a node (default 1000)
+//   S25_STORAGE_TIMEOUT_MS     longest a call may wait on a node without
+//                              progress (default 10000; 0 = no limit)
+//
+// The state lives in shared memory created before forking, so every S1
+// child sees what the heartbeat saw.
+
+// Function to set up health tracking for the storage nodes; call before forking
+int health_init(const int* ports, const char* const* names, int count);
+
+// Function to start the heartbeat thread in the long-lived S1 process
+int health_start(void);
+
+// Function to check whether the node on a port is up; unknown ports count as up
+int health_is_up(int port);
+
+// Function to count a failed call to a node towards marking it down
+void health_report_failure(int port);
+
+// Function to get the connect deadline in milliseconds
+int health_connect_timeout_ms(void);
+
+// Function to get the per-call deadline in milliseconds (0 = none)
+int health_call_timeout_ms(void);
+
+#endif
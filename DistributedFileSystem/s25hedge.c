@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "s25hedge.h"
+#include "s25common.h"
+#include "s25stats.h"
+
+// Recent first-byte times the threshold is taken from, and how many are needed first
+#define HEDGE_WINDOW 256
+#define HEDGE_WARMUP 20
+
+struct hedge_region {
+    unsigned long reads;
+    unsigned long hedges;
+    unsigned int next_sample;
+    long long samples_us[HEDGE_WINDOW];
+};
+
+static struct hedge_region* region;
+static long budget_percent;
+static double percentile;
+static long min_threshold_us;
+
+// Function to read the S25_HEDGE_* settings; call before forking
+int hedge_init(void) {
+    budget_percent = get_config_long("S25_HEDGE_BUDGET_PERCENT", 0);
+    percentile = get_config_double("S25_HEDGE_PERCENTILE", 95);
+    if (percentile <= 0 || percentile > 100) percentile = 95;
+    min_threshold_us = get_config_long("S25_HEDGE_MIN_US", 1000);
+    if (budget_percent <= 0) return 0;
+
+    region = mmap(NULL, sizeof(*region), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        region = NULL;
+        perror("Hedge region");
+        return -1;
+    }
+
+    stats_init_reads();
+    printf("Hedged reads: after p%g of recent reads (at least %ld us), up to %ld%% extra\n", percentile,
+           min_threshold_us, budget_percent);
+    return 0;
+}
+
+// Function to compare two times for qsort
+static int compare_times(const void* a, const void* b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+// Function to get the current hedge threshold in microseconds; -1 until enough reads were seen
+static long long threshold_us(void) {
+    long long sorted[HEDGE_WINDOW];
+    unsigned int taken = __atomic_load_n(&region->next_sample, __ATOMIC_RELAXED);
+    int filled = taken < HEDGE_WINDOW ? (int)taken : HEDGE_WINDOW;
+
+    if (filled < HEDGE_WARMUP) return -1;
+    for (int i = 0; i < filled; i++) sorted[i] = __atomic_load_n(&region->samples_us[i], __ATOMIC_RELAXED);
+    qsort(sorted, filled, sizeof(sorted[0]), compare_times);
+
+    int index = (int)ceil(percentile / 100 * filled) - 1;
+    if (index < 0) index = 0;
+    return sorted[index] > min_threshold_us ? sorted[index] : min_threshold_us;
+}
+
+// Function to add a first-byte time to the window
+static void record_sample(long long first_byte_us) {
+    unsigned int slot = __atomic_fetch_add(&region->next_sample, 1, __ATOMIC_RELAXED) % HEDGE_WINDOW;
+    __atomic_store_n(&region->samples_us[slot], first_byte_us, __ATOMIC_RELAXED);
+}
+
+// Function to take one hedge out of the budget; 0 if it is spent
+static int take_budget(void) {
+    unsigned long reads = __atomic_load_n(&region->reads, __ATOMIC_RELAXED);
+    unsigned long hedges = __atomic_add_fetch(&region->hedges, 1, __ATOMIC_RELAXED);
+
+    if (hedges * 100 <= (unsigned long)budget_percent * reads) return 1;
+    __atomic_sub_fetch(&region->hedges, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Function to wait for the first live socket with reply bytes to read; its index, or -1 on timeout or once
+// every socket has failed (an error, a reset or the end of the stream), which marks it dead
+static int wait_first(const int* sockets, int* alive, int count, long long timeout_us) {
+    long long deadline = stats_now_us() + timeout_us;
+
+    while (1) {
+        struct pollfd fds[2];
+        int live = 0;
+        for (int i = 0; i < count; i++) {
+            fds[i] = (struct pollfd){ alive[i] ? sockets[i] : -1, POLLIN, 0 };
+            live += alive[i];
+        }
+        if (live == 0) return -1;
+
+        long long left = deadline - stats_now_us();
+        if (timeout_us >= 0 && left < 0) left = 0;
+        struct timespec wait = { left / 1000000, (left % 1000000) * 1000 };
+
+        int ready = ppoll(fds, count, timeout_us < 0 ? NULL : &wait, NULL);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) return -1;
+        for (int i = 0; i < count; i++) {
+            if (fds[i].revents == 0) continue;
+
+            // A reset also reports POLLIN, so only a byte waiting to be read counts as an answer
+            char byte;
+            ssize_t peeked = recv(sockets[i], &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (peeked > 0) return i;
+            if (peeked < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            alive[i] = 0;
+        }
+    }
+}
+
+// Function to start a read, hedging it if it is slow; returns the socket that answered first, or -1
+int hedge_read(hedge_start_fn start, void* context) {
+    if (region == NULL) return start(context);
+
+    long long started = stats_now_us();
+    int sockets[2] = { start(context), -1 };
+    int alive[2] = { 1, 0 };
+    if (sockets[0] < 0) return -1;
+    __atomic_add_fetch(&region->reads, 1, __ATOMIC_RELAXED);
+
+    int deadline_ms = get_socket_timeout(sockets[0], SO_RCVTIMEO);
+    long long deadline_us = deadline_ms < 0 ? -1 : deadline_ms * 1000LL;
+    long long threshold = threshold_us();
+    int count = 1;
+    int tried = 0;
+    int winner = -1;
+    while (1) {
+        // Until a hedge has been tried, wake up at the threshold to send one; after that, wait out the deadline
+        int hedge_due = !tried && threshold >= 0 && (deadline_us < 0 || threshold < deadline_us);
+        long long limit = hedge_due ? threshold : deadline_us;
+        long long left = limit - (stats_now_us() - started);
+        winner = wait_first(sockets, alive, count, limit < 0 ? -1 : (left > 0 ? left : 0));
+        if (winner >= 0 || tried || (!hedge_due && alive[0])) break;
+
+        // Without a reply by the threshold, or once the first attempt failed, ask again and take whichever answers first
+        tried = 1;
+        if (take_budget()) {
+            sockets[1] = start(context);
+            if (sockets[1] >= 0) {
+                count = 2;
+                alive[1] = 1;
+            } else {
+                __atomic_sub_fetch(&region->hedges, 1, __ATOMIC_RELAXED);
+            }
+        }
+        if (!alive[0] && !alive[1]) break;
+    }
+
+    // A read whose attempts all failed says nothing about how long replies take
+    long long first_byte_us = stats_now_us() - started;
+    if (alive[0] || alive[1]) record_sample(first_byte_us);
+    stats_record_read(first_byte_us, count == 2, winner == 1);
+
+    // Closing the loser cancels it: the storage server stops at its next send
+    for (int i = 0; i < count; i++) {
+        if (i != winner) close(sockets[i]);
+    }
+    if (winner == 1) printf("Hedged read answered first after %lld us\n", first_byte_us);
+    return winner >= 0 ? sockets[winner] : -1;
+}
@@ -0,0 +1,33 @@
+#ifndef S25HEDGE_H
+#define S25HEDGE_H
+
+// Hedged storage reads for S1.
+//
+// A read is started once.  If its first reply byte has not arrived within
+// the hedge threshold, or its connection fails first, the same read is
+// started a second time and whichever answers first is used; the other
+// connection is closed, which cancels it.
+// The threshold is a percentile of recent first-byte times, so only the
+// slow tail is hedged:
+//
+//   S25_HEDGE_BUDGET_PERCENT  extra reads allowed, as a share of all reads
+//                             (default 0 = hedging off)
+//   S25_HEDGE_PERCENTILE      percentile of recent reads used as the
+//                             threshold (default 95)
+//   S25_HEDGE_MIN_US          lowest threshold (default 1000)
+//
+// Recent times and the budget live in shared memory created before
+// forking, so every S1 child hedges against the same numbers.  Times are
+// exported as s25_read_first_byte_seconds, hedges as
+// s25_hedged_reads_total and s25_hedge_wins_total.
+
+// Function that starts one attempt of a read and returns its socket, or -1
+typedef int (*hedge_start_fn)(void* context);
+
+// Function to read the S25_HEDGE_* settings; call before forking
+int hedge_init(void);
+
+// Function to start a read, hedging it if it is slow; returns the socket that answered first, or -1
+int hedge_read(hedge_start_fn start, void* context);
+
+#endif
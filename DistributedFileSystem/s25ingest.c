@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "s25ingest.h"
+#include "s25common.h"
+#include "s25pool.h"
+
+// Alignment of O_DIRECT buffers, offsets and lengths; enough for any common block size
+#define BLOCK 4096
+
+struct ingest_writer {
+    int fd;
+    int direct;
+    int failed;
+    char* buffer;
+    size_t capacity;
+    size_t used;
+    long offset;
+};
+
+static long large_file_bytes;
+static long write_chunk;
+
+// Function to read the S25_LARGE_FILE_BYTES and S25_WRITE_CHUNK settings; call before forking/threads
+int ingest_init(void) {
+    large_file_bytes = get_config_long("S25_LARGE_FILE_BYTES", 4L * 1024 * 1024);
+    write_chunk = get_config_long("S25_WRITE_CHUNK", 1024 * 1024);
+
+    // Whole blocks, so every full buffer can go out with O_DIRECT
+    if (write_chunk < BLOCK) write_chunk = BLOCK;
+    write_chunk -= write_chunk % BLOCK;
+    if (large_file_bytes > 0) {
+        printf("Large files: preallocated and written with O_DIRECT from %ld bytes, %ld byte writes\n",
+               large_file_bytes, write_chunk);
+    }
+    return 0;
+}
+
+// Function to go back to writing through the page cache
+static void stop_direct(struct ingest_writer* writer) {
+    int flags = fcntl(writer->fd, F_GETFL);
+    if (flags >= 0) fcntl(writer->fd, F_SETFL, flags & ~O_DIRECT);
+    writer->direct = 0;
+}
+
+// Function to write length bytes at the writer's offset
+static int write_out(struct ingest_writer* writer, const char* data, size_t length) {
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t put = pwrite(writer->fd, data + done, length - done, writer->offset);
+        if (put < 0 && errno == EINTR) continue;
+
+        // Some file systems take the O_DIRECT flag but refuse the writes
+        if (put < 0 && errno == EINVAL && writer->direct) {
+            stop_direct(writer);
+            continue;
+        }
+        if (put <= 0) return -1;
+        done += put;
+        writer->offset += put;
+
+        // A short direct write leaves the rest unaligned
+        if (writer->direct && put % BLOCK != 0) stop_direct(writer);
+    }
+    return 0;
+}
+
+// Function to start writing a file of size bytes to fd, which must be empty; NULL if out of memory
+struct ingest_writer* ingest_open(int fd, long size) {
+    int large = large_file_bytes > 0 && size >= large_file_bytes;
+    struct ingest_writer* writer = calloc(1, sizeof(*writer));
+    if (writer == NULL) return NULL;
+
+    // Small files get a buffer just big enough to be written in one go
+    writer->capacity = write_chunk;
+    if (size >= 0 && size < write_chunk) writer->capacity = size > BLOCK ? (size + BLOCK - 1) / BLOCK * BLOCK : BLOCK;
+    if ((writer->buffer = pool_get(writer->capacity)) == NULL) {
+        free(writer);
+        return NULL;
+    }
+    writer->fd = fd;
+
+    if (large) {
+        // Reserved without changing the size, so a short upload never shows trailing zeros
+        if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0 && errno != EOPNOTSUPP) {
+            printf("Warning: Cannot preallocate %ld bytes: %s\n", size, strerror(errno));
+        }
+        int flags = fcntl(fd, F_GETFL);
+        writer->direct = flags >= 0 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0;
+    }
+    return writer;
+}
+
+// Function to get the free part of the writer's buffer, to receive into it directly
+void* ingest_space(struct ingest_writer* writer, size_t* length) {
+    *length = writer->capacity - writer->used;
+    return writer->buffer + writer->used;
+}
+
+// Function to add length bytes placed in ingest_space() to the file, writing out a full buffer
+int ingest_fill(struct ingest_writer* writer, size_t length) {
+    writer->used += length;
+    if (writer->used < writer->capacity) return writer->failed ? -1 : 0;
+
+    // After a failure the rest is only accepted, so the caller can finish reading it
+    if (!writer->failed && write_out(writer, writer->buffer, writer->used) < 0) writer->failed = 1;
+    writer->used = 0;
+    return writer->failed ? -1 : 0;
+}
+
+// Function to add length bytes to the file
+int ingest_write(struct ingest_writer* writer, const void* data, size_t length) {
+    const char* next = data;
+
+    while (length > 0) {
+        size_t space;
+        char* into = ingest_space(writer, &space);
+        if (space > length) space = length;
+        memcpy(into, next, space);
+        next += space;
+        length -= space;
+        if (ingest_fill(writer, space) < 0) return -1;
+    }
+    return writer->failed ? -1 : 0;
+}
+
+// Function to write out what is buffered, tail included, and free the writer (fd stays open)
+int ingest_finish(struct ingest_writer* writer) {
+    size_t aligned = writer->direct ? writer->used - writer->used % BLOCK : writer->used;
+    int result = writer->failed ? -1 : 0;
+
+    // Whole blocks go out directly; the tail goes through the page cache
+    if (result == 0 && write_out(writer, writer->buffer, aligned) < 0) result = -1;
+    if (result == 0 && aligned < writer->used) {
+        if (writer->direct) stop_direct(writer);
+        if (write_out(writer, writer->buffer + aligned, writer->used - aligned) < 0) result = -1;
+    }
+    if (writer->direct) stop_direct(writer);
+
+    pool_put(writer->buffer, writer->capacity);
+    free(writer);
+    return result;
+}
+
+// Function to free the writer without writing out what is buffered (fd stays open)
+void ingest_abort(struct ingest_writer* writer) {
+    pool_put(writer->buffer, writer->capacity);
+    free(writer);
+}
@@ -0,0 +1,43 @@
+#ifndef S25INGEST_H
+#define S25INGEST_H
+
+#include <stddef.h>
+
+// Write path for uploads whose size is known before the first byte.
+//
+// Data is gathered into a page-aligned buffer and written a chunk at a time.
+// Files of at least S25_LARGE_FILE_BYTES are first preallocated with
+// fallocate(), so the file system can lay them out in few extents, and
+// then written with O_DIRECT, so ingesting them does not push other files
+// out of the page cache.  Direct writes cover whole blocks only: the
+// unaligned tail of a file is written through the page cache.  A file
+// system that refuses O_DIRECT or fallocate() gets ordinary writes.
+//
+//   S25_LARGE_FILE_BYTES   size from which files are preallocated and written
+//                          with O_DIRECT (default 4 MB; 0 = never)
+//   S25_WRITE_CHUNK        size of each write (default 1 MB)
+
+struct ingest_writer;
+
+// Function to read the S25_LARGE_FILE_BYTES and S25_WRITE_CHUNK settings; call before forking/threads
+int ingest_init(void);
+
+// Function to start writing a file of size bytes to fd, which must be empty; NULL if out of memory
+struct ingest_writer* ingest_open(int fd, long size);
+
+// Function to get the free part of the writer's buffer, to receive into it directly
+void* ingest_space(struct ingest_writer* writer, size_t* length);
+
+// Function to add length bytes placed in ingest_space() to the file, writing out a full buffer
+int ingest_fill(struct ingest_writer* writer, size_t length);
+
+// Function to add length bytes to the file
+int ingest_write(struct ingest_writer* writer, const void* data, size_t length);
+
+// Function to write out what is buffered, tail included, and free the writer (fd stays open)
+int ingest_finish(struct ingest_writer* writer);
+
+// Function to free the writer without writing out what is buffered (fd stays open)
+void ingest_abort(struct ingest_writer* writer);
+
+#endif
@@ -0,0 +1,878 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "s25meta.h"
+#include "s25common.h"
+
+#define SNAPSHOT_MAGIC 0x534d3532u // "25MS"
+#define JOURNAL_MAGIC 0x4a4d3532u  // "25MJ"
+#define JOURNAL_PUT 1
+#define JOURNAL_DELETE 2
+#define META_CHECKSUM 1            // the checksum field is known
+#define META_PATH 1024
+
+// Snapshot layout: header | entries sorted by path | NUL-terminated paths
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t crc;          // over everything after this field
+    uint64_t count;
+    uint64_t strings_size;
+};
+
+struct snapshot_entry {
+    uint64_t path_offset;  // into the path table
+    int64_t size;
+    int64_t mtime;
+    uint32_t checksum;
+    uint32_t flags;
+};
+
+// Journal record, followed by the path
+struct journal_record {
+    uint32_t magic;
+    uint32_t crc;          // over the rest of the record and the path
+    uint8_t type;
+    uint8_t flags;
+    uint16_t path_length;
+    uint32_t checksum;
+    int64_t size;
+    int64_t mtime;
+};
+
+// Change made since the snapshot
+struct overlay_entry {
+    struct overlay_entry* next;
+    uint64_t hash;
+    int64_t size;
+    int64_t mtime;
+    uint32_t checksum;
+    uint32_t flags;
+    int deleted;
+    char path[];
+};
+
+struct snapshot_builder {
+    struct snapshot_entry* entries;
+    size_t count;
+    size_t capacity;
+    FILE* strings;
+    char* strings_data;
+    size_t strings_size;
+    uint64_t strings_used;
+};
+
+// File found by the directory scan
+struct scan_file {
+    char* path;
+    int64_t size;
+    int64_t mtime;
+};
+
+struct scan_state {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    char** directories;    // queued directories, relative to root ("" is root)
+    size_t count;
+    size_t capacity;
+    int busy;              // threads reading a directory
+};
+
+struct scan_worker {
+    struct scan_state* state;
+    struct scan_file* files;
+    size_t count;
+    size_t capacity;
+};
+
+static pthread_rwlock_t meta_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t merge_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t merge_wakeup = PTHREAD_COND_INITIALIZER;
+
+static char root_path[META_PATH];
+static size_t root_length;
+static char meta_directory[META_PATH];
+static long journal_limit;
+
+static void* snapshot_base;
+static size_t snapshot_size;
+static const struct snapshot_entry* snapshot_entries;
+static uint64_t snapshot_count;
+static const char* snapshot_strings;
+
+static struct overlay_entry** buckets;
+static size_t bucket_count;
+static size_t overlay_count;
+
+static int journal_fd = -1;
+static long journal_records;
+
+// Function to hash a relative path (FNV-1a)
+static uint64_t hash_path(const char* key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Function to turn a local path into a metadata key; NULL if outside root
+static const char* relative_key(const char* path) {
+    if (root_length == 0 || strncmp(path, root_path, root_length) != 0 || path[root_length] != '/') return NULL;
+    const char* key = path + root_length + 1;
+    return *key != '\0' && strlen(key) < META_PATH ? key : NULL;
+}
+
+// Function to get the path of a snapshot entry
+static const char* snapshot_path(uint64_t index) {
+    return snapshot_strings + snapshot_entries[index].path_offset;
+}
+
+// Function to find the first snapshot entry not sorting before key
+static uint64_t snapshot_lower_bound(const char* key) {
+    uint64_t low = 0;
+    uint64_t high = snapshot_count;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        if (strcmp(snapshot_path(middle), key) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Function to check whether the snapshot holds key
+static int snapshot_contains(const char* key) {
+    uint64_t index = snapshot_lower_bound(key);
+    return index < snapshot_count && strcmp(snapshot_path(index), key) == 0;
+}
+
+// Function to find the link pointing at a key's overlay entry
+static struct overlay_entry** find_link(const char* key, uint64_t hash) {
+    struct overlay_entry** link = &buckets[hash & (bucket_count - 1)];
+    while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->path, key) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Function to double the overlay's bucket array
+static void grow_overlay(void) {
+    size_t new_count = bucket_count * 2;
+    struct overlay_entry** new_buckets = calloc(new_count, sizeof(*new_buckets));
+    if (new_buckets == NULL) return;
+
+    for (size_t i = 0; i < bucket_count; i++) {
+        struct overlay_entry* entry = buckets[i];
+        while (entry != NULL) {
+            struct overlay_entry* next = entry->next;
+            entry->next = new_buckets[entry->hash & (new_count - 1)];
+            new_buckets[entry->hash & (new_count - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(buckets);
+    buckets = new_buckets;
+    bucket_count = new_count;
+}
+
+// Function to record a key's current state in the overlay
+static void overlay_set(const char* key, int64_t size, int64_t mtime, uint32_t checksum, uint32_t flags, int deleted) {
+    uint64_t hash = hash_path(key);
+    struct overlay_entry** link = find_link(key, hash);
+    struct overlay_entry* entry = *link;
+
+    // A file created and deleted since the snapshot needs no entry at all
+    if (deleted && !snapshot_contains(key)) {
+        if (entry != NULL) {
+            *link = entry->next;
+            free(entry);
+            overlay_count--;
+        }
+        return;
+    }
+
+    if (entry == NULL) {
+        size_t length = strlen(key);
+        entry = malloc(sizeof(*entry) + length + 1);
+        if (entry == NULL) return;
+        memcpy(entry->path, key, length + 1);
+        entry->hash = hash;
+        entry->next = *link;
+        *link = entry;
+        if (++overlay_count > bucket_count) grow_overlay();
+    }
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->checksum = checksum;
+    entry->flags = flags;
+    entry->deleted = deleted;
+}
+
+// Function to drop every overlay entry
+static void clear_overlay(void) {
+    for (size_t i = 0; i < bucket_count; i++) {
+        struct overlay_entry* entry = buckets[i];
+        while (entry != NULL) {
+            struct overlay_entry* next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        buckets[i] = NULL;
+    }
+    overlay_count = 0;
+}
+
+// Function to check whether key is currently a known file
+static int key_known(const char* key) {
+    struct overlay_entry* entry = *find_link(key, hash_path(key));
+    return entry != NULL ? !entry->deleted : snapshot_contains(key);
+}
+
+// Function to record a key's real state on disk; hint supplies the checksum if it still matches
+static void refresh_key(const char* key, const struct journal_record* hint) {
+    char path[META_PATH * 2];
+    struct stat info;
+
+    snprintf(path, sizeof(path), "%s/%s", root_path, key);
+    if (lstat(path, &info) < 0 || !S_ISREG(info.st_mode)) {
+        overlay_set(key, 0, 0, 0, 0, 1);
+        return;
+    }
+    int known = hint != NULL && hint->type == JOURNAL_PUT && (hint->flags & META_CHECKSUM) &&
+                hint->size == info.st_size && hint->mtime == info.st_mtime;
+    overlay_set(key, info.st_size, info.st_mtime, known ? hint->checksum : 0, known ? META_CHECKSUM : 0, 0);
+}
+
+// Function to append a change to the journal
+static int append_journal(int type, const char* key, int64_t size, int64_t mtime, uint32_t checksum, uint32_t flags) {
+    struct journal_record record;
+    size_t length = strlen(key);
+
+    memset(&record, 0, sizeof(record));
+    record.magic = JOURNAL_MAGIC;
+    record.type = type;
+    record.flags = flags;
+    record.path_length = length;
+    record.checksum = checksum;
+    record.size = size;
+    record.mtime = mtime;
+    record.crc = crc32_update(0, &record.type, sizeof(record) - offsetof(struct journal_record, type));
+    record.crc = crc32_update(record.crc, key, length);
+
+    struct iovec parts[2] = { { &record, sizeof(record) }, { (void*)key, length } };
+    if (writev(journal_fd, parts, 2) != (ssize_t)(sizeof(record) + length)) return -1;
+    journal_records++;
+    return 0;
+}
+
+// Function to re-apply the journal on top of the snapshot; a torn tail is cut off
+static long replay_journal(void) {
+    struct stat info;
+    long replayed = 0;
+
+    if (fstat(journal_fd, &info) < 0 || info.st_size == 0) return 0;
+    char* data = malloc(info.st_size);
+    if (data == NULL || pread(journal_fd, data, info.st_size, 0) != info.st_size) {
+        free(data);
+        return -1;
+    }
+
+    size_t position = 0;
+    while (position + sizeof(struct journal_record) <= (size_t)info.st_size) {
+        struct journal_record record;
+        char key[META_PATH];
+
+        memcpy(&record, data + position, sizeof(record));
+        if (record.magic != JOURNAL_MAGIC || record.path_length == 0 || record.path_length >= META_PATH ||
+            position + sizeof(record) + record.path_length > (size_t)info.st_size) {
+            break;
+        }
+        memcpy(key, data + position + sizeof(record), record.path_length);
+        key[record.path_length] = '\0';
+        uint32_t crc = crc32_update(0, &record.type, sizeof(record) - offsetof(struct journal_record, type));
+        if (crc32_update(crc, key, record.path_length) != record.crc || strlen(key) != record.path_length) break;
+
+        // The record was written before the change, so the disk has the final say
+        refresh_key(key, &record);
+        position += sizeof(record) + record.path_length;
+        replayed++;
+    }
+    free(data);
+
+    if (position < (size_t)info.st_size && ftruncate(journal_fd, position) == 0) {
+        printf("Metadata journal: dropped %ld torn bytes\n", (long)(info.st_size - position));
+    }
+    journal_records = replayed;
+    return replayed;
+}
+
+// Function to unmap the current snapshot
+static void unmap_snapshot(void) {
+    if (snapshot_base != NULL) munmap(snapshot_base, snapshot_size);
+    snapshot_base = NULL;
+    snapshot_size = 0;
+    snapshot_entries = NULL;
+    snapshot_count = 0;
+    snapshot_strings = NULL;
+}
+
+// Function to map and validate the snapshot file
+static int map_snapshot(void) {
+    char path[META_PATH + 32];
+    struct stat info;
+
+    snprintf(path, sizeof(path), "%s/snapshot", meta_directory);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(struct snapshot_header)) {
+        close(fd);
+        return -1;
+    }
+    void* base = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+
+    const struct snapshot_header* header = base;
+    size_t body_size = info.st_size - sizeof(*header);
+    const struct snapshot_entry* entries = (const struct snapshot_entry*)(header + 1);
+    const char* strings = (const char*)(entries + header->count);
+    int valid = header->magic == SNAPSHOT_MAGIC && header->count <= body_size / sizeof(*entries) &&
+                header->count * sizeof(*entries) + header->strings_size == body_size &&
+                (header->strings_size == 0 ? header->count == 0 : strings[header->strings_size - 1] == '\0');
+    if (valid) {
+        uint32_t crc = crc32_update(0, &header->count, sizeof(*header) - offsetof(struct snapshot_header, count));
+        valid = crc32_update(crc, entries, body_size) == header->crc;
+    }
+    for (uint64_t i = 0; valid && i < header->count; i++) {
+        valid = entries[i].path_offset < header->strings_size;
+    }
+    if (!valid) {
+        munmap(base, info.st_size);
+        return -1;
+    }
+
+    // Readers only ever touch the entries they look up
+    madvise(base, info.st_size, MADV_RANDOM);
+    unmap_snapshot();
+    snapshot_base = base;
+    snapshot_size = info.st_size;
+    snapshot_entries = entries;
+    snapshot_count = header->count;
+    snapshot_strings = strings;
+    return 0;
+}
+
+// Function to start an empty snapshot
+static int builder_init(struct snapshot_builder* builder) {
+    memset(builder, 0, sizeof(*builder));
+    builder->strings = open_memstream(&builder->strings_data, &builder->strings_size);
+    return builder->strings != NULL ? 0 : -1;
+}
+
+// Function to add the next file in path order
+static int builder_add(struct snapshot_builder* builder, const char* path, int64_t size, int64_t mtime,
+                       uint32_t checksum, uint32_t flags) {
+    if (builder->count == builder->capacity) {
+        size_t capacity = builder->capacity ? builder->capacity * 2 : 1024;
+        struct snapshot_entry* entries = realloc(builder->entries, capacity * sizeof(*entries));
+        if (entries == NULL) return -1;
+        builder->entries = entries;
+        builder->capacity = capacity;
+    }
+
+    size_t length = strlen(path) + 1;
+    struct snapshot_entry* entry = &builder->entries[builder->count++];
+    entry->path_offset = builder->strings_used;
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->checksum = checksum;
+    entry->flags = flags;
+    builder->strings_used += length;
+    return fwrite(path, 1, length, builder->strings) == length ? 0 : -1;
+}
+
+// Function to write the built snapshot aside, rename it into place and map it
+static int write_snapshot(struct snapshot_builder* builder) {
+    struct snapshot_header header;
+    char path[META_PATH + 32];
+    char temp_path[META_PATH + 32];
+    int result = fclose(builder->strings) == 0 ? 0 : -1;
+    size_t entries_size = builder->count * sizeof(struct snapshot_entry);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SNAPSHOT_MAGIC;
+    header.count = builder->count;
+    header.strings_size = builder->strings_size;
+    header.crc = crc32_update(0, &header.count, sizeof(header) - offsetof(struct snapshot_header, count));
+    header.crc = crc32_update(header.crc, builder->entries, entries_size);
+    header.crc = crc32_update(header.crc, builder->strings_data, builder->strings_size);
+
+    snprintf(path, sizeof(path), "%s/snapshot", meta_directory);
+    snprintf(temp_path, sizeof(temp_path), "%s/snapshot.tmp", meta_directory);
+    int fd = result == 0 ? open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    struct iovec parts[3] = {
+        { &header, sizeof(header) }, { builder->entries, entries_size }, { builder->strings_data, builder->strings_size },
+    };
+    size_t total = sizeof(header) + entries_size + builder->strings_size;
+    if (fd < 0 || writev(fd, parts, 3) != (ssize_t)total || fdatasync(fd) < 0) result = -1;
+    if (fd >= 0) close(fd);
+    if (result == 0 && rename(temp_path, path) < 0) result = -1;
+    if (result == 0) {
+        int directory = open(meta_directory, O_RDONLY | O_DIRECTORY);
+        if (directory >= 0) {
+            fsync(directory);
+            close(directory);
+        }
+        result = map_snapshot();
+    }
+
+    free(builder->entries);
+    free(builder->strings_data);
+    return result;
+}
+
+// Function to sort overlay entries by path
+static int compare_overlay(const void* first, const void* second) {
+    return strcmp((*(struct overlay_entry* const*)first)->path, (*(struct overlay_entry* const*)second)->path);
+}
+
+// Function to fold the overlay into a new snapshot and empty the journal; caller holds the write lock
+static int rewrite_snapshot(void) {
+    struct snapshot_builder builder;
+    struct overlay_entry** changes = malloc((overlay_count ? overlay_count : 1) * sizeof(*changes));
+    size_t change_count = 0;
+    int result = 0;
+
+    if (changes == NULL || builder_init(&builder) < 0) {
+        free(changes);
+        return -1;
+    }
+    for (size_t i = 0; i < bucket_count; i++) {
+        for (struct overlay_entry* entry = buckets[i]; entry != NULL; entry = entry->next) {
+            changes[change_count++] = entry;
+        }
+    }
+    qsort(changes, change_count, sizeof(*changes), compare_overlay);
+
+    // Both sides are sorted; the overlay wins on equal paths
+    uint64_t old = 0;
+    size_t change = 0;
+    while (result == 0 && (old < snapshot_count || change < change_count)) {
+        int order = old == snapshot_count ? 1 : change == change_count ? -1
+                  : strcmp(snapshot_path(old), changes[change]->path);
+        if (order < 0) {
+            const struct snapshot_entry* entry = &snapshot_entries[old++];
+            result = builder_add(&builder, snapshot_strings + entry->path_offset, entry->size, entry->mtime,
+                                 entry->checksum, entry->flags);
+        } else {
+            struct overlay_entry* entry = changes[change++];
+            if (!entry->deleted) {
+                result = builder_add(&builder, entry->path, entry->size, entry->mtime, entry->checksum, entry->flags);
+            }
+            if (order == 0) old++;
+        }
+    }
+    free(changes);
+
+    if (result < 0) {
+        fclose(builder.strings);
+        free(builder.entries);
+        free(builder.strings_data);
+        return -1;
+    }
+    if (write_snapshot(&builder) < 0) return -1;
+
+    // A crash before the truncate replays records the snapshot already holds, which is harmless
+    clear_overlay();
+    if (ftruncate(journal_fd, 0) == 0) fdatasync(journal_fd);
+    journal_records = 0;
+    return 0;
+}
+
+// Function to queue a directory for the scan
+static int scan_push(struct scan_state* state, char* directory) {
+    pthread_mutex_lock(&state->lock);
+    if (state->count == state->capacity) {
+        size_t capacity = state->capacity ? state->capacity * 2 : 64;
+        char** directories = realloc(state->directories, capacity * sizeof(*directories));
+        if (directories == NULL) {
+            pthread_mutex_unlock(&state->lock);
+            free(directory);
+            return -1;
+        }
+        state->directories = directories;
+        state->capacity = capacity;
+    }
+    state->directories[state->count++] = directory;
+    pthread_cond_signal(&state->ready);
+    pthread_mutex_unlock(&state->lock);
+    return 0;
+}
+
+// Function to read one directory: files are collected, subdirectories queued
+static void scan_directory(struct scan_worker* worker, const char* directory) {
+    char path[META_PATH * 2];
+    char child[META_PATH];
+    struct dirent* entry;
+    struct stat info;
+
+    snprintf(path, sizeof(path), *directory ? "%s/%s" : "%s", root_path, directory);
+    DIR* handle = opendir(path);
+    if (handle == NULL) return;
+
+    while ((entry = readdir(handle)) != NULL) {
+        // Skips ".", "..", .meta, .pack and in-progress uploads
+        if (entry->d_name[0] == '.') continue;
+        if ((size_t)snprintf(child, sizeof(child), *directory ? "%s/%s" : "%s%s", directory, entry->d_name) >= sizeof(child)) {
+            continue;
+        }
+
+        // Directories need no stat when the file system reports the type
+        if (entry->d_type == DT_DIR) {
+            char* copy = strdup(child);
+            if (copy != NULL) scan_push(worker->state, copy);
+            continue;
+        }
+        if ((entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN) ||
+            fstatat(dirfd(handle), entry->d_name, &info, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;
+        }
+        if (S_ISDIR(info.st_mode)) {
+            char* copy = strdup(child);
+            if (copy != NULL) scan_push(worker->state, copy);
+        } else if (S_ISREG(info.st_mode)) {
+            if (worker->count == worker->capacity) {
+                size_t capacity = worker->capacity ? worker->capacity * 2 : 1024;
+                struct scan_file* files = realloc(worker->files, capacity * sizeof(*files));
+                if (files == NULL) continue;
+                worker->files = files;
+                worker->capacity = capacity;
+            }
+            struct scan_file* file = &worker->files[worker->count];
+            if ((file->path = strdup(child)) == NULL) continue;
+            file->size = info.st_size;
+            file->mtime = info.st_mtime;
+            worker->count++;
+        }
+    }
+    closedir(handle);
+}
+
+// Function to take directories off the queue until every thread is idle and it is empty
+static void* scan_thread(void* argument) {
+    struct scan_worker* worker = argument;
+    struct scan_state* state = worker->state;
+
+    pthread_mutex_lock(&state->lock);
+    while (1) {
+        while (state->count == 0 && state->busy > 0) {
+            pthread_cond_wait(&state->ready, &state->lock);
+        }
+        if (state->count == 0) break;
+
+        char* directory = state->directories[--state->count];
+        state->busy++;
+        pthread_mutex_unlock(&state->lock);
+
+        scan_directory(worker, directory);
+        free(directory);
+
+        pthread_mutex_lock(&state->lock);
+        if (--state->busy == 0 && state->count == 0) pthread_cond_broadcast(&state->ready);
+    }
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+// Function to sort scanned files by path
+static int compare_files(const void* first, const void* second) {
+    return strcmp(((const struct scan_file*)first)->path, ((const struct scan_file*)second)->path);
+}
+
+// Function to build the snapshot by scanning the tree with several threads
+static int scan_tree(long thread_count, size_t* file_count) {
+    struct scan_state state;
+    struct snapshot_builder builder;
+    struct scan_worker* workers = calloc(thread_count, sizeof(*workers));
+    pthread_t* threads = calloc(thread_count, sizeof(*threads));
+    struct scan_file* files = NULL;
+    size_t total = 0;
+    int result = 0;
+
+    memset(&state, 0, sizeof(state));
+    memset(&builder, 0, sizeof(builder));
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.ready, NULL);
+    if (workers == NULL || threads == NULL || scan_push(&state, strdup("")) < 0) result = -1;
+
+    long started = 0;
+    for (long i = 0; result == 0 && i < thread_count; i++) {
+        workers[i].state = &state;
+        if (pthread_create(&threads[i], NULL, scan_thread, &workers[i]) != 0) break;
+        started++;
+    }
+    // Without any thread the scan runs here
+    if (result == 0 && started == 0) {
+        workers[0].state = &state;
+        scan_thread(&workers[0]);
+    }
+    for (long i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (long i = 0; workers != NULL && i < thread_count; i++) {
+        total += workers[i].count;
+    }
+    files = malloc((total ? total : 1) * sizeof(*files));
+    if (files == NULL) result = -1;
+    total = 0;
+    for (long i = 0; workers != NULL && i < thread_count; i++) {
+        if (files != NULL) memcpy(files + total, workers[i].files, workers[i].count * sizeof(*files));
+        total += workers[i].count;
+        free(workers[i].files);
+    }
+
+    if (result == 0) {
+        qsort(files, total, sizeof(*files), compare_files);
+        result = builder_init(&builder);
+    }
+    for (size_t i = 0; result == 0 && i < total; i++) {
+        result = builder_add(&builder, files[i].path, files[i].size, files[i].mtime, 0, 0);
+    }
+    if (result == 0) {
+        result = write_snapshot(&builder);
+    } else if (builder.strings != NULL) {
+        fclose(builder.strings);
+        free(builder.entries);
+        free(builder.strings_data);
+    }
+
+    for (size_t i = 0; files != NULL && i < total; i++) {
+        free(files[i].path);
+    }
+    free(files);
+    free(state.directories);
+    free(workers);
+    free(threads);
+    *file_count = total;
+    return result;
+}
+
+// Function to fold the journal into the snapshot once it grows past the limit
+static void* merge_thread(void* argument) {
+    (void)argument;
+
+    pthread_mutex_lock(&merge_lock);
+    while (1) {
+        pthread_cond_wait(&merge_wakeup, &merge_lock);
+        pthread_mutex_unlock(&merge_lock);
+
+        pthread_rwlock_wrlock(&meta_lock);
+        if (journal_records >= journal_limit && rewrite_snapshot() < 0) {
+            printf("Metadata snapshot rewrite failed\n");
+        }
+        pthread_rwlock_unlock(&meta_lock);
+
+        pthread_mutex_lock(&merge_lock);
+    }
+    return NULL;
+}
+
+// Function to map the snapshot and replay the journal (or scan the tree) under root
+int meta_init(const char* root) {
+    char path[META_PATH + 32];
+    pthread_t thread;
+
+    journal_limit = get_config_long("S25_META_JOURNAL_ENTRIES", 4096);
+    long scan_threads = get_config_long("S25_META_SCAN_THREADS", 8);
+    if (journal_limit < 1) journal_limit = 1;
+    if (scan_threads < 1) scan_threads = 1;
+
+    snprintf(root_path, sizeof(root_path), "%s", root);
+    snprintf(meta_directory, sizeof(meta_directory), "%s/.meta", root);
+    mkdir(root_path, 0755);
+    mkdir(meta_directory, 0755);
+
+    bucket_count = 1024;
+    buckets = calloc(bucket_count, sizeof(*buckets));
+    snprintf(path, sizeof(path), "%s/journal", meta_directory);
+    journal_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (buckets == NULL || journal_fd < 0) {
+        perror("Metadata journal");
+        return -1;
+    }
+
+    long long started = wall_clock_us();
+    if (map_snapshot() == 0) {
+        long replayed = replay_journal();
+        printf("Metadata: %llu files from snapshot, %ld journal records replayed (%.1f ms)\n",
+               (unsigned long long)snapshot_count, replayed, (wall_clock_us() - started) / 1000.0);
+    } else {
+        size_t file_count = 0;
+        if (scan_tree(scan_threads, &file_count) < 0) {
+            printf("Metadata: directory scan failed\n");
+            return -1;
+        }
+        // The scan saw every change the journal describes
+        if (ftruncate(journal_fd, 0) == 0) fdatasync(journal_fd);
+        printf("Metadata: snapshot missing or corrupt, scanned %zu files with %ld threads (%.1f ms)\n",
+               file_count, scan_threads, (wall_clock_us() - started) / 1000.0);
+    }
+
+    if (pthread_create(&thread, NULL, merge_thread, NULL) == 0) {
+        pthread_detach(thread);
+    }
+    root_length = strlen(root_path);
+    return 0;
+}
+
+// Function to wake the merge thread once the journal is long enough
+static void check_merge(void) {
+    if (journal_records < journal_limit) return;
+    pthread_mutex_lock(&merge_lock);
+    pthread_cond_signal(&merge_wakeup);
+    pthread_mutex_unlock(&merge_lock);
+}
+
+// Function to record a file about to be published at path
+int meta_update(const char* path, long size, long mtime, uint32_t checksum, int sync) {
+    const char* key = relative_key(path);
+    if (key == NULL) return -1;
+
+    pthread_rwlock_wrlock(&meta_lock);
+    int result = append_journal(JOURNAL_PUT, key, size, mtime, checksum, META_CHECKSUM);
+    overlay_set(key, size, mtime, checksum, META_CHECKSUM, 0);
+    long records = journal_records;
+    pthread_rwlock_unlock(&meta_lock);
+
+    if (result == 0 && sync && fdatasync(journal_fd) < 0) result = -1;
+    if (records >= journal_limit) check_merge();
+    return result;
+}
+
+// Function to record a copy of from about to be published at path, keeping from's checksum
+int meta_copy(const char* from, const char* path, long size, long mtime, int sync) {
+    const char* from_key = relative_key(from);
+    const char* key = relative_key(path);
+    uint32_t checksum = 0;
+    uint32_t flags = 0;
+    if (key == NULL) return -1;
+
+    pthread_rwlock_wrlock(&meta_lock);
+    if (from_key != NULL) {
+        // The contents are the same, so a known checksum carries over without reading them
+        struct overlay_entry* entry = *find_link(from_key, hash_path(from_key));
+        uint64_t index = snapshot_lower_bound(from_key);
+        if (entry != NULL && !entry->deleted) {
+            checksum = entry->checksum;
+            flags = entry->flags;
+        } else if (entry == NULL && index < snapshot_count && strcmp(snapshot_path(index), from_key) == 0) {
+            checksum = snapshot_entries[index].checksum;
+            flags = snapshot_entries[index].flags;
+        }
+    }
+    int result = append_journal(JOURNAL_PUT, key, size, mtime, checksum, flags & META_CHECKSUM);
+    overlay_set(key, size, mtime, checksum, flags & META_CHECKSUM, 0);
+    long records = journal_records;
+    pthread_rwlock_unlock(&meta_lock);
+
+    if (result == 0 && sync && fdatasync(journal_fd) < 0) result = -1;
+    if (records >= journal_limit) check_merge();
+    return result;
+}
+
+// Function to record that path is about to be removed
+int meta_remove(const char* path, int sync) {
+    const char* key = relative_key(path);
+    if (key == NULL) return -1;
+
+    pthread_rwlock_wrlock(&meta_lock);
+    int result = 0;
+    if (key_known(key)) {
+        result = append_journal(JOURNAL_DELETE, key, 0, 0, 0, 0);
+        overlay_set(key, 0, 0, 0, 0, 1);
+    } else {
+        sync = 0;
+    }
+    long records = journal_records;
+    pthread_rwlock_unlock(&meta_lock);
+
+    if (result == 0 && sync && fdatasync(journal_fd) < 0) result = -1;
+    if (records >= journal_limit) check_merge();
+    return result;
+}
+
+// Function to re-read a path's real state after a failed publish or remove
+void meta_refresh(const char* path) {
+    const char* key = relative_key(path);
+    if (key == NULL) return;
+
+    pthread_rwlock_wrlock(&meta_lock);
+    refresh_key(key, NULL);
+    pthread_rwlock_unlock(&meta_lock);
+}
+
+// Function to visit every file in directory (and below it if recursive); -1 if
+// metadata is unavailable.  It is locked during the walk; visit must not call meta functions.
+int meta_list(const char* directory, int recursive,
+              void (*visit)(const char* path, long size, long mtime, void* user_data), void* user_data) {
+    char prefix[META_PATH + 1];
+    char bound[META_PATH + 2];
+    char path[META_PATH * 2];
+
+    if (root_length == 0) return -1;
+    if (strcmp(directory, root_path) == 0) {
+        prefix[0] = '\0';
+    } else {
+        const char* key = relative_key(directory);
+        if (key == NULL) return 0;
+        snprintf(prefix, sizeof(prefix), "%s/", key);
+    }
+    size_t prefix_length = strlen(prefix);
+
+    pthread_rwlock_rdlock(&meta_lock);
+    // The directory's files are one contiguous run of the sorted table
+    uint64_t index = snapshot_lower_bound(prefix);
+    while (index < snapshot_count) {
+        const char* key = snapshot_path(index);
+        if (strncmp(key, prefix, prefix_length) != 0) break;
+
+        const char* slash = strchr(key + prefix_length, '/');
+        if (slash != NULL && !recursive) {
+            // Skip the whole subdirectory: its paths sort before "<name>0" ('0' follows '/')
+            snprintf(bound, sizeof(bound), "%.*s0", (int)(slash - key), key);
+            index = snapshot_lower_bound(bound);
+            continue;
+        }
+        if (*find_link(key, hash_path(key)) == NULL) {
+            const struct snapshot_entry* entry = &snapshot_entries[index];
+            snprintf(path, sizeof(path), "%s/%s", root_path, key);
+            visit(path, entry->size, entry->mtime, user_data);
+        }
+        index++;
+    }
+
+    for (size_t i = 0; i < bucket_count; i++) {
+        for (struct overlay_entry* entry = buckets[i]; entry != NULL; entry = entry->next) {
+            if (entry->deleted || strncmp(entry->path, prefix, prefix_length) != 0) continue;
+            if (!recursive && strchr(entry->path + prefix_length, '/') != NULL) continue;
+            snprintf(path, sizeof(path), "%s/%s", root_path, entry->path);
+            visit(path, entry->size, entry->mtime, user_data);
+        }
+    }
+    pthread_rwlock_unlock(&meta_lock);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef S25META_H
+#define S25META_H
+
+#include <stdint.h>
+
+// Persistent metadata for the file-per-object storage layout.
+//
+// <root>/.meta/snapshot is a sorted path table (size, mtime and CRC-32 of
+// the contents per file) that is mapped read-only at startup, so a server
+// knows what it holds without walking the tree.  Changes since the
+// snapshot are appended to <root>/.meta/journal and kept in an in-memory
+// overlay; once the journal holds S25_META_JOURNAL_ENTRIES records a
+// background thread merges both into a new snapshot.
+//
+// Journal records are written before the file is published or removed.
+// On replay every journaled path is checked with lstat(), so a crash
+// between the journal write and the rename leaves no stale entry.  If the
+// snapshot is missing or corrupt, the tree is scanned by
+// S25_META_SCAN_THREADS threads and a new snapshot is written.
+//
+// Files added to the tree behind the server's back are not seen until the
+// snapshot is rebuilt (delete .meta/snapshot and restart).
+
+// Function to map the snapshot and replay the journal (or scan the tree) under root
+int meta_init(const char* root);
+
+// Function to record a file about to be published at path
+int meta_update(const char* path, long size, long mtime, uint32_t checksum, int sync);
+
+// Function to record a copy of from about to be published at path, keeping from's checksum
+int meta_copy(const char* from, const char* path, long size, long mtime, int sync);
+
+// Function to record that path is about to be removed
+int meta_remove(const char* path, int sync);
+
+// Function to re-read a path's real state after a failed publish or remove
+void meta_refresh(const char* path);
+
+// Function to visit every file in directory (and below it if recursive); -1 if
+// metadata is unavailable.  It is locked during the walk; visit must not call meta functions.
+int meta_list(const char* directory, int recursive,
+              void (*visit)(const char* path, long size, long mtime, void* user_data), void* user_data);
+
+#endif
@@ -0,0 +1,1140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "s25pack.h"
+#include "s25common.h"
+#include "s25pool.h"
+
+#define PACK_MAGIC 0x4b503532u       // "25PK"
+#define CHECKPOINT_MAGIC 0x50433532u // "25CP"
+#define RECORD_PUT 1
+#define RECORD_DELETE 2
+#define PACK_PATH 512
+#define COPY_CHUNK (64 * 1024)
+
+struct record_header {
+    uint32_t magic;
+    uint32_t crc; // CRC-32 of the header fields after crc, the path and the data; written at commit
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t path_length;
+    uint32_t data_length;
+    int64_t mtime;
+};
+
+struct checkpoint_header {
+    uint32_t magic;
+    uint32_t crc;        // CRC-32 of everything after this field
+    uint32_t segment_id; // replay resumes at this segment...
+    uint32_t segment_count;
+    uint64_t offset;     // ...and offset
+    uint64_t entry_count;
+};
+
+struct checkpoint_segment {
+    uint32_t id;
+    uint32_t reserved;
+    uint64_t dead;
+};
+
+struct checkpoint_entry {
+    uint32_t segment_id;
+    uint32_t length;
+    uint64_t offset;
+    int64_t mtime;
+    uint16_t path_length; // the path follows the entry
+    uint16_t reserved[3];
+};
+
+struct pack_segment {
+    uint32_t id;
+    int fd;
+    uint64_t size;
+    uint64_t dead;
+    int refs;    // readers, writers and the compactor currently using fd
+    int retired; // compacted away; freed when refs drops to 0
+};
+
+struct pack_entry {
+    struct pack_entry* next;
+    uint64_t hash;
+    struct pack_segment* segment;
+    uint64_t offset; // start of the record in its segment
+    uint32_t length;
+    int64_t mtime;
+    uint16_t path_length;
+    char path[]; // relative to root
+};
+
+struct pack_writer {
+    struct pack_writer* next; // pending writers
+    struct pack_segment* segment;
+    uint64_t offset;
+    uint64_t data_offset;
+    uint32_t length;
+    uint32_t written;
+    uint32_t crc;
+    int64_t mtime;
+    uint64_t generation;
+    int failed;
+    int cancelled;               // the file was deleted while being written
+    struct pack_segment* source; // compaction: the record being copied
+    uint64_t source_offset;
+    char key[PACK_PATH];
+};
+
+struct pack_reader {
+    struct pack_segment* segment;
+    uint64_t offset;
+    uint32_t remaining;
+};
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char root_path[PACK_PATH];
+static size_t root_length;
+static char pack_directory[PACK_PATH];
+static long max_size;
+static long segment_limit;
+static long compact_percent;
+static long compact_seconds;
+static long checkpoint_seconds;
+
+static struct pack_entry** buckets;
+static size_t bucket_count;
+static size_t entry_count;
+
+static struct pack_segment** segments;
+static int segment_count;
+static int segment_capacity;
+static struct pack_segment* active;
+static struct pack_writer* pending_writers;
+
+static uint64_t write_generation;
+static uint64_t synced_generation;
+static uint64_t change_count;
+static uint64_t checkpoint_changes;
+
+// Function to hash a relative path (FNV-1a)
+static uint64_t hash_path(const char* key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Function to get the on-disk size of a record
+static uint64_t record_size(size_t path_length, size_t data_length) {
+    return sizeof(struct record_header) + path_length + data_length;
+}
+
+// Function to order two log positions
+static int position_before(uint32_t first_id, uint64_t first_offset, uint32_t second_id, uint64_t second_offset) {
+    return first_id < second_id || (first_id == second_id && first_offset < second_offset);
+}
+
+// Function to turn a local path into a store key; NULL if outside root
+static const char* relative_key(const char* path) {
+    if (root_length == 0 || strncmp(path, root_path, root_length) != 0 || path[root_length] != '/') return NULL;
+    const char* key = path + root_length + 1;
+    return *key != '\0' && strlen(key) < PACK_PATH ? key : NULL;
+}
+
+// Function to find the link pointing at a key's entry
+static struct pack_entry** find_link(const char* key, uint64_t hash) {
+    struct pack_entry** link = &buckets[hash & (bucket_count - 1)];
+    while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->path, key) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Function to double the hash table once it is fuller than one entry per bucket
+static void grow_index(void) {
+    size_t new_count = bucket_count * 2;
+    struct pack_entry** new_buckets = calloc(new_count, sizeof(*new_buckets));
+    if (new_buckets == NULL) return;
+
+    for (size_t bucket = 0; bucket < bucket_count; bucket++) {
+        struct pack_entry* entry = buckets[bucket];
+        while (entry != NULL) {
+            struct pack_entry* next = entry->next;
+            entry->next = new_buckets[entry->hash & (new_count - 1)];
+            new_buckets[entry->hash & (new_count - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(buckets);
+    buckets = new_buckets;
+    bucket_count = new_count;
+}
+
+// Function to wake the compactor if a sealed segment is now mostly dead
+static void check_compaction(struct pack_segment* segment) {
+    if (segment != active && segment->size > 0 && segment->dead * 100 >= segment->size * compact_percent) {
+        pthread_cond_signal(&compact_wakeup);
+    }
+}
+
+// Function to point a key at a new record, marking the old record dead
+static int index_set(const char* key, struct pack_segment* segment, uint64_t offset, uint32_t length, int64_t mtime) {
+    uint64_t hash = hash_path(key);
+    struct pack_entry** link = find_link(key, hash);
+    struct pack_entry* entry = *link;
+
+    if (entry != NULL) {
+        entry->segment->dead += record_size(entry->path_length, entry->length);
+        check_compaction(entry->segment);
+    } else {
+        size_t path_length = strlen(key);
+        entry = malloc(sizeof(*entry) + path_length + 1);
+        if (entry == NULL) return -1;
+        memcpy(entry->path, key, path_length + 1);
+        entry->path_length = path_length;
+        entry->hash = hash;
+        entry->next = NULL;
+        *link = entry;
+        if (++entry_count > bucket_count) grow_index();
+    }
+
+    entry->segment = segment;
+    entry->offset = offset;
+    entry->length = length;
+    entry->mtime = mtime;
+    change_count++;
+    return 0;
+}
+
+// Function to drop a key from the index, marking its record dead
+static int index_remove(const char* key) {
+    struct pack_entry** link = find_link(key, hash_path(key));
+    struct pack_entry* entry = *link;
+    if (entry == NULL) return -1;
+
+    entry->segment->dead += record_size(entry->path_length, entry->length);
+    check_compaction(entry->segment);
+    *link = entry->next;
+    free(entry);
+    entry_count--;
+    change_count++;
+    return 0;
+}
+
+// Function to empty the index (a checkpoint turned out unusable)
+static void clear_index(void) {
+    for (size_t bucket = 0; bucket < bucket_count; bucket++) {
+        while (buckets[bucket] != NULL) {
+            struct pack_entry* entry = buckets[bucket];
+            buckets[bucket] = entry->next;
+            free(entry);
+        }
+    }
+    entry_count = 0;
+    for (int i = 0; i < segment_count; i++) {
+        segments[i]->dead = 0;
+    }
+}
+
+// Function to build a segment's file name
+static void segment_path(uint32_t id, char* path, size_t path_size) {
+    snprintf(path, path_size, "%s/segment-%08u", pack_directory, id);
+}
+
+// Function to find an open segment by ID
+static struct pack_segment* find_segment(uint32_t id) {
+    for (int i = 0; i < segment_count; i++) {
+        if (segments[i]->id == id) return segments[i];
+    }
+    return NULL;
+}
+
+// Function to open (or create) a segment and register it
+static struct pack_segment* add_segment(uint32_t id, int create) {
+    char path[PACK_PATH + 32];
+    struct stat info;
+
+    if (segment_count == segment_capacity) {
+        int new_capacity = segment_capacity ? segment_capacity * 2 : 16;
+        struct pack_segment** grown = realloc(segments, new_capacity * sizeof(*segments));
+        if (grown == NULL) return NULL;
+        segments = grown;
+        segment_capacity = new_capacity;
+    }
+
+    struct pack_segment* segment = calloc(1, sizeof(*segment));
+    if (segment == NULL) return NULL;
+
+    segment_path(id, path, sizeof(path));
+    segment->id = id;
+    segment->fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (segment->fd < 0 || fstat(segment->fd, &info) < 0) {
+        perror("Pack segment");
+        if (segment->fd >= 0) close(segment->fd);
+        free(segment);
+        return NULL;
+    }
+    segment->size = info.st_size;
+    segments[segment_count++] = segment;
+    return segment;
+}
+
+// Function to drop a reference taken on a segment
+static void release_segment(struct pack_segment* segment) {
+    pthread_mutex_lock(&store_lock);
+    if (--segment->refs == 0 && segment->retired) {
+        close(segment->fd);
+        free(segment);
+    }
+    pthread_mutex_unlock(&store_lock);
+}
+
+// Function to seal the active segment and start the next one
+static int rotate_segment(void) {
+    struct pack_segment* next = add_segment(active->id + 1, 1);
+    if (next == NULL) return -1;
+
+    // Everything committed so far is durable once the sealed segment is synced
+    if (fdatasync(active->fd) == 0) {
+        __atomic_store_n(&synced_generation, write_generation, __ATOMIC_RELEASE);
+    }
+    active = next;
+    return 0;
+}
+
+// Function to fill in a record header and return the CRC of its fields and path
+static uint32_t fill_header(struct record_header* header, int type, const char* key, uint32_t length, int64_t mtime) {
+    memset(header, 0, sizeof(*header));
+    header->magic = PACK_MAGIC;
+    header->type = type;
+    header->path_length = strlen(key);
+    header->data_length = length;
+    header->mtime = mtime;
+
+    uint32_t crc = crc32_update(0, &header->type, sizeof(*header) - offsetof(struct record_header, type));
+    return crc32_update(crc, key, header->path_length);
+}
+
+// Function to reserve space for a record and write its header and path; store_lock must be held
+static int reserve_record(const struct record_header* header, const char* key, uint64_t* offset) {
+    uint64_t size = record_size(header->path_length, header->data_length);
+
+    if (active->size > 0 && active->size + size > (uint64_t)segment_limit && rotate_segment() < 0) return -1;
+
+    // Headers go out under the lock, so a scan can always step over records being written
+    struct iovec parts[2] = {
+        { (void*)header, sizeof(*header) },
+        { (void*)key, header->path_length },
+    };
+    if (pwritev(active->fd, parts, 2, active->size) != (ssize_t)(sizeof(*header) + header->path_length)) {
+        if (ftruncate(active->fd, active->size) < 0) perror("Pack truncate");
+        return -1;
+    }
+
+    *offset = active->size;
+    active->size += size;
+    return 0;
+}
+
+// Function to append a tombstone for key; store_lock must be held
+static int append_tombstone(const char* key, int64_t mtime) {
+    struct record_header header;
+    uint64_t offset;
+
+    uint32_t crc = fill_header(&header, RECORD_DELETE, key, 0, mtime);
+    header.crc = crc;
+    if (reserve_record(&header, key, &offset) < 0) return -1;
+
+    // Tombstones only matter for replay; count them as dead space right away
+    active->dead += record_size(header.path_length, 0);
+    return 0;
+}
+
+// Function to check whether an upload of key is still being written; store_lock must be held
+static int key_pending(const char* key) {
+    for (struct pack_writer* writer = pending_writers; writer != NULL; writer = writer->next) {
+        if (strcmp(writer->key, key) == 0) return 1;
+    }
+    return 0;
+}
+
+// Function to check whether a segment still has records being written; store_lock must be held
+static int segment_pending(struct pack_segment* segment) {
+    for (struct pack_writer* writer = pending_writers; writer != NULL; writer = writer->next) {
+        if (writer->segment == segment) return 1;
+    }
+    return 0;
+}
+
+// Function to reserve the record for a writer and register it as pending
+static int start_writer(struct pack_writer* writer, uint32_t length, int64_t mtime) {
+    struct record_header header;
+
+    writer->crc = fill_header(&header, RECORD_PUT, writer->key, length, mtime);
+    writer->length = length;
+    writer->mtime = mtime;
+
+    pthread_mutex_lock(&store_lock);
+    if (reserve_record(&header, writer->key, &writer->offset) < 0) {
+        pthread_mutex_unlock(&store_lock);
+        return -1;
+    }
+    writer->segment = active;
+    writer->segment->refs++;
+    writer->data_offset = writer->offset + sizeof(header) + header.path_length;
+    writer->next = pending_writers;
+    pending_writers = writer;
+    pthread_mutex_unlock(&store_lock);
+    return 0;
+}
+
+// Function to end a write; returns 1 if the record was published, 0 if it was superseded, -1 on failure
+static int finish_writer(struct pack_writer* writer) {
+    int outcome = -1;
+
+    pthread_mutex_lock(&store_lock);
+    for (struct pack_writer** link = &pending_writers; *link != NULL; link = &(*link)->next) {
+        if (*link == writer) {
+            *link = writer->next;
+            break;
+        }
+    }
+
+    if (!writer->failed && writer->written == writer->length) {
+        struct pack_entry* entry = *find_link(writer->key, hash_path(writer->key));
+        int current;
+
+        if (writer->source != NULL) {
+            // A compaction copy only counts if nothing touched the file meanwhile
+            current = entry != NULL && entry->segment == writer->source && entry->offset == writer->source_offset &&
+                      !key_pending(writer->key);
+        } else {
+            // Log order decides between concurrent uploads, so replay agrees with the index
+            current = !writer->cancelled &&
+                      (entry == NULL || position_before(entry->segment->id, entry->offset, writer->segment->id, writer->offset));
+        }
+
+        if (!current) {
+            outcome = 0;
+        } else if (pwrite(writer->segment->fd, &writer->crc, sizeof(writer->crc),
+                          writer->offset + offsetof(struct record_header, crc)) == sizeof(writer->crc) &&
+                   index_set(writer->key, writer->segment, writer->offset, writer->length, writer->mtime) == 0) {
+            writer->generation = ++write_generation;
+            outcome = 1;
+        }
+    }
+
+    // An unpublished record keeps a zero CRC, so replay skips it
+    if (outcome != 1) {
+        writer->segment->dead += record_size(strlen(writer->key), writer->length);
+        check_compaction(writer->segment);
+    }
+    pthread_mutex_unlock(&store_lock);
+    return outcome;
+}
+
+// Function to make every commit up to a generation durable; concurrent callers share one fdatasync
+static int sync_generation(uint64_t wanted) {
+    int result = 0;
+
+    if (__atomic_load_n(&synced_generation, __ATOMIC_ACQUIRE) >= wanted) return 0;
+
+    pthread_mutex_lock(&sync_lock);
+    if (__atomic_load_n(&synced_generation, __ATOMIC_ACQUIRE) < wanted) {
+        // Whoever gets here first syncs for every commit made so far
+        pthread_mutex_lock(&store_lock);
+        uint64_t target = write_generation;
+        struct pack_segment* segment = active;
+        segment->refs++;
+        pthread_mutex_unlock(&store_lock);
+
+        result = fdatasync(segment->fd);
+        release_segment(segment);
+
+        uint64_t current = __atomic_load_n(&synced_generation, __ATOMIC_ACQUIRE);
+        while (result == 0 && current < target &&
+               !__atomic_compare_exchange_n(&synced_generation, &current, target, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        }
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return result;
+}
+
+// Function to make one writer's record durable
+static int sync_writer(struct pack_writer* writer) {
+    pthread_mutex_lock(&store_lock);
+    int in_active = writer->segment == active;
+    pthread_mutex_unlock(&store_lock);
+
+    // A record left behind in a sealed segment is synced on its own
+    return in_active ? sync_generation(writer->generation) : fdatasync(writer->segment->fd);
+}
+
+// Function to read a record's header and path; returns its size, 0 at a clean end, -1 if torn
+static long read_header(struct pack_segment* segment, uint64_t offset, struct record_header* header, char* key) {
+    if (offset >= segment->size) return 0;
+    if (pread(segment->fd, header, sizeof(*header), offset) != sizeof(*header) || header->magic != PACK_MAGIC) return -1;
+
+    uint64_t size = record_size(header->path_length, header->data_length);
+    if (header->path_length == 0 || header->path_length >= PACK_PATH || offset + size > segment->size ||
+        (header->type != RECORD_PUT && header->type != RECORD_DELETE)) return -1;
+
+    if (pread(segment->fd, key, header->path_length, offset + sizeof(*header)) != header->path_length) return -1;
+    key[header->path_length] = '\0';
+    return size;
+}
+
+// Function to check a record's CRC, reading its data in chunks
+static int verify_record(struct pack_segment* segment, uint64_t offset, const struct record_header* header, const char* key) {
+    char* buffer = pool_get(COPY_CHUNK);
+    struct record_header fields;
+    uint64_t position = offset + sizeof(*header) + header->path_length;
+    uint32_t remaining = header->data_length;
+
+    uint32_t crc = fill_header(&fields, header->type, key, header->data_length, header->mtime);
+    while (buffer != NULL && remaining > 0) {
+        size_t chunk = remaining < COPY_CHUNK ? remaining : COPY_CHUNK;
+        if (pread(segment->fd, buffer, chunk, position) != (ssize_t)chunk) break;
+        crc = crc32_update(crc, buffer, chunk);
+        position += chunk;
+        remaining -= chunk;
+    }
+    pool_put(buffer, COPY_CHUNK);
+    return buffer != NULL && remaining == 0 && crc == header->crc ? 0 : -1;
+}
+
+// Function to replay one segment into the index, starting at offset
+static void recover_segment(struct pack_segment* segment, uint64_t offset, int newest) {
+    struct record_header header;
+    char key[PACK_PATH];
+    long size;
+
+    while ((size = read_header(segment, offset, &header, key)) > 0) {
+        struct pack_entry* entry = *find_link(key, hash_path(key));
+
+        if (verify_record(segment, offset, &header, key) < 0) {
+            // Never committed: an interrupted, superseded or cancelled upload
+            segment->dead += size;
+        } else if (entry != NULL && entry->segment == segment && entry->offset == offset) {
+            // Already in the checkpoint
+        } else if (header.type == RECORD_PUT) {
+            if (entry == NULL || position_before(entry->segment->id, entry->offset, segment->id, offset)) {
+                index_set(key, segment, offset, header.data_length, header.mtime);
+            } else {
+                segment->dead += size;
+            }
+        } else {
+            if (entry != NULL && position_before(entry->segment->id, entry->offset, segment->id, offset)) {
+                index_remove(key);
+            }
+            segment->dead += size;
+        }
+        offset += size;
+    }
+
+    if (size < 0) {
+        printf("Pack segment %u: bad record at offset %llu\n", segment->id, (unsigned long long)offset);
+        if (newest && ftruncate(segment->fd, offset) == 0) {
+            segment->size = offset;
+        } else {
+            segment->dead += segment->size - offset;
+        }
+    }
+}
+
+// Function to check whether any live segment is older than id
+static int older_segment_exists(uint32_t id) {
+    for (int i = 0; i < segment_count; i++) {
+        if (segments[i]->id < id) return 1;
+    }
+    return 0;
+}
+
+// Function to write the index and replay position to the checkpoint file
+static int write_checkpoint(void) {
+    struct checkpoint_header header;
+    struct pack_segment** held;
+    char* body = NULL;
+    size_t body_size = 0;
+    char path[PACK_PATH + 32];
+    char temp_path[PACK_PATH + 32];
+    int result = 0;
+
+    pthread_mutex_lock(&checkpoint_lock);
+    pthread_mutex_lock(&store_lock);
+    uint64_t changes = change_count;
+    if (changes == checkpoint_changes) {
+        pthread_mutex_unlock(&store_lock);
+        pthread_mutex_unlock(&checkpoint_lock);
+        return 0;
+    }
+    held = malloc(segment_count * sizeof(*held));
+    FILE* stream = held ? open_memstream(&body, &body_size) : NULL;
+    if (stream == NULL) {
+        pthread_mutex_unlock(&store_lock);
+        free(held);
+        pthread_mutex_unlock(&checkpoint_lock);
+        return -1;
+    }
+
+    // Replay must resume at the oldest record still being written
+    memset(&header, 0, sizeof(header));
+    header.magic = CHECKPOINT_MAGIC;
+    header.segment_id = active->id;
+    header.offset = active->size;
+    for (struct pack_writer* writer = pending_writers; writer != NULL; writer = writer->next) {
+        if (position_before(writer->segment->id, writer->offset, header.segment_id, header.offset)) {
+            header.segment_id = writer->segment->id;
+            header.offset = writer->offset;
+        }
+    }
+
+    header.segment_count = segment_count;
+    for (int i = 0; i < segment_count; i++) {
+        struct checkpoint_segment saved = { segments[i]->id, 0, segments[i]->dead };
+        fwrite(&saved, sizeof(saved), 1, stream);
+        held[i] = segments[i];
+        held[i]->refs++;
+    }
+
+    header.entry_count = entry_count;
+    for (size_t bucket = 0; bucket < bucket_count; bucket++) {
+        for (struct pack_entry* entry = buckets[bucket]; entry != NULL; entry = entry->next) {
+            struct checkpoint_entry saved;
+            memset(&saved, 0, sizeof(saved));
+            saved.segment_id = entry->segment->id;
+            saved.length = entry->length;
+            saved.offset = entry->offset;
+            saved.mtime = entry->mtime;
+            saved.path_length = entry->path_length;
+            fwrite(&saved, sizeof(saved), 1, stream);
+            fwrite(entry->path, 1, entry->path_length, stream);
+        }
+    }
+    int held_count = segment_count;
+    pthread_mutex_unlock(&store_lock);
+    if (fclose(stream) != 0) result = -1;
+
+    // Everything the checkpoint points at must be on disk before it
+    for (int i = 0; i < held_count; i++) {
+        if (fdatasync(held[i]->fd) < 0) result = -1;
+        release_segment(held[i]);
+    }
+    free(held);
+
+    header.crc = crc32_update(0, &header.segment_id, sizeof(header) - offsetof(struct checkpoint_header, segment_id));
+    header.crc = crc32_update(header.crc, body, body_size);
+
+    // Write aside and rename, so a crash leaves the previous checkpoint intact
+    snprintf(path, sizeof(path), "%s/checkpoint", pack_directory);
+    snprintf(temp_path, sizeof(temp_path), "%s/checkpoint.tmp", pack_directory);
+    int fd = result == 0 ? open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (fd < 0 || write(fd, &header, sizeof(header)) != sizeof(header) ||
+        write(fd, body, body_size) != (ssize_t)body_size || fdatasync(fd) < 0) {
+        result = -1;
+    }
+    if (fd >= 0) close(fd);
+    if (result == 0 && rename(temp_path, path) < 0) result = -1;
+    if (result == 0) {
+        int directory = open(pack_directory, O_RDONLY | O_DIRECTORY);
+        if (directory >= 0) {
+            fsync(directory);
+            close(directory);
+        }
+        checkpoint_changes = changes;
+    }
+    free(body);
+    pthread_mutex_unlock(&checkpoint_lock);
+    return result;
+}
+
+// Function to load the checkpoint into the index; returns 0 and the replay position if usable
+static int load_checkpoint(uint32_t* segment_id, uint64_t* offset) {
+    char path[PACK_PATH + 32];
+    struct checkpoint_header header;
+    struct stat info;
+    char* body = NULL;
+    size_t body_size = 0;
+
+    snprintf(path, sizeof(path), "%s/checkpoint", pack_directory);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    int valid = fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(header) &&
+                read(fd, &header, sizeof(header)) == sizeof(header) && header.magic == CHECKPOINT_MAGIC;
+    if (valid) {
+        body_size = info.st_size - sizeof(header);
+        body = malloc(body_size ? body_size : 1);
+        valid = body != NULL && read(fd, body, body_size) == (ssize_t)body_size;
+    }
+    close(fd);
+    if (valid) {
+        uint32_t crc = crc32_update(0, &header.segment_id, sizeof(header) - offsetof(struct checkpoint_header, segment_id));
+        valid = crc32_update(crc, body, body_size) == header.crc &&
+                body_size >= header.segment_count * sizeof(struct checkpoint_segment);
+    }
+
+    // Segments compacted away since the checkpoint are fine as long as no entry points into them
+    size_t position = 0;
+    for (uint32_t i = 0; valid && i < header.segment_count; i++) {
+        struct checkpoint_segment saved;
+        memcpy(&saved, body + position, sizeof(saved));
+        position += sizeof(saved);
+        struct pack_segment* segment = find_segment(saved.id);
+        if (segment != NULL) segment->dead = saved.dead;
+    }
+    for (uint64_t i = 0; valid && i < header.entry_count; i++) {
+        struct checkpoint_entry saved;
+        char key[PACK_PATH];
+
+        if (body_size - position < sizeof(saved)) {
+            valid = 0;
+            break;
+        }
+        memcpy(&saved, body + position, sizeof(saved));
+        position += sizeof(saved);
+
+        struct pack_segment* segment = find_segment(saved.segment_id);
+        valid = saved.path_length > 0 && saved.path_length < PACK_PATH && body_size - position >= saved.path_length &&
+                segment != NULL && saved.offset + record_size(saved.path_length, saved.length) <= segment->size;
+        if (valid) {
+            memcpy(key, body + position, saved.path_length);
+            key[saved.path_length] = '\0';
+            position += saved.path_length;
+            valid = index_set(key, segment, saved.offset, saved.length, saved.mtime) == 0;
+        }
+    }
+    free(body);
+
+    if (!valid) {
+        printf("Pack checkpoint unusable, replaying the whole log\n");
+        clear_index();
+        return -1;
+    }
+    *segment_id = header.segment_id;
+    *offset = header.offset;
+    return 0;
+}
+
+// Function to copy one live record to the active segment; -1 if it has to be retried later
+static int copy_record(struct pack_segment* segment, uint64_t offset, const struct record_header* header, const char* key) {
+    struct pack_writer* writer = calloc(1, sizeof(*writer));
+    if (writer == NULL) return -1;
+
+    snprintf(writer->key, sizeof(writer->key), "%s", key);
+    writer->source = segment;
+    writer->source_offset = offset;
+    if (start_writer(writer, header->data_length, header->mtime) < 0) {
+        free(writer);
+        return -1;
+    }
+
+    uint64_t position = offset + sizeof(*header) + header->path_length;
+    uint32_t remaining = header->data_length;
+    char* buffer = pool_get(COPY_CHUNK);
+    if (buffer == NULL) writer->failed = 1;
+    while (remaining > 0 && !writer->failed) {
+        size_t chunk = remaining < COPY_CHUNK ? remaining : COPY_CHUNK;
+        if (pread(segment->fd, buffer, chunk, position) != (ssize_t)chunk || pack_write(writer, buffer, chunk) < 0) {
+            writer->failed = 1;
+        }
+        position += chunk;
+        remaining -= chunk;
+    }
+    pool_put(buffer, COPY_CHUNK);
+
+    int outcome = finish_writer(writer);
+    release_segment(writer->segment);
+    free(writer);
+    if (outcome != 0) return outcome < 0 ? -1 : 0;
+
+    // Not copied: fine if the file changed, but an upload still in flight means try again later
+    pthread_mutex_lock(&store_lock);
+    struct pack_entry* entry = *find_link(key, hash_path(key));
+    int still_here = entry != NULL && entry->segment == segment && entry->offset == offset;
+    pthread_mutex_unlock(&store_lock);
+    return still_here ? -1 : 0;
+}
+
+// Function to move the live records of a sealed segment to the active one
+static int compact_segment(struct pack_segment* segment) {
+    struct record_header header;
+    char key[PACK_PATH];
+    uint64_t offset = 0;
+    long size;
+    int result = 0;
+
+    while (result == 0 && (size = read_header(segment, offset, &header, key)) > 0) {
+        pthread_mutex_lock(&store_lock);
+        struct pack_entry* entry = *find_link(key, hash_path(key));
+        int live = header.type == RECORD_PUT && entry != NULL && entry->segment == segment && entry->offset == offset;
+
+        // Keep a tombstone while an older segment may still hold the file
+        if (header.type == RECORD_DELETE && entry == NULL && older_segment_exists(segment->id) &&
+            append_tombstone(key, header.mtime) < 0) {
+            result = -1;
+        }
+        pthread_mutex_unlock(&store_lock);
+
+        if (live && result == 0) result = copy_record(segment, offset, &header, key);
+        offset += size;
+    }
+    if (size < 0) result = -1;
+    return result;
+}
+
+// Function to compact sealed segments whose dead space passed the threshold
+static void* compaction_thread(void* argument) {
+    (void)argument;
+
+    pthread_mutex_lock(&store_lock);
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += compact_seconds;
+        pthread_cond_timedwait(&compact_wakeup, &store_lock, &deadline);
+
+        // A segment that still has uploads being written into it waits for them
+        struct pack_segment* candidate = NULL;
+        for (int i = 0; i < segment_count && candidate == NULL; i++) {
+            struct pack_segment* segment = segments[i];
+            if (segment != active && segment->size > 0 && segment->dead * 100 >= segment->size * compact_percent &&
+                !segment_pending(segment)) {
+                candidate = segment;
+            }
+        }
+        if (candidate == NULL) continue;
+
+        candidate->refs++;
+        pthread_mutex_unlock(&store_lock);
+
+        int result = compact_segment(candidate);
+        pthread_mutex_lock(&store_lock);
+        struct pack_segment* target = active;
+        target->refs++;
+        pthread_mutex_unlock(&store_lock);
+
+        // The copies must be on disk before the old segment disappears
+        if (result == 0 && fdatasync(target->fd) < 0) result = -1;
+        release_segment(target);
+
+        // Checkpoint first so the saved index no longer points into the segment
+        if (result == 0 && checkpoint_seconds > 0 && write_checkpoint() < 0) result = -1;
+
+        pthread_mutex_lock(&store_lock);
+        if (result == 0) {
+            char path[PACK_PATH + 32];
+            segment_path(candidate->id, path, sizeof(path));
+            unlink(path);
+            for (int i = 0; i < segment_count; i++) {
+                if (segments[i] == candidate) segments[i] = segments[--segment_count];
+            }
+            candidate->retired = 1;
+            printf("Pack segment %u compacted\n", candidate->id);
+        } else {
+            printf("Pack segment %u: compaction deferred\n", candidate->id);
+        }
+        if (--candidate->refs == 0 && candidate->retired) {
+            close(candidate->fd);
+            free(candidate);
+        }
+    }
+    return NULL;
+}
+
+// Function to checkpoint the index periodically
+static void* checkpoint_thread(void* argument) {
+    (void)argument;
+
+    while (1) {
+        sleep(checkpoint_seconds);
+        if (write_checkpoint() < 0) {
+            printf("Pack checkpoint failed\n");
+        }
+    }
+    return NULL;
+}
+
+// Function to sort segment IDs
+static int compare_ids(const void* first, const void* second) {
+    uint32_t a = *(const uint32_t*)first;
+    uint32_t b = *(const uint32_t*)second;
+    return a < b ? -1 : a > b;
+}
+
+// Function to open and recover the store under root; a max_file_size of 0 disables it
+int pack_init(const char* root, long max_file_size) {
+    uint32_t* ids = NULL;
+    int id_count = 0;
+    int id_capacity = 0;
+    uint32_t start_id = 0;
+    uint64_t start_offset = 0;
+    pthread_t thread;
+
+    if (max_file_size <= 0) return 0;
+    if (max_file_size > 0xffffffffL) max_file_size = 0xffffffffL;
+
+    segment_limit = get_config_long("S25_PACK_SEGMENT_SIZE", 64L * 1024 * 1024);
+    compact_percent = get_config_long("S25_PACK_COMPACT_PERCENT", 50);
+    compact_seconds = get_config_long("S25_PACK_COMPACT_SECONDS", 10);
+    checkpoint_seconds = get_config_long("S25_PACK_CHECKPOINT_SECONDS", 30);
+    if (compact_seconds < 1) compact_seconds = 1;
+
+    snprintf(root_path, sizeof(root_path), "%s", root);
+    snprintf(pack_directory, sizeof(pack_directory), "%s/.pack", root);
+    mkdir(root_path, 0755);
+    mkdir(pack_directory, 0755);
+
+    bucket_count = 1024;
+    buckets = calloc(bucket_count, sizeof(*buckets));
+    if (buckets == NULL) return -1;
+
+    // Open the segments oldest first
+    DIR* directory = opendir(pack_directory);
+    if (directory == NULL) {
+        perror("Pack directory");
+        return -1;
+    }
+    struct dirent* entry;
+    unsigned id;
+    while ((entry = readdir(directory)) != NULL) {
+        if (sscanf(entry->d_name, "segment-%08u", &id) != 1) continue;
+        if (id_count == id_capacity) {
+            id_capacity = id_capacity ? id_capacity * 2 : 16;
+            ids = realloc(ids, id_capacity * sizeof(*ids));
+            if (ids == NULL) {
+                closedir(directory);
+                return -1;
+            }
+        }
+        ids[id_count++] = id;
+    }
+    closedir(directory);
+    qsort(ids, id_count, sizeof(*ids), compare_ids);
+    for (int i = 0; i < id_count; i++) {
+        add_segment(ids[i], 0);
+    }
+    free(ids);
+
+    // Replay only what was logged after the checkpoint (everything without one)
+    int from_checkpoint = load_checkpoint(&start_id, &start_offset) == 0;
+    for (int i = 0; i < segment_count; i++) {
+        struct pack_segment* segment = segments[i];
+        if (segment->id < start_id) continue;
+        recover_segment(segment, segment->id == start_id ? start_offset : 0, i == segment_count - 1);
+    }
+    checkpoint_changes = from_checkpoint ? change_count : 0;
+
+    active = segment_count > 0 ? segments[segment_count - 1] : add_segment(1, 1);
+    if (active == NULL) return -1;
+
+    if (pthread_create(&thread, NULL, compaction_thread, NULL) == 0) {
+        pthread_detach(thread);
+    }
+    if (checkpoint_seconds > 0 && pthread_create(&thread, NULL, checkpoint_thread, NULL) == 0) {
+        pthread_detach(thread);
+    }
+
+    root_length = strlen(root_path);
+    max_size = max_file_size;
+    printf("Pack store: %zu files in %d segments (%s), files up to %ld bytes\n", entry_count, segment_count,
+           from_checkpoint ? "checkpoint + log tail" : "full log replay", max_size);
+    return 0;
+}
+
+// Function to get the largest file size the store accepts (0 when disabled)
+long pack_max_file_size(void) {
+    return max_size;
+}
+
+// Function to reserve a record for a file of exactly length bytes; NULL on failure
+struct pack_writer* pack_create(const char* path, long length, long mtime) {
+    const char* key = relative_key(path);
+    if (key == NULL || length < 0 || length > max_size) return NULL;
+
+    struct pack_writer* writer = calloc(1, sizeof(*writer));
+    if (writer == NULL) return NULL;
+
+    snprintf(writer->key, sizeof(writer->key), "%s", key);
+    if (start_writer(writer, length, mtime) < 0) {
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+// Function to append the next part of the file's data
+int pack_write(struct pack_writer* writer, const void* data, size_t length) {
+    const char* bytes = data;
+    size_t done = 0;
+
+    if (writer->failed || length > writer->length - writer->written) {
+        writer->failed = 1;
+        return -1;
+    }
+    while (done < length) {
+        ssize_t written = pwrite(writer->segment->fd, bytes + done, length - done, writer->data_offset + writer->written + done);
+        if (written <= 0) {
+            writer->failed = 1;
+            return -1;
+        }
+        done += written;
+    }
+    writer->crc = crc32_update(writer->crc, data, length);
+    writer->written += length;
+    return 0;
+}
+
+// Function to publish the file, replacing any previous version; sync makes it durable first.
+// Frees the writer.
+int pack_commit(struct pack_writer* writer, int sync) {
+    int outcome = finish_writer(writer);
+    int result = outcome < 0 ? -1 : 0;
+
+    if (outcome == 1 && sync && sync_writer(writer) < 0) result = -1;
+    release_segment(writer->segment);
+    free(writer);
+    return result;
+}
+
+// Function to drop an unfinished file; frees the writer
+void pack_abort(struct pack_writer* writer) {
+    writer->failed = 1;
+    finish_writer(writer);
+    release_segment(writer->segment);
+    free(writer);
+}
+
+// Function to open a stored file for reading; NULL if it is not stored
+struct pack_reader* pack_open(const char* path, long* size) {
+    const char* key = relative_key(path);
+    struct pack_reader* reader = NULL;
+
+    if (key == NULL) return NULL;
+
+    pthread_mutex_lock(&store_lock);
+    struct pack_entry* entry = *find_link(key, hash_path(key));
+    if (entry != NULL && (reader = malloc(sizeof(*reader))) != NULL) {
+        reader->segment = entry->segment;
+        reader->segment->refs++;
+        reader->offset = entry->offset + sizeof(struct record_header) + entry->path_length;
+        reader->remaining = entry->length;
+        *size = entry->length;
+    }
+    pthread_mutex_unlock(&store_lock);
+    return reader;
+}
+
+// Function to read the next part of a file; returns bytes read, 0 at the end, -1 on error
+long pack_read(struct pack_reader* reader, void* buffer, size_t length) {
+    if (length > reader->remaining) length = reader->remaining;
+    if (length == 0) return 0;
+
+    ssize_t got = pread(reader->segment->fd, buffer, length, reader->offset);
+    if (got <= 0) return -1;
+    reader->offset += got;
+    reader->remaining -= got;
+    return got;
+}
+
+// Function to get the segment descriptor and offset a reader's remaining data starts at
+int pack_extent(struct pack_reader* reader, int* fd, long* offset) {
+    // Records are never rewritten in place, so the range stays valid for as long as fd is open
+    *fd = reader->segment->fd;
+    *offset = reader->offset;
+    return 0;
+}
+
+// Function to close a reader
+void pack_close(struct pack_reader* reader) {
+    release_segment(reader->segment);
+    free(reader);
+}
+
+// Function to check whether a path is stored; returns its size or -1
+long pack_stat(const char* path, long* mtime) {
+    const char* key = relative_key(path);
+    long size = -1;
+
+    if (key == NULL) return -1;
+
+    pthread_mutex_lock(&store_lock);
+    struct pack_entry* entry = *find_link(key, hash_path(key));
+    if (entry != NULL) {
+        size = entry->length;
+        if (mtime) *mtime = entry->mtime;
+    }
+    pthread_mutex_unlock(&store_lock);
+    return size;
+}
+
+// Function to delete a stored file; -1 if it was not stored
+int pack_delete(const char* path) {
+    const char* key = relative_key(path);
+    int result = -1;
+
+    if (key == NULL) return -1;
+
+    pthread_mutex_lock(&store_lock);
+    if (*find_link(key, hash_path(key)) != NULL && append_tombstone(key, time(NULL)) == 0) {
+        // Uploads of the file still in flight are older than the tombstone
+        for (struct pack_writer* writer = pending_writers; writer != NULL; writer = writer->next) {
+            if (strcmp(writer->key, key) == 0) writer->cancelled = 1;
+        }
+        result = index_remove(key);
+    }
+    pthread_mutex_unlock(&store_lock);
+    return result;
+}
+
+// Function to visit every stored file in directory (and below it if recursive)
+void pack_list(const char* directory, int recursive,
+               void (*visit)(const char* path, long size, long mtime, void* user_data), void* user_data) {
+    char full_path[PACK_PATH * 2];
+    char normalized[PACK_PATH];
+    const char* prefix;
+    size_t prefix_length;
+
+    if (root_length == 0) return;
+
+    // Accept the directory with or without trailing slashes
+    snprintf(normalized, sizeof(normalized), "%s", directory);
+    size_t length = strlen(normalized);
+    while (length > 1 && normalized[length - 1] == '/') normalized[--length] = '\0';
+
+    if (strcmp(normalized, root_path) == 0) {
+        prefix = "";
+    } else if ((prefix = relative_key(normalized)) == NULL) {
+        return;
+    }
+    prefix_length = strlen(prefix);
+
+    pthread_mutex_lock(&store_lock);
+    for (size_t bucket = 0; bucket < bucket_count; bucket++) {
+        for (struct pack_entry* entry = buckets[bucket]; entry != NULL; entry = entry->next) {
+            const char* rest = entry->path;
+            if (prefix_length > 0) {
+                if (strncmp(entry->path, prefix, prefix_length) != 0 || entry->path[prefix_length] != '/') continue;
+                rest = entry->path + prefix_length + 1;
+            }
+            if (!recursive && strchr(rest, '/') != NULL) continue;
+
+            snprintf(full_path, sizeof(full_path), "%s/%s", root_path, entry->path);
+            visit(full_path, entry->length, entry->mtime, user_data);
+        }
+    }
+    pthread_mutex_unlock(&store_lock);
+}
@@ -0,0 +1,74 @@
+#ifndef S25PACK_H
+#define S25PACK_H
+
+#include <stddef.h>
+
+// Log-structured store for file contents (storage servers).
+//
+// Files are appended as records to large segment files under <root>/.pack
+// instead of getting an inode each:
+//
+//   header (magic, crc32, type, path length, data length, mtime) | path | data
+//
+// An in-memory hash index maps each path to its latest record, so a read
+// is one pread and a write is one sequential append.  A writer reserves
+// its record up front and streams the data into it; the record only
+// becomes valid when its CRC is written at commit, so a half-received
+// upload is never visible, not even after a crash.  Deletes append a
+// tombstone.
+//
+// The index is checkpointed to <root>/.pack/checkpoint every
+// S25_PACK_CHECKPOINT_SECONDS.  At startup the checkpoint is loaded and
+// only the log written after it is replayed (a torn record at the tail of
+// the newest segment is cut off).  A background thread rewrites the live
+// records of segments whose dead space passes S25_PACK_COMPACT_PERCENT and
+// unlinks them.
+//
+// Paths are the server's local paths; only files below root are stored.
+
+struct pack_writer;
+struct pack_reader;
+
+// Function to open and recover the store under root; a max_file_size of 0 disables it
+int pack_init(const char* root, long max_file_size);
+
+// Function to get the largest file size the store accepts (0 when disabled)
+long pack_max_file_size(void);
+
+// Function to reserve a record for a file of exactly length bytes; NULL on failure
+struct pack_writer* pack_create(const char* path, long length, long mtime);
+
+// Function to append the next part of the file's data
+int pack_write(struct pack_writer* writer, const void* data, size_t length);
+
+// Function to publish the file, replacing any previous version; sync makes it durable first.
+// Frees the writer.
+int pack_commit(struct pack_writer* writer, int sync);
+
+// Function to drop an unfinished file; frees the writer
+void pack_abort(struct pack_writer* writer);
+
+// Function to open a stored file for reading; NULL if it is not stored
+struct pack_reader* pack_open(const char* path, long* size);
+
+// Function to read the next part of a file; returns bytes read, 0 at the end, -1 on error
+long pack_read(struct pack_reader* reader, void* buffer, size_t length);
+
+// Function to close a reader
+void pack_close(struct pack_reader* reader);
+
+// Function to get the segment descriptor and offset a reader's remaining data starts at
+int pack_extent(struct pack_reader* reader, int* fd, long* offset);
+
+// Function to check whether a path is stored; returns its size or -1
+long pack_stat(const char* path, long* mtime);
+
+// Function to delete a stored file; -1 if it was not stored
+int pack_delete(const char* path);
+
+// Function to visit every stored file in directory (and below it if recursive).
+// The store is locked during the walk; visit must not call pack functions.
+void pack_list(const char* directory, int recursive,
+               void (*visit)(const char* path, long size, long mtime, void* user_data), void* user_data);
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "s25pool.h"
+#include "s25common.h"
+
+#define PAGE_SHIFT 12
+#define POOL_CLASSES 11     // 4 KB << 0 .. 4 KB << 10 = 4 MB
+#define POOL_CACHE 4        // buffers of each size a thread keeps for itself
+#define HUGE_PAGE (2L * 1024 * 1024)
+
+// Buffers a thread freed most recently, reused before the shared free lists
+struct thread_cache {
+    void* buffers[POOL_CLASSES][POOL_CACHE];
+    int counts[POOL_CLASSES];
+};
+
+static char* arena;
+static size_t arena_size;
+static size_t carved;                     // bytes of the arena handed out so far
+static uint64_t free_lists[POOL_CLASSES]; // (generation << 32) | (page index + 1) of the top buffer
+static size_t io_size;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static __thread struct thread_cache* cache;
+
+// Function to get the size class of a request; POOL_CLASSES if it is too large for the pool
+static int size_class(size_t size) {
+    int class = 0;
+    while (class < POOL_CLASSES && ((size_t)1 << (PAGE_SHIFT + class)) < size) class++;
+    return class;
+}
+
+// Function to push a free arena buffer onto its size's list
+static void push_free(int class, void* buffer) {
+    uint64_t index = (uint64_t)(((char*)buffer - arena) >> PAGE_SHIFT) + 1;
+    uint64_t top = __atomic_load_n(&free_lists[class], __ATOMIC_ACQUIRE);
+    uint64_t next;
+
+    // The generation changes on every push and pop, so a stale top never matches (no ABA)
+    do {
+        __atomic_store_n((uint64_t*)buffer, top & 0xffffffff, __ATOMIC_RELAXED);
+        next = ((top >> 32) + 1) << 32 | index;
+    } while (!__atomic_compare_exchange_n(&free_lists[class], &top, next, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+// Function to pop a free arena buffer of a size; NULL if there is none
+static void* pop_free(int class) {
+    uint64_t top = __atomic_load_n(&free_lists[class], __ATOMIC_ACQUIRE);
+    uint64_t next;
+    char* buffer;
+
+    // Arena memory is never unmapped, so reading a buffer another thread just took is harmless
+    do {
+        if ((top & 0xffffffff) == 0) return NULL;
+        buffer = arena + (((top & 0xffffffff) - 1) << PAGE_SHIFT);
+        next = ((top >> 32) + 1) << 32 | __atomic_load_n((uint64_t*)buffer, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&free_lists[class], &top, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return buffer;
+}
+
+// Function to take a new buffer of a size from the unused end of the arena; NULL when it is used up
+static void* carve(int class) {
+    size_t size = (size_t)1 << (PAGE_SHIFT + class);
+    size_t offset = __atomic_load_n(&carved, __ATOMIC_RELAXED);
+
+    do {
+        if (offset + size > arena_size) return NULL;
+    } while (!__atomic_compare_exchange_n(&carved, &offset, offset + size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return arena + offset;
+}
+
+// Function to hand a thread's cached buffers back to the free lists as it exits
+static void flush_cache(void* argument) {
+    struct thread_cache* exiting = argument;
+
+    for (int class = 0; class < POOL_CLASSES; class++) {
+        for (int i = 0; i < exiting->counts[class]; i++) push_free(class, exiting->buffers[class][i]);
+    }
+    free(exiting);
+}
+
+// Function to map the arena once per process tree
+static void setup_pool(void) {
+    long pool_bytes = get_config_long("S25_POOL_BYTES", 64L * 1024 * 1024);
+    int hugepages = get_config_long("S25_POOL_HUGEPAGES", 0) != 0;
+    long io_bytes = get_config_long("S25_IO_BUFFER", 256 * 1024);
+
+    io_size = io_bytes < 4096 ? 4096 : (size_t)io_bytes;
+    pthread_key_create(&cache_key, flush_cache);
+    if (pool_bytes <= 0) return;
+
+    // Pages are only backed once a buffer is first used
+    arena_size = (size_t)pool_bytes;
+    arena = MAP_FAILED;
+    if (hugepages) {
+        arena_size = (arena_size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+        arena = mmap(NULL, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_HUGETLB,
+                     -1, 0);
+    }
+    if (arena == MAP_FAILED) {
+        arena = mmap(NULL, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (arena != MAP_FAILED && hugepages) madvise(arena, arena_size, MADV_HUGEPAGE);
+    }
+    if (arena == MAP_FAILED) {
+        perror("Buffer pool");
+        arena = NULL;
+        arena_size = 0;
+    }
+}
+
+// Function to read the S25_POOL_* settings and map the arena; optional, call before forking/threads
+int pool_init(void) {
+    pthread_once(&pool_once, setup_pool);
+    printf("Buffer pool: %zu byte arena, %zu byte transfer buffers\n", arena_size, io_size);
+    return arena != NULL ? 0 : -1;
+}
+
+// Function to get the size of the buffer a transfer loop should use
+size_t pool_io_size(void) {
+    pthread_once(&pool_once, setup_pool);
+    return io_size;
+}
+
+// Function to get a page-aligned buffer of at least size bytes; NULL if out of memory
+void* pool_get(size_t size) {
+    pthread_once(&pool_once, setup_pool);
+    int class = size_class(size);
+    void* buffer = NULL;
+
+    if (arena != NULL && class < POOL_CLASSES) {
+        if (cache != NULL && cache->counts[class] > 0) return cache->buffers[class][--cache->counts[class]];
+        buffer = pop_free(class);
+        if (buffer == NULL) buffer = carve(class);
+    }
+
+    // Past the cap, or too large to pool: a buffer of its own
+    if (buffer == NULL && posix_memalign(&buffer, (size_t)1 << PAGE_SHIFT, size > 0 ? size : 1) != 0) return NULL;
+    return buffer;
+}
+
+// Function to give a buffer back; size must be the one it was got with
+void pool_put(void* buffer, size_t size) {
+    if (buffer == NULL) return;
+    if (arena == NULL || (char*)buffer < arena || (char*)buffer >= arena + arena_size) {
+        free(buffer);
+        return;
+    }
+
+    // The thread's cache is set up on first use, so its exit hands the buffers back
+    int class = size_class(size);
+    if (cache == NULL && (cache = calloc(1, sizeof(*cache))) != NULL) pthread_setspecific(cache_key, cache);
+    if (cache != NULL && cache->counts[class] < POOL_CACHE) {
+        cache->buffers[class][cache->counts[class]++] = buffer;
+    } else {
+        push_free(class, buffer);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef S25POOL_H
+#define S25POOL_H
+
+#include <stddef.h>
+
+// Shared pool of page-aligned I/O buffers, used by every transfer path.
+//
+// Buffers come in power-of-two sizes from 4 KB to 4 MB, carved out of one
+// arena of S25_POOL_BYTES.  A returned buffer goes to a small cache of the
+// thread that freed it, then to a lock-free free list for its size, so a
+// steady stream of transfers reuses the same memory without locking or
+// touching new pages.  A thread's cache goes back to the free lists when it
+// exits.  When the arena is used up, or for larger sizes, buffers are
+// allocated on their own and freed when put back.
+//
+// The pool is per process: each of S1's forked children has its own arena,
+// which costs memory only for the pages it actually uses.
+//
+//   S25_POOL_BYTES       arena size, the most memory pooled buffers take
+//                        (default 64 MB)
+//   S25_POOL_HUGEPAGES   1 = back the arena with huge pages, reserved ones
+//                        if there are any, else transparent (default 0)
+//   S25_IO_BUFFER        size of the buffer a transfer loop uses
+//                        (default 256 KB)
+
+// Function to read the S25_POOL_* settings and map the arena; optional, call before forking/threads
+int pool_init(void);
+
+// Function to get the size of the buffer a transfer loop should use
+size_t pool_io_size(void);
+
+// Function to get a page-aligned buffer of at least size bytes; NULL if out of memory
+void* pool_get(size_t size);
+
+// Function to give a buffer back; size must be the one it was got with
+void pool_put(void* buffer, size_t size);
+
+#endif
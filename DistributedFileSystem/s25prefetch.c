@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "s25prefetch.h"
+#include "s25common.h"
+#include "s25stats.h"
+#include "s25pool.h"
+
+#define PAGE 4096
+
+// Where the prefetch thread is with each entry
+enum { ENTRY_QUEUED, ENTRY_READING, ENTRY_DONE, ENTRY_TAKEN };
+
+struct prefetch_batch {
+    const struct tar_list* list;
+    const struct tar_source* source;
+    const unsigned char* wanted;
+    unsigned char* state;
+    int reader;  // index of the entry after the one the writer last reached
+    int reached; // entries the writer has reached
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t moved;
+};
+
+static long readahead_bytes;
+static long read_chunk;
+static long prefetch_files;
+static long prefetch_bytes;
+
+// Function to read the S25_READAHEAD_* and S25_PREFETCH_* settings; call before forking/threads
+int prefetch_init(void) {
+    readahead_bytes = get_config_long("S25_READAHEAD_BYTES", 4L * 1024 * 1024);
+    read_chunk = get_config_long("S25_READ_CHUNK", 256 * 1024);
+    prefetch_files = get_config_long("S25_PREFETCH_FILES", 8);
+    prefetch_bytes = get_config_long("S25_PREFETCH_BYTES", 8L * 1024 * 1024);
+
+    // Whole pages, so chunk-aligned reads are page-aligned too
+    if (read_chunk < PAGE) read_chunk = PAGE;
+    read_chunk -= read_chunk % PAGE;
+    if (readahead_bytes < 0) readahead_bytes = 0;
+    if (prefetch_files < 0) prefetch_files = 0;
+    stats_init_prefetch();
+    return 0;
+}
+
+// Function to get the size reads of a sequential transfer should use
+long prefetch_read_size(void) {
+    return read_chunk > 0 ? read_chunk : 256 * 1024;
+}
+
+// Function to get how much to read first so later reads start on chunk boundaries of the file
+long prefetch_first_read(long offset, long length) {
+    long chunk = prefetch_read_size();
+    long first = chunk - offset % chunk;
+    return first < length ? first : length;
+}
+
+// Function to mark length bytes of fd from offset as read sequentially and request the first window
+void prefetch_sequential(int fd, long offset, long length) {
+    if (readahead_bytes <= 0 || length <= 0) return;
+
+    // Doubles the kernel's own read-ahead for this file and drops pages behind the reader sooner
+    posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, offset, length < readahead_bytes ? length : readahead_bytes, POSIX_FADV_WILLNEED);
+}
+
+// Function to keep the window requested ahead of a sequential reader at position; returns the new end of the
+// requested range (start with hinted = offset)
+long prefetch_ahead(int fd, long position, long hinted, long end) {
+    if (readahead_bytes <= 0) return end;
+
+    // Asking again once half the window is used keeps the disk busy without a request per read
+    if (hinted < position + readahead_bytes / 2) {
+        if (hinted < position) hinted = position;
+        long target = position + readahead_bytes < end ? position + readahead_bytes : end;
+        if (target > hinted) posix_fadvise(fd, hinted, target - hinted, POSIX_FADV_WILLNEED);
+        hinted = target;
+    }
+    return hinted;
+}
+
+// Function to read the start of one entry into the page cache; returns the bytes read ahead
+static long warm_entry(const struct tar_entry* entry, const struct tar_source* source) {
+    long size = entry->size;
+    long wanted = size < prefetch_bytes ? size : prefetch_bytes;
+    long offset = 0;
+    int fd = -1;
+    void* handle = NULL;
+
+    if (source == NULL) {
+        fd = open(entry->source, O_RDONLY);
+    } else if ((handle = source->open(entry->source, &size)) != NULL && source->extent != NULL &&
+               source->extent(handle, &fd, &offset) < 0) {
+        fd = -1;
+    }
+
+    // readahead() returns once the pages are in the cache; a source without a descriptor is read through
+    long warmed = 0;
+    if (fd >= 0 && wanted > 0 && readahead(fd, offset, wanted) == 0) {
+        warmed = wanted;
+    } else if (handle != NULL && fd < 0) {
+        size_t buffer_size = pool_io_size();
+        char* buffer = pool_get(buffer_size);
+        long got;
+        while (buffer != NULL && warmed < wanted && (got = source->read(handle, buffer, buffer_size)) > 0) warmed += got;
+        pool_put(buffer, buffer_size);
+    }
+
+    if (handle != NULL) source->close(handle);
+    if (source == NULL && fd >= 0) close(fd);
+    return warmed;
+}
+
+// Function to read entries ahead of the writer, at most S25_PREFETCH_FILES of them
+static void* prefetch_thread(void* argument) {
+    struct prefetch_batch* batch = argument;
+
+    for (int index = 0; index < batch->list->count; index++) {
+        pthread_mutex_lock(&batch->lock);
+        while (!batch->stop && index >= batch->reader + prefetch_files) {
+            pthread_cond_wait(&batch->moved, &batch->lock);
+        }
+
+        // Entries the writer has already passed, or copies without reading, are skipped
+        int skip = batch->stop || index < batch->reader || (batch->wanted != NULL && !batch->wanted[index]);
+        if (batch->stop) {
+            pthread_mutex_unlock(&batch->lock);
+            break;
+        }
+        if (!skip) batch->state[index] = ENTRY_READING;
+        pthread_mutex_unlock(&batch->lock);
+        if (skip) continue;
+
+        long warmed = warm_entry(&batch->list->entries[index], batch->source);
+        stats_count_prefetch_bytes(warmed);
+
+        pthread_mutex_lock(&batch->lock);
+        if (batch->state[index] == ENTRY_READING) batch->state[index] = ENTRY_DONE;
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+// Function to start reading the entries of list ahead of the archive writer (wanted[i] == 0 skips an entry,
+// wanted NULL reads them all); NULL when prefetching is off
+struct prefetch_batch* prefetch_start(const struct tar_list* list, const struct tar_source* source,
+                                      const unsigned char* wanted) {
+    if (prefetch_files <= 0 || list->count < 2) return NULL;
+
+    struct prefetch_batch* batch = calloc(1, sizeof(*batch));
+    if (batch == NULL) return NULL;
+    batch->state = calloc(list->count, 1);
+    batch->list = list;
+    batch->source = source;
+    batch->wanted = wanted;
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->moved, NULL);
+
+    if (batch->state == NULL || pthread_create(&batch->thread, NULL, prefetch_thread, batch) != 0) {
+        pthread_mutex_destroy(&batch->lock);
+        pthread_cond_destroy(&batch->moved);
+        free(batch->state);
+        free(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+// Function to note that the writer is about to read entry index, counting what it finds
+void prefetch_reached(struct prefetch_batch* batch, int index) {
+    if (batch == NULL) return;
+
+    pthread_mutex_lock(&batch->lock);
+    int state = batch->state[index];
+    batch->state[index] = ENTRY_TAKEN;
+    batch->reader = index + 1;
+    int first = batch->reached++ == 0;
+    pthread_cond_signal(&batch->moved);
+    pthread_mutex_unlock(&batch->lock);
+
+    // The first entry is read before any prefetch could have helped
+    if (!first) {
+        stats_record_prefetch(state == ENTRY_DONE ? PREFETCH_HIT : state == ENTRY_READING ? PREFETCH_LATE
+                                                                                            : PREFETCH_MISSED);
+    }
+}
+
+// Function to stop the prefetch thread and free the batch
+void prefetch_finish(struct prefetch_batch* batch) {
+    if (batch == NULL) return;
+
+    pthread_mutex_lock(&batch->lock);
+    batch->stop = 1;
+    pthread_cond_signal(&batch->moved);
+    pthread_mutex_unlock(&batch->lock);
+
+    pthread_join(batch->thread, NULL);
+    pthread_mutex_destroy(&batch->lock);
+    pthread_cond_destroy(&batch->moved);
+    free(batch->state);
+    free(batch);
+}
@@ -0,0 +1,61 @@
+#ifndef S25PREFETCH_H
+#define S25PREFETCH_H
+
+#include "s25tar.h"
+
+// Read-ahead and page-cache hints for sequential reads.
+//
+// Downloads tell the kernel a file will be read front to back
+// (POSIX_FADV_SEQUENTIAL) and keep a window ahead of the reader requested
+// with POSIX_FADV_WILLNEED, so a cold file is read at the disk's sequential
+// speed.  Data is read in large chunks that start on chunk boundaries of
+// the underlying file.
+//
+// Archives are read file after file.  While one entry streams, a
+// background thread reads the next few into the page cache with
+// readahead(), so the next open does not wait for the disk.  Each entry the
+// archive writer reaches is counted by what it found:
+//
+//   hit     the prefetch had finished
+//   late    the prefetch was still reading
+//   missed  the prefetch had not started
+//
+// as s25_prefetch_files_total{outcome=...}, and the bytes read ahead as
+// s25_prefetch_bytes_total.
+//
+//   S25_READAHEAD_BYTES    window kept ahead of a download (default 4 MB;
+//                          0 = no hints)
+//   S25_READ_CHUNK         size of each read (default 256 KB)
+//   S25_PREFETCH_FILES     archive entries read ahead (default 8; 0 = off)
+//   S25_PREFETCH_BYTES     most bytes read ahead of one entry (default 8 MB)
+
+struct prefetch_batch;
+
+// Function to read the S25_READAHEAD_* and S25_PREFETCH_* settings; call before forking/threads
+int prefetch_init(void);
+
+// Function to get the size reads of a sequential transfer should use
+long prefetch_read_size(void);
+
+// Function to get how much to read first so later reads start on chunk boundaries of the file
+long prefetch_first_read(long offset, long length);
+
+// Function to mark length bytes of fd from offset as read sequentially and request the first window
+void prefetch_sequential(int fd, long offset, long length);
+
+// Function to keep the window requested ahead of a sequential reader at position; returns the new end of the
+// requested range (start with hinted = offset)
+long prefetch_ahead(int fd, long position, long hinted, long end);
+
+// Function to start reading the entries of list ahead of the archive writer (wanted[i] == 0 skips an entry,
+// wanted NULL reads them all); NULL when prefetching is off
+struct prefetch_batch* prefetch_start(const struct tar_list* list, const struct tar_source* source,
+                                      const unsigned char* wanted);
+
+// Function to note that the writer is about to read entry index, counting what it finds
+void prefetch_reached(struct prefetch_batch* batch, int index);
+
+// Function to stop the prefetch thread and free the batch
+void prefetch_finish(struct prefetch_batch* batch);
+
+#endif
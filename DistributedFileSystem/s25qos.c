@@ -0,0 +1,441 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "s25qos.h"
+#include "s25common.h"
+#include "s25stats.h"
+
+#define QOS_MAX_CLIENTS 64
+#define QOS_MAX_FLOWS (QOS_MAX_CLIENTS * QOS_CLASSES)
+#define QOS_MAX_TICKETS 512
+#define QOS_MAX_OVERRIDES 16
+#define TICKET_FREE 0
+#define TICKET_WAITING 1
+#define TICKET_HOLDING 2
+
+struct token_bucket {
+    double rate;           // bytes per second; 0 = unlimited
+    double tokens;
+    long long refilled_us;
+};
+
+struct qos_flow {
+    long deficit;          // bytes the flow may still be granted this round
+    int waiting;
+    int holding;
+    int active;            // in the round-robin ring
+};
+
+struct qos_client {
+    uint32_t address;
+    int used;
+    long long last_used_us;
+    struct token_bucket bucket;
+    struct qos_flow flows[QOS_CLASSES];
+};
+
+// One waiting or granted request
+struct qos_ticket {
+    pid_t pid;
+    int state;
+    int flow;              // client * QOS_CLASSES + class
+    uint64_t sequence;
+};
+
+struct qos_region {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int slots;
+    int slots_used;
+    long weights[QOS_CLASSES];
+    struct token_bucket link;
+    struct token_bucket classes[QOS_CLASSES];
+    double client_rate;
+    struct qos_client clients[QOS_MAX_CLIENTS];
+    struct qos_ticket tickets[QOS_MAX_TICKETS];
+    int ring[QOS_MAX_FLOWS];
+    int ring_head;
+    int ring_count;
+    uint64_t next_sequence;
+    long long reclaimed_us;
+};
+
+static const char* const class_names[QOS_CLASSES] = { "interactive", "transfer", "bulk" };
+
+// Per-address rates from S25_QOS_CLIENT_RATES, inherited by the children
+static struct {
+    uint32_t address;
+    double rate;
+} overrides[QOS_MAX_OVERRIDES];
+static int override_count;
+
+static struct qos_region* region;
+
+// This process's session
+static uint32_t session_address;
+static int session_class;
+static int session_ticket = -1;
+static long session_credit;
+
+// Function to lock the region, recovering it if a child died holding the lock
+static void lock_region(void) {
+    if (pthread_mutex_lock(&region->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&region->lock);
+    }
+}
+
+// Function to add the tokens earned since the last refill
+static void refill(struct token_bucket* bucket, long long now) {
+    if (bucket->rate <= 0) return;
+
+    // Up to a tenth of a second of traffic, but always room for two grants
+    double burst = bucket->rate / 10 > 2.0 * QOS_GRANT ? bucket->rate / 10 : 2.0 * QOS_GRANT;
+    bucket->tokens += bucket->rate * (now - bucket->refilled_us) / 1e6;
+    if (bucket->tokens > burst) bucket->tokens = burst;
+    bucket->refilled_us = now;
+}
+
+// Function to check whether a bucket can pay for a grant
+static int bucket_ready(struct token_bucket* bucket, long long now) {
+    refill(bucket, now);
+    return bucket->rate <= 0 || bucket->tokens >= QOS_GRANT;
+}
+
+// Function to take (or, for a negative amount, give back) tokens
+static void bucket_take(struct token_bucket* bucket, double amount) {
+    if (bucket->rate > 0) bucket->tokens -= amount;
+}
+
+// Function to look up the rate configured for a client address
+static double client_rate(uint32_t address) {
+    for (int i = 0; i < override_count; i++) {
+        if (overrides[i].address == address) return overrides[i].rate;
+    }
+    return region->client_rate;
+}
+
+// Function to find (or assign) the client entry for an address; the last entry is shared overflow
+static int find_client(uint32_t address, long long now) {
+    int reusable = -1;
+
+    for (int i = 0; i < QOS_MAX_CLIENTS - 1; i++) {
+        struct qos_client* client = &region->clients[i];
+        if (client->used && client->address == address) return i;
+
+        // An idle entry can be handed to another address, least recently used first
+        int idle = 1;
+        for (int k = 0; k < QOS_CLASSES; k++) {
+            if (client->flows[k].waiting || client->flows[k].holding || client->flows[k].active) idle = 0;
+        }
+        if (idle && (reusable < 0 || !client->used ||
+                     (region->clients[reusable].used && client->last_used_us < region->clients[reusable].last_used_us))) {
+            reusable = i;
+        }
+    }
+
+    int index = reusable >= 0 ? reusable : QOS_MAX_CLIENTS - 1;
+    struct qos_client* client = &region->clients[index];
+    if (!client->used || client->address != address) {
+        if (reusable >= 0) memset(client, 0, sizeof(*client));
+        client->used = 1;
+        client->address = address;
+        client->bucket.rate = client_rate(address);
+        client->bucket.tokens = 2.0 * QOS_GRANT;
+        client->bucket.refilled_us = now;
+    }
+    return index;
+}
+
+// Function to get a flow by index
+static struct qos_flow* flow_at(int flow) {
+    return &region->clients[flow / QOS_CLASSES].flows[flow % QOS_CLASSES];
+}
+
+// Function to move the ring's head flow to its back
+static void rotate_ring(void) {
+    int flow = region->ring[region->ring_head];
+    region->ring_head = (region->ring_head + 1) % QOS_MAX_FLOWS;
+    region->ring[(region->ring_head + region->ring_count - 1) % QOS_MAX_FLOWS] = flow;
+}
+
+// Function to drop the ring's head flow
+static void pop_ring(void) {
+    struct qos_flow* flow = flow_at(region->ring[region->ring_head]);
+    flow->active = 0;
+    flow->deficit = 0;
+    region->ring_head = (region->ring_head + 1) % QOS_MAX_FLOWS;
+    region->ring_count--;
+}
+
+// Function to free the tickets of children that died waiting or holding a grant
+static void reclaim_tickets(long long now) {
+    if (now - region->reclaimed_us < 100000) return;
+    region->reclaimed_us = now;
+
+    for (int i = 0; i < QOS_MAX_TICKETS; i++) {
+        struct qos_ticket* ticket = &region->tickets[i];
+        if (ticket->state == TICKET_FREE || kill(ticket->pid, 0) == 0 || errno != ESRCH) continue;
+
+        struct qos_flow* flow = flow_at(ticket->flow);
+        if (ticket->state == TICKET_HOLDING) {
+            flow->holding--;
+            region->slots_used--;
+        } else {
+            flow->waiting--;
+        }
+        ticket->state = TICKET_FREE;
+    }
+}
+
+// Function to hand the free slots to waiting flows by deficit round robin
+static void dispatch(long long now) {
+    if (region->slots_used >= region->slots) reclaim_tickets(now);
+
+    int skipped = 0;
+    while (region->slots_used < region->slots && region->ring_count > 0 && skipped < region->ring_count) {
+        int index = region->ring[region->ring_head];
+        int qos_class = index % QOS_CLASSES;
+        struct qos_client* client = &region->clients[index / QOS_CLASSES];
+        struct qos_flow* flow = &client->flows[qos_class];
+
+        // A flow still holding a grant keeps its place and deficit; it usually asks again soon
+        if (flow->waiting == 0) {
+            if (flow->holding == 0) {
+                pop_ring();
+            } else {
+                rotate_ring();
+                skipped++;
+            }
+            continue;
+        }
+        if (!bucket_ready(&region->link, now) || !bucket_ready(&region->classes[qos_class], now) ||
+            !bucket_ready(&client->bucket, now)) {
+            rotate_ring();
+            skipped++;
+            continue;
+        }
+        if (flow->deficit < QOS_GRANT) flow->deficit += region->weights[qos_class] * QOS_GRANT;
+
+        // Grant the flow's oldest waiting ticket
+        struct qos_ticket* oldest = NULL;
+        for (int i = 0; i < QOS_MAX_TICKETS; i++) {
+            struct qos_ticket* ticket = &region->tickets[i];
+            if (ticket->state == TICKET_WAITING && ticket->flow == index &&
+                (oldest == NULL || ticket->sequence < oldest->sequence)) {
+                oldest = ticket;
+            }
+        }
+        if (oldest == NULL) {
+            flow->waiting = 0;
+            continue;
+        }
+        oldest->state = TICKET_HOLDING;
+        flow->waiting--;
+        flow->holding++;
+        flow->deficit -= QOS_GRANT;
+        region->slots_used++;
+        bucket_take(&region->link, QOS_GRANT);
+        bucket_take(&region->classes[qos_class], QOS_GRANT);
+        bucket_take(&client->bucket, QOS_GRANT);
+        skipped = 0;
+
+        if (flow->deficit < QOS_GRANT) rotate_ring();
+    }
+}
+
+// Function to wait for a grant for the session's current class
+static void acquire_grant(void) {
+    long long started = stats_now_us();
+
+    lock_region();
+    int client = find_client(session_address, started);
+    int index = client * QOS_CLASSES + session_class;
+    struct qos_flow* flow = flow_at(index);
+    region->clients[client].last_used_us = started;
+
+    // Without a free ticket the command runs unscheduled rather than failing
+    session_ticket = -1;
+    for (int i = 0; i < QOS_MAX_TICKETS && session_ticket < 0; i++) {
+        if (region->tickets[i].state == TICKET_FREE) session_ticket = i;
+    }
+    if (session_ticket < 0) {
+        pthread_mutex_unlock(&region->lock);
+        return;
+    }
+
+    struct qos_ticket* ticket = &region->tickets[session_ticket];
+    ticket->pid = getpid();
+    ticket->state = TICKET_WAITING;
+    ticket->flow = index;
+    ticket->sequence = region->next_sequence++;
+    flow->waiting++;
+    if (!flow->active) {
+        flow->active = 1;
+        region->ring[(region->ring_head + region->ring_count) % QOS_MAX_FLOWS] = index;
+        region->ring_count++;
+    }
+
+    // Rate limits free up over time, so waiters poll while any bucket is in use
+    int limited = region->link.rate > 0 || region->client_rate > 0 || override_count > 0;
+    for (int k = 0; k < QOS_CLASSES; k++) {
+        if (region->classes[k].rate > 0) limited = 1;
+    }
+    while (1) {
+        dispatch(stats_now_us());
+        if (ticket->state == TICKET_HOLDING) break;
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += limited ? 10000000 : 200000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (pthread_cond_timedwait(&region->changed, &region->lock, &deadline) == EOWNERDEAD) {
+            pthread_mutex_consistent(&region->lock);
+        }
+    }
+    pthread_cond_broadcast(&region->changed);
+    pthread_mutex_unlock(&region->lock);
+
+    session_credit = QOS_GRANT;
+    stats_record_queue(session_class, stats_now_us() - started);
+}
+
+// Function to give back the session's grant and refund what it did not use
+static void release_grant(void) {
+    if (session_ticket < 0) return;
+
+    lock_region();
+    struct qos_ticket* ticket = &region->tickets[session_ticket];
+    if (ticket->state == TICKET_HOLDING && ticket->pid == getpid()) {
+        int client = ticket->flow / QOS_CLASSES;
+        double unused = session_credit > 0 ? session_credit : 0;
+        flow_at(ticket->flow)->holding--;
+        region->slots_used--;
+        bucket_take(&region->link, -unused);
+        bucket_take(&region->classes[session_class], -unused);
+        bucket_take(&region->clients[client].bucket, -unused);
+        ticket->state = TICKET_FREE;
+    }
+    dispatch(stats_now_us());
+    pthread_cond_broadcast(&region->changed);
+    pthread_mutex_unlock(&region->lock);
+    session_ticket = -1;
+}
+
+// Function to parse S25_QOS_CLIENT_RATES ("ip=rate,ip=rate")
+static void parse_overrides(const char* setting) {
+    char copy[1024];
+    char* saved;
+
+    snprintf(copy, sizeof(copy), "%s", setting);
+    for (char* item = strtok_r(copy, ",", &saved); item != NULL && override_count < QOS_MAX_OVERRIDES;
+         item = strtok_r(NULL, ",", &saved)) {
+        char* equals = strchr(item, '=');
+        struct in_addr address;
+        if (equals == NULL) continue;
+        *equals = '\0';
+        if (inet_pton(AF_INET, item, &address) != 1) {
+            fprintf(stderr, "Ignoring invalid S25_QOS_CLIENT_RATES entry %s\n", item);
+            continue;
+        }
+        overrides[override_count].address = address.s_addr;
+        overrides[override_count].rate = atof(equals + 1);
+        override_count++;
+    }
+}
+
+// Function to read the S25_QOS_* settings and set up the scheduler; call before forking
+int qos_init(void) {
+    static const char* const weight_settings[QOS_CLASSES] = {
+        "S25_QOS_WEIGHT_INTERACTIVE", "S25_QOS_WEIGHT_TRANSFER", "S25_QOS_WEIGHT_BULK",
+    };
+    static const char* const rate_settings[QOS_CLASSES] = {
+        "S25_QOS_RATE_INTERACTIVE", "S25_QOS_RATE_TRANSFER", "S25_QOS_RATE_BULK",
+    };
+    static const long default_weights[QOS_CLASSES] = { 8, 2, 1 };
+    pthread_mutexattr_t mutex_attributes;
+    pthread_condattr_t cond_attributes;
+
+    long slots = get_config_long("S25_QOS_SLOTS", 16);
+    if (slots <= 0) {
+        printf("QoS scheduler: disabled\n");
+        return 0;
+    }
+
+    region = mmap(NULL, sizeof(*region), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        region = NULL;
+        perror("QoS region");
+        return -1;
+    }
+
+    pthread_mutexattr_init(&mutex_attributes);
+    pthread_mutexattr_setpshared(&mutex_attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&region->lock, &mutex_attributes);
+    pthread_mutexattr_destroy(&mutex_attributes);
+    pthread_condattr_init(&cond_attributes);
+    pthread_condattr_setpshared(&cond_attributes, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&region->changed, &cond_attributes);
+    pthread_condattr_destroy(&cond_attributes);
+
+    long long now = stats_now_us();
+    region->slots = slots;
+    region->link.rate = get_config_double("S25_QOS_LINK_RATE", 0);
+    region->link.refilled_us = now;
+    for (int k = 0; k < QOS_CLASSES; k++) {
+        region->weights[k] = get_config_long(weight_settings[k], default_weights[k]);
+        if (region->weights[k] < 1) region->weights[k] = 1;
+        region->classes[k].rate = get_config_double(rate_settings[k], 0);
+        region->classes[k].refilled_us = now;
+    }
+    region->client_rate = get_config_double("S25_QOS_CLIENT_RATE", 0);
+    parse_overrides(get_config_string("S25_QOS_CLIENT_RATES", ""));
+
+    stats_init_queues(class_names, QOS_CLASSES);
+    printf("QoS scheduler: %ld slots, weights %ld/%ld/%ld, link rate %.0f B/s\n", slots,
+           region->weights[QOS_INTERACTIVE], region->weights[QOS_TRANSFER], region->weights[QOS_BULK],
+           region->link.rate);
+    return 0;
+}
+
+// Function to tie this process's commands to a client address (network byte order)
+void qos_session(uint32_t client_address) {
+    session_address = client_address;
+}
+
+// Function to wait for the first grant of a command
+void qos_begin(int qos_class) {
+    if (region == NULL) return;
+    session_class = qos_class >= 0 && qos_class < QOS_CLASSES ? qos_class : QOS_INTERACTIVE;
+    acquire_grant();
+}
+
+// Function to account bytes moved by the command, waiting for a new grant when one is used up
+void qos_charge(long bytes) {
+    if (region == NULL || session_ticket < 0) return;
+
+    session_credit -= bytes;
+    if (session_credit > 0) return;
+
+    // Give other flows their turn before moving the next QOS_GRANT bytes
+    release_grant();
+    acquire_grant();
+}
+
+// Function to give back the command's grant
+void qos_end(void) {
+    if (region == NULL) return;
+    release_grant();
+}
@@ -0,0 +1,49 @@
+#ifndef S25QOS_H
+#define S25QOS_H
+
+#include <stdint.h>
+
+// Fair scheduling of S1's backend work and relay bandwidth across clients.
+//
+// Every command runs in a class:
+//
+//   interactive  dispfnames, removef, stats, trace
+//   transfer     uploadf, downlf
+//   bulk         downltar
+//
+// Work is handed out in grants of QOS_GRANT bytes; a command holds one
+// grant from qos_begin() to qos_end() and asks for the next whenever it has
+// moved that many bytes.  Each (client address, class) pair is a flow, and
+// waiting flows are served by deficit round robin with S25_QOS_WEIGHT_<CLASS>
+// grants per round (interactive 8, transfer 2, bulk 1).  At most
+// S25_QOS_SLOTS grants are held at a time (default 16, 0 disables the
+// scheduler).  Token buckets can also cap the bytes per second of the whole
+// server (S25_QOS_LINK_RATE), of a class (S25_QOS_RATE_<CLASS>) and of each
+// client (S25_QOS_CLIENT_RATE, or per address with
+// S25_QOS_CLIENT_RATES=ip=rate,ip=rate).
+//
+// The scheduler lives in shared memory created before forking, so every S1
+// child takes part; grants held by children that died are reclaimed.  Time
+// spent waiting is recorded per class as s25_queue_wait_seconds.
+#define QOS_INTERACTIVE 0
+#define QOS_TRANSFER 1
+#define QOS_BULK 2
+#define QOS_CLASSES 3
+#define QOS_GRANT (64 * 1024)
+
+// Function to read the S25_QOS_* settings and set up the scheduler; call before forking
+int qos_init(void);
+
+// Function to tie this process's commands to a client address (network byte order)
+void qos_session(uint32_t client_address);
+
+// Function to wait for the first grant of a command
+void qos_begin(int qos_class);
+
+// Function to account bytes moved by the command, waiting for a new grant when one is used up
+void qos_charge(long bytes);
+
+// Function to give back the command's grant
+void qos_end(void);
+
+#endif
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "s25relay.h"
+#include "s25common.h"
+#include "s25stats.h"
+#include "s25qos.h"
+#include "s25pool.h"
+
+static const char* const side_names[2] = { "client", "storage" };
+
+static long* budget;       // shared: bytes of buffer still available (negative when over)
+static long high_watermark;
+static long low_percent;
+
+// Function to read the S25_RELAY_* settings and set up the shared budget; call before forking
+int relay_init(void) {
+    long total = get_config_long("S25_RELAY_BUDGET", 16L * 1024 * 1024);
+
+    high_watermark = get_config_long("S25_RELAY_HIGH_WATERMARK", 1024 * 1024);
+    if (high_watermark < RELAY_MIN_BUFFER) high_watermark = RELAY_MIN_BUFFER;
+    low_percent = get_config_long("S25_RELAY_LOW_PERCENT", 25);
+    if (low_percent < 0 || low_percent > 100) low_percent = 25;
+
+    budget = mmap(NULL, sizeof(*budget), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (budget == MAP_FAILED) {
+        budget = NULL;
+        perror("Relay budget");
+        return -1;
+    }
+    *budget = total;
+
+    stats_init_stalls(side_names, 2);
+    printf("Relay buffers: %ld byte budget, %ld byte high watermark, low at %ld%%\n", total, high_watermark,
+           low_percent);
+    return 0;
+}
+
+// Function to take a buffer out of the budget: the high watermark if it fits, RELAY_MIN_BUFFER at least
+static long reserve_buffer(void) {
+    if (budget == NULL) return RELAY_MIN_BUFFER;
+
+    long available = __atomic_load_n(budget, __ATOMIC_RELAXED);
+    while (1) {
+        long size = available >= high_watermark ? high_watermark : available;
+        if (size < RELAY_MIN_BUFFER) size = RELAY_MIN_BUFFER;
+        if (__atomic_compare_exchange_n(budget, &available, available - size, 0, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            return size;
+        }
+    }
+}
+
+// Function to give a buffer back to the budget
+static void release_buffer(long size) {
+    if (budget != NULL) __atomic_fetch_add(budget, size, __ATOMIC_RELAXED);
+}
+
+// Function to check whether a descriptor is a socket
+static int is_socket(int fd) {
+    struct stat info;
+    return fd >= 0 && fstat(fd, &info) == 0 && S_ISSOCK(info.st_mode);
+}
+
+// Function to read without blocking past what poll() reported
+static ssize_t read_some(int fd, int socket, void* data, size_t length) {
+    return socket ? recv(fd, data, length, MSG_DONTWAIT) : read(fd, data, length);
+}
+
+// Function to write without blocking past what poll() reported
+static ssize_t write_some(int fd, int socket, const void* data, size_t length) {
+    return socket ? send(fd, data, length, MSG_DONTWAIT | MSG_NOSIGNAL) : write(fd, data, length);
+}
+
+// Function to move length bytes from source to sink (sink -1 discards them); 0 if all arrived
+int relay_copy(int source, int sink, long length, int flags, struct relay_result* result) {
+    memset(result, 0, sizeof(*result));
+    if (length <= 0) return 0;
+
+    long capacity = reserve_buffer();
+    char* ring = pool_get(capacity);
+    if (ring == NULL) {
+        release_buffer(capacity);
+        result->source_failed = result->sink_failed = 1;
+        return -1;
+    }
+
+    long low_watermark = capacity * low_percent / 100;
+    long head = 0;       // next byte for the sink
+    long buffered = 0;
+    int paused = 0;
+    int source_socket = is_socket(source);
+    int sink_socket = is_socket(sink);
+    int discard = sink < 0;
+
+    // Sockets with a send/receive timeout get the same deadline while the relay polls them
+    int source_timeout = source_socket ? get_socket_timeout(source, SO_RCVTIMEO) : -1;
+    int sink_timeout = sink_socket ? get_socket_timeout(sink, SO_SNDTIMEO) : -1;
+
+    while (1) {
+        int want_read = !result->source_failed && result->received < length && !paused;
+        int want_write = !discard && !result->sink_failed && buffered > 0;
+
+        // A failed sink ends the transfer unless the source must still be drained
+        if (result->sink_failed && !(flags & RELAY_DRAIN)) break;
+        if (!want_read && !want_write) break;
+
+        struct pollfd fds[2];
+        int count = 0;
+        if (want_read) fds[count++] = (struct pollfd){ source, POLLIN, 0 };
+        if (want_write) fds[count++] = (struct pollfd){ sink, POLLOUT, 0 };
+
+        int timeout = want_read ? source_timeout : -1;
+        if (want_write && sink_timeout >= 0 && (timeout < 0 || sink_timeout < timeout)) timeout = sink_timeout;
+
+        long long wait_start = stats_now_us();
+        int ready = poll(fds, count, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            result->source_failed = result->sink_failed = 1;
+            break;
+        }
+        if (ready == 0) {
+            // Only a side with a deadline can time out, and it made no progress
+            if (want_read && source_timeout >= 0) result->source_failed = 1;
+            if (want_write && sink_timeout >= 0) {
+                result->sink_failed = 1;
+                buffered = 0;
+                paused = 0;
+            }
+            printf("Relay timed out waiting on the %s\n", result->source_failed ? "source" : "sink");
+            continue;
+        }
+
+        // Waiting on one side only means that side is holding the transfer up
+        long long waited = stats_now_us() - wait_start;
+        if (want_read && !want_write) result->source_stall_us += waited;
+        if (want_write && !want_read) result->sink_stall_us += waited;
+
+        if (want_read && fds[0].revents) {
+            long tail = (head + buffered) % capacity;
+            long space = discard || result->sink_failed ? capacity : capacity - buffered;
+            if (!discard && !result->sink_failed && tail + space > capacity) space = capacity - tail;
+            if (space > length - result->received) space = length - result->received;
+
+            ssize_t got = read_some(source, source_socket, discard || result->sink_failed ? ring : ring + tail, space);
+            if (got < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            if (got <= 0) {
+                result->source_failed = 1;
+            } else {
+                result->received += got;
+                if (!discard && !result->sink_failed) buffered += got;
+                if (buffered == capacity) paused = 1;
+            }
+        }
+
+        if (want_write && fds[count - 1].revents) {
+            long chunk = buffered < capacity - head ? buffered : capacity - head;
+            ssize_t put = write_some(sink, sink_socket, ring + head, chunk);
+            if (put < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            if (put <= 0) {
+                result->sink_failed = 1;
+                buffered = 0;
+                paused = 0;
+            } else {
+                head = (head + put) % capacity;
+                buffered -= put;
+                result->sent += put;
+                if (paused && buffered <= low_watermark) paused = 0;
+                qos_charge(put);
+            }
+        }
+    }
+
+    pool_put(ring, capacity);
+    release_buffer(capacity);
+
+    int source_side = flags & RELAY_FROM_CLIENT ? SIDE_CLIENT : SIDE_STORAGE;
+    stats_count_stall(source_side, result->source_stall_us);
+    stats_count_stall(!source_side, result->sink_stall_us);
+
+    if (!discard && result->sent < result->received) result->sink_failed = 1;
+    if (result->received < length) result->source_failed = 1;
+    return result->source_failed || result->sink_failed ? -1 : 0;
+}
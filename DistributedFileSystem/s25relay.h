@@ -0,0 +1,45 @@
+#ifndef S25RELAY_H
+#define S25RELAY_H
+
+// Bounded relay between two descriptors, used by S1 for every transfer.
+//
+// relay_copy() moves a known number of bytes through a ring buffer, reading
+// ahead of a slow sink until the buffer is full (the high watermark) and then
+// pausing the source until the sink has drained it to the low watermark.
+// Buffers come out of a memory budget shared by all S1 children:
+//
+//   S25_RELAY_BUDGET          bytes of relay buffers in use at once (default 16 MB)
+//   S25_RELAY_HIGH_WATERMARK  buffer a transfer asks for (default 1 MB)
+//   S25_RELAY_LOW_PERCENT     share of the buffer at which reading resumes (default 25)
+//
+// When the budget is used up a transfer gets less, but never less than
+// RELAY_MIN_BUFFER, so no transfer waits for another one's memory.  Time
+// spent waiting on only one side is counted per side as
+// s25_relay_stall_seconds_total{side="client"|"storage"}.
+// A socket's SO_RCVTIMEO/SO_SNDTIMEO bounds how long the relay waits on it.
+#define RELAY_MIN_BUFFER (64 * 1024)
+
+// relay_copy() flags
+#define RELAY_FROM_CLIENT 1  // the source is the client (uploads); otherwise the sink is
+#define RELAY_DRAIN 2        // keep reading the source after the sink fails
+
+// Sides of s25_relay_stall_seconds_total
+#define SIDE_CLIENT 0
+#define SIDE_STORAGE 1
+
+struct relay_result {
+    long received;             // bytes read from the source
+    long sent;                 // bytes written to the sink
+    int source_failed;
+    int sink_failed;
+    long long source_stall_us; // waiting for the source with nothing to send
+    long long sink_stall_us;   // waiting for the sink with reading paused
+};
+
+// Function to read the S25_RELAY_* settings and set up the shared budget; call before forking
+int relay_init(void);
+
+// Function to move length bytes from source to sink (sink -1 discards them); 0 if all arrived
+int relay_copy(int source, int sink, long length, int flags, struct relay_result* result);
+
+#endif
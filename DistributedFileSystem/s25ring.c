@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "s25ring.h"
+#include "s25common.h"
+
+// The header gets its own page; data starts right after it
+#define RING_HEADER_SIZE 4096
+
+struct ring_header {
+    uint64_t head;                  // bytes produced, written by the producer only
+    char head_pad[56];
+    uint64_t tail;                  // bytes consumed, written by the consumer only
+    char tail_pad[56];
+    uint32_t consumer_waiting;      // set while the consumer sleeps on data_event
+    uint32_t producer_waiting;      // set while the producer sleeps on space_event
+};
+
+struct ring {
+    struct ring_header* header;
+    char* data;
+    long capacity;
+    int memfd;
+    int data_event;     // producer -> consumer
+    int space_event;    // consumer -> producer
+    int control_socket;
+};
+
+// Function to map a ring's memfd
+static struct ring* map_ring(int memfd, int data_event, int space_event, long capacity) {
+    struct ring* ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) return NULL;
+
+    void* base = mmap(NULL, RING_HEADER_SIZE + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (base == MAP_FAILED) {
+        free(ring);
+        return NULL;
+    }
+    ring->header = base;
+    ring->data = (char*)base + RING_HEADER_SIZE;
+    ring->capacity = capacity;
+    ring->memfd = memfd;
+    ring->data_event = data_event;
+    ring->space_event = space_event;
+    ring->control_socket = -1;
+    return ring;
+}
+
+// Function to create a ring of the given capacity; NULL on failure
+struct ring* ring_create(long capacity) {
+    int memfd = memfd_create("s25ring", MFD_CLOEXEC);
+    int data_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    int space_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct ring* ring = NULL;
+
+    if (memfd >= 0 && data_event >= 0 && space_event >= 0 && ftruncate(memfd, RING_HEADER_SIZE + capacity) == 0) {
+        ring = map_ring(memfd, data_event, space_event, capacity);
+    }
+    if (ring == NULL) {
+        perror("Ring creation failed");
+        if (memfd >= 0) close(memfd);
+        if (data_event >= 0) close(data_event);
+        if (space_event >= 0) close(space_event);
+    }
+    return ring;
+}
+
+// Function to map a ring from the descriptors another process passed; takes ownership of them
+struct ring* ring_attach(const int* fds) {
+    struct stat info;
+    struct ring* ring = NULL;
+
+    if (fstat(fds[0], &info) == 0 && info.st_size > RING_HEADER_SIZE) {
+        ring = map_ring(fds[0], fds[1], fds[2], info.st_size - RING_HEADER_SIZE);
+    }
+    if (ring == NULL) {
+        for (int i = 0; i < RING_FDS; i++) close(fds[i]);
+    }
+    return ring;
+}
+
+// Function to get the descriptors to pass to the other side
+void ring_fds(const struct ring* ring, int* fds) {
+    fds[0] = ring->memfd;
+    fds[1] = ring->data_event;
+    fds[2] = ring->space_event;
+}
+
+// Function to set the control socket whose hangup or timeout ends a wait
+void ring_bind(struct ring* ring, int control_socket) {
+    ring->control_socket = control_socket;
+}
+
+// Function to get how many bytes are waiting in the ring
+static long ring_used(const struct ring* ring) {
+    return __atomic_load_n(&ring->header->head, __ATOMIC_SEQ_CST) - __atomic_load_n(&ring->header->tail, __ATOMIC_SEQ_CST);
+}
+
+// Function to check whether the waiting side can go on: data for the consumer, space for the producer
+static int ring_ready(const struct ring* ring, int consumer) {
+    long used = ring_used(ring);
+    return consumer ? used > 0 : used < ring->capacity;
+}
+
+// Function to sleep until the other side makes room or data; -1 on hangup or timeout
+static int ring_wait(struct ring* ring, int consumer) {
+    uint32_t* waiting = consumer ? &ring->header->consumer_waiting : &ring->header->producer_waiting;
+    int event = consumer ? ring->data_event : ring->space_event;
+    int timeout_ms = ring->control_socket >= 0 ? get_socket_timeout(ring->control_socket, SO_RCVTIMEO) : -1;
+
+    while (!ring_ready(ring, consumer)) {
+        // Announce the wait before the last look, so a wakeup in between is not lost
+        __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+        if (ring_ready(ring, consumer)) {
+            __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+            break;
+        }
+
+        struct pollfd fds[2] = { { event, POLLIN, 0 }, { ring->control_socket, POLLRDHUP, 0 } };
+        int ready = poll(fds, 2, timeout_ms);
+        __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) return -1;
+
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(event, &count, sizeof(count)) < 0 && errno != EAGAIN) return -1;
+        } else if (fds[1].revents && !ring_ready(ring, consumer)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to wake the other side if it is asleep
+static void ring_notify(int event, uint32_t* waiting) {
+    uint64_t one = 1;
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) && write(event, &one, sizeof(one)) < 0) {
+        perror("Ring notify failed");
+    }
+}
+
+// Function to wait for free space; returns where to write and how much fits there, NULL on failure
+void* ring_reserve(struct ring* ring, size_t* length) {
+    if (ring_wait(ring, 0) < 0) return NULL;
+
+    uint64_t head = ring->header->head;
+    long offset = head % ring->capacity;
+    long space = ring->capacity - ring_used(ring);
+    *length = space < ring->capacity - offset ? space : ring->capacity - offset;
+    return ring->data + offset;
+}
+
+// Function to publish length bytes written at ring_reserve()'s pointer
+void ring_produce(struct ring* ring, size_t length) {
+    __atomic_store_n(&ring->header->head, ring->header->head + length, __ATOMIC_SEQ_CST);
+    ring_notify(ring->data_event, &ring->header->consumer_waiting);
+}
+
+// Function to wait for data; returns where it starts and how much is there, NULL on failure
+const void* ring_peek(struct ring* ring, size_t* length) {
+    if (ring_wait(ring, 1) < 0) return NULL;
+
+    uint64_t tail = ring->header->tail;
+    long offset = tail % ring->capacity;
+    long used = ring_used(ring);
+    *length = used < ring->capacity - offset ? used : ring->capacity - offset;
+    return ring->data + offset;
+}
+
+// Function to release length bytes read at ring_peek()'s pointer
+void ring_consume(struct ring* ring, size_t length) {
+    __atomic_store_n(&ring->header->tail, ring->header->tail + length, __ATOMIC_SEQ_CST);
+    ring_notify(ring->space_event, &ring->header->producer_waiting);
+}
+
+// Function to check whether everything produced has been consumed
+int ring_empty(const struct ring* ring) {
+    return ring_used(ring) == 0;
+}
+
+// Function to unmap a ring and close its descriptors
+void ring_free(struct ring* ring) {
+    if (ring == NULL) return;
+    munmap(ring->header, RING_HEADER_SIZE + ring->capacity);
+    close(ring->memfd);
+    close(ring->data_event);
+    close(ring->space_event);
+    free(ring);
+}
@@ -0,0 +1,53 @@
+#ifndef S25RING_H
+#define S25RING_H
+
+#include <stddef.h>
+
+// Shared-memory data plane between S1 and a co-located storage server.
+//
+// A ring is a single-producer/single-consumer byte queue in a memfd that
+// both processes map.  Head and tail are free-running counters updated with
+// atomics, so neither side takes a lock; a side that finds the ring full
+// (or empty) sleeps on an eventfd the other side signals only while it is
+// marked as waiting.  The memfd and both eventfds travel over an AF_UNIX
+// socket with SCM_RIGHTS, and that socket stays the control channel: a
+// hangup on it, or its SO_RCVTIMEO passing, ends any wait on the ring.
+//
+//   S25_RING_SIZE       ring capacity in bytes (default 0 = no rings)
+//   S25_RING_MIN_BYTES  smallest upload sent through a ring (default 65536)
+
+#define RING_FDS 3
+
+struct ring;
+
+// Function to create a ring of the given capacity; NULL on failure
+struct ring* ring_create(long capacity);
+
+// Function to map a ring from the descriptors another process passed; takes ownership of them
+struct ring* ring_attach(const int* fds);
+
+// Function to get the descriptors to pass to the other side
+void ring_fds(const struct ring* ring, int* fds);
+
+// Function to set the control socket whose hangup or timeout ends a wait
+void ring_bind(struct ring* ring, int control_socket);
+
+// Function to wait for free space; returns where to write and how much fits there, NULL on failure
+void* ring_reserve(struct ring* ring, size_t* length);
+
+// Function to publish length bytes written at ring_reserve()'s pointer
+void ring_produce(struct ring* ring, size_t length);
+
+// Function to wait for data; returns where it starts and how much is there, NULL on failure
+const void* ring_peek(struct ring* ring, size_t* length);
+
+// Function to release length bytes read at ring_peek()'s pointer
+void ring_consume(struct ring* ring, size_t length);
+
+// Function to check whether everything produced has been consumed
+int ring_empty(const struct ring* ring);
+
+// Function to unmap a ring and close its descriptors
+void ring_free(struct ring* ring);
+
+#endif
@@ -0,0 +1,481 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "s25stats.h"
+
+// Histogram layout: values below 16 are exact, above that each power of
+// two is split into 16 linear sub-buckets
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define MAX_EXPONENT 40
+#define HISTOGRAM_BUCKETS (SUB_BUCKETS + (MAX_EXPONENT - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+struct command_counters {
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t rejected;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t latency_sum_us;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+struct stats_shard {
+    struct command_counters commands[STATS_MAX_COMMANDS];
+    struct command_counters queues[STATS_MAX_QUEUES];
+    uint64_t stall_us[STATS_MAX_STALLS];
+    uint64_t sessions_rejected;
+    struct command_counters reads;   // time to a storage read's first reply byte
+    uint64_t hedges;
+    uint64_t hedge_wins;
+    uint64_t prefetch_outcomes[PREFETCH_OUTCOMES];
+    uint64_t prefetch_bytes;
+} __attribute__((aligned(64)));
+
+struct stats_region {
+    uint32_t next_shard;
+    int node_up[STATS_MAX_NODES];
+    struct stats_shard shards[STATS_SHARDS];
+};
+
+static struct stats_region* region;
+static const char* const* names;
+static int name_count;
+static const char* const* queue_names;
+static int queue_count;
+static const char* const* stall_names;
+static int stall_count;
+static const char* const* node_names;
+static int node_count;
+static int reads_enabled;
+static int prefetch_enabled;
+static char server[16];
+
+// Per-thread state: shard assignment and the request being timed
+static __thread int thread_shard = -1;
+static __thread int current_command = -1;
+static __thread long long current_start_us;
+static __thread long current_bytes_in;
+static __thread long current_bytes_out;
+static __thread pid_t shard_owner;
+
+// Function to set up the metrics region; call once before forking/threads
+int stats_init(const char* server_name, const char* const* command_names, int command_count) {
+    region = mmap(NULL, sizeof(*region), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        region = NULL;
+        perror("Stats region");
+        return -1;
+    }
+
+    names = command_names;
+    name_count = command_count < STATS_MAX_COMMANDS ? command_count : STATS_MAX_COMMANDS;
+    snprintf(server, sizeof(server), "%s", server_name);
+    return 0;
+}
+
+// Function to get a monotonic timestamp in microseconds
+long long stats_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Function to pick this thread's shard (re-picked after fork)
+static struct stats_shard* my_shard(void) {
+    pid_t pid = getpid();
+
+    if (thread_shard < 0 || shard_owner != pid) {
+        thread_shard = __atomic_fetch_add(&region->next_shard, 1, __ATOMIC_RELAXED) % STATS_SHARDS;
+        shard_owner = pid;
+    }
+    return &region->shards[thread_shard];
+}
+
+// Function to map a latency to its histogram bucket
+static int bucket_for(uint64_t value) {
+    if (value < SUB_BUCKETS) return (int)value;
+
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > MAX_EXPONENT) return HISTOGRAM_BUCKETS - 1;
+
+    int shift = exponent - SUB_BUCKET_BITS;
+    int sub = (int)((value >> shift) & (SUB_BUCKETS - 1));
+    return SUB_BUCKETS + (exponent - SUB_BUCKET_BITS) * SUB_BUCKETS + sub;
+}
+
+// Function to get the highest value a bucket stands for
+static uint64_t bucket_upper(int bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+
+    int shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+    int sub = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+    return ((uint64_t)(SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+// Function to start timing a request on the calling thread
+void stats_begin(int command) {
+    current_command = command;
+    current_start_us = stats_now_us();
+    current_bytes_in = 0;
+    current_bytes_out = 0;
+}
+
+// Function to account bytes moved by the current request
+void stats_count_bytes(long bytes_in, long bytes_out) {
+    current_bytes_in += bytes_in;
+    current_bytes_out += bytes_out;
+}
+
+// Function to finish the current request and record it
+void stats_end(int ok) {
+    if (current_command < 0) return;
+    stats_record(current_command, ok, current_bytes_in, current_bytes_out, stats_now_us() - current_start_us);
+    current_command = -1;
+}
+
+// Function to record a complete request in one call
+void stats_record(int command, int ok, long bytes_in, long bytes_out, long long latency_us) {
+    if (region == NULL || command < 0 || command >= name_count) return;
+    if (latency_us < 0) latency_us = 0;
+
+    struct command_counters* counters = &my_shard()->commands[command];
+    __atomic_fetch_add(&counters->requests, 1, __ATOMIC_RELAXED);
+    if (!ok) __atomic_fetch_add(&counters->errors, 1, __ATOMIC_RELAXED);
+    if (bytes_in > 0) __atomic_fetch_add(&counters->bytes_in, (uint64_t)bytes_in, __ATOMIC_RELAXED);
+    if (bytes_out > 0) __atomic_fetch_add(&counters->bytes_out, (uint64_t)bytes_out, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters->latency_sum_us, (uint64_t)latency_us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters->buckets[bucket_for((uint64_t)latency_us)], 1, __ATOMIC_RELAXED);
+}
+
+// Function to count a request (or, for command -1, a session) turned away by admission control
+void stats_count_rejected(int command) {
+    if (region == NULL || command >= name_count) return;
+
+    if (command < 0) {
+        __atomic_fetch_add(&my_shard()->sessions_rejected, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&my_shard()->commands[command].rejected, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Function to name the scheduler queues whose waiting times are recorded; call before forking
+void stats_init_queues(const char* const* names_of_queues, int count) {
+    queue_names = names_of_queues;
+    queue_count = count < STATS_MAX_QUEUES ? count : STATS_MAX_QUEUES;
+}
+
+// Function to record how long a request waited in a scheduler queue
+void stats_record_queue(int queue, long long wait_us) {
+    if (region == NULL || queue < 0 || queue >= queue_count) return;
+    if (wait_us < 0) wait_us = 0;
+
+    struct command_counters* counters = &my_shard()->queues[queue];
+    __atomic_fetch_add(&counters->requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters->latency_sum_us, (uint64_t)wait_us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters->buckets[bucket_for((uint64_t)wait_us)], 1, __ATOMIC_RELAXED);
+}
+
+// Function to name the sides a relay can stall on; call before forking
+void stats_init_stalls(const char* const* side_names, int side_count) {
+    stall_names = side_names;
+    stall_count = side_count < STATS_MAX_STALLS ? side_count : STATS_MAX_STALLS;
+}
+
+// Function to add time a relay spent waiting on one side
+void stats_count_stall(int side, long long stall_us) {
+    if (region == NULL || side < 0 || side >= stall_count || stall_us <= 0) return;
+    __atomic_fetch_add(&my_shard()->stall_us[side], (uint64_t)stall_us, __ATOMIC_RELAXED);
+}
+
+// Function to name the storage nodes whose health is reported; call before forking
+void stats_init_nodes(const char* const* names_of_nodes, int count) {
+    node_names = names_of_nodes;
+    node_count = count < STATS_MAX_NODES ? count : STATS_MAX_NODES;
+    for (int node = 0; region != NULL && node < node_count; node++) region->node_up[node] = 1;
+}
+
+// Function to publish whether a storage node is up (1) or marked down (0)
+void stats_set_node_up(int node, int up) {
+    if (region == NULL || node < 0 || node >= node_count) return;
+    __atomic_store_n(&region->node_up[node], up, __ATOMIC_RELAXED);
+}
+
+// Function to start reporting storage read latencies and hedging; call before forking
+void stats_init_reads(void) {
+    reads_enabled = 1;
+}
+
+// Function to record how long a storage read took to start answering, and whether it was hedged
+void stats_record_read(long long first_byte_us, int hedged, int hedge_won) {
+    if (region == NULL) return;
+    if (first_byte_us < 0) first_byte_us = 0;
+
+    struct stats_shard* shard = my_shard();
+    __atomic_fetch_add(&shard->reads.requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->reads.latency_sum_us, (uint64_t)first_byte_us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->reads.buckets[bucket_for((uint64_t)first_byte_us)], 1, __ATOMIC_RELAXED);
+    if (hedged) __atomic_fetch_add(&shard->hedges, 1, __ATOMIC_RELAXED);
+    if (hedge_won) __atomic_fetch_add(&shard->hedge_wins, 1, __ATOMIC_RELAXED);
+}
+
+// Function to start reporting prefetch effectiveness; call before forking
+void stats_init_prefetch(void) {
+    prefetch_enabled = 1;
+}
+
+// Function to count what the reader of a prefetched entry found
+void stats_record_prefetch(int outcome) {
+    if (region == NULL || outcome < 0 || outcome >= PREFETCH_OUTCOMES) return;
+    __atomic_fetch_add(&my_shard()->prefetch_outcomes[outcome], 1, __ATOMIC_RELAXED);
+}
+
+// Function to add bytes a prefetch read into the page cache
+void stats_count_prefetch_bytes(long bytes) {
+    if (region == NULL || bytes <= 0) return;
+    __atomic_fetch_add(&my_shard()->prefetch_bytes, (uint64_t)bytes, __ATOMIC_RELAXED);
+}
+
+// Function to sum one command's (kind 0), queue's (1) or the storage reads' (2) counters over all shards
+static void sum_command(int command, int kind, struct command_counters* total) {
+    memset(total, 0, sizeof(*total));
+
+    for (int shard = 0; shard < STATS_SHARDS; shard++) {
+        struct command_counters* counters = kind == 2 ? &region->shards[shard].reads
+                                          : kind == 1 ? &region->shards[shard].queues[command]
+                                                      : &region->shards[shard].commands[command];
+        total->requests += __atomic_load_n(&counters->requests, __ATOMIC_RELAXED);
+        total->errors += __atomic_load_n(&counters->errors, __ATOMIC_RELAXED);
+        total->rejected += __atomic_load_n(&counters->rejected, __ATOMIC_RELAXED);
+        total->bytes_in += __atomic_load_n(&counters->bytes_in, __ATOMIC_RELAXED);
+        total->bytes_out += __atomic_load_n(&counters->bytes_out, __ATOMIC_RELAXED);
+        total->latency_sum_us += __atomic_load_n(&counters->latency_sum_us, __ATOMIC_RELAXED);
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            total->buckets[bucket] += __atomic_load_n(&counters->buckets[bucket], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Function to read a quantile (in microseconds) out of a summed histogram
+static uint64_t histogram_quantile(const struct command_counters* total, double quantile) {
+    uint64_t count = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) count += total->buckets[bucket];
+    if (count == 0) return 0;
+
+    // Nearest-rank: the smallest value with at least quantile * count samples at or below it
+    uint64_t rank = (uint64_t)ceil(quantile * count);
+    uint64_t target = rank > 0 ? rank - 1 : 0;
+    if (target >= count) target = count - 1;
+
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += total->buckets[bucket];
+        if (seen > target) return bucket_upper(bucket);
+    }
+    return bucket_upper(HISTOGRAM_BUCKETS - 1);
+}
+
+// Function to render all metrics in Prometheus text format (caller frees)
+char* stats_format(void) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    char* text = NULL;
+    size_t length = 0;
+    FILE* out = open_memstream(&text, &length);
+    struct command_counters* totals;
+
+    if (out == NULL) return NULL;
+    if (region == NULL || (totals = malloc(name_count * sizeof(*totals))) == NULL) {
+        fclose(out);
+        return text;
+    }
+    for (int command = 0; command < name_count; command++) sum_command(command, 0, &totals[command]);
+
+    fprintf(out, "# TYPE s25_requests_total counter\n");
+    for (int command = 0; command < name_count; command++) {
+        fprintf(out, "s25_requests_total{server=\"%s\",command=\"%s\"} %llu\n",
+                server, names[command], (unsigned long long)totals[command].requests);
+    }
+    fprintf(out, "# TYPE s25_errors_total counter\n");
+    for (int command = 0; command < name_count; command++) {
+        fprintf(out, "s25_errors_total{server=\"%s\",command=\"%s\"} %llu\n",
+                server, names[command], (unsigned long long)totals[command].errors);
+    }
+    fprintf(out, "# TYPE s25_requests_rejected_total counter\n");
+    for (int command = 0; command < name_count; command++) {
+        fprintf(out, "s25_requests_rejected_total{server=\"%s\",command=\"%s\"} %llu\n",
+                server, names[command], (unsigned long long)totals[command].rejected);
+    }
+    uint64_t sessions_rejected = 0;
+    for (int shard = 0; shard < STATS_SHARDS; shard++) {
+        sessions_rejected += __atomic_load_n(&region->shards[shard].sessions_rejected, __ATOMIC_RELAXED);
+    }
+    fprintf(out, "# TYPE s25_sessions_rejected_total counter\n");
+    fprintf(out, "s25_sessions_rejected_total{server=\"%s\"} %llu\n", server, (unsigned long long)sessions_rejected);
+    fprintf(out, "# TYPE s25_bytes_received_total counter\n");
+    for (int command = 0; command < name_count; command++) {
+        fprintf(out, "s25_bytes_received_total{server=\"%s\",command=\"%s\"} %llu\n",
+                server, names[command], (unsigned long long)totals[command].bytes_in);
+    }
+    fprintf(out, "# TYPE s25_bytes_sent_total counter\n");
+    for (int command = 0; command < name_count; command++) {
+        fprintf(out, "s25_bytes_sent_total{server=\"%s\",command=\"%s\"} %llu\n",
+                server, names[command], (unsigned long long)totals[command].bytes_out);
+    }
+    fprintf(out, "# TYPE s25_request_duration_seconds summary\n");
+    for (int command = 0; command < name_count; command++) {
+        for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+            fprintf(out, "s25_request_duration_seconds{server=\"%s\",command=\"%s\",quantile=\"%g\"} %.6f\n",
+                    server, names[command], quantiles[i], histogram_quantile(&totals[command], quantiles[i]) / 1e6);
+        }
+        fprintf(out, "s25_request_duration_seconds_sum{server=\"%s\",command=\"%s\"} %.6f\n",
+                server, names[command], totals[command].latency_sum_us / 1e6);
+        fprintf(out, "s25_request_duration_seconds_count{server=\"%s\",command=\"%s\"} %llu\n",
+                server, names[command], (unsigned long long)totals[command].requests);
+    }
+
+    // Time spent waiting for the scheduler (S1 only)
+    if (queue_count > 0) fprintf(out, "# TYPE s25_queue_wait_seconds summary\n");
+    for (int queue = 0; queue < queue_count; queue++) {
+        struct command_counters total;
+        sum_command(queue, 1, &total);
+        for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+            fprintf(out, "s25_queue_wait_seconds{server=\"%s\",queue=\"%s\",quantile=\"%g\"} %.6f\n",
+                    server, queue_names[queue], quantiles[i], histogram_quantile(&total, quantiles[i]) / 1e6);
+        }
+        fprintf(out, "s25_queue_wait_seconds_sum{server=\"%s\",queue=\"%s\"} %.6f\n",
+                server, queue_names[queue], total.latency_sum_us / 1e6);
+        fprintf(out, "s25_queue_wait_seconds_count{server=\"%s\",queue=\"%s\"} %llu\n",
+                server, queue_names[queue], (unsigned long long)total.requests);
+    }
+
+    // Time relays spent waiting on each side (S1 only)
+    if (stall_count > 0) fprintf(out, "# TYPE s25_relay_stall_seconds_total counter\n");
+    for (int side = 0; side < stall_count; side++) {
+        uint64_t stall_us = 0;
+        for (int shard = 0; shard < STATS_SHARDS; shard++) {
+            stall_us += __atomic_load_n(&region->shards[shard].stall_us[side], __ATOMIC_RELAXED);
+        }
+        fprintf(out, "s25_relay_stall_seconds_total{server=\"%s\",side=\"%s\"} %.6f\n",
+                server, stall_names[side], stall_us / 1e6);
+    }
+
+    // Time to the first byte of storage reads, with hedging (S1 only)
+    if (reads_enabled) {
+        struct command_counters total;
+        uint64_t hedges = 0, hedge_wins = 0;
+        sum_command(0, 2, &total);
+        for (int shard = 0; shard < STATS_SHARDS; shard++) {
+            hedges += __atomic_load_n(&region->shards[shard].hedges, __ATOMIC_RELAXED);
+            hedge_wins += __atomic_load_n(&region->shards[shard].hedge_wins, __ATOMIC_RELAXED);
+        }
+        fprintf(out, "# TYPE s25_read_first_byte_seconds summary\n");
+        for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+            fprintf(out, "s25_read_first_byte_seconds{server=\"%s\",quantile=\"%g\"} %.6f\n",
+                    server, quantiles[i], histogram_quantile(&total, quantiles[i]) / 1e6);
+        }
+        fprintf(out, "s25_read_first_byte_seconds_sum{server=\"%s\"} %.6f\n", server, total.latency_sum_us / 1e6);
+        fprintf(out, "s25_read_first_byte_seconds_count{server=\"%s\"} %llu\n",
+                server, (unsigned long long)total.requests);
+        fprintf(out, "# TYPE s25_hedged_reads_total counter\n");
+        fprintf(out, "s25_hedged_reads_total{server=\"%s\"} %llu\n", server, (unsigned long long)hedges);
+        fprintf(out, "# TYPE s25_hedge_wins_total counter\n");
+        fprintf(out, "s25_hedge_wins_total{server=\"%s\"} %llu\n", server, (unsigned long long)hedge_wins);
+    }
+
+    // How far ahead of the archive writer the prefetch thread got
+    if (prefetch_enabled) {
+        static const char* const outcome_names[PREFETCH_OUTCOMES] = { "hit", "late", "missed" };
+        uint64_t prefetched = 0;
+        fprintf(out, "# TYPE s25_prefetch_files_total counter\n");
+        for (int outcome = 0; outcome < PREFETCH_OUTCOMES; outcome++) {
+            uint64_t count = 0;
+            for (int shard = 0; shard < STATS_SHARDS; shard++) {
+                count += __atomic_load_n(&region->shards[shard].prefetch_outcomes[outcome], __ATOMIC_RELAXED);
+            }
+            fprintf(out, "s25_prefetch_files_total{server=\"%s\",outcome=\"%s\"} %llu\n",
+                    server, outcome_names[outcome], (unsigned long long)count);
+        }
+        for (int shard = 0; shard < STATS_SHARDS; shard++) {
+            prefetched += __atomic_load_n(&region->shards[shard].prefetch_bytes, __ATOMIC_RELAXED);
+        }
+        fprintf(out, "# TYPE s25_prefetch_bytes_total counter\n");
+        fprintf(out, "s25_prefetch_bytes_total{server=\"%s\"} %llu\n", server, (unsigned long long)prefetched);
+    }
+
+    // Storage node health as seen by the heartbeat (S1 only)
+    if (node_count > 0) fprintf(out, "# TYPE s25_storage_up gauge\n");
+    for (int node = 0; node < node_count; node++) {
+        fprintf(out, "s25_storage_up{server=\"%s\",node=\"%s\"} %d\n",
+                server, node_names[node], __atomic_load_n(&region->node_up[node], __ATOMIC_RELAXED));
+    }
+
+    free(totals);
+    fclose(out);
+    return text;
+}
+
+// Function to answer HTTP scrapes until the process exits
+static void* http_thread(void* argument) {
+    int listen_socket = (int)(intptr_t)argument;
+    char request[1024];
+
+    while (1) {
+        int client_socket = accept(listen_socket, NULL, NULL);
+        if (client_socket < 0) continue;
+
+        // Any request gets the metrics; the request itself is ignored
+        recv(client_socket, request, sizeof(request), 0);
+
+        char* body = stats_format();
+        char header[256];
+        int header_length = snprintf(header, sizeof(header),
+                                     "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                     "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                                     body ? strlen(body) : 0);
+        send(client_socket, header, header_length, MSG_NOSIGNAL);
+        if (body) send(client_socket, body, strlen(body), MSG_NOSIGNAL);
+        free(body);
+        close(client_socket);
+    }
+    return NULL;
+}
+
+// Function to serve stats_format() over HTTP on 127.0.0.1:port from a thread
+int stats_start_http(int port) {
+    struct sockaddr_in address;
+    pthread_t thread;
+    int opt = 1;
+
+    int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket < 0) return -1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(listen_socket, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listen_socket, 16) < 0) {
+        perror("Metrics endpoint");
+        close(listen_socket);
+        return -1;
+    }
+
+    if (pthread_create(&thread, NULL, http_thread, (void*)(intptr_t)listen_socket) != 0) {
+        close(listen_socket);
+        return -1;
+    }
+    pthread_detach(thread);
+    printf("Metrics available on http://127.0.0.1:%d/metrics\n", port);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#ifndef S25STATS_H
+#define S25STATS_H
+
+#include <stddef.h>
+
+// Per-command request metrics shared by every server.
+//
+// Each command gets counters (requests, errors, bytes in/out) and an
+// HDR-style log-linear latency histogram (16 sub-buckets per power of two,
+// about 6% precision from 1us to 2^40us).  Updates are relaxed atomic adds
+// into one of STATS_SHARDS shards picked per thread/process, so recording
+// never takes a lock.  The shards live in a MAP_SHARED mapping created by
+// stats_init(), so forked S1 children report into the parent's view.
+#define STATS_MAX_COMMANDS 16
+#define STATS_SHARDS 16
+#define STATS_MAX_QUEUES 4
+#define STATS_MAX_STALLS 4
+#define STATS_MAX_NODES 8
+
+// Function to set up the metrics region; call once before forking/threads
+int stats_init(const char* server_name, const char* const* command_names, int command_count);
+
+// Function to get a monotonic timestamp in microseconds
+long long stats_now_us(void);
+
+// Function to start timing a request on the calling thread
+void stats_begin(int command);
+
+// Function to account bytes moved by the current request
+void stats_count_bytes(long bytes_in, long bytes_out);
+
+// Function to finish the current request and record it
+void stats_end(int ok);
+
+// Function to record a complete request in one call
+void stats_record(int command, int ok, long bytes_in, long bytes_out, long long latency_us);
+
+// Function to count a request (or, for command -1, a session) turned away by admission control
+void stats_count_rejected(int command);
+
+// Function to name the scheduler queues whose waiting times are recorded; call before forking
+void stats_init_queues(const char* const* queue_names, int queue_count);
+
+// Function to record how long a request waited in a scheduler queue
+void stats_record_queue(int queue, long long wait_us);
+
+// Function to name the sides a relay can stall on; call before forking
+void stats_init_stalls(const char* const* side_names, int side_count);
+
+// Function to add time a relay spent waiting on one side
+void stats_count_stall(int side, long long stall_us);
+
+// Function to name the storage nodes whose health is reported; call before forking
+void stats_init_nodes(const char* const* node_names, int node_count);
+
+// Function to publish whether a storage node is up (1) or marked down (0)
+void stats_set_node_up(int node, int up);
+
+// Function to start reporting storage read latencies and hedging; call before forking
+void stats_init_reads(void);
+
+// Function to record how long a storage read took to start answering, and whether it was hedged
+void stats_record_read(long long first_byte_us, int hedged, int hedge_won);
+
+// Outcomes of a background prefetch, as the reader found the entry
+#define PREFETCH_HIT 0     // read into the page cache already
+#define PREFETCH_LATE 1    // still being read
+#define PREFETCH_MISSED 2  // not started yet
+#define PREFETCH_OUTCOMES 3
+
+// Function to start reporting prefetch effectiveness; call before forking
+void stats_init_prefetch(void);
+
+// Function to count what the reader of a prefetched entry found
+void stats_record_prefetch(int outcome);
+
+// Function to add bytes a prefetch read into the page cache
+void stats_count_prefetch_bytes(long bytes);
+
+// Function to render all metrics in Prometheus text format (caller frees)
+char* stats_format(void);
+
+// Function to serve stats_format() over HTTP on 127.0.0.1:port from a thread
+int stats_start_http(int port);
+
+#endif
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "s25tar.h"
+#include "s25common.h"
+#include "s25pool.h"
+
+#define TAR_PATH 1024
+
+// Function to round a size up to whole tar blocks
+static long block_round(long size) {
+    return (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+}
+
+// Function to duplicate a string (strdup is not C99)
+static char* copy_string(const char* text) {
+    size_t length = strlen(text) + 1;
+    char* copy = malloc(length);
+    if (copy) memcpy(copy, text, length);
+    return copy;
+}
+
+// Function to find where a long name splits into ustar prefix + name; -1 if it cannot
+static long split_point(const char* name) {
+    size_t length = strlen(name);
+    if (length <= 100) return 0;
+
+    // The slash must leave at most 100 characters after it and 155 before it
+    const char* slash = strchr(name + length - 101, '/');
+    if (slash == NULL || slash - name > 155) return -1;
+    return slash - name;
+}
+
+// Function to start an empty entry list
+void tar_list_init(struct tar_list* list) {
+    list->entries = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+// Function to add one entry
+int tar_list_add(struct tar_list* list, const char* name, const char* source, long size, long mtime) {
+    // The 11-digit octal size field limits entries to 8 GB
+    if (split_point(name) < 0 || size < 0 || size > 077777777777L) return -1;
+
+    if (list->count == list->capacity) {
+        int new_capacity = list->capacity ? list->capacity * 2 : 64;
+        struct tar_entry* grown = realloc(list->entries, new_capacity * sizeof(*grown));
+        if (grown == NULL) return -1;
+        list->entries = grown;
+        list->capacity = new_capacity;
+    }
+
+    struct tar_entry* entry = &list->entries[list->count];
+    entry->name = copy_string(name);
+    entry->source = copy_string(source);
+    if (entry->name == NULL || entry->source == NULL) {
+        free(entry->name);
+        free(entry->source);
+        return -1;
+    }
+    entry->size = size;
+    entry->mtime = mtime;
+    list->count++;
+    return 0;
+}
+
+// Function to walk one directory level for tar_collect_files
+static void collect_directory(struct tar_list* list, const char* path, const char* name_prefix, const char* extension) {
+    DIR* directory = opendir(path);
+    struct dirent* entry;
+    char child_path[TAR_PATH];
+    char child_name[TAR_PATH];
+    struct stat info;
+
+    if (directory == NULL) return;
+
+    while ((entry = readdir(directory)) != NULL) {
+        // Skips ".", "..", the pack store and in-progress uploads
+        if (entry->d_name[0] == '.') continue;
+
+        snprintf(child_path, sizeof(child_path), "%s/%s", path, entry->d_name);
+        snprintf(child_name, sizeof(child_name), "%s%s", name_prefix, entry->d_name);
+        if (lstat(child_path, &info) < 0) continue;
+
+        if (S_ISDIR(info.st_mode)) {
+            strncat(child_name, "/", sizeof(child_name) - strlen(child_name) - 1);
+            collect_directory(list, child_path, child_name, extension);
+        } else if (S_ISREG(info.st_mode)) {
+            const char* dot = strrchr(entry->d_name, '.');
+            if (dot != NULL && strcmp(dot + 1, extension) == 0) {
+                tar_list_add(list, child_name, child_path, info.st_size, info.st_mtime);
+            }
+        }
+    }
+    closedir(directory);
+}
+
+// Function to add every regular *.extension file below root (hidden names skipped)
+int tar_collect_files(struct tar_list* list, const char* root, const char* extension) {
+    collect_directory(list, root, "", extension);
+    return list->count;
+}
+
+// Function to compare entries by name
+static int compare_entries(const void* first, const void* second) {
+    return strcmp(((const struct tar_entry*)first)->name, ((const struct tar_entry*)second)->name);
+}
+
+// Function to sort entries by name so archives are reproducible
+void tar_list_sort(struct tar_list* list) {
+    if (list->count > 1) qsort(list->entries, list->count, sizeof(*list->entries), compare_entries);
+}
+
+// Function to release an entry list
+void tar_list_free(struct tar_list* list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->entries[i].name);
+        free(list->entries[i].source);
+    }
+    free(list->entries);
+    tar_list_init(list);
+}
+
+// Function to compute the exact archive size in bytes
+long tar_archive_size(const struct tar_list* list) {
+    long size = 2 * TAR_BLOCK; // end-of-archive marker
+
+    for (int i = 0; i < list->count; i++) {
+        size += tar_entry_size(&list->entries[i]);
+    }
+    return size;
+}
+
+// Function to write an 11-digit octal field (values are clamped to fit)
+static void format_octal(char* field, long value) {
+    char digits[24];
+    unsigned long clamped = value < 0 ? 0 : (unsigned long)value;
+
+    if (clamped > 077777777777UL) clamped = 077777777777UL;
+    snprintf(digits, sizeof(digits), "%011lo", clamped);
+    memcpy(field, digits, 12);
+}
+
+// Function to fill a ustar header block for one entry
+static void format_header(char* block, const struct tar_entry* entry) {
+    size_t name_length = strlen(entry->name);
+    long split = split_point(entry->name);
+    unsigned checksum = 0;
+
+    memset(block, 0, TAR_BLOCK);
+
+    // Names over 100 characters are split at a slash into prefix + name
+    if (split <= 0) {
+        memcpy(block, entry->name, name_length < 100 ? name_length : 100);
+    } else {
+        memcpy(block + 345, entry->name, split);
+        memcpy(block, entry->name + split + 1, name_length - split - 1);
+    }
+
+    snprintf(block + 100, 8, "%07o", 0644);
+    snprintf(block + 108, 8, "%07o", 0);
+    snprintf(block + 116, 8, "%07o", 0);
+    format_octal(block + 124, entry->size);
+    format_octal(block + 136, entry->mtime);
+    block[156] = '0';
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    snprintf(block + 265, 32, "s25");
+    snprintf(block + 297, 32, "s25");
+
+    // Checksum is computed with the checksum field itself set to spaces
+    memset(block + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK; i++) checksum += (unsigned char)block[i];
+    snprintf(block + 148, 8, "%06o", checksum);
+    block[155] = ' ';
+}
+
+// Function to write a whole buffer to a socket (no SIGPIPE) or to a file
+static int output_all(int fd, int socket, const void* data, size_t length) {
+    const char* cursor = data;
+
+    if (socket) return send_all(fd, data, length);
+    while (length > 0) {
+        ssize_t written = write(fd, cursor, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        cursor += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Function to output count zero bytes
+static int output_zeros(int fd, int socket, long count) {
+    static const char zeros[TAR_BLOCK];
+
+    while (count > 0) {
+        long chunk = count < TAR_BLOCK ? count : TAR_BLOCK;
+        if (output_all(fd, socket, zeros, chunk) < 0) return -1;
+        count -= chunk;
+    }
+    return 0;
+}
+
+// Function to output exactly entry->size bytes of one entry's data
+static int output_entry_data(int fd, int socket, const struct tar_entry* entry, const struct tar_source* source) {
+    size_t buffer_size = pool_io_size();
+    char* buffer = pool_get(buffer_size);
+    long sent = 0;
+    long size;
+    void* handle = source ? source->open(entry->source, &size) : NULL;
+    int input = source ? -1 : open(entry->source, O_RDONLY);
+    int data_fd;
+    long offset;
+
+    // Each entry is read once, front to back
+    if (input >= 0) {
+        posix_fadvise(input, 0, entry->size, POSIX_FADV_SEQUENTIAL);
+    } else if (handle != NULL && source->extent != NULL && source->extent(handle, &data_fd, &offset) == 0) {
+        posix_fadvise(data_fd, offset, entry->size, POSIX_FADV_SEQUENTIAL);
+    }
+
+    while ((handle != NULL || input >= 0) && sent < entry->size) {
+        if (buffer == NULL) {
+            sent = -1;
+            break;
+        }
+        long wanted = entry->size - sent < (long)buffer_size ? entry->size - sent : (long)buffer_size;
+        long got = handle ? source->read(handle, buffer, wanted) : read(input, buffer, wanted);
+        if (got <= 0) break;
+        if (output_all(fd, socket, buffer, got) < 0) {
+            sent = -1;
+            break;
+        }
+        sent += got;
+    }
+    if (handle != NULL) source->close(handle);
+    if (input >= 0) close(input);
+    pool_put(buffer, buffer_size);
+    if (sent < 0) return -1;
+
+    // A file that shrank or vanished since listing is zero-filled to keep the stream valid
+    return output_zeros(fd, socket, entry->size - sent);
+}
+
+// Function to output one entry: header, data and padding
+static int output_entry(int fd, int socket, const struct tar_entry* entry, const struct tar_source* source) {
+    char header[TAR_BLOCK];
+
+    format_header(header, entry);
+    if (output_all(fd, socket, header, TAR_BLOCK) < 0) return -1;
+    if (output_entry_data(fd, socket, entry, source) < 0) return -1;
+    return output_zeros(fd, socket, block_round(entry->size) - entry->size);
+}
+
+// Function to stream the archive (source NULL reads local files); returns bytes sent or -1 on a socket error
+long tar_send_archive(int sock, const struct tar_list* list, const struct tar_source* source) {
+    long total = 0;
+
+    for (int i = 0; i < list->count; i++) {
+        if (output_entry(sock, 1, &list->entries[i], source) < 0) return -1;
+        total += tar_entry_size(&list->entries[i]);
+    }
+
+    if (output_zeros(sock, 1, 2 * TAR_BLOCK) < 0) return -1;
+    return total + 2 * TAR_BLOCK;
+}
+
+// Function to get the bytes one entry takes in an archive (header, data and padding)
+long tar_entry_size(const struct tar_entry* entry) {
+    return TAR_BLOCK + block_round(entry->size);
+}
+
+// Function to get the bytes an archived entry takes from its header block; -1 if it is not a valid header
+long tar_header_entry_size(const char* block) {
+    char field[13];
+    unsigned checksum = 0;
+    char* end;
+
+    // The checksum is taken with its own field counted as spaces
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        checksum += i >= 148 && i < 156 ? ' ' : (unsigned char)block[i];
+    }
+    memcpy(field, block + 148, 8);
+    field[8] = '\0';
+    if (strtoul(field, &end, 8) != checksum || end == field) return -1;
+
+    memcpy(field, block + 124, 12);
+    field[12] = '\0';
+    long size = strtol(field, &end, 8);
+    if (end == field || size < 0) return -1;
+    return TAR_BLOCK + block_round(size);
+}
+
+// Function to send one entry (header, data and padding) to a socket
+int tar_send_entry(int sock, const struct tar_entry* entry, const struct tar_source* source) {
+    return output_entry(sock, 1, entry, source);
+}
+
+// Function to send count zero bytes to a socket (end-of-archive marker and padding)
+int tar_send_zeros(int sock, long count) {
+    return output_zeros(sock, 1, count);
+}
+
+// Function to write one entry to a file descriptor that is not a socket
+int tar_write_entry(int fd, const struct tar_entry* entry, const struct tar_source* source) {
+    return output_entry(fd, 0, entry, source);
+}
+
+// Function to write the end-of-archive marker to a file descriptor that is not a socket
+int tar_write_end(int fd) {
+    return output_zeros(fd, 0, 2 * TAR_BLOCK);
+}
@@ -0,0 +1,77 @@
+#ifndef S25TAR_H
+#define S25TAR_H
+
+#include <stddef.h>
+
+#define TAR_BLOCK 512
+
+// Streaming ustar writer.
+//
+// The archive is described up front (names and sizes), so its exact size
+// can be sent before the data, then streamed straight to the socket with no
+// temporary tar file.  Archives can also be written entry by entry to a file
+// (used by the storage servers' tar cache).  Entry data is read from the source path on disk, or
+// through a tar_source (used for files held by a storage engine).
+
+struct tar_entry {
+    char* name;   // name inside the archive
+    char* source; // local path
+    long size;
+    long mtime;
+};
+
+struct tar_list {
+    struct tar_entry* entries;
+    int count;
+    int capacity;
+};
+
+// Reader for entry data; open returns a handle (and the size) or NULL.  extent, which may be
+// NULL, gives the descriptor and offset the handle's data starts at, for read-ahead hints.
+struct tar_source {
+    void* (*open)(const char* source, long* size);
+    long (*read)(void* handle, void* buffer, size_t length);
+    void (*close)(void* handle);
+    int (*extent)(void* handle, int* fd, long* offset);
+};
+
+// Function to start an empty entry list
+void tar_list_init(struct tar_list* list);
+
+// Function to add one entry
+int tar_list_add(struct tar_list* list, const char* name, const char* source, long size, long mtime);
+
+// Function to add every regular *.extension file below root (hidden names skipped)
+int tar_collect_files(struct tar_list* list, const char* root, const char* extension);
+
+// Function to sort entries by name so archives are reproducible
+void tar_list_sort(struct tar_list* list);
+
+// Function to release an entry list
+void tar_list_free(struct tar_list* list);
+
+// Function to compute the exact archive size in bytes
+long tar_archive_size(const struct tar_list* list);
+
+// Function to stream the archive (source NULL reads local files); returns bytes sent or -1 on a socket error
+long tar_send_archive(int sock, const struct tar_list* list, const struct tar_source* source);
+
+// Function to get the bytes one entry takes in an archive (header, data and padding)
+long tar_entry_size(const struct tar_entry* entry);
+
+// Function to get the bytes an archived entry takes from its header block; -1 if it is not a valid header
+long tar_header_entry_size(const char* block);
+
+// Function to send one entry (header, data and padding) to a socket
+int tar_send_entry(int sock, const struct tar_entry* entry, const struct tar_source* source);
+
+// Function to send count zero bytes to a socket (end-of-archive marker and padding)
+int tar_send_zeros(int sock, long count);
+
+// Function to write one entry to a file descriptor that is not a socket
+int tar_write_entry(int fd, const struct tar_entry* entry, const struct tar_source* source);
+
+// Function to write the end-of-archive marker to a file descriptor that is not a socket
+int tar_write_end(int fd);
+
+#endif
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "s25tarcache.h"
+#include "s25common.h"
+#include "s25prefetch.h"
+#include "s25pool.h"
+
+#define CACHE_PATH 1024
+#define DIRTY_LIMIT 4096
+#define COPY_CHUNK (64 * 1024)
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_ready = PTHREAD_COND_INITIALIZER;
+
+static char cache_directory[CACHE_PATH];
+static uint64_t generation = 1;    // bumped by every change
+static uint64_t cached_generation; // generation the cached archive includes (0 = none)
+static int building;
+static int cache_fd = -1;
+static long cache_size;
+static struct tar_list cached_list; // entries of the cached archive, sorted by name
+
+// Names changed since the cached archive was built
+static char** dirty;
+static int dirty_count;
+static int dirty_capacity;
+static int dirty_overflow; // too many changes to track: reuse nothing
+
+// Function to forget the changed names
+static void clear_dirty(void) {
+    for (int i = 0; i < dirty_count; i++) {
+        free(dirty[i]);
+    }
+    free(dirty);
+    dirty = NULL;
+    dirty_count = 0;
+    dirty_capacity = 0;
+}
+
+// Function to sort names
+static int compare_names(const void* first, const void* second) {
+    return strcmp(*(char* const*)first, *(char* const*)second);
+}
+
+// Function to copy length bytes at offset of one file to the end of another, in the kernel if possible
+static int copy_range(int input, long offset, int output, long length) {
+    loff_t position = offset;
+
+    while (length > 0) {
+        ssize_t copied = copy_file_range(input, &position, output, NULL, length, 0);
+        if (copied < 0 && errno == EINTR) continue;
+        if (copied <= 0) break;
+        length -= copied;
+    }
+
+    // Fall back to a user-space copy where the file system cannot do it
+    size_t buffer_size = pool_io_size();
+    char* buffer = pool_get(buffer_size);
+    while (buffer != NULL && length > 0) {
+        ssize_t got = pread(input, buffer, length < (long)buffer_size ? length : (long)buffer_size, position);
+        if (got <= 0 || write(output, buffer, got) != got) break;
+        position += got;
+        length -= got;
+    }
+    pool_put(buffer, buffer_size);
+    return buffer != NULL && length == 0 ? 0 : -1;
+}
+
+// Function to write the archive, copying entries that are unchanged since the previous one
+static int write_archive(int fd, const struct tar_list* list, const struct tar_source* source, int old_fd,
+                         const struct tar_list* old_list, char** changed, int changed_count, int* reused) {
+    long old_offset = 0;
+    int old_index = 0;
+    int result = 0;
+    long* reuse_offsets = malloc((list->count + 1) * sizeof(*reuse_offsets));
+    unsigned char* fresh = malloc(list->count + 1);
+    if (reuse_offsets == NULL || fresh == NULL) {
+        free(reuse_offsets);
+        free(fresh);
+        return -1;
+    }
+
+    // First find where each unchanged entry sits in the old archive (both lists are sorted by name)
+    for (int i = 0; i < list->count; i++) {
+        const struct tar_entry* entry = &list->entries[i];
+
+        while (old_fd >= 0 && old_index < old_list->count && strcmp(old_list->entries[old_index].name, entry->name) < 0) {
+            old_offset += tar_entry_size(&old_list->entries[old_index++]);
+        }
+        const struct tar_entry* old = old_fd >= 0 && old_index < old_list->count ? &old_list->entries[old_index] : NULL;
+        int unchanged = old != NULL && strcmp(old->name, entry->name) == 0 && old->size == entry->size &&
+                        old->mtime == entry->mtime &&
+                        bsearch(&entry->name, changed, changed_count, sizeof(*changed), compare_names) == NULL;
+        reuse_offsets[i] = unchanged ? old_offset : -1;
+        fresh[i] = !unchanged;
+    }
+
+    // Only the files that are read get prefetched while earlier entries are written
+    struct prefetch_batch* prefetch = prefetch_start(list, source, fresh);
+    for (int i = 0; i < list->count && result == 0; i++) {
+        const struct tar_entry* entry = &list->entries[i];
+
+        if (reuse_offsets[i] >= 0) {
+            result = copy_range(old_fd, reuse_offsets[i], fd, tar_entry_size(entry));
+            (*reused)++;
+        } else {
+            prefetch_reached(prefetch, i);
+            result = tar_write_entry(fd, entry, source);
+        }
+    }
+    prefetch_finish(prefetch);
+    free(reuse_offsets);
+    free(fresh);
+    return result == 0 ? tar_write_end(fd) : -1;
+}
+
+// Function to rebuild the cached archive; called and returns with cache_lock held
+static void rebuild_archive(void (*collect)(struct tar_list* list, void* user_data), void* user_data,
+                            const struct tar_source* source) {
+    char path[CACHE_PATH + 32];
+    char temp_path[CACHE_PATH + 32];
+    struct tar_list list;
+    int reused = 0;
+
+    // Take the change list; changes made during the build go into a new one
+    building = 1;
+    uint64_t build_generation = generation;
+    char** changed = dirty;
+    int changed_count = dirty_count;
+    int old_fd = dirty_overflow ? -1 : cache_fd;
+    dirty = NULL;
+    dirty_count = 0;
+    dirty_capacity = 0;
+    dirty_overflow = 0;
+    pthread_mutex_unlock(&cache_lock);
+
+    long long started = wall_clock_us();
+    qsort(changed, changed_count, sizeof(*changed), compare_names);
+    tar_list_init(&list);
+    collect(&list, user_data);
+    tar_list_sort(&list);
+
+    snprintf(path, sizeof(path), "%s/archive.tar", cache_directory);
+    snprintf(temp_path, sizeof(temp_path), "%s/archive.tmp", cache_directory);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int result = fd >= 0 ? write_archive(fd, &list, source, old_fd, &cached_list, changed, changed_count, &reused) : -1;
+    if (fd >= 0 && close(fd) < 0) result = -1;
+    if (result == 0 && rename(temp_path, path) < 0) result = -1;
+    int new_fd = result == 0 ? open(path, O_RDONLY) : -1;
+    if (new_fd < 0) unlink(temp_path);
+
+    for (int i = 0; i < changed_count; i++) {
+        free(changed[i]);
+    }
+    free(changed);
+
+    pthread_mutex_lock(&cache_lock);
+    if (new_fd >= 0) {
+        printf("Tar cache: %d files (%d reused) rebuilt in %.1f ms\n", list.count, reused,
+               (wall_clock_us() - started) / 1000.0);
+        if (cache_fd >= 0) close(cache_fd);
+        tar_list_free(&cached_list);
+        cache_fd = new_fd;
+        cached_list = list;
+        cache_size = tar_archive_size(&list);
+        cached_generation = build_generation;
+    } else {
+        // The changes taken above are lost, so the next build must not reuse anything
+        printf("Tar cache: rebuild failed\n");
+        tar_list_free(&list);
+        dirty_overflow = 1;
+        clear_dirty();
+    }
+    building = 0;
+    pthread_cond_broadcast(&cache_ready);
+}
+
+// Function to prepare the cache directory
+int tar_cache_init(const char* directory) {
+    snprintf(cache_directory, sizeof(cache_directory), "%s", directory);
+    tar_list_init(&cached_list);
+    if (mkdir(cache_directory, 0755) < 0 && errno != EEXIST) {
+        perror("Tar cache directory");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to mark an archived file (by its name inside the archive) as changed
+void tar_cache_invalidate(const char* name) {
+    pthread_mutex_lock(&cache_lock);
+    generation++;
+
+    // Only an existing or upcoming archive can have stale copies of the file
+    if ((cache_fd >= 0 || building) && !dirty_overflow) {
+        if (dirty_count == dirty_capacity) {
+            int capacity = dirty_capacity ? dirty_capacity * 2 : 64;
+            char** names = capacity <= DIRTY_LIMIT ? realloc(dirty, capacity * sizeof(*names)) : NULL;
+            if (names != NULL) {
+                dirty = names;
+                dirty_capacity = capacity;
+            }
+        }
+        char* copy = dirty_count < dirty_capacity ? strdup(name) : NULL;
+        if (copy != NULL) {
+            dirty[dirty_count++] = copy;
+        } else {
+            dirty_overflow = 1;
+            clear_dirty();
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Function to send the size header and the current archive, rebuilding it first if needed.
+// collect fills the entry list; returns bytes sent, or -1 (size -1 is sent if the build failed).
+long tar_cache_send(int sock, void (*collect)(struct tar_list* list, void* user_data), void* user_data,
+                    const struct tar_source* source) {
+    int built = 0;
+
+    // Every change completed before this request must be in the archive
+    pthread_mutex_lock(&cache_lock);
+    uint64_t wanted = generation;
+    while (cached_generation < wanted) {
+        if (building) {
+            pthread_cond_wait(&cache_ready, &cache_lock);
+        } else if (built) {
+            break;
+        } else {
+            rebuild_archive(collect, user_data, source);
+            built = 1;
+        }
+    }
+    int fd = cached_generation >= wanted ? dup(cache_fd) : -1;
+    long size = cache_size;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (fd < 0) {
+        send_size(sock, -1);
+        return -1;
+    }
+
+    // The descriptor keeps this version readable even if a rebuild replaces it; the size is held back to share a
+    // segment with the start of the archive
+    off_t offset = 0;
+    struct iovec header = { &size, sizeof(size) };
+    int result = send_parts(sock, &header, 1, size > 0);
+    while (result == 0 && offset < size) {
+        ssize_t sent = sendfile(sock, fd, &offset, size - offset);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) result = -1;
+    }
+    close(fd);
+    return result == 0 ? size : -1;
+}
@@ -0,0 +1,29 @@
+#ifndef S25TARCACHE_H
+#define S25TARCACHE_H
+
+#include "s25tar.h"
+
+// Cached TAR archive for a storage server's file type.
+//
+// The archive is kept in <directory>/archive.tar and sent with sendfile()
+// for as long as no archived file changes.  Uploads and deletes call
+// tar_cache_invalidate(); the next request rebuilds the archive, copying
+// every unchanged entry from the previous one with copy_file_range() and
+// reading only the changed files.  Requests that arrive during a rebuild
+// wait for it and send its result instead of starting another one.
+//
+// A request always gets an archive that includes every change completed
+// before it arrived.
+
+// Function to prepare the cache directory
+int tar_cache_init(const char* directory);
+
+// Function to mark an archived file (by its name inside the archive) as changed
+void tar_cache_invalidate(const char* name);
+
+// Function to send the size header and the current archive, rebuilding it first if needed.
+// collect fills the entry list; returns bytes sent, or -1 (size -1 is sent if the build failed).
+long tar_cache_send(int sock, void (*collect)(struct tar_list* list, void* user_data), void* user_data,
+                    const struct tar_source* source);
+
+#endif
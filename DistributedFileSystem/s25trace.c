@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "s25trace.h"
+
+#define TRACE_NAME_LENGTH 16
+#define TRACE_ARG_LENGTH 12
+
+struct span_record {
+    uint64_t sequence; // ring position + 1 once complete, 0 while being written
+    uint64_t request_id;
+    long long start_us;
+    long long duration_us;
+    int thread_id;
+    char name[TRACE_NAME_LENGTH];
+    char arg_names[2][TRACE_ARG_LENGTH];
+    long long arg_values[2];
+};
+
+struct trace_region {
+    uint64_t head;
+    uint64_t capacity;
+    struct span_record spans[];
+};
+
+static struct trace_region* region;
+static double sample_rate;
+static char server[16];
+static int server_number;
+
+// Per-thread state: the request being served
+static __thread struct request_context current;
+static __thread const char* current_name;
+static __thread long long current_start_us;
+
+// Function to set up the span ring; call once before forking/threads
+int trace_init(const char* server_name) {
+    long capacity = get_config_long("S25_TRACE_SPANS", 8192);
+    if (capacity < 16) capacity = 16;
+
+    sample_rate = get_config_double("S25_TRACE_SAMPLE", 0.0);
+    snprintf(server, sizeof(server), "%s", server_name);
+    server_number = atoi(server_name + strcspn(server_name, "0123456789"));
+
+    size_t size = sizeof(struct trace_region) + capacity * sizeof(struct span_record);
+    region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        region = NULL;
+        perror("Trace region");
+        return -1;
+    }
+    region->capacity = capacity;
+    return 0;
+}
+
+// Function to make context the calling thread's current request
+void trace_begin_request(struct request_context* context, const char* name) {
+    // Requests from old clients carry no ID; give them one and sample here
+    if (context->id == 0) {
+        context->id = new_request_id();
+        context->sampled = request_sampled(context->id, sample_rate);
+        context->sent_us = 0;
+    }
+
+    current = *context;
+    current_name = name;
+    current_start_us = current.sampled ? wall_clock_us() : 0;
+
+    // Time between the sender stamping the frame and us reading it
+    if (current.sampled && current.sent_us > 0 && current.sent_us <= current_start_us) {
+        trace_span("queue", current.sent_us);
+    }
+}
+
+// Function to get the calling thread's current request
+const struct request_context* trace_current(void) {
+    return &current;
+}
+
+// Function to get a span start time; 0 when the current request is not sampled
+long long trace_now_us(void) {
+    return current.sampled ? wall_clock_us() : 0;
+}
+
+// Function to record a span from start_us until now
+void trace_span(const char* name, long long start_us) {
+    trace_span_args(name, start_us, NULL, 0, NULL, 0);
+}
+
+// Function to record a span carrying up to two numeric arguments
+void trace_span_args(const char* name, long long start_us,
+                     const char* arg1, long long value1, const char* arg2, long long value2) {
+    if (!current.sampled || region == NULL) return;
+
+    long long now = wall_clock_us();
+    uint64_t position = __atomic_fetch_add(&region->head, 1, __ATOMIC_RELAXED);
+    struct span_record* span = &region->spans[position % region->capacity];
+
+    // Readers skip the slot until the final sequence store
+    __atomic_store_n(&span->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    span->request_id = current.id;
+    span->start_us = start_us;
+    span->duration_us = now - start_us;
+    span->thread_id = gettid();
+    snprintf(span->name, TRACE_NAME_LENGTH, "%s", name);
+    snprintf(span->arg_names[0], TRACE_ARG_LENGTH, "%s", arg1 ? arg1 : "");
+    snprintf(span->arg_names[1], TRACE_ARG_LENGTH, "%s", arg2 ? arg2 : "");
+    span->arg_values[0] = value1;
+    span->arg_values[1] = value2;
+
+    __atomic_store_n(&span->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+// Function to close the current request's span and forget it
+void trace_end_request(void) {
+    if (current.sampled && current_name != NULL) {
+        trace_span(current_name, current_start_us);
+    }
+    memset(&current, 0, sizeof(current));
+    current_name = NULL;
+}
+
+// Function to render the ring as comma-separated Chrome trace events (caller frees)
+char* trace_format_events(void) {
+    char* text = NULL;
+    size_t length = 0;
+    FILE* out = open_memstream(&text, &length);
+
+    if (out == NULL) return NULL;
+
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+            server_number, server);
+
+    for (uint64_t slot = 0; region != NULL && slot < region->capacity; slot++) {
+        struct span_record* shared = &region->spans[slot];
+        struct span_record span;
+
+        uint64_t before = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+        if (before == 0) continue;
+        memcpy(&span, shared, sizeof(span));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) != before) continue;
+
+        span.name[TRACE_NAME_LENGTH - 1] = '\0';
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                "\"pid\":%d,\"tid\":%d,\"args\":{\"rid\":\"%016llx\"",
+                span.name, server, span.start_us, span.duration_us,
+                server_number, span.thread_id, (unsigned long long)span.request_id);
+        for (int i = 0; i < 2; i++) {
+            span.arg_names[i][TRACE_ARG_LENGTH - 1] = '\0';
+            if (span.arg_names[i][0] != '\0') {
+                fprintf(out, ",\"%s\":%lld", span.arg_names[i], span.arg_values[i]);
+            }
+        }
+        fprintf(out, "}}");
+    }
+
+    fclose(out);
+    return text;
+}
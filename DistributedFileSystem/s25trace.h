@@ -0,0 +1,45 @@
+#ifndef S25TRACE_H
+#define S25TRACE_H
+
+#include "s25common.h"
+
+// Span tracing for sampled requests.
+//
+// A server calls trace_begin_request() with the context parsed from the
+// command frame, records timed spans (queue, connect, disk, network, ...)
+// while it works and trace_end_request() when done.  Spans go into a
+// fixed-size ring in a MAP_SHARED mapping (the oldest are overwritten), so
+// S1's forked children and the storage servers' threads all land in one
+// buffer without locks.  Requests that are not sampled cost one
+// thread-local flag check per span.
+//
+//   S25_TRACE_SAMPLE  fraction of requests traced when the caller did not
+//                     decide (default 0; clients normally decide)
+//   S25_TRACE_SPANS   ring capacity in spans (default 8192)
+
+// Function to set up the span ring; call once before forking/threads
+int trace_init(const char* server_name);
+
+// Function to make context the calling thread's current request
+void trace_begin_request(struct request_context* context, const char* name);
+
+// Function to get the calling thread's current request
+const struct request_context* trace_current(void);
+
+// Function to get a span start time; 0 when the current request is not sampled
+long long trace_now_us(void);
+
+// Function to record a span from start_us until now
+void trace_span(const char* name, long long start_us);
+
+// Function to record a span carrying up to two numeric arguments
+void trace_span_args(const char* name, long long start_us,
+                     const char* arg1, long long value1, const char* arg2, long long value2);
+
+// Function to close the current request's span and forget it
+void trace_end_request(void);
+
+// Function to render the ring as comma-separated Chrome trace events (caller frees)
+char* trace_format_events(void);
+
+#endif